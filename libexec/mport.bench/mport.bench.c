@@ -0,0 +1,520 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mport.bench: time the core operations on synthetic packages, against
+ * a root of its own, and print the results as JSON.
+ *
+ * Each package has a file count taken in turn from -f, of sizes up to -s
+ * bytes, made from a seeded generator so a run can be repeated.  A version
+ * 1.0 and 1.1 of each is built with mport_create_primative(), then every
+ * iteration installs, verifies, looks up, searches, checks for upgrades,
+ * updates and deletes them.  The upgrade check needs the index, and is
+ * skipped without one.
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mport.h>
+#include "mport_private.h"
+
+#define BENCH_PREFIX "/usr/local"
+#define BENCH_DIR "share/mport-bench"
+#define BENCH_DIR_FILES 100 /* files to a directory */
+#define BENCH_WHICH_MAX 1000 /* file lookups an iteration */
+#define BENCH_SEARCHES 100
+
+enum bench_op {
+	OP_CREATE, OP_INSTALL, OP_VERIFY, OP_WHICH, OP_SEARCH, OP_UPGRADE_CHECK, OP_UPDATE, OP_DELETE, OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+	"create", "install", "verify", "which", "search", "upgrade_check", "update", "delete"
+};
+
+struct bench_result {
+	size_t count; /* operations in one run */
+	double *runs; /* seconds, one per iteration */
+	int nruns;
+	bool skipped;
+};
+
+struct bench_pkg {
+	char name[32];
+	size_t nfiles;
+	char bundle[2][FILENAME_MAX]; /* 1.0 and 1.1 */
+};
+
+struct bench {
+	mportInstance *mport;
+	char work[FILENAME_MAX];
+	char root[FILENAME_MAX];
+	size_t *counts;
+	size_t ncounts;
+	size_t maxsize;
+	uint64_t seed;
+	int iterations;
+	mportCompression codec;
+	struct bench_pkg *pkgs;
+	size_t npkgs;
+	struct bench_result results[OP_COUNT];
+};
+
+static void usage(void);
+static void parse_counts(struct bench *, char *);
+static void make_packages(struct bench *);
+static void run_iteration(struct bench *, int);
+static void print_json(struct bench *, FILE *);
+
+static void quiet_msg(const char *msg) { }
+static void quiet_init(const char *title) { }
+static void quiet_step(int current, int total, const char *msg) { }
+static void quiet_free(void) { }
+
+int
+main(int argc, char *argv[])
+{
+	struct bench b;
+	const char *dir = "/tmp", *output = NULL;
+	bool keep = false;
+	FILE *out = stdout;
+	int ch;
+
+	memset(&b, 0, sizeof(b));
+	b.npkgs = 8;
+	b.maxsize = 64 * 1024;
+	b.seed = 1;
+	b.iterations = 3;
+	b.codec = MPORT_COMPRESS_DEFAULT;
+	parse_counts(&b, strdup("1,10,100,1000"));
+
+	while ((ch = getopt(argc, argv, "Z:d:f:i:kn:o:s:S:")) != -1) {
+		switch (ch) {
+			case 'Z':
+				if (mport_compression_parse(optarg, &b.codec) != MPORT_OK)
+					errx(EXIT_FAILURE, "%s", mport_err_string());
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			case 'f':
+				free(b.counts);
+				parse_counts(&b, optarg);
+				break;
+			case 'i':
+				b.iterations = atoi(optarg);
+				break;
+			case 'k':
+				keep = true;
+				break;
+			case 'n':
+				b.npkgs = (size_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 's':
+				b.maxsize = (size_t)strtoul(optarg, NULL, 10);
+				break;
+			case 'S':
+				b.seed = strtoull(optarg, NULL, 10);
+				break;
+			case '?':
+			default:
+				usage();
+				break;
+		}
+	}
+
+	if (b.npkgs == 0 || b.iterations < 1 || b.ncounts == 0)
+		usage();
+
+	(void)snprintf(b.work, sizeof(b.work), "%s/mport.bench.XXXXXXXX", dir);
+	if (mkdtemp(b.work) == NULL)
+		err(EXIT_FAILURE, "%s", b.work);
+	(void)snprintf(b.root, sizeof(b.root), "%s/root", b.work);
+	if (mport_mkdir(b.root) != MPORT_OK)
+		errx(EXIT_FAILURE, "%s", mport_err_string());
+
+	b.mport = mport_instance_new();
+	if (mport_instance_init(b.mport, b.root, NULL, true) != MPORT_OK)
+		errx(EXIT_FAILURE, "%s", mport_err_string());
+	mport_set_msg_cb(b.mport, quiet_msg);
+	mport_set_progress_init_cb(b.mport, quiet_init);
+	mport_set_progress_step_cb(b.mport, quiet_step);
+	mport_set_progress_free_cb(b.mport, quiet_free);
+
+	/* the index is shared with the real root, so only an existing one is used */
+	if (mport_file_exists(MPORT_INDEX_FILE) && mport_index_load(b.mport) != MPORT_OK)
+		warnx("No upgrade check: %s", mport_err_string());
+
+	for (int op = 0; op < OP_COUNT; op++) {
+		if ((b.results[op].runs = calloc((size_t)b.iterations, sizeof(double))) == NULL)
+			err(EXIT_FAILURE, "calloc");
+	}
+	if ((b.pkgs = calloc(b.npkgs, sizeof(struct bench_pkg))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	make_packages(&b);
+	for (int i = 0; i < b.iterations; i++)
+		run_iteration(&b, i);
+
+	if (output != NULL && (out = fopen(output, "w")) == NULL)
+		err(EXIT_FAILURE, "%s", output);
+	print_json(&b, out);
+	if (out != stdout && fclose(out) != 0)
+		err(EXIT_FAILURE, "%s", output);
+
+	mport_instance_free(b.mport);
+	if (!keep && mport_rmtree(b.work) != MPORT_OK)
+		warnx("%s", mport_err_string());
+
+	return (0);
+}
+
+static void
+parse_counts(struct bench *b, char *list)
+{
+	char *c;
+
+	b->ncounts = 0;
+	b->counts = NULL;
+	while ((c = strsep(&list, ",")) != NULL) {
+		if (*c == '\0')
+			continue;
+		if ((b->counts = reallocarray(b->counts, b->ncounts + 1, sizeof(size_t))) == NULL)
+			err(EXIT_FAILURE, "reallocarray");
+		b->counts[b->ncounts++] = (size_t)strtoul(c, NULL, 10);
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift64*, seeded per file so each version of a file is the same every run */
+static uint64_t
+next_random(uint64_t *state)
+{
+
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 2685821657736338717ULL;
+}
+
+/*
+ * A file of words from a short list with random bytes between, so it
+ * compresses about as well as the usual mix of text and binaries.  Sizes
+ * lean small, as they do in packages.
+ */
+static void
+make_file(struct bench *b, const char *path, uint64_t seed)
+{
+	static const char *words[] = {
+		"the ", "mport ", "package ", "lib", "share/", "usr/local ", "0x00", "\n", "int ", "return "
+	};
+	uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+	uint64_t r = next_random(&state);
+	size_t size = b->maxsize == 0 ? 0 : (size_t)((r % (b->maxsize + 1)) * (r % (b->maxsize + 1)) / (b->maxsize + 1));
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL)
+		err(EXIT_FAILURE, "%s", path);
+	for (size_t n = 0; n < size; ) {
+		r = next_random(&state);
+		if (r % 4 == 0) {
+			fputc((int)(r >> 8) & 0xff, f);
+			n++;
+		} else {
+			const char *w = words[(r >> 8) % (sizeof(words) / sizeof(words[0]))];
+			size_t len = strlen(w) < size - n ? strlen(w) : size - n;
+
+			fwrite(w, 1, len, f);
+			n += len;
+		}
+	}
+	if (fclose(f) != 0)
+		err(EXIT_FAILURE, "%s", path);
+}
+
+/* stage version v of pkg, with its plist, and build it; returns the seconds mport_create_primative() took */
+static double
+make_package(struct bench *b, struct bench_pkg *pkg, size_t index, int v)
+{
+	const char *version = v == 0 ? "1.0" : "1.1";
+	char src[FILENAME_MAX], path[FILENAME_MAX], plist[FILENAME_MAX], dir[FILENAME_MAX];
+	mportPackageMeta *pack;
+	mportCreateExtras *extra;
+	mportAssetList *assetlist;
+	FILE *fp;
+	double start, took;
+
+	(void)snprintf(src, sizeof(src), "%s/src/%s-%s", b->work, pkg->name, version);
+	(void)snprintf(plist, sizeof(plist), "%s/plist-%s-%s", b->work, pkg->name, version);
+	if ((fp = fopen(plist, "w")) == NULL)
+		err(EXIT_FAILURE, "%s", plist);
+
+	for (size_t f = 0; f < pkg->nfiles; f++) {
+		(void)snprintf(dir, sizeof(dir), "%s%s/%s/%s/d%zu", src, BENCH_PREFIX, BENCH_DIR, pkg->name, f / BENCH_DIR_FILES);
+		if (f % BENCH_DIR_FILES == 0 && mport_mkdirp(dir, 0755) != MPORT_OK)
+			errx(EXIT_FAILURE, "%s", mport_err_string());
+		(void)snprintf(path, sizeof(path), "%s/f%zu", dir, f);
+		/* a third of the files change between versions */
+		make_file(b, path, b->seed ^ (index << 32) ^ (f << 1) ^ (uint64_t)(v == 1 && f % 3 == 0));
+		fprintf(fp, "%s/%s/d%zu/f%zu\n", BENCH_DIR, pkg->name, f / BENCH_DIR_FILES, f);
+	}
+	if (fclose(fp) != 0)
+		err(EXIT_FAILURE, "%s", plist);
+
+	pack = mport_pkgmeta_new();
+	extra = mport_createextras_new();
+	assetlist = mport_assetlist_new();
+	if (pack == NULL || extra == NULL || assetlist == NULL)
+		errx(EXIT_FAILURE, "Failed to allocate memory");
+
+	if ((fp = fopen(plist, "r")) == NULL)
+		err(EXIT_FAILURE, "%s", plist);
+	if (mport_parse_plistfile(fp, assetlist) != 0)
+		errx(EXIT_FAILURE, "Could not parse plist file '%s'.", plist);
+	fclose(fp);
+
+	pack->name = strdup(pkg->name);
+	pack->version = strdup(version);
+	pack->origin = strdup("benchmarks/mport-bench");
+	pack->prefix = strdup(BENCH_PREFIX);
+	pack->comment = strdup("Synthetic package for mport.bench");
+	pack->lang = strdup("c");
+	mport_parselist(strdup("benchmarks"), &pack->categories);
+	pack->type = MPORT_TYPE_APP;
+	extra->pkg_filename = strdup(pkg->bundle[v]);
+	extra->sourcedir = strdup(src);
+	extra->compression = b->codec;
+
+	start = now();
+	if (mport_create_primative(b->mport, assetlist, pack, extra) != MPORT_OK)
+		errx(EXIT_FAILURE, "create %s-%s: %s", pkg->name, version, mport_err_string());
+	took = now() - start;
+
+	mport_assetlist_free(assetlist);
+	mport_pkgmeta_free(pack);
+	mport_createextras_free(extra);
+
+	return took;
+}
+
+static void
+make_packages(struct bench *b)
+{
+	char dir[FILENAME_MAX];
+
+	(void)snprintf(dir, sizeof(dir), "%s/pkgs", b->work);
+	if (mport_mkdir(dir) != MPORT_OK)
+		errx(EXIT_FAILURE, "%s", mport_err_string());
+
+	for (size_t i = 0; i < b->npkgs; i++) {
+		struct bench_pkg *pkg = &b->pkgs[i];
+
+		(void)snprintf(pkg->name, sizeof(pkg->name), "bench-%zu", i);
+		pkg->nfiles = b->counts[i % b->ncounts];
+		(void)snprintf(pkg->bundle[0], sizeof(pkg->bundle[0]), "%s/%s-1.0.mport", dir, pkg->name);
+		(void)snprintf(pkg->bundle[1], sizeof(pkg->bundle[1]), "%s/%s-1.1.mport", dir, pkg->name);
+	}
+}
+
+static void
+record(struct bench *b, enum bench_op op, int iteration, size_t count, double seconds)
+{
+
+	b->results[op].count = count;
+	b->results[op].runs[iteration] = seconds;
+	b->results[op].nruns = iteration + 1;
+}
+
+static void
+verify_cb(const mportVerifyResult *result, void *arg)
+{
+	size_t *bad = arg;
+
+	*bad += result->missing + result->modified + result->unreadable;
+}
+
+static void
+run_iteration(struct bench *b, int it)
+{
+	mportInstance *mport = b->mport;
+	mportPackageMeta **packs, *pack;
+	mportOutdatedEntry **outdated;
+	char path[FILENAME_MAX];
+	double start, took = 0;
+	size_t files = 0, lookups = 0, bad = 0;
+
+	for (size_t i = 0; i < b->npkgs; i++) {
+		took += make_package(b, &b->pkgs[i], i, 0);
+		took += make_package(b, &b->pkgs[i], i, 1);
+		files += b->pkgs[i].nfiles;
+	}
+	record(b, OP_CREATE, it, b->npkgs * 2, took);
+
+	start = now();
+	for (size_t i = 0; i < b->npkgs; i++) {
+		if (mport_install_primative(mport, b->pkgs[i].bundle[0], NULL, MPORT_EXPLICIT) != MPORT_OK)
+			errx(EXIT_FAILURE, "install %s: %s", b->pkgs[i].name, mport_err_string());
+	}
+	record(b, OP_INSTALL, it, b->npkgs, now() - start);
+
+	start = now();
+	if (mport_verify_packages(mport, verify_cb, &bad) != MPORT_OK)
+		errx(EXIT_FAILURE, "verify: %s", mport_err_string());
+	record(b, OP_VERIFY, it, files, now() - start);
+	if (bad != 0)
+		warnx("verify found %zu bad files", bad);
+
+	/* the files spread evenly over the packages */
+	start = now();
+	for (size_t i = 0; i < b->npkgs && lookups < BENCH_WHICH_MAX; i++) {
+		size_t step = files / BENCH_WHICH_MAX + 1;
+
+		for (size_t f = 0; f < b->pkgs[i].nfiles && lookups < BENCH_WHICH_MAX; f += step, lookups++) {
+			(void)snprintf(path, sizeof(path), "%s/%s/%s/d%zu/f%zu", BENCH_PREFIX, BENCH_DIR, b->pkgs[i].name,
+			    f / BENCH_DIR_FILES, f);
+			pack = NULL;
+			if (mport_asset_get_package_from_file_path(mport, path, &pack) != MPORT_OK || pack == NULL)
+				errx(EXIT_FAILURE, "which %s: %s", path, pack == NULL ? "no package" : mport_err_string());
+			mport_pkgmeta_free(pack);
+		}
+	}
+	record(b, OP_WHICH, it, lookups, now() - start);
+
+	start = now();
+	for (int i = 0; i < BENCH_SEARCHES; i++) {
+		if (mport_pkgmeta_search_master(mport, &packs, "pkg LIKE %Q", "bench-%") != MPORT_OK)
+			errx(EXIT_FAILURE, "search: %s", mport_err_string());
+		mport_pkgmeta_vec_free(packs);
+	}
+	record(b, OP_SEARCH, it, BENCH_SEARCHES, now() - start);
+
+	if (mport->flags & MPORT_INST_HAVE_INDEX) {
+		start = now();
+		if (mport_index_outdated(mport, &outdated) != MPORT_OK)
+			errx(EXIT_FAILURE, "upgrade check: %s", mport_err_string());
+		record(b, OP_UPGRADE_CHECK, it, 1, now() - start);
+		mport_index_outdated_free_vec(outdated);
+	} else
+		b->results[OP_UPGRADE_CHECK].skipped = true;
+
+	start = now();
+	for (size_t i = 0; i < b->npkgs; i++) {
+		if (mport_update_primative(mport, b->pkgs[i].bundle[1]) != MPORT_OK)
+			errx(EXIT_FAILURE, "update %s: %s", b->pkgs[i].name, mport_err_string());
+	}
+	record(b, OP_UPDATE, it, b->npkgs, now() - start);
+
+	start = now();
+	for (size_t i = 0; i < b->npkgs; i++) {
+		if (mport_pkgmeta_search_master(mport, &packs, "pkg=%Q", b->pkgs[i].name) != MPORT_OK || packs == NULL)
+			errx(EXIT_FAILURE, "delete %s: %s", b->pkgs[i].name, packs == NULL ? "not installed" : mport_err_string());
+		if (mport_delete_primative(mport, packs[0], 0) != MPORT_OK)
+			errx(EXIT_FAILURE, "delete %s: %s", b->pkgs[i].name, mport_err_string());
+		mport_pkgmeta_vec_free(packs);
+	}
+	record(b, OP_DELETE, it, b->npkgs, now() - start);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+print_json(struct bench *b, FILE *out)
+{
+	double sorted[b->iterations];
+
+	fprintf(out, "{\n  \"mport_version\": \"%s\",\n", MPORT_VERSION);
+	fprintf(out, "  \"config\": {\"packages\": %zu, \"files\": [", b->npkgs);
+	for (size_t i = 0; i < b->ncounts; i++)
+		fprintf(out, "%s%zu", i == 0 ? "" : ", ", b->counts[i]);
+	fprintf(out, "], \"max_size\": %zu, \"seed\": %ju, \"iterations\": %d, \"compression\": \"%s\"},\n",
+	    b->maxsize, (uintmax_t)b->seed, b->iterations, b->codec == MPORT_COMPRESS_ZSTD ? "zstd" :
+	    b->codec == MPORT_COMPRESS_XZ ? "xz" : "default");
+	fprintf(out, "  \"results\": [\n");
+
+	for (int op = 0; op < OP_COUNT; op++) {
+		struct bench_result *r = &b->results[op];
+
+		fprintf(out, "    {\"op\": \"%s\"", op_names[op]);
+		if (r->skipped || r->nruns == 0) {
+			fprintf(out, ", \"skipped\": true}");
+		} else {
+			double sum = 0;
+
+			memcpy(sorted, r->runs, sizeof(double) * (size_t)r->nruns);
+			qsort(sorted, (size_t)r->nruns, sizeof(double), cmp_double);
+			fprintf(out, ", \"count\": %zu, \"runs\": [", r->count);
+			for (int i = 0; i < r->nruns; i++) {
+				fprintf(out, "%s%.6f", i == 0 ? "" : ", ", r->runs[i]);
+				sum += r->runs[i];
+			}
+			fprintf(out, "], \"min\": %.6f, \"median\": %.6f, \"mean\": %.6f, \"per_op_ms\": %.3f}",
+			    sorted[0], sorted[r->nruns / 2], sum / r->nruns,
+			    r->count == 0 ? 0.0 : sorted[r->nruns / 2] * 1000 / r->count);
+		}
+		fprintf(out, "%s\n", op + 1 < OP_COUNT ? "," : "");
+	}
+
+	fprintf(out, "  ]\n}\n");
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: mport.bench [-k] [-d dir] [-f count,...] [-i iterations] [-n packages]\n"
+	    "                   [-o output.json] [-s max file size] [-S seed] [-Z xz|zstd]\n");
+	exit(2);
+}
@@ -86,7 +86,7 @@ main(int argc, char *argv[]) {
 
 	mport = mport_instance_new();
 
-	if (mport_instance_init(mport, NULL, NULL, false) != MPORT_OK) {
+	if (mport_instance_init_flags(mport, NULL, NULL, false, MPORT_INIT_READONLY) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		mport_instance_free(mport);
 		exit(EXIT_FAILURE);
@@ -63,7 +63,7 @@ int main(int argc, char *argv[])
 		errx(EXIT_FAILURE, "%s", mport_err_string());
 	}
 
-	while ((ch = getopt(argc, argv, "C:D:E:M:O:P:S:c:d:e:f:i:j:l:m:n:o:p:r:s:t:v:x:")) != -1) {
+	while ((ch = getopt(argc, argv, "C:D:E:KL:M:O:P:S:T:UZ:c:d:e:f:i:j:l:m:n:o:p:r:s:t:v:x:")) != -1) {
 		switch (ch) {
 			case 'o':
 				extra->pkg_filename = optarg;
@@ -161,6 +161,24 @@ int main(int argc, char *argv[])
 			case 't':
 				mport_parselist(optarg, &(pack->categories));
 				break;
+			case 'Z':
+				if (mport_compression_parse(optarg, &extra->compression) != MPORT_OK)
+					errx(EXIT_FAILURE, "%s", mport_err_string());
+				break;
+			case 'L':
+				extra->compression_level = atoi(optarg);
+				break;
+			case 'T':
+				extra->compression_threads = atoi(optarg);
+				if (extra->compression_threads == 0)
+					extra->compression_threads = MPORT_COMPRESS_THREADS_AUTO;
+				break;
+			case 'U':
+				extra->dedup = true;
+				break;
+			case 'K':
+				extra->chunks = true;
+				break;
 			case 'x':
 				if (optarg != NULL) {
 					pack->deprecated = strdup(optarg);
@@ -230,6 +248,11 @@ static void usage(void)
 	fprintf(stderr, "\t-m <pkg-message file>\n");
 	fprintf(stderr, "\t-M <mtree file>\n");
 	fprintf(stderr, "\t-t <categories>\n");
+	fprintf(stderr, "\t-Z <compression: xz or zstd>\n");
+	fprintf(stderr, "\t-L <compression level>\n");
+	fprintf(stderr, "\t-T <compression threads, 0 for one per CPU>\n");
+	fprintf(stderr, "\t-U (store files with the same content as hard links)\n");
+	fprintf(stderr, "\t-K (write a version 6 bundle in chunks, for parallel unpacking)\n");
 	exit(1);
 }
 
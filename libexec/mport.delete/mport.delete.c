@@ -39,22 +39,30 @@
 static void usage(void);
 
 int main(int argc, char *argv[]) {
-	int ch, force;
+	int ch, force, deep;
 	mportInstance *mport;
 	mportPackageMeta **packs;
 	const char *arg = NULL, *where = NULL;
 	const char *chroot_path = NULL;
+	const char *trace_path = NULL;
 
 	force = 0;
+	deep = 0;
 
 	if (argc == 1)
 		usage();
 
-	while ((ch = getopt(argc, argv, "c:fo:n:")) != -1) {
+	while ((ch = getopt(argc, argv, "T:c:dfo:n:")) != -1) {
 		switch (ch) {
+			case 'T':
+				trace_path = optarg;
+				break;
 			case 'c':
 				chroot_path = optarg;
 				break;
+			case 'd':
+				deep = 1;
+				break;
 			case 'f':
 				force = 1;
 				break;
@@ -93,6 +101,15 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
+	if (deep)
+		mport->flags |= MPORT_INST_DEEP;
+
+	if (trace_path != NULL && mport_trace_file(mport, trace_path) != MPORT_OK) {
+		warnx("%s", mport_err_string());
+		mport_instance_free(mport);
+		exit(EXIT_FAILURE);
+	}
+
 	if (mport_pkgmeta_search_master(mport, &packs, where, arg) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		mport_instance_free(mport);
@@ -121,7 +138,7 @@ int main(int argc, char *argv[]) {
 
 static void
 usage(void) {
-	fprintf(stderr, "Usage: mport.delete [-f] [-c <chroot directory>] -n pkgname\n");
-	fprintf(stderr, "Usage: mport.delete [-f] [-c <chroot directory>] -o origin\n");
+	fprintf(stderr, "Usage: mport.delete [-df] [-c <chroot directory>] [-T <timeline>] -n pkgname\n");
+	fprintf(stderr, "Usage: mport.delete [-df] [-c <chroot directory>] [-T <timeline>] -o origin\n");
 	exit(2);
 }
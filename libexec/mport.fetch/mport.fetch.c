@@ -46,6 +46,8 @@ main(int argc, char *argv[]) {
 	mportInstance *mport;
 	mportIndexEntry **indexEntries;
 	bool verbose = false;
+	bool depends = false;
+	mportIndexEntry **closure = NULL;
 	char *bundleFile = NULL;
 	const char *chroot_path = NULL;
 	const char *directory = NULL;
@@ -53,11 +55,14 @@ main(int argc, char *argv[]) {
 	if (argc < 2)
 		usage();
 
-	while ((ch = getopt(argc, argv, "c:o:v")) != -1) {
+	while ((ch = getopt(argc, argv, "c:do:v")) != -1) {
 		switch (ch) {
 			case 'c':
 				chroot_path = optarg;
 				break;
+			case 'd':
+				depends = true;
+				break;
 			case 'o':
 				directory = optarg;
 				break;
@@ -96,7 +101,36 @@ main(int argc, char *argv[]) {
 		exit(mport_err_code());
 	}
 
-	if (indexEntries != NULL) {
+	if (indexEntries != NULL && depends) {
+		/* every match with its dependencies, in one queue that fetches each bundle once */
+		for (int i = 0; indexEntries[i] != NULL; i++) {
+			mportIndexEntry **deps = NULL;
+			size_t n = 0, m = 0;
+
+			if (mport_index_depends_closure(mport, indexEntries[i]->pkgname, indexEntries[i]->version, &deps) != MPORT_OK) {
+				fprintf(stderr, "%s\n", mport_err_string());
+				exit(mport_err_code());
+			}
+			while (closure != NULL && closure[n] != NULL)
+				n++;
+			while (deps != NULL && deps[m] != NULL)
+				m++;
+			if ((closure = reallocarray(closure, n + m + 1, sizeof(mportIndexEntry *))) == NULL)
+				err(EXIT_FAILURE, "reallocarray");
+			if (m > 0)
+				memcpy(closure + n, deps, m * sizeof(mportIndexEntry *));
+			closure[n + m] = NULL;
+			/* the entries now belong to closure */
+			free(deps);
+		}
+
+		if (mport_fetch_bundles(mport, directory == NULL ? MPORT_LOCAL_PKG_PATH: directory, closure) != MPORT_OK) {
+			fprintf(stderr, "%s\n", mport_err_string());
+			exit(mport_err_code());
+		}
+		mport_index_entry_free_vec(closure);
+		mport_index_entry_free_vec(indexEntries);
+	} else if (indexEntries != NULL) {
 		/* TODO: currently only fetches first match */
 		if (*indexEntries != NULL) {
 			bundleFile = strdup((*indexEntries)->bundlefile);
@@ -122,6 +156,6 @@ main(int argc, char *argv[]) {
 
 static void
 usage(void) {
-	fprintf(stderr, "Usage: mport.fetch [-c <chroot directory>] <package name>\n");
+	fprintf(stderr, "Usage: mport.fetch [-d] [-c <chroot directory>] [-o <output directory>] <package name>\n");
 	exit(2);
 }
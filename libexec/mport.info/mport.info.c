@@ -45,6 +45,7 @@ main(int argc, char *argv[]) {
 	int ch;
 	mportInstance *mport;
 	mportPackageMeta **packs;
+	mportResultSet *set;
 	bool quiet = false;
 	bool verbose = false;
 	bool origin = false;
@@ -87,12 +88,12 @@ main(int argc, char *argv[]) {
 
 	mport = mport_instance_new();
 
-	if (mport_instance_init(mport, NULL, NULL, false) != MPORT_OK) {
+	if (mport_instance_init_flags(mport, NULL, NULL, false, MPORT_INIT_READONLY) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		exit(EXIT_FAILURE);
 	}
 
-	if (mport_pkgmeta_list(mport, &packs) != MPORT_OK) {
+	if (mport_pkgmeta_list_set(mport, &set, &packs) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		mport_instance_free(mport);
 		exit(EXIT_FAILURE);
@@ -101,6 +102,7 @@ main(int argc, char *argv[]) {
 	if (packs == NULL) {
 		if (!quiet)
 			warnx("No packages installed matching.");
+		mport_result_set_free(set);
 		mport_instance_free(mport);
 		exit(3);
 	}
@@ -121,6 +123,7 @@ main(int argc, char *argv[]) {
 		packs++;
 	}
 
+	mport_result_set_free(set);
 	mport_instance_free(mport);
 
 	return 0;
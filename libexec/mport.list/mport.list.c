@@ -38,26 +38,15 @@
 #include <getopt.h>
 #include <mport.h>
 
+#include "query.h"
+
 static void usage(void);
-static char * str_remove(const char *, const char);
 
 int 
 main(int argc, char *argv[]) 
 {
-	int ch;
+	int ch, flags = 0, ret;
 	mportInstance *mport;
-	mportPackageMeta **packs;
-	mportIndexEntry **indexEntries;
-	mportIndexEntry **iestart;
-	bool quiet = false;
-	bool verbose = false;
-	bool origin = false;
-	bool update = false;
-	bool locks = false;
-    bool prime = false;
-	char *comment;
-	char *os_release;
-	char name_version[30];
 	const char *chroot_path = NULL;
 	
 	if (argc > 3)
@@ -69,22 +58,22 @@ main(int argc, char *argv[])
 				chroot_path = optarg;
 				break;
 			case 'l':
-				locks = true;
+				flags |= LIST_LOCKS;
 				break;
 			case 'o':
-				origin = true;
+				flags |= LIST_ORIGIN;
 				break;
             case 'p':
-                prime = true;
+                flags |= LIST_PRIME;
                 break;
 			case 'q':
-				quiet = true;
+				flags |= LIST_QUIET;
 				break;
 			case 'v':
-				verbose = true;
+				flags |= LIST_VERBOSE;
 				break;
 			case 'u':
-				update = true;
+				flags |= LIST_UPDATES;
 				break; 
 			case '?':
 			default:
@@ -100,120 +89,21 @@ main(int argc, char *argv[])
 	}
 	
 	mport = mport_instance_new();
-	if (mport_instance_init(mport, NULL, NULL, false) != MPORT_OK) {
+	/* refreshing the index writes to it, plain listing only reads */
+	if (mport_instance_init_flags(mport, NULL, NULL, false,
+	    (flags & LIST_UPDATES) ? 0 : MPORT_INIT_READONLY) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		exit(EXIT_FAILURE);
 	}
 
-	os_release = mport_get_osrelease(mport);
-
-	if (update && mport_index_load(mport) != MPORT_OK) {
-                warnx("Unable to load updates index, %s", mport_err_string());
-		exit(8);
-	}
-
-	if (mport_pkgmeta_list(mport, &packs) != MPORT_OK) {
-		warnx("%s", mport_err_string());
-		mport_instance_free(mport);
-		exit(EXIT_FAILURE);
-	}
-	
-	if (packs == NULL) {
-		if (!quiet)
-			warnx("No packages installed matching.");
-		mport_instance_free(mport);
-		exit(3);
-	}
-	
-	while (*packs != NULL) {
-		if (update) {
-			if (mport_index_lookup_pkgname(mport, (*packs)->name, &indexEntries) != MPORT_OK) {
-				(void) fprintf(stderr, "Error Looking up package name %s: %d %s\n", (*packs)->name,  mport_err_code(), mport_err_string());
-				exit(mport_err_code());
-			}
-
-			if (indexEntries == NULL || *indexEntries == NULL) {
-				(void) printf("%-15s %8s is no longer available.\n", (*packs)->name, (*packs)->version);
-				packs++;
-				continue;
-			}
-	
-			iestart = indexEntries;		
-			while (*indexEntries != NULL) {
-				if (((*indexEntries)->version != NULL && mport_version_cmp((*packs)->version, (*indexEntries)->version) < 0) 
-					|| ((*packs)->version != NULL && mport_version_cmp((*packs)->os_release, os_release) < 0)) {
-
-                        if (verbose) {
-                            (void) printf("%-15s %8s (%s)  <  %-s\n", (*packs)->name, (*packs)->version,
-                                          (*packs)->os_release, (*indexEntries)->version);
-                        } else {
-                            (void) printf("%-15s %8s  <  %-8s\n", (*packs)->name, (*packs)->version,
-                                          (*indexEntries)->version);
-                        }
-				}
-				indexEntries++;
-			}
-				
-			mport_index_entry_free_vec(iestart);
-			indexEntries = NULL;
-		} else if (verbose) {
-			comment = str_remove((*packs)->comment, '\\');
-			snprintf(name_version, 30, "%s-%s", (*packs)->name, (*packs)->version);
-			
-			(void) printf("%-30s\t%6s\t%s\n", name_version, (*packs)->os_release, comment);
-			free(comment);
-		}
-        else if (prime && (*packs)->automatic == 0)
-            (void) printf("%s\n", (*packs)->name);
-		else if (quiet && !origin)
-			(void) printf("%s\n", (*packs)->name);
-		else if (quiet && origin)
-			(void) printf("%s\n", (*packs)->origin);
-		else if (origin)
-			(void) printf("Information for %s-%s:\n\nOrigin:\n%s\n\n",
-						  (*packs)->name, (*packs)->version, (*packs)->origin);
-		else if (locks) {
-			if ((*packs)->locked == 1)
-				(void) printf("%s-%s\n", (*packs)->name, (*packs)->version);
-
-		} else
-			(void) printf("%s-%s\n", (*packs)->name, (*packs)->version);
-		packs++;
-	}
-	
+	/* the same listing mportd gives, see query.c */
+	ret = list_packages(mport, flags);
 	mport_instance_free(mport); 
 	
-	return (0);
+	return (ret);
 }
 
 
-static char * 
-str_remove( const char *str, const char ch )
-{
-	size_t i;
-	size_t x;
-	size_t len;
-	char *output;
-	
-	if (str == NULL)
-		return NULL;
-	
-	len = strlen(str);
-	
-	output = calloc(len + 1, sizeof(char));
-	
-	for (i = 0, x = 0; i <= len; i++) {
-		if (str[i] != ch) {
-			output[x] = str[i];
-			x++;
-		}
-    }
-    output[len] = '\0';
-	
-    return (output);
-} 
-
-
 static void 
 usage(void) 
 {
@@ -82,7 +82,7 @@ int main(int argc, char *argv[]) {
 
 	mport = mport_instance_new();
 
-	if (mport_instance_init(mport, NULL, NULL, false) != MPORT_OK) {
+	if (mport_instance_init_flags(mport, NULL, NULL, false, MPORT_INIT_READONLY) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		mport_instance_free(mport);
 		exit(EXIT_FAILURE);
@@ -176,7 +176,7 @@ build_where(int argc, char **argv) {
 		} else if (strcmp(column, "origin") == 0) {
 			clause = sqlite3_mprintf("origin=%Q", arg);
 		} else if (strcmp(column, "version") == 0) {
-			clause = sqlite3_mprintf("mport_version_cmp(version, %Q)%s0", arg, op);
+			clause = sqlite3_mprintf("version_key%smport_version_key(%Q)", op, arg);
 		} else {
 			usage();
 		}
@@ -36,59 +36,103 @@
 #include "mport.h"
 #include "mport_private.h"
 
+/* mport_asset_get_owners(mport, paths, npaths, owners)
+ *
+ * Look up which installed package owns each of npaths file paths.  owners
+ * is set to an array parallel to paths holding the owning package name, or
+ * NULL where no package claims the path.  Free it with
+ * mport_asset_owners_free().
+ *
+ * The lookups share one statement and use the assets_data index, so this
+ * is cheap for large batches.
+ */
 MPORT_PUBLIC_API int
-mport_asset_get_package_from_file_path(mportInstance *mport, const char *filePath, mportPackageMeta **pack)
+mport_asset_get_owners(mportInstance *mport, const char **paths, size_t npaths, char ***owners_p)
 {
-	sqlite3_stmt *stmt = NULL;
-	int result = MPORT_OK;
-	char *err;
+	sqlite3_stmt *stmt;
+	char **owners;
+	const char *pkgName;
 
-	if (mport_db_prepare(mport->db, &stmt, "SELECT pkg FROM assets WHERE data=%Q", filePath) != MPORT_OK) {
-		sqlite3_finalize(stmt);
+	*owners_p = NULL;
+
+	if ((owners = calloc(npaths + 1, sizeof(char *))) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	if (mport_db_borrow(mport, &stmt, "SELECT pkg FROM assets WHERE data=? LIMIT 1") != MPORT_OK) {
+		free(owners);
 		RETURN_CURRENT_ERROR;
 	}
 
-	if (stmt == NULL) {
-		RETURN_ERROR(MPORT_ERR_FATAL, "Statement was null");
+	for (size_t i = 0; i < npaths; i++) {
+		if (sqlite3_bind_text(stmt, 1, paths[i], -1, SQLITE_STATIC) != SQLITE_OK) {
+			SET_ERRORX(MPORT_ERR_FATAL, "Error reading assets %s", sqlite3_errmsg(mport->db));
+			goto ERROR;
+		}
+
+		switch (sqlite3_step(stmt)) {
+			case SQLITE_ROW:
+				if ((pkgName = (const char *) sqlite3_column_text(stmt, 0)) != NULL &&
+				    (owners[i] = strdup(pkgName)) == NULL) {
+					SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+					goto ERROR;
+				}
+				break;
+			case SQLITE_DONE:
+				break;
+			default:
+				SET_ERRORX(MPORT_ERR_FATAL, "Error reading assets %s", sqlite3_errmsg(mport->db));
+				goto ERROR;
+		}
+
+		sqlite3_reset(stmt);
 	}
 
-	while (1) {
-		int ret = sqlite3_step(stmt);
+	mport_db_return(mport, stmt);
+	*owners_p = owners;
 
-		if (ret == SQLITE_BUSY || ret == SQLITE_LOCKED) {
-			sleep(1);
-			ret = sqlite3_step(stmt);
-		}
+	return MPORT_OK;
 
-		if (ret == SQLITE_DONE)
-			break;
+ERROR:
+	mport_db_return(mport, stmt);
+	mport_asset_owners_free(owners, npaths);
+	RETURN_CURRENT_ERROR;
+}
 
-		if (ret != SQLITE_ROW) {
-			err = (char *) sqlite3_errmsg(mport->db);
-			result = MPORT_ERR_FATAL;
-			break; // we finalize below
-		}
+MPORT_PUBLIC_API void
+mport_asset_owners_free(char **owners, size_t npaths)
+{
 
-		const unsigned char *pkgName = sqlite3_column_text(stmt, 0);
-		if (pkgName != NULL) {
-			mportPackageMeta **packs;
-			if (mport_pkgmeta_search_master(mport, &packs, "pkg=%Q", pkgName) != MPORT_OK || packs[0] == NULL) {
-				err = "Package does not exist despite having assets";
-				result = MPORT_ERR_FATAL;
-				break; // we finalize below
-			} else {
-				*pack = packs[0];
-				result = MPORT_OK;
-				break;
-			}
+	if (owners == NULL)
+		return;
+
+	for (size_t i = 0; i < npaths; i++)
+		free(owners[i]);
+	free(owners);
+}
+
+MPORT_PUBLIC_API int
+mport_asset_get_package_from_file_path(mportInstance *mport, const char *filePath, mportPackageMeta **pack)
+{
+	mportPackageMeta **packs;
+	char **owners;
+
+	if (mport_asset_get_owners(mport, &filePath, 1, &owners) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (owners[0] != NULL) {
+		if (mport_pkgmeta_get(mport, &packs, owners[0]) != MPORT_OK || packs == NULL) {
+			mport_asset_owners_free(owners, 1);
+			RETURN_ERROR(MPORT_ERR_FATAL, "Error reading assets Package does not exist despite having assets");
 		}
+
+		/* pkg is unique, so there is only the one */
+		*pack = packs[0];
+		free(packs);
 	}
 
-	sqlite3_finalize(stmt);
+	mport_asset_owners_free(owners, 1);
 
-	if (result == MPORT_ERR_FATAL)
-		SET_ERRORX(result, "Error reading assets %s", err);
-	return result;
+	return MPORT_OK;
 }
 
 MPORT_PUBLIC_API int
@@ -120,12 +164,7 @@ mport_asset_get_assetlist(mportInstance *mport, mportPackageMeta *pack, mportAss
 	while (1) {
 		mportAssetListEntry *e;
 
-		int ret = sqlite3_step(stmt);
-
-		if (ret == SQLITE_BUSY || ret == SQLITE_LOCKED) {
-			sleep(1);
-			ret = sqlite3_step(stmt);
-		}
+		int ret = mport_db_step(stmt);
 
 		if (ret == SQLITE_DONE)
 			break;
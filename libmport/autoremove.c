@@ -31,66 +31,47 @@
 #include "mport.h"
 #include "mport_private.h"
 
+/*
+ * Every package that is still needed: the explicitly installed and the
+ * locked ones, and whatever they depend on, directly or not.  UNION rather
+ * than UNION ALL, so a dependency cycle ends the recursion.
+ */
+#define AUTOREMOVE_NEEDED \
+    "WITH RECURSIVE needed(pkg) AS (" \
+    "SELECT pkg FROM packages WHERE automatic=%i OR locked=1 " \
+    "UNION " \
+    "SELECT d.depend_pkgname FROM depends d JOIN needed n ON d.pkg=n.pkg) "
+
+/*
+ * mport_autoremove(mportInstance *mport)
+ *
+ * Delete every automatically installed package that nothing explicitly
+ * installed needs any more.  The whole orphan set is worked out in one
+ * query, so packages only kept by other orphans go in the same run.
+ */
 MPORT_PUBLIC_API int
 mport_autoremove(mportInstance *mport) {
-    mportPackageMeta **packs, **packs_start;
-    mportPackageMeta **depends, **depends_start;
+    mportPackageMeta **orphans;
+    int ret = MPORT_OK;
 
-    if (mport_pkgmeta_list(mport, &packs) != MPORT_OK) {
+    if (mport_pkgmeta_search_master(mport, &orphans,
+            "automatic=%i AND pkg NOT IN (" AUTOREMOVE_NEEDED "SELECT pkg FROM needed)",
+            MPORT_AUTOMATIC, MPORT_EXPLICIT) != MPORT_OK) {
         RETURN_CURRENT_ERROR;
     }
 
-    if (packs == NULL)
+    if (orphans == NULL)
         return MPORT_OK;
 
-    packs_start = packs;
-    while (*packs != NULL) {
-        if ((*packs)->automatic == MPORT_EXPLICIT) {
-            packs++;
-            continue;
-        }
-
-        if (mport_pkgmeta_get_updepends(mport, *packs, &depends) != MPORT_OK) {
-            mport_call_msg_cb(mport, "Unable to evaluate package %s: %s", (*packs)->name, mport_err_string());
-            packs++;
-            continue;
-        }
-
-        if (depends == NULL) {
-            packs++;
-            continue;
-        }
+    for (mportPackageMeta **p = orphans; *p != NULL; p++)
+        mport_call_msg_cb(mport, "Auto-removing %s", (*p)->name);
 
-        depends_start = depends;
-        bool found = false;
-        while (*depends != NULL) {
-            if ((*depends)->automatic == MPORT_EXPLICIT) {
-                found = true;
-                break;
-            }
-            depends++;
-        }
-
-        if (found) {
-            packs++;
-            continue;
-        }
-
-        depends = depends_start;
-        while ((*depends) != NULL) {
-            mport_call_msg_cb(mport, "Auto-removing %s", (*depends)->name);
-            if (mport_delete_primative(mport, *depends, true) != MPORT_OK) {
-                mport_call_msg_cb(mport, "Unable to autoremove %s: %s", (*depends)->name, mport_err_string());
-                continue;
-            }
-
-            depends++;
-        }
-        mport_pkgmeta_vec_free(depends_start);
-
-        packs++;
+    if (mport_delete_packages(mport, orphans, true) != MPORT_OK) {
+        mport_call_msg_cb(mport, "Unable to autoremove: %s", mport_err_string());
+        ret = mport_err_code();
     }
-    mport_pkgmeta_vec_free(packs_start);
 
-    return MPORT_OK;
-}
\ No newline at end of file
+    mport_pkgmeta_vec_free(orphans);
+
+    return ret;
+}
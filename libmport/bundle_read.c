@@ -28,11 +28,21 @@
 
 #include <sys/cdefs.h>
 
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/acl.h>
+#include <sys/extattr.h>
+
 #include "mport.h"
 #include "mport_private.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 #include <archive_entry.h>
 
 /*
@@ -72,6 +82,10 @@ mport_bundle_read_init(mportBundleRead *bundle, const char *filename)
 	if (archive_read_support_filter_xz(bundle->archive) != ARCHIVE_OK) {
 		RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
 	}
+	/* zstd bundles; a warning is libarchive falling back to the zstd program */
+	if (archive_read_support_filter_zstd(bundle->archive) < ARCHIVE_WARN) {
+		RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+	}
 
 	if (archive_read_open_filename(bundle->archive, bundle->filename, 10240) != ARCHIVE_OK) {
 		RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
@@ -108,10 +122,17 @@ mport_bundle_read_finish(mportInstance *mport, mportBundleRead *bundle)
 	}
 
 	if (bundle->stub_attached && (mport != NULL)) {
+		/* inside a batch, the stub can only go once the package is committed */
+		if (mport_batch_pause(mport) != MPORT_OK)
+			ret = mport_err_code();
+
 		if (mport_detach_stub_db(mport->db) != MPORT_OK) {
 			mport_call_msg_cb(mport, "Stub database could not be detatched.");
 			ret = mport_err_code();
 		}
+
+		if (mport_batch_resume(mport) != MPORT_OK)
+			ret = mport_err_code();
 	}
 
 	if (bundle->tmpdir != NULL) {
@@ -120,6 +141,13 @@ mport_bundle_read_finish(mportInstance *mport, mportBundleRead *bundle)
 		}
 	}
 
+	/* after the detach, the stub image is one of these */
+	for (size_t i = 0; i < bundle->nmeta; i++) {
+		free(bundle->meta[i].name);
+		free(bundle->meta[i].data);
+	}
+	free(bundle->meta);
+
 	free(bundle->tmpdir);
 	free(bundle->filename);
 	free(bundle);
@@ -185,6 +213,169 @@ mport_bundle_read_extract_metafiles(mportBundleRead *bundle, char **dirnamep)
 	return (MPORT_OK);
 }
 
+/*
+ * mport_bundle_read_load_metafiles(bundle)
+ *
+ * Like mport_bundle_read_extract_metafiles(), but reads the meta files
+ * into memory rather than a temp dir.  They are small, and most are only
+ * ever read back, so writing them out and removing them again is wasted.
+ * See mport_bundle_read_metafile() and mport_bundle_read_metafile_path().
+ */
+int
+mport_bundle_read_load_metafiles(mportBundleRead *bundle)
+{
+	struct mport_bundle_metafile *m;
+	struct archive_entry *entry;
+	const unsigned char *linked;
+	const char *file, *link;
+	int64_t size;
+	ssize_t got;
+	size_t len;
+
+	while (1) {
+		if (mport_bundle_read_next_entry(bundle, &entry) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+
+		if (entry == NULL)
+			break;
+
+		file = archive_entry_pathname(entry);
+
+		if (*file != '+') {
+			/* hold on to the first real file, as extract_metafiles() does */
+			bundle->firstreal = entry;
+			break;
+		}
+
+		/* directories under +INFRASTRUCTURE have nothing to keep */
+		if (archive_entry_filetype(entry) != AE_IFREG && archive_entry_hardlink(entry) == NULL)
+			continue;
+
+		if ((size = archive_entry_size(entry)) < 0)
+			RETURN_ERRORX(MPORT_ERR_FATAL, "%s: bad size for %s", bundle->filename, file);
+
+		m = reallocarray(bundle->meta, bundle->nmeta + 1, sizeof(*bundle->meta));
+		if (m == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		bundle->meta = m;
+		m = &bundle->meta[bundle->nmeta];
+
+		/* a hard link carries no data, it shares an earlier file's */
+		linked = NULL;
+		if ((link = archive_entry_hardlink(entry)) != NULL)
+			linked = mport_bundle_read_metafile(bundle, link, &len);
+		if (linked == NULL)
+			len = (size_t)size;
+
+		/* one spare byte, so text files can be used as strings */
+		m->name = strdup(file);
+		m->data = malloc(len + 1);
+		m->len = len;
+		if (m->name == NULL || m->data == NULL) {
+			free(m->name);
+			free(m->data);
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		}
+		bundle->nmeta++;
+
+		if (linked != NULL) {
+			memcpy(m->data, linked, len + 1);
+			continue;
+		}
+
+		for (size_t off = 0; off < len; off += (size_t)got) {
+			if ((got = archive_read_data(bundle->archive, m->data + off, len - off)) <= 0)
+				RETURN_ERRORX(MPORT_ERR_FATAL, "%s: short read on %s: %s", bundle->filename, file,
+				    got == 0 ? "unexpected end of file" : archive_error_string(bundle->archive));
+		}
+		m->data[len] = '\0';
+	}
+
+	return (MPORT_OK);
+}
+
+/*
+ * mport_bundle_read_metafile(bundle, name, &len)
+ *
+ * Returns the contents of the meta file name (as in the archive, eg
+ * "+CONTENTS.db"), loaded by mport_bundle_read_load_metafiles(), or NULL
+ * if the bundle has none.  The data is NUL terminated one byte past len.
+ */
+const unsigned char *
+mport_bundle_read_metafile(mportBundleRead *bundle, const char *name, size_t *len)
+{
+	for (size_t i = 0; i < bundle->nmeta; i++) {
+		if (strcmp(bundle->meta[i].name, name) == 0) {
+			if (len != NULL)
+				*len = bundle->meta[i].len;
+			return (bundle->meta[i].data);
+		}
+	}
+
+	return (NULL);
+}
+
+/*
+ * mport_bundle_read_metafile_path(bundle, name, mode, path, pathlen)
+ *
+ * For meta files that have to be run or handed to another program: write
+ * name out under the bundle's temp dir with mode, creating the temp dir
+ * on first use, and put the file name in path.  Returns MPORT_ERR_WARN,
+ * without setting an error, if the bundle has no such meta file.
+ */
+int
+mport_bundle_read_metafile_path(mportBundleRead *bundle, const char *name, mode_t mode, char *path,
+    size_t pathlen)
+{
+	const unsigned char *data;
+	char dirtmpl[] = "/tmp/mport.XXXXXXXX";
+	char *slash;
+	size_t len, off;
+	ssize_t wrote;
+	int fd;
+
+	if ((data = mport_bundle_read_metafile(bundle, name, &len)) == NULL)
+		return (MPORT_ERR_WARN);
+
+	if (bundle->tmpdir == NULL) {
+		if (mkdtemp(dirtmpl) == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, strerror(errno));
+		if ((bundle->tmpdir = strdup(dirtmpl)) == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+
+	if ((size_t)snprintf(path, pathlen, "%s/%s", bundle->tmpdir, name) >= pathlen)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Path too long: %s/%s", bundle->tmpdir, name);
+
+	if ((slash = strrchr(path, '/')) != NULL) {
+		*slash = '\0';
+		if (mport_mkdirp(path, S_IRWXU) == 0) {
+			*slash = '/';
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't create the directory for %s", path);
+		}
+		*slash = '/';
+	}
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode)) == -1)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't create %s: %s", path, strerror(errno));
+
+	for (off = 0; off < len; off += (size_t)wrote) {
+		if ((wrote = write(fd, data + off, len - off)) == -1) {
+			close(fd);
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", path, strerror(errno));
+		}
+	}
+
+	/* open() leaves the mode to the umask */
+	if (fchmod(fd, mode) == -1) {
+		close(fd);
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't set the mode of %s: %s", path, strerror(errno));
+	}
+	close(fd);
+
+	return (MPORT_OK);
+}
+
 /*
  * mport_bundle_read_skip_metafiles(bundle)
  *
@@ -264,18 +455,305 @@ mport_bundle_read_extract_next_file(mportBundleRead *bundle, struct archive_entr
 	if (archive_read_extract(bundle->archive, entry,
 		ARCHIVE_EXTRACT_OWNER | ARCHIVE_EXTRACT_PERM |
 		    ARCHIVE_EXTRACT_TIME | ARCHIVE_EXTRACT_ACL |
-		    ARCHIVE_EXTRACT_FFLAGS) != ARCHIVE_OK) {
+		    ARCHIVE_EXTRACT_XATTR | ARCHIVE_EXTRACT_FFLAGS) != ARCHIVE_OK) {
 		RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
 	}
 
 	return (MPORT_OK);
 }
 
+/* whether entry has ACLs or extended attributes to restore */
+static bool
+has_acl_xattr(struct archive_entry *entry)
+{
+
+	return archive_entry_acl_count(entry, ARCHIVE_ENTRY_ACL_TYPE_POSIX1E | ARCHIVE_ENTRY_ACL_TYPE_NFS4) > 0 ||
+	    archive_entry_xattr_count(entry) > 0;
+}
+
+/*
+ * Set the ACLs and extended attributes entry carries on the file open on
+ * fd, as ARCHIVE_EXTRACT_ACL and ARCHIVE_EXTRACT_XATTR would.  A file
+ * system that supports neither is not an error.
+ */
+static int
+restore_acl_xattr(struct archive_entry *entry, int fd, bool dir)
+{
+	static const struct {
+		int archive;
+		acl_type_t type;
+	} acls[] = {
+		{ ARCHIVE_ENTRY_ACL_TYPE_ACCESS, ACL_TYPE_ACCESS },
+		{ ARCHIVE_ENTRY_ACL_TYPE_DEFAULT, ACL_TYPE_DEFAULT },
+		{ ARCHIVE_ENTRY_ACL_TYPE_NFS4, ACL_TYPE_NFS4 },
+	};
+	const char *name;
+	const void *value;
+	size_t size;
+	char *text;
+	acl_t acl;
+	int ns, ret;
+
+	for (size_t i = 0; i < nitems(acls); i++) {
+		/* only a directory has a default ACL */
+		if ((acls[i].type == ACL_TYPE_DEFAULT && !dir) || archive_entry_acl_count(entry, acls[i].archive) == 0)
+			continue;
+		if ((text = archive_entry_acl_to_text(entry, NULL, acls[i].archive)) == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		acl = acl_from_text(text);
+		free(text);
+		if (acl == NULL)
+			return -1;
+		ret = acl_set_fd_np(fd, acl, acls[i].type);
+		acl_free(acl);
+		if (ret == -1 && errno != EOPNOTSUPP)
+			return -1;
+	}
+
+	if (archive_entry_xattr_reset(entry) == 0)
+		return 0;
+
+	/* libarchive names them namespace.name */
+	while (archive_entry_xattr_next(entry, &name, &value, &size) == ARCHIVE_OK) {
+		if (strncmp(name, "user.", 5) == 0) {
+			ns = EXTATTR_NAMESPACE_USER;
+			name += 5;
+		} else if (strncmp(name, "system.", 7) == 0) {
+			ns = EXTATTR_NAMESPACE_SYSTEM;
+			name += 7;
+		} else {
+			continue;
+		}
+		if (extattr_set_fd(fd, ns, name, value, size) == -1 && errno != EOPNOTSUPP)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* fsync the directory holding path, named relative to dirfd */
+static int
+sync_parent(int dirfd, const char *path)
+{
+	char parent[FILENAME_MAX];
+	const char *slash;
+	int fd, ret;
+
+	if ((slash = strrchr(path, '/')) == NULL)
+		return (fsync(dirfd));
+
+	if (slash == path)
+		(void)strlcpy(parent, "/", sizeof(parent));
+	else if ((size_t)(slash - path) < sizeof(parent))
+		(void)strlcpy(parent, path, slash - path + 1);
+	else {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	if ((fd = openat(dirfd, parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return (-1);
+	ret = fsync(fd);
+	close(fd);
+
+	return (ret);
+}
+
+/*
+ * A copy of the file at from as to, both relative to dirfd, for a hard link
+ * the filesystem won't make.  copy_file_range() lets one that can share
+ * blocks between files do so.  -1 with errno set on failure.
+ */
+static int
+copy_linked(int dirfd, const char *from, const char *to)
+{
+	ssize_t n;
+	int in, out, saved;
+
+	if ((in = openat(dirfd, from, O_RDONLY | O_CLOEXEC)) == -1)
+		return (-1);
+	if ((out = openat(dirfd, to, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+	    S_IRUSR | S_IWUSR)) == -1) {
+		saved = errno;
+		close(in);
+		errno = saved;
+		return (-1);
+	}
+
+#if __MidnightBSD_version >= 300000
+	while ((n = copy_file_range(in, NULL, out, NULL, SSIZE_MAX, 0)) > 0)
+		;
+#else
+	char buf[BUFSIZ * 16];
+
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		for (ssize_t off = 0, w; off < n; off += w) {
+			if ((w = write(out, buf + off, (size_t)(n - off))) < 0) {
+				n = -1;
+				break;
+			}
+		}
+		if (n < 0)
+			break;
+	}
+#endif
+
+	saved = errno;
+	close(in);
+	if (close(out) != 0 && n == 0) {
+		saved = errno;
+		n = -1;
+	}
+	errno = saved;
+
+	return (n < 0 ? -1 : 0);
+}
+
+/*
+ * mport_bundle_read_extract_next_file_at(bundle, entry, dirfd, path)
+ *
+ * extract the next file in the bundle to path, relative to the directory
+ * open on dirfd.  The file is written under a temporary name, given the
+ * owner, mode, ACLs, extended attributes and times from entry through its
+ * own descriptor, and then
+ * renamed over path, so path never exists half written or with the wrong
+ * permissions.  As with mport_bundle_read_extract_next_file(), change the
+ * entry first to install with different settings.  With the "file"
+ * durability the data and the rename are synced before returning.
+ */
+int
+mport_bundle_read_extract_next_file_at(mportBundleRead *bundle, struct archive_entry *entry, int dirfd, const char *path)
+{
+	char tmp[FILENAME_MAX];
+	struct timespec ts[2];
+	const char *link;
+	u_long set, clear;
+	uid_t uid = (uid_t)archive_entry_uid(entry);
+	gid_t gid = (gid_t)archive_entry_gid(entry);
+	mode_t perm = archive_entry_perm(entry);
+	int fd = -1;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.mport.%d", path, (int)getpid()) >= (int)sizeof(tmp))
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Path too long: %s", path);
+
+	ts[1].tv_sec = archive_entry_mtime(entry);
+	ts[1].tv_nsec = archive_entry_mtime_is_set(entry) ? archive_entry_mtime_nsec(entry) : UTIME_NOW;
+	if (archive_entry_atime_is_set(entry)) {
+		ts[0].tv_sec = archive_entry_atime(entry);
+		ts[0].tv_nsec = archive_entry_atime_nsec(entry);
+	} else
+		ts[0] = ts[1];
+
+	/* left over from an interrupted install */
+	(void)unlinkat(dirfd, tmp, 0);
+
+	if ((link = archive_entry_hardlink(entry)) != NULL) {
+		/* the target was extracted earlier, relative to the same directory */
+		if (linkat(dirfd, link, dirfd, tmp, 0) == -1) {
+			/* on another filesystem, or out of links: the same content will do */
+			if ((errno != EXDEV && errno != EMLINK) || copy_linked(dirfd, link, tmp) == -1 ||
+			    utimensat(dirfd, tmp, ts, AT_SYMLINK_NOFOLLOW) == -1)
+				goto ERROR;
+		}
+		if (fchownat(dirfd, tmp, uid, gid, AT_SYMLINK_NOFOLLOW) == -1 ||
+		    fchmodat(dirfd, tmp, perm, 0) == -1)
+			goto ERROR;
+	} else {
+		switch (archive_entry_filetype(entry)) {
+		case AE_IFREG:
+			if ((fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+			    S_IRUSR | S_IWUSR)) == -1)
+				goto ERROR;
+			if (archive_read_data_into_fd(bundle->archive, fd) != ARCHIVE_OK) {
+				SET_ERRORX(MPORT_ERR_FATAL, "Unable to extract %s: %s", path,
+				    archive_error_string(bundle->archive));
+				goto CLEANUP;
+			}
+			/* owner before mode, chown clears the set-id bits; the ACL after the mode it masks */
+			if (fchown(fd, uid, gid) == -1 || fchmod(fd, perm) == -1 ||
+			    restore_acl_xattr(entry, fd, false) == -1 || futimens(fd, ts) == -1)
+				goto ERROR;
+			if (bundle->durability == MPORT_DURABLE_FILE && fsync(fd) == -1)
+				goto ERROR;
+			break;
+		case AE_IFLNK:
+			if (symlinkat(archive_entry_symlink(entry), dirfd, tmp) == -1 ||
+			    fchownat(dirfd, tmp, uid, gid, AT_SYMLINK_NOFOLLOW) == -1 ||
+			    utimensat(dirfd, tmp, ts, AT_SYMLINK_NOFOLLOW) == -1)
+				goto ERROR;
+			break;
+		case AE_IFDIR:
+			/* directories are made in place; an existing one is kept */
+			if ((mkdirat(dirfd, path, perm) == -1 && errno != EEXIST) ||
+			    fchownat(dirfd, path, uid, gid, 0) == -1 ||
+			    fchmodat(dirfd, path, perm, 0) == -1) {
+				RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to create directory %s: %s", path,
+				    strerror(errno));
+			}
+			if (has_acl_xattr(entry)) {
+				if ((fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) == -1 ||
+				    restore_acl_xattr(entry, fd, true) == -1) {
+					SET_ERRORX(MPORT_ERR_FATAL, "Unable to create directory %s: %s", path,
+					    strerror(errno));
+					if (fd != -1)
+						close(fd);
+					RETURN_CURRENT_ERROR;
+				}
+				close(fd);
+			}
+			return (MPORT_OK);
+		case AE_IFIFO:
+		case AE_IFCHR:
+		case AE_IFBLK:
+			if (mknodat(dirfd, tmp, archive_entry_mode(entry), archive_entry_rdev(entry)) == -1 ||
+			    fchownat(dirfd, tmp, uid, gid, 0) == -1 ||
+			    fchmodat(dirfd, tmp, perm, 0) == -1)
+				goto ERROR;
+			break;
+		default:
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Unsupported file type in bundle for %s", path);
+		}
+	}
+
+	if (renameat(dirfd, tmp, dirfd, path) == -1)
+		goto ERROR;
+
+	/* and the rename itself; dirfd is the parent unless path has a slash */
+	if (bundle->durability == MPORT_DURABLE_FILE && sync_parent(dirfd, path) == -1)
+		goto ERROR;
+
+	/* renaming a hard link over the same file succeeds and leaves tmp behind */
+	if (link != NULL)
+		(void)unlinkat(dirfd, tmp, 0);
+
+	/* file flags last, schg and friends would refuse the rename */
+	archive_entry_fflags(entry, &set, &clear);
+	if (set != 0) {
+		if ((fd != -1 ? fchflags(fd, set) : chflagsat(dirfd, path, set, AT_SYMLINK_NOFOLLOW)) == -1)
+			goto ERROR;
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	return (MPORT_OK);
+
+ERROR:
+	SET_ERRORX(MPORT_ERR_FATAL, "Unable to extract %s: %s", path, strerror(errno));
+CLEANUP:
+	if (fd != -1)
+		close(fd);
+	(void)unlinkat(dirfd, tmp, 0);
+	RETURN_CURRENT_ERROR;
+}
+
 /*
  * mport_bundle_read_prep_for_install(mport, bundle)
  *
- * Extract the metafile into a tmpdir that the bundle maintains, attach the stub
- * db for the instance master database.
+ * Load the metafiles into memory, and attach the stub db from there to the
+ * instance master database.
  */
 int
 mport_bundle_read_prep_for_install(
@@ -284,12 +762,19 @@ mport_bundle_read_prep_for_install(
 	sqlite3_stmt *stmt;
 	int bundle_version;
 	int ret;
+	unsigned char *stub;
+	size_t stublen;
 
-	if (mport_bundle_read_extract_metafiles(bundle, &(bundle->tmpdir)) != MPORT_OK) {
+	if (mport_bundle_read_load_metafiles(bundle) != MPORT_OK) {
 		RETURN_CURRENT_ERROR;
 	}
 
-	if (mport_attach_stub_db(mport->db, bundle->tmpdir) != MPORT_OK) {
+	/* the image is only read, so attach it in place */
+	if ((stub = (unsigned char *)mport_bundle_read_metafile(bundle, MPORT_STUB_DB_FILE, &stublen)) == NULL) {
+		RETURN_ERRORX(MPORT_ERR_FATAL, "%s: no %s in bundle", bundle->filename, MPORT_STUB_DB_FILE);
+	}
+
+	if (mport_attach_stub_db_mem(mport->db, stub, stublen) != MPORT_OK) {
 		RETURN_CURRENT_ERROR;
 	}
 
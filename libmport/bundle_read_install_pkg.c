@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <stdarg.h>
@@ -50,6 +51,7 @@ enum phase {
 static int do_pre_install(mportInstance *, mportBundleRead *, mportPackageMeta *);
 
 static int do_actual_install(mportInstance *, mportBundleRead *, mportPackageMeta *);
+static int sync_package_files(mportInstance *, mportPackageMeta *, mportAssetList *);
 
 static int do_post_install(mportInstance *, mportBundleRead *, mportPackageMeta *);
 
@@ -61,7 +63,16 @@ static int run_mtree(mportInstance *, mportBundleRead *, mportPackageMeta *);
 
 static int display_pkg_msg(mportInstance *, mportBundleRead *, mportPackageMeta *);
 
-static int get_file_count(mportInstance *, char *, int *);
+static int get_file_count(mportAssetList *);
+
+static bool same_on_disk(int, const char *, struct archive_entry *);
+
+struct asset_rows;
+static struct asset_rows *asset_rows_new(void);
+static int asset_rows_add(mportInstance *, struct asset_rows *, mportPackageMeta *, mportAssetListEntryType,
+    const char *, const char *, const char *, const char *, const char *, const struct stat *);
+static int asset_rows_flush(mportInstance *, struct asset_rows *, mportPackageMeta *);
+static void asset_rows_free(struct asset_rows *);
 
 static int create_package_row(mportInstance *, mportPackageMeta *);
 
@@ -89,15 +100,25 @@ static int copy_metafile(mportInstance *, mportBundleRead *, mportPackageMeta *,
 int
 mport_bundle_read_install_pkg(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
 {
-	if (do_pre_install(mport, bundle, pkg) != MPORT_OK) {
+	int ret;
+
+	mport_trace_begin(mport, MPORT_TRACE_PREINSTALL, pkg->name);
+	ret = do_pre_install(mport, bundle, pkg);
+	mport_trace_end(mport, MPORT_TRACE_PREINSTALL, 0, 0, ret);
+	if (ret != MPORT_OK) {
 		RETURN_CURRENT_ERROR;
 	}
 
+	/* do_actual_install() ends the extract phase itself, with its counts */
+	mport_trace_begin(mport, MPORT_TRACE_EXTRACT, pkg->name);
 	if (do_actual_install(mport, bundle, pkg) != MPORT_OK) {
 		RETURN_CURRENT_ERROR;
 	}
 
-	if (do_post_install(mport, bundle, pkg) != MPORT_OK) {
+	mport_trace_begin(mport, MPORT_TRACE_POSTINSTALL, pkg->name);
+	ret = do_post_install(mport, bundle, pkg);
+	mport_trace_end(mport, MPORT_TRACE_POSTINSTALL, 0, 0, ret);
+	if (ret != MPORT_OK) {
 		RETURN_CURRENT_ERROR;
 	}
 
@@ -164,37 +185,231 @@ do_pre_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *
 	RETURN_CURRENT_ERROR;
 }
 
-/* get the file count for the progress meter */
+/* get the file count for the progress meter, from the list already in memory */
 static int
-get_file_count(mportInstance *mport, char *pkg_name, int *file_total)
+get_file_count(mportAssetList *alist)
 {
-	sqlite3_stmt *count;
-	int result = MPORT_OK;
-	char *err;
+	mportAssetListEntry *e;
+	int file_total = 0;
 
-	if (mport_db_prepare(mport->db, &count,
-	                     "SELECT COUNT(*) FROM stub.assets WHERE (type=%i or type=%i or type=%i or type=%i or type=%i) AND pkg=%Q",
-	                     ASSET_FILE, ASSET_SAMPLE, ASSET_SHELL, ASSET_FILE_OWNER_MODE, ASSET_SAMPLE_OWNER_MODE,
-	                     pkg_name) != MPORT_OK) {
-		sqlite3_finalize(count);
-		RETURN_CURRENT_ERROR;
+	STAILQ_FOREACH(e, alist, next) {
+		switch (e->type) {
+			case ASSET_FILE:
+			case ASSET_SAMPLE:
+			case ASSET_SHELL:
+			case ASSET_FILE_OWNER_MODE:
+			case ASSET_SAMPLE_OWNER_MODE:
+				file_total++;
+				break;
+			default:
+				break;
+		}
 	}
 
+	return file_total;
+}
+
+
+/*
+ * Whether the file at dirfd/rel is what entry would extract, going by what
+ * the installed package recorded (its checksum, checked by the caller) and
+ * what extraction sets: type, size, owner, mode and modification time.
+ */
+static bool
+same_on_disk(int dirfd, const char *rel, struct archive_entry *entry)
+{
+	struct stat st;
+
+	if (archive_entry_filetype(entry) != AE_IFREG || archive_entry_hardlink(entry) != NULL)
+		return false;
+
+	if (fstatat(dirfd, rel, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	return st.st_size == archive_entry_size(entry) &&
+	    st.st_uid == archive_entry_uid(entry) &&
+	    st.st_gid == archive_entry_gid(entry) &&
+	    (st.st_mode & ALLPERMS) == (archive_entry_perm(entry) & ALLPERMS) &&
+	    st.st_mtime == archive_entry_mtime(entry);
+}
+
+/*
+ * Asset rows for the master database, held back and inserted
+ * ASSET_INSERT_ROWS at a time with one multi-row statement.  The strings are
+ * the asset list's own, except the names that were made absolute, which are
+ * copied into the row.  11 parameters a row keeps the statement under
+ * SQLite's default limit of 999.
+ */
+#define ASSET_INSERT_ROWS 64
+#define ASSET_INSERT_COLS 10
+
+struct asset_row {
+	mportAssetListEntryType type;
+	const char *data;
+	const char *checksum;
+	const char *owner;
+	const char *group;
+	const char *mode;
+	bool fingerprint; /* size, mtime, ino and ctime are set */
+	sqlite3_int64 size, mtime, ino, ctime;
+	char path[FILENAME_MAX];
+};
+
+struct asset_rows {
+	sqlite3_stmt *full; /* prepared for ASSET_INSERT_ROWS rows, on first use */
+	int count;
+	struct asset_row row[ASSET_INSERT_ROWS];
+};
+
+static struct asset_rows *
+asset_rows_new(void)
+{
 
-	switch (sqlite3_step(count)) {
-		case SQLITE_ROW:
-			*file_total = sqlite3_column_int(count, 0);
-			sqlite3_finalize(count);
-			break;
-		default:
-			err = (char *) sqlite3_errmsg(mport->db);
-			result = MPORT_ERR_FATAL;
-			sqlite3_finalize(count);
+	return calloc(1, sizeof(struct asset_rows));
+}
+
+static void
+asset_rows_free(struct asset_rows *rows)
+{
+
+	if (rows == NULL)
+		return;
+	sqlite3_finalize(rows->full);
+	free(rows);
+}
+
+/* an INSERT for nrows assets */
+static int
+asset_rows_prepare(mportInstance *mport, int nrows, sqlite3_stmt **stmt)
+{
+	static const char head[] = "INSERT INTO assets (pkg, type, data, checksum, owner, grp, mode, size, mtime, ino, ctime) VALUES ";
+	static const char tuple[] = "(?,?,?,?,?,?,?,?,?,?,?),";
+	char sql[sizeof(head) + ASSET_INSERT_ROWS * (sizeof(tuple) - 1)];
+	char *p;
+
+	(void) memcpy(sql, head, sizeof(head) - 1);
+	p = sql + sizeof(head) - 1;
+	for (int i = 0; i < nrows; i++) {
+		(void) memcpy(p, tuple, sizeof(tuple) - 1);
+		p += sizeof(tuple) - 1;
 	}
+	p[-1] = '\0'; /* the last comma */
 
-	if (result == MPORT_ERR_FATAL)
-		SET_ERRORX(result, "Error reading file count %s", err);
-	return result;
+	if (sqlite3_prepare_v2(mport->db, sql, -1, stmt, NULL) != SQLITE_OK) {
+		sqlite3_finalize(*stmt);
+		*stmt = NULL;
+		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	}
+
+	return MPORT_OK;
+}
+
+/* a fingerprint column, NULL when the row has none */
+static int
+bind_fingerprint(sqlite3_stmt *stmt, int col, bool set, sqlite3_int64 value)
+{
+
+	return set ? sqlite3_bind_int64(stmt, col, value) : sqlite3_bind_null(stmt, col);
+}
+
+/*
+ * asset_rows_flush(mport, rows, pkg)
+ *
+ * Insert the rows held so far, in order, so rowids keep the order of the
+ * packing list.
+ */
+static int
+asset_rows_flush(mportInstance *mport, struct asset_rows *rows, mportPackageMeta *pkg)
+{
+	sqlite3_stmt *stmt, *tail = NULL;
+	struct asset_row *r;
+	int col = 1, ret;
+
+	if (rows->count == 0)
+		return MPORT_OK;
+
+	if (rows->count == ASSET_INSERT_ROWS) {
+		if (rows->full == NULL && asset_rows_prepare(mport, ASSET_INSERT_ROWS, &rows->full) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+		stmt = rows->full;
+	} else {
+		if (asset_rows_prepare(mport, rows->count, &tail) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+		stmt = tail;
+	}
+
+	for (int i = 0; i < rows->count; i++) {
+		r = &rows->row[i];
+		/* a NULL string binds as NULL */
+		if (sqlite3_bind_text(stmt, col++, pkg->name, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_int(stmt, col++, (int) r->type) != SQLITE_OK ||
+		    sqlite3_bind_text(stmt, col++, r->data, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(stmt, col++, r->checksum, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(stmt, col++, r->owner, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(stmt, col++, r->group, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(stmt, col++, r->mode, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    bind_fingerprint(stmt, col++, r->fingerprint, r->size) != SQLITE_OK ||
+		    bind_fingerprint(stmt, col++, r->fingerprint, r->mtime) != SQLITE_OK ||
+		    bind_fingerprint(stmt, col++, r->fingerprint, r->ino) != SQLITE_OK ||
+		    bind_fingerprint(stmt, col++, r->fingerprint, r->ctime) != SQLITE_OK) {
+			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+			(void) sqlite3_clear_bindings(stmt);
+			sqlite3_finalize(tail);
+			rows->count = 0;
+			RETURN_CURRENT_ERROR;
+		}
+	}
+
+	mport_trace_begin(mport, MPORT_TRACE_DB, pkg->name);
+	ret = sqlite3_step(stmt);
+	if (ret != SQLITE_DONE)
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	mport_trace_end(mport, MPORT_TRACE_DB, rows->count, 0, ret == SQLITE_DONE ? MPORT_OK : MPORT_ERR_FATAL);
+	(void) sqlite3_reset(stmt);
+	(void) sqlite3_clear_bindings(stmt);
+	sqlite3_finalize(tail);
+	rows->count = 0;
+
+	return ret == SQLITE_DONE ? MPORT_OK : MPORT_ERR_FATAL;
+}
+
+/*
+ * asset_rows_add(mport, rows, pkg, type, data, checksum, owner, group, mode, st)
+ *
+ * Hold an asset row, inserting the batch once it is full.  data is copied;
+ * the others must live as long as the asset list.  st is the installed
+ * file's fingerprint, NULL for anything that isn't a regular file.
+ */
+static int
+asset_rows_add(mportInstance *mport, struct asset_rows *rows, mportPackageMeta *pkg, mportAssetListEntryType type,
+    const char *data, const char *checksum, const char *owner, const char *group, const char *mode,
+    const struct stat *st)
+{
+	struct asset_row *r = &rows->row[rows->count];
+
+	r->type = type;
+	if (data != NULL) {
+		(void) strlcpy(r->path, data, sizeof(r->path));
+		r->data = r->path;
+	} else {
+		r->data = NULL;
+	}
+	r->checksum = checksum;
+	r->owner = owner;
+	r->group = group;
+	r->mode = mode;
+	r->fingerprint = st != NULL;
+	if (st != NULL) {
+		r->size = (sqlite3_int64) st->st_size;
+		r->mtime = mport_stat_mtime(st);
+		r->ino = (sqlite3_int64) st->st_ino;
+		r->ctime = mport_stat_ctime(st);
+	}
+
+	if (++rows->count == ASSET_INSERT_ROWS)
+		return asset_rows_flush(mport, rows, pkg);
+
+	return MPORT_OK;
 }
 
 static int
@@ -203,11 +418,12 @@ create_package_row(mportInstance *mport, mportPackageMeta *pkg)
 	/* Insert the package meta row into the packages table (We use pack here because things might have been twiddled) */
 	/* Note that this will be marked as dirty by default */
 	if (mport_db_do(mport->db,
-	                "INSERT INTO packages (pkg, version, origin, prefix, lang, options, comment, os_release, cpe, locked, deprecated, expiration_date, no_provide_shlib, flavor, automatic, install_date) VALUES (%Q,%Q,%Q,%Q,%Q,%Q,%Q,%Q,%Q,0,%Q,%ld,%d,%Q,%d,%ld)",
+	                "INSERT INTO packages (pkg, version, origin, prefix, lang, options, comment, os_release, cpe, locked, deprecated, expiration_date, no_provide_shlib, flavor, automatic, install_date, version_key) VALUES (%Q,%Q,%Q,%Q,%Q,%Q,%Q,%Q,%Q,0,%Q,%ld,%d,%Q,%d,%ld,mport_version_key(%Q))",
 	                pkg->name, pkg->version, pkg->origin, pkg->prefix, pkg->lang, pkg->options, pkg->comment,
 	                pkg->os_release, pkg->cpe, pkg->deprecated, pkg->expiration_date, pkg->no_provide_shlib,
-	                pkg->flavor, pkg->automatic, pkg->install_date) != MPORT_OK)
+	                pkg->flavor, pkg->automatic, pkg->install_date, pkg->version) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
+	mport_precheck_forget(mport, pkg->name);
 
 	return MPORT_OK;
 }
@@ -282,9 +498,11 @@ create_sample_file(mportInstance *mport, char *cwd, const char *file)
 		/* single file */
 		char *sptr = strcasestr(nonSample, ".sample");
 		if (sptr != NULL) {
-			sptr[0] = '\0'; /* hack off .sample */
-			if (!mport_file_exists(nonSample)) {
-				if (mport_copy_file(file, nonSample) != MPORT_OK) {
+			/* copy from the absolute name, not relative to the process cwd */
+			strlcpy(secondFile, nonSample, FILENAME_MAX);
+			secondFile[sptr - nonSample] = '\0'; /* hack off .sample */
+			if (!mport_file_exists(secondFile)) {
+				if (mport_copy_file(nonSample, secondFile) != MPORT_OK) {
 					RETURN_CURRENT_ERROR;
 				}
 			}
@@ -296,6 +514,65 @@ create_sample_file(mportInstance *mport, char *cwd, const char *file)
 	return MPORT_OK;
 }
 
+/*
+ * The "package" durability: once every file of the package is in place,
+ * sync them and the directories they were renamed into.  Syncing after
+ * the whole package is written lets the filesystem push the data out
+ * together, instead of stalling on each file as it is extracted.
+ */
+static int
+sync_package_files(mportInstance *mport, mportPackageMeta *pkg, mportAssetList *alist)
+{
+	mportAssetListEntry *e;
+	char data[FILENAME_MAX];
+	int dirfd, fd;
+
+	if ((dirfd = mport_open_dir(mport, pkg->prefix)) == -1)
+		RETURN_CURRENT_ERROR;
+
+	STAILQ_FOREACH(e, alist, next) {
+		switch (e->type) {
+			case ASSET_CWD:
+				if (fsync(dirfd) == -1)
+					goto ERROR;
+				close(dirfd);
+				if ((dirfd = mport_open_dir(mport, e->data == NULL ? pkg->prefix : e->data)) == -1)
+					RETURN_CURRENT_ERROR;
+				break;
+			case ASSET_FILE_OWNER_MODE:
+			case ASSET_FILE:
+			case ASSET_SHELL:
+			case ASSET_SAMPLE:
+			case ASSET_SAMPLE_OWNER_MODE:
+				(void) strlcpy(data, e->data, sizeof(data));
+				if (e->type == ASSET_SAMPLE || e->type == ASSET_SAMPLE_OWNER_MODE)
+					data[strcspn(data, " \t")] = '\0';
+
+				/* symlinks and the like have no data to sync */
+				if ((fd = openat(dirfd, data, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+					break;
+				if (fsync(fd) == -1) {
+					close(fd);
+					goto ERROR;
+				}
+				close(fd);
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (fsync(dirfd) == -1)
+		goto ERROR;
+	close(dirfd);
+
+	return (MPORT_OK);
+
+ERROR:
+	close(dirfd);
+	RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to sync %s-%s: %s", pkg->name, pkg->version, strerror(errno));
+}
+
 /**
  * Get the list of assets (plist entries) from the stub attached database (package we are installing)
  * filtered on entries that are not pre/post exec groups.
@@ -344,12 +621,7 @@ mport_bundle_read_get_assetlist(mportInstance *mport, mportPackageMeta *pkg, mpo
 		while (1) {
 			mportAssetListEntry *e;
 
-			int ret = sqlite3_step(stmt);
-
-			if (ret == SQLITE_BUSY || ret == SQLITE_LOCKED) {
-				sleep(5);
-				ret = sqlite3_step(stmt);
-			}
+			int ret = mport_db_step(stmt);
 
 			if (ret == SQLITE_DONE)
 				break;
@@ -400,61 +672,88 @@ do_actual_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMet
 {
 	mportAssetList *alist = NULL;
 	mportAssetListEntry *e = NULL;
-	int file_total;
-	int file_count = 0;
 	struct archive_entry *entry;
-	char *orig_cwd = NULL;
+	int dirfd = -1, origfd = -1;
+	const char *rel, *name;
 	uid_t owner = 0; /* root */
 	gid_t group = 0; /* wheel */
-	mode_t *set = NULL;
+	const void *set;
 	mode_t newmode;
-	mode_t *dirset = NULL;
+	const void *dirset;
 	mode_t dirnewmode;
 	char *mode = NULL;
 	char *mkdirp = NULL;
-	struct stat sb;
+	struct stat sb, fp;
+	bool have_fp;
 	char file[FILENAME_MAX], cwd[FILENAME_MAX];
-	sqlite3_stmt *insert = NULL;
-
-	/* sadly, we can't just use abs pathnames, because it will break hardlinks */
-	orig_cwd = getcwd(NULL, 0);
-
-	if (get_file_count(mport, pkg->name, &file_total) != MPORT_OK)
-		goto ERROR;
+	struct asset_rows *rows = NULL;
+	struct mport_id_cache *ids;
+	bool savepoint = false;
+	long files = 0;
+	off_t bytes = 0;
+
+	/* one lookup per distinct owner, group and mode in the package */
+	if ((ids = mport_id_cache_new()) == NULL) {
+		SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		mport_trace_end(mport, MPORT_TRACE_EXTRACT, 0, 0, MPORT_ERR_FATAL);
+		RETURN_CURRENT_ERROR;
+	}
 
-	mport_call_progress_init_cb(mport, "Installing %s-%s", pkg->name, pkg->version);
+	/*
+	 * Files are placed relative to a descriptor on the current @cwd
+	 * rather than by chdir, which keeps hardlinks in the bundle working
+	 * without moving the whole process around.  Only @exec still needs
+	 * the process working directory, which is put back afterwards when
+	 * it can be opened.
+	 */
+	origfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 
 	if (mport_bundle_read_get_assetlist(mport, pkg, &alist, ACTUALINSTALL) != MPORT_OK)
 		goto ERROR;
 
-	if (create_package_row(mport, pkg) != MPORT_OK)
-		goto ERROR;
+	mport_progress_begin(mport, MPORT_PHASE_INSTALL, get_file_count(alist), "Installing %s-%s",
+	    pkg->name, pkg->version);
 
-	if (create_depends(mport, pkg) != MPORT_OK)
+	/*
+	 * One savepoint for the package row and its assets: its own transaction
+	 * normally, nested in the open one inside mport_batch_begin().
+	 */
+	if (mport_db_do(mport->db, "SAVEPOINT install_pkg") != MPORT_OK)
 		goto ERROR;
+	savepoint = true;
 
-	if (create_categories(mport, pkg) != MPORT_OK)
+	mport_trace_begin(mport, MPORT_TRACE_DB, pkg->name);
+	if (create_package_row(mport, pkg) != MPORT_OK || create_depends(mport, pkg) != MPORT_OK ||
+	    create_categories(mport, pkg) != MPORT_OK) {
+		mport_trace_end(mport, MPORT_TRACE_DB, 0, 0, mport_err_code());
 		goto ERROR;
-
-	/* Insert the assets into the master table. We do this one by one because we want to insert file assets as absolute paths. */
-	if (mport_db_prepare(mport->db, &insert,
-	                     "INSERT INTO assets (pkg, type, data, checksum, owner, grp, mode) values (%Q,?,?,?,?,?,?)",
-	                     pkg->name) != MPORT_OK)
+	}
+	mport_trace_end(mport, MPORT_TRACE_DB, 1, 0, MPORT_OK);
+
+	/*
+	 * Insert the assets into the master table as we go, with file assets as
+	 * the absolute paths they were placed at.
+	 */
+	if ((rows = asset_rows_new()) == NULL) {
+		SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
 		goto ERROR;
+	}
 
 	(void) strlcpy(cwd, pkg->prefix, sizeof(cwd));
 
-	if (mport_chdir(mport, cwd) != MPORT_OK)
+	if ((dirfd = mport_open_dir(mport, cwd)) == -1)
 		goto ERROR;
 
-	mport_db_do(mport->db, "BEGIN TRANSACTION");
+	bundle->durability = mport_durability(mport);
 
 	STAILQ_FOREACH(e, alist, next)
 	{
+		have_fp = false;
 		switch (e->type) {
 			case ASSET_CWD:
 				(void) strlcpy(cwd, e->data == NULL ? pkg->prefix : e->data, sizeof(cwd));
-				if (mport_chdir(mport, cwd) != MPORT_OK)
+				close(dirfd);
+				if ((dirfd = mport_open_dir(mport, cwd)) == -1)
 					goto ERROR;
 				break;
 			case ASSET_CHMOD:
@@ -467,17 +766,17 @@ do_actual_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMet
 					mode = strdup(e->data);
 				break;
 			case ASSET_CHOWN:
-				owner = mport_get_uid(e->data);
+				owner = mport_id_cache_uid(ids, e->data);
 				break;
 			case ASSET_CHGRP:
-				group = mport_get_gid(e->data);
+				group = mport_id_cache_gid(ids, e->data);
 				break;
 			case ASSET_DIR:
 			case ASSET_DIRRM:
 			case ASSET_DIRRMTRY:
 			case ASSET_DIR_OWNER_MODE:
 				mkdirp = strdup(e->data == NULL ? "" : e->data); /* need a char * here */
-				if (mkdirp == NULL || mport_mkdirp(mkdirp, S_IRWXU | S_IRWXG | S_IRWXO) == 0) {
+				if (mkdirp == NULL || mport_mkdirp_at(dirfd, mkdirp, S_IRWXU | S_IRWXG | S_IRWXO) == 0) {
 					free(mkdirp);
 					SET_ERRORX(MPORT_ERR_FATAL, "Unable to create directory %s", e->data);
 					goto ERROR;
@@ -485,26 +784,31 @@ do_actual_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMet
 				free(mkdirp);
 
 				if (e->mode != NULL && e->mode[0] != '\0') {
-					if ((dirset = setmode(e->mode)) == NULL)
+					if ((dirset = mport_id_cache_mode(ids, e->mode)) == NULL)
 						goto ERROR;
+					if (fstatat(dirfd, e->data, &sb, 0) == -1) {
+						SET_ERRORX(MPORT_ERR_FATAL, "Unable to stat directory %s", e->data);
+						goto ERROR;
+					}
 					dirnewmode = getmode(dirset, sb.st_mode);
-					free(dirset);
-					if (chmod(e->data, dirnewmode))
+					if (fchmodat(dirfd, e->data, dirnewmode, 0) == -1) {
+						SET_ERRORX(MPORT_ERR_FATAL, "Unable to set permissions on directory %s", e->data);
 						goto ERROR;
+					}
 				}
 				if (e->owner != NULL && e->group != NULL && e->owner[0] != '\0' &&
 				    e->group[0] != '\0') {
-					if (chown(e->data, mport_get_uid(e->owner), mport_get_gid(e->group)) == -1) {
+					if (fchownat(dirfd, e->data, mport_id_cache_uid(ids, e->owner), mport_id_cache_gid(ids, e->group), 0) == -1) {
 						SET_ERROR(MPORT_ERR_FATAL, "Unable to change owner");
 						goto ERROR;
 					}
 				} else if (e->owner != NULL && e->owner[0] != '\0') {
-					if (chown(e->data, mport_get_uid(e->owner), group) == -1) {
+					if (fchownat(dirfd, e->data, mport_id_cache_uid(ids, e->owner), group, 0) == -1) {
 						SET_ERROR(MPORT_ERR_FATAL, "Unable to change owner");
 						goto ERROR;
 					}
 				} else if (e->group != NULL && e->group[0] != '\0') {
-					if (chown(e->data, owner, mport_get_gid(e->group)) == -1) {
+					if (fchownat(dirfd, e->data, owner, mport_id_cache_gid(ids, e->group), 0) == -1) {
 						SET_ERROR(MPORT_ERR_FATAL, "Unable to change owner");
 						goto ERROR;
 					}
@@ -512,8 +816,15 @@ do_actual_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMet
 
 				break;
 			case ASSET_EXEC:
+				/* the command line may lean on the working directory, so give it one */
+				if (fchdir(dirfd) == -1) {
+					SET_ERRORX(MPORT_ERR_FATAL, "Couldn't chdir to %s: %s", cwd, strerror(errno));
+					goto ERROR;
+				}
 				if (mport_run_asset_exec(mport, e->data, cwd, file) != MPORT_OK)
 					goto ERROR;
+				if (origfd != -1)
+					(void) fchdir(origfd);
 				break;
 			case ASSET_FILE_OWNER_MODE:
 				/* FALLS THROUGH */
@@ -527,10 +838,22 @@ do_actual_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMet
 				if (mport_bundle_read_next_entry(bundle, &entry) != MPORT_OK)
 					goto ERROR;
 
+				/*
+				 * rel is the name handed to the *at() calls and name the one the
+				 * assets keep, without the root; both are tails of file.
+				 */
 				if (e->data[0] == '/') {
 					(void) snprintf(file, FILENAME_MAX, "%s", e->data);
+					rel = file;
+					name = file;
 				} else {
-					(void) snprintf(file, FILENAME_MAX, "%s%s/%s", mport->root, cwd, e->data);
+					int n = snprintf(file, FILENAME_MAX, "%s%s/", mport->root, cwd);
+					if (n >= FILENAME_MAX || strlcat(file, e->data, FILENAME_MAX) >= FILENAME_MAX) {
+						SET_ERRORX(MPORT_ERR_FATAL, "Path too long: %s%s/%s", mport->root, cwd, e->data);
+						goto ERROR;
+					}
+					rel = file + n;
+					name = file + strlen(mport->root);
 				}
 
 				if (e->type == ASSET_SAMPLE || e->type == ASSET_SAMPLE_OWNER_MODE)
@@ -548,74 +871,35 @@ do_actual_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMet
 					goto ERROR;
 				}
 
-				archive_entry_set_pathname(entry, file);
-
-				if (mport_bundle_read_extract_next_file(bundle, entry) != MPORT_OK)
-					goto ERROR;
-
-				if (lstat(file, &sb)) {
-					SET_ERRORX(MPORT_ERR_FATAL, "Unable to stat file %s", file);
-					goto ERROR;
-				}
-
-				if (S_ISREG(sb.st_mode)) {
+				if (archive_entry_filetype(entry) == AE_IFREG) {
+					/*
+					 * Owner and mode go on the entry so the extraction applies them
+					 * to the open file, before it is visible under its real name.
+					 */
 					if (e->type == ASSET_FILE_OWNER_MODE || e->type == ASSET_SAMPLE_OWNER_MODE) {
 						/* Test for owner and group settings, otherwise roll with our default. */
-						if (e->owner != NULL && e->group != NULL && e->owner[0] != '\0' &&
-						    e->group[0] != '\0') {
-#ifdef DEBUG
-							fprintf(stderr, "owner %s and group %s\n", e->owner, e->group);
-#endif
-							if (chown(file, mport_get_uid(e->owner),
-							          mport_get_gid(e->group)) == -1) {
-								SET_ERROR(MPORT_ERR_FATAL, "Unable to change owner");
-								goto ERROR;
-							}
-						} else if (e->owner != NULL && e->owner[0] != '\0') {
 #ifdef DEBUG
-							fprintf(stderr, "owner %s\n", e->owner);
+						fprintf(stderr, "owner %s and group %s\n", e->owner, e->group);
 #endif
-							if (chown(file, mport_get_uid(e->owner), group) == -1) {
-								SET_ERROR(MPORT_ERR_FATAL, "Unable to change owner");
-								goto ERROR;
-							}
-						} else if (e->group != NULL && e->group[0] != '\0') {
-#ifdef DEBUG
-							fprintf(stderr, "group %s\n", e->group);
-#endif
-							if (chown(file, owner, mport_get_gid(e->group)) == -1) {
-								SET_ERROR(MPORT_ERR_FATAL, "Unable to change owner");
-								goto ERROR;
-							}
-						} else {
-							// use default.
-							if (chown(file, owner, group) == -1) {
-								SET_ERROR(MPORT_ERR_FATAL, "Unable to change owner");
-								goto ERROR;
-							}
-						}
+						archive_entry_set_uid(entry, e->owner != NULL && e->owner[0] != '\0' ?
+						    mport_id_cache_uid(ids, e->owner) : owner);
+						archive_entry_set_gid(entry, e->group != NULL && e->group[0] != '\0' ?
+						    mport_id_cache_gid(ids, e->group) : group);
 					} else {
 						/* Set the owner and group */
-						if (chown(file, owner, group) == -1) {
-							SET_ERRORX(MPORT_ERR_FATAL,
-							           "Unable to set permissions on file %s", file);
-							goto ERROR;
-						}
+						archive_entry_set_uid(entry, owner);
+						archive_entry_set_gid(entry, group);
 					}
 
 					/* Set the file permissions, assumes non NFSv4 */
 					if (mode != NULL || (e->mode != NULL && e->mode[0] != '\0' &&
 					                     (e->type == ASSET_SAMPLE_OWNER_MODE || e->type == ASSET_FILE_OWNER_MODE))) {
-						if (stat(file, &sb)) {
-							SET_ERRORX(MPORT_ERR_FATAL, "Unable to stat file %s", file);
-							goto ERROR;
-						}
 						if ((e->type == ASSET_SAMPLE_OWNER_MODE || e->type == ASSET_FILE_OWNER_MODE)
 						    && e->mode != NULL && e->mode[0] != '\0') {
 #ifdef DEBUG
 							fprintf(stderr, "sample or file owner mode %s\n", e->mode);
 #endif
-							if ((set = setmode(e->mode)) == NULL) {
+							if ((set = mport_id_cache_mode(ids, e->mode)) == NULL) {
 								SET_ERROR(MPORT_ERR_FATAL, "Unable to set mode");
 								goto ERROR;
 							}
@@ -623,20 +907,30 @@ do_actual_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMet
 #ifdef DEBUG
 							fprintf(stderr, "mode %s\n", e->mode);
 #endif
-							if ((set = setmode(mode)) == NULL) {
+							if ((set = mport_id_cache_mode(ids, mode)) == NULL) {
 								SET_ERROR(MPORT_ERR_FATAL, "Unable to set mode");
 								goto ERROR;
 							}
 						}
-						newmode = getmode(set, sb.st_mode);
-						free(set);
+						newmode = getmode(set, archive_entry_mode(entry));
+						archive_entry_set_perm(entry, newmode & ALLPERMS);
+					}
+				}
 
-						if (chmod(file, newmode)) {
-							SET_ERROR(MPORT_ERR_FATAL, "Unable to set file permissions");
-							goto ERROR;
-						}
+				if (bundle->unchanged != NULL && mport_unchanged_has(bundle->unchanged, name) &&
+				    same_on_disk(dirfd, rel, entry)) {
+					/* an update bringing the file that is already there */
+					if (archive_read_data_skip(bundle->archive) != ARCHIVE_OK) {
+						SET_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+						goto ERROR;
 					}
+				} else if (mport_bundle_read_extract_next_file_at(bundle, entry, dirfd, rel) != MPORT_OK)
+					goto ERROR;
+
+				/* so delete and verify can tell it is untouched without reading it */
+				have_fp = fstatat(dirfd, rel, &fp, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(fp.st_mode);
 
+				if (archive_entry_filetype(entry) == AE_IFREG) {
 					/* shell registration */
 					if (e->type == ASSET_SHELL && mport_shell_register(file) != MPORT_OK) {
 						goto ERROR;
@@ -652,7 +946,9 @@ do_actual_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMet
 				}
 
 
-				(mport->progress_step_cb)(++file_count, file_total, file);
+				mport_progress_step(mport, archive_entry_size(entry), file);
+				files++;
+				bytes += archive_entry_size(entry);
 
 				break;
 			default:
@@ -661,171 +957,123 @@ do_actual_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMet
 		}
 
 		/* insert this asset into the master database */
-		char *filePtr = strdup(file);
-		char *cwdPtr = strdup(cwd);
-
-		char dir[FILENAME_MAX];
-		if (sqlite3_bind_int(insert, 1, (int) e->type) != SQLITE_OK) {
-			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-			goto ERROR;
-		}
 		if (e->type == ASSET_FILE || e->type == ASSET_SAMPLE || e->type == ASSET_SHELL ||
 		    e->type == ASSET_FILE_OWNER_MODE || e->type == ASSET_SAMPLE_OWNER_MODE) {
 			/* don't put the root in the database! */
-			if (sqlite3_bind_text(insert, 2, filePtr + strlen(mport->root), -1, SQLITE_STATIC) !=
-			    SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-				goto ERROR;
-			}
-
-			if (sqlite3_bind_text(insert, 3, e->checksum, -1, SQLITE_STATIC) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+			if (asset_rows_add(mport, rows, pkg, e->type, name, e->checksum,
+			    e->owner, e->group, e->mode, have_fp ? &fp : NULL) != MPORT_OK)
 				goto ERROR;
-			}
-
-			if (e->owner != NULL) {
-				if (sqlite3_bind_text(insert, 4, e->owner, -1, SQLITE_STATIC) != SQLITE_OK) {
-					SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-					goto ERROR;
-				}
-			} else {
-				if (sqlite3_bind_null(insert, 4) != SQLITE_OK) {
-					SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-					goto ERROR;
-				}
-			}
-
-			if (e->group != NULL) {
-				if (sqlite3_bind_text(insert, 5, e->group, -1, SQLITE_STATIC) != SQLITE_OK) {
-					SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-					goto ERROR;
-				}
-			} else {
-				if (sqlite3_bind_null(insert, 5) != SQLITE_OK) {
-					SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-					goto ERROR;
-				}
-			}
-
-			if (e->mode != NULL) {
-				if (sqlite3_bind_text(insert, 6, e->mode, -1, SQLITE_STATIC) != SQLITE_OK) {
-					SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-					goto ERROR;
-				}
-			} else {
-				if (sqlite3_bind_null(insert, 6) != SQLITE_OK) {
-					SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-					goto ERROR;
-				}
-			}
 		} else if (e->type == ASSET_DIR || e->type == ASSET_DIRRM || e->type == ASSET_DIRRMTRY) {
+			char dir[FILENAME_MAX];
+
 			/* if data starts with /, it's most likely an absolute path. Don't prepend cwd */
 			if (e->data != NULL && e->data[0] == '/')
 				(void) snprintf(dir, FILENAME_MAX, "%s", e->data);
 			else
-				(void) snprintf(dir, FILENAME_MAX, "%s/%s", cwdPtr, e->data);
+				(void) snprintf(dir, FILENAME_MAX, "%s/%s", cwd, e->data);
 
-			if (sqlite3_bind_text(insert, 2, dir, -1, SQLITE_STATIC) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+			if (asset_rows_add(mport, rows, pkg, e->type, dir, NULL, NULL, NULL, NULL, NULL) != MPORT_OK)
 				goto ERROR;
-			}
-
-			if (sqlite3_bind_null(insert, 3) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-				goto ERROR;
-			}
-
-			if (sqlite3_bind_null(insert, 4) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-				goto ERROR;
-			}
-
-			if (sqlite3_bind_null(insert, 5) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-				goto ERROR;
-			}
-
-			if (sqlite3_bind_null(insert, 6) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-				goto ERROR;
-			}
 		} else {
-			if (sqlite3_bind_text(insert, 2, e->data, -1, SQLITE_STATIC) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-				goto ERROR;
-			}
-
-			if (sqlite3_bind_null(insert, 3) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-				goto ERROR;
-			}
-
-			if (sqlite3_bind_null(insert, 4) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-				goto ERROR;
-			}
-
-			if (sqlite3_bind_null(insert, 5) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-				goto ERROR;
-			}
-
-			if (sqlite3_bind_null(insert, 6) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+			if (asset_rows_add(mport, rows, pkg, e->type, e->data, NULL, NULL, NULL, NULL, NULL) != MPORT_OK)
 				goto ERROR;
-			}
 		}
+	}
 
-		if (sqlite3_step(insert) != SQLITE_DONE) {
-			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-			goto ERROR;
-		}
+	if (asset_rows_flush(mport, rows, pkg) != MPORT_OK)
+		goto ERROR;
+	asset_rows_free(rows);
+	rows = NULL;
 
-		sqlite3_clear_bindings(insert);
-		sqlite3_reset(insert);
+	/* files on disk before the package is recorded as installed */
+	if (bundle->durability == MPORT_DURABLE_PACKAGE && sync_package_files(mport, pkg, alist) != MPORT_OK)
+		goto ERROR;
 
-		free(filePtr);
-		free(cwdPtr);
-	}
+	mport_pkgmeta_logevent(mport, pkg, "Installed");
 
-	if (mport_db_do(mport->db, "COMMIT") != MPORT_OK) {
-		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	savepoint = false;
+	mport_trace_begin(mport, MPORT_TRACE_DB, pkg->name);
+	if (mport_db_do(mport->db, "RELEASE install_pkg") != MPORT_OK) {
+		mport_trace_end(mport, MPORT_TRACE_DB, 0, 0, mport_err_code());
 		goto ERROR;
 	}
-	sqlite3_finalize(insert);
-
-	mport_pkgmeta_logevent(mport, pkg, "Installed");
+	mport_trace_end(mport, MPORT_TRACE_DB, 0, 0, MPORT_OK);
 
-	(mport->progress_free_cb)();
-	(void) mport_chdir(NULL, orig_cwd);
-	free(orig_cwd);
+	mport_progress_end(mport);
+	close(dirfd);
+	if (origfd != -1)
+		close(origfd);
 	mport_assetlist_free(alist);
+	mport_id_cache_free(ids);
+	mport_trace_end(mport, MPORT_TRACE_EXTRACT, files, bytes, MPORT_OK);
 	return (MPORT_OK);
 
 	ERROR:
-	sqlite3_finalize(insert);
-	(mport->progress_free_cb)();
-	free(orig_cwd);
+	/*
+	 * keep the dirty package row and the assets recorded so far, so the
+	 * files already extracted can still be found and cleaned up
+	 */
+	if (savepoint) {
+		/* the rows still held are for assets already in place */
+		if (rows != NULL && rows->count > 0) {
+			int code = mport_err_code();
+			char *msg = strdup(mport_err_string());
+
+			(void) asset_rows_flush(mport, rows, pkg);
+			if (msg != NULL) {
+				(void) mport_set_err(code, msg);
+				free(msg);
+			}
+		}
+		(void) sqlite3_exec(mport->db, "RELEASE install_pkg", NULL, NULL, NULL);
+	}
+	asset_rows_free(rows);
+	mport_progress_end(mport);
+	if (dirfd != -1)
+		close(dirfd);
+	if (origfd != -1) {
+		(void) fchdir(origfd);
+		close(origfd);
+	}
 	mport_assetlist_free(alist);
+	mport_id_cache_free(ids);
+	mport_trace_end(mport, MPORT_TRACE_EXTRACT, files, bytes, mport_err_code());
 	RETURN_CURRENT_ERROR;
 }
 
 
+/* the name of one of pkg's +INFRASTRUCTURE files in the bundle */
+static void
+infra_name(char *name, size_t len, mportPackageMeta *pkg, const char *type)
+{
+
+	(void)snprintf(name, len, "%s/%s-%s/%s", MPORT_STUB_INFRA_DIR, pkg->name, pkg->version, type);
+}
+
 static int
 copy_metafile(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg, char *type) 
 {
 	char from[FILENAME_MAX];
 	char to[FILENAME_MAX];
 	char todir[FILENAME_MAX];
+	const unsigned char *data;
+	size_t len;
+	FILE *fp;
 	
-	(void)snprintf(from, FILENAME_MAX, "%s/%s/%s-%s/%s", bundle->tmpdir, MPORT_STUB_INFRA_DIR, pkg->name, pkg->version, type);
-    if (mport_file_exists(from)) {
+	infra_name(from, sizeof(from), pkg, type);
+    if ((data = mport_bundle_read_metafile(bundle, from, &len)) != NULL) {
 		(void)snprintf(todir, FILENAME_MAX, "%s%s/%s-%s", mport->root, MPORT_INST_INFRA_DIR, pkg->name, pkg->version);
 		(void)snprintf(to, FILENAME_MAX, "%s%s/%s-%s/%s", mport->root, MPORT_INST_INFRA_DIR, pkg->name, pkg->version, type);
         if (mport_mkdir(todir) != MPORT_OK)
             RETURN_CURRENT_ERROR;
-        if (mport_copy_file(from, to) != MPORT_OK)
-    	    RETURN_CURRENT_ERROR; 
+		if ((fp = fopen(to, "we")) == NULL)
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", to, strerror(errno));
+		if (fwrite(data, 1, len, fp) != len) {
+			fclose(fp);
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", to, strerror(errno));
+		}
+		if (fclose(fp) != 0)
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", to, strerror(errno));
 	}
 	return (MPORT_OK);
 }
@@ -837,6 +1085,7 @@ mark_complete(mportInstance *mport, mportPackageMeta *pkg)
 		SET_ERROR(MPORT_ERR_FATAL, "Unable to mark package clean");
 		RETURN_CURRENT_ERROR;
 	}
+	mport_precheck_forget(mport, pkg->name);
 
 	return (MPORT_OK);
 }
@@ -902,32 +1151,15 @@ run_postexec(mportInstance *mport, mportPackageMeta *pkg)
 					goto ERROR;
 				break;
 			case ASSET_LDCONFIG:
-				if (mport_xsystem(mport, "/usr/sbin/service ldconfig restart > /dev/null") != MPORT_OK) {
-					goto ERROR;
-				}
-				break;
 			case ASSET_LDCONFIG_LINUX:
-				if (e->data == NULL) {
-					if (mport_xsystem(mport, "/compat/linux/sbin/ldconfig") != MPORT_OK) {
-						goto ERROR;
-					}
-				} else {
-					if (mport_xsystem(mport, "%s/sbin/ldconfig", e->data) != MPORT_OK) {
-						goto ERROR;
-					}
-				}
-				break;
-			case ASSET_GLIB_SCHEMAS:
-				if (mport_file_exists("/usr/local/bin/glib-compile-schemas") && 
-					mport_xsystem(mport, "/usr/local/bin/glib-compile-schemas %s/share/glib-2.0/schemas > /dev/null || true", e->data == NULL ? pkg->prefix : e->data) != MPORT_OK) {
+				/* once per batch, see trigger.c */
+				if (mport_trigger_run(mport, e->type, e->data) != MPORT_OK)
 					goto ERROR;
-				}
 				break;
+			case ASSET_GLIB_SCHEMAS:
 			case ASSET_INFO:
-				if (mport_file_exists("/usr/local/bin/indexinfo") && 
-					mport_xsystem(mport, "/usr/local/bin/indexinfo %s", e->data == NULL ? pkg->prefix : e->data) != MPORT_OK) {
+				if (mport_trigger_run(mport, e->type, e->data == NULL ? pkg->prefix : e->data) != MPORT_OK)
 					goto ERROR;
-				}
 				break;
 			case ASSET_KLD:
 				if (mport_xsystem(mport, "/usr/sbin/kldxref %s", file) != MPORT_OK) {
@@ -935,9 +1167,8 @@ run_postexec(mportInstance *mport, mportPackageMeta *pkg)
 				}
 				break;
 			case ASSET_DESKTOP_FILE_UTILS:
-				if (mport_file_exists("/usr/local/bin/update-desktop-database") && mport_xsystem(mport, "/usr/local/bin/update-desktop-database -q > /dev/null || true") != MPORT_OK) {
+				if (mport_trigger_run(mport, e->type, NULL) != MPORT_OK)
 					goto ERROR;
-				}
 				break;
 			default:
 				/* do nothing */
@@ -960,13 +1191,16 @@ static int
 run_mtree(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
 {
 	char file[FILENAME_MAX];
+	char name[FILENAME_MAX];
 	int ret;
 
-	(void) snprintf(file, FILENAME_MAX, "%s/%s/%s-%s/%s", bundle->tmpdir, MPORT_STUB_INFRA_DIR, pkg->name,
-	                pkg->version,
-	                MPORT_MTREE_FILE);
+	/* mtree(8) wants a file, so this one is written out */
+	infra_name(name, sizeof(name), pkg, MPORT_MTREE_FILE);
+	if ((ret = mport_bundle_read_metafile_path(bundle, name, S_IRUSR | S_IWUSR, file, sizeof(file))) ==
+	    MPORT_ERR_FATAL)
+		RETURN_CURRENT_ERROR;
 
-	if (mport_file_exists(file)) {
+	if (ret == MPORT_OK) {
 		if ((ret = mport_xsystem(mport, "%s -U -f %s -d -e -p %s >/dev/null", MPORT_MTREE_BIN, file,
 		                         pkg->prefix)) != 0)
 			RETURN_ERRORX(MPORT_ERR_FATAL, "%s returned non-zero: %i", MPORT_MTREE_BIN, ret);
@@ -980,17 +1214,20 @@ static int
 run_pkg_install(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg, const char *mode)
 {
 	char file[FILENAME_MAX];
+	char name[FILENAME_MAX];
 	int ret;
 
-	(void) snprintf(file, FILENAME_MAX, "%s/%s/%s-%s/%s", bundle->tmpdir, MPORT_STUB_INFRA_DIR, pkg->name,
-	                pkg->version,
-	                MPORT_INSTALL_FILE);
-
-	if (mport_file_exists(file)) {
-		if (chmod(file, 755) != 0)
-			RETURN_ERRORX(MPORT_ERR_FATAL, "chmod(%s, 755): %s", file, strerror(errno));
+	/* the script is run, so it is written out */
+	infra_name(name, sizeof(name), pkg, MPORT_INSTALL_FILE);
+	if ((ret = mport_bundle_read_metafile_path(bundle, name, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH,
+	    file, sizeof(file))) == MPORT_ERR_FATAL)
+		RETURN_CURRENT_ERROR;
 
-		if ((ret = mport_xsystem(mport, "PKG_PREFIX=%s %s %s %s", pkg->prefix, file, pkg->name, mode)) != 0)
+	if (ret == MPORT_OK) {
+		mport_trace_begin(mport, MPORT_TRACE_SCRIPT, pkg->name);
+		ret = mport_xsystem(mport, "PKG_PREFIX=%s %s %s %s", pkg->prefix, file, pkg->name, mode);
+		mport_trace_end(mport, MPORT_TRACE_SCRIPT, 0, 0, ret == 0 ? MPORT_OK : MPORT_ERR_FATAL);
+		if (ret != 0)
 			RETURN_ERRORX(MPORT_ERR_FATAL, "%s %s returned non-zero: %i", MPORT_INSTALL_FILE, mode, ret);
 	}
 
@@ -1045,32 +1282,25 @@ static int
 load_pkg_msg(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg, mportPackageMessage *packageMessage)
 {
     char filename[FILENAME_MAX];
+    const unsigned char *data;
     char *buf;
     struct stat st;
-    FILE *file;
+    size_t len;
     struct ucl_parser *parser;
     ucl_object_t *obj;
 
-    (void) snprintf(filename, FILENAME_MAX, "%s/%s/%s-%s/%s", bundle->tmpdir, MPORT_STUB_INFRA_DIR, pkg->name,
-                    pkg->version, MPORT_MESSAGE_FILE);
+    infra_name(filename, sizeof(filename), pkg, MPORT_MESSAGE_FILE);
 
-    if (stat(filename, &st) == -1) {
-        /* if we couldn't stat the file, we assume there isn't a pkg-msg */
+    if ((data = mport_bundle_read_metafile(bundle, filename, &len)) == NULL) {
+        /* no pkg-msg in the bundle */
         return MPORT_OK;
     }
 
-    if ((file = fopen(filename, "re")) == NULL)
-        RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", filename, strerror(errno));
-
-    if ((buf = (char *) calloc((size_t)(st.st_size + 1), sizeof(char))) == NULL)
+    /* the parsing below edits the buffer */
+    if ((buf = (char *) calloc(len + 1, sizeof(char))) == NULL)
         RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-
-    if (fread(buf, sizeof(char), (size_t) st.st_size, file) != (size_t) st.st_size) {
-        free(buf);
-        RETURN_ERRORX(MPORT_ERR_FATAL, "Read error: %s", strerror(errno));
-    }
-
-    buf[st.st_size] = '\0';
+    memcpy(buf, data, len);
+    st.st_size = (off_t) len;
 
     if (buf[0] == '[') {
         parser = ucl_parser_new(0);
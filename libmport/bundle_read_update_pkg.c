@@ -31,11 +31,61 @@
 
 #include "mport.h"
 #include "mport_private.h"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <ohash.h>
 
+/*
+ * What an update with the journal backup kept: a hard link beside each file
+ * it goes on to replace, and beside each config made from a sample, and a
+ * copy of the infrastructure directory, made of hard links as well.  The
+ * database side is a savepoint around the delete and install.
+ */
+struct update_journal_file {
+	char *path;
+	char *aside;
+	bool shell; /* back into /etc/shells on rollback */
+};
+
+struct update_journal {
+	struct update_journal_file *files; /* sorted by path once begun */
+	size_t nfiles;
+	size_t capfiles;
+	char infra[FILENAME_MAX];
+	char infra_aside[FILENAME_MAX]; /* empty if the directory wasn't there */
+};
+
+/*
+ * The installed file assets of the package being updated, by path.  same
+ * is set for those the new version has at the same path with the same
+ * checksum: the delete leaves them and the install skips extracting them
+ * when the file on disk still matches, so a point release only writes the
+ * files that changed.
+ */
+struct unchanged_file {
+	char *checksum;
+	bool same;
+	char path[]; /* the ohash key */
+};
+
+struct mport_unchanged {
+	struct ohash files;
+	size_t nsame;
+};
+
+static int unchanged_new(mportInstance *, mportPackageMeta *, struct mport_unchanged **);
+static void unchanged_free(struct mport_unchanged *);
+static int journal_begin(mportInstance *, mportPackageMeta *, const struct mport_unchanged *, struct update_journal *);
+static void journal_commit(struct update_journal *);
+static void journal_rollback(mportInstance *, mportPackageMeta *, const struct mport_unchanged *, struct update_journal *);
+static void journal_free(struct update_journal *);
 static int make_backup_bundle(mportInstance *, mportPackageMeta *, char *);
 static int install_backup_bundle(mportInstance *, char *);
 static int build_create_extras(mportInstance *, mportPackageMeta *, char *, mportCreateExtras **);
@@ -45,42 +95,536 @@ static int build_create_extras_depends(mportInstance *, mportPackageMeta *, mpor
 int mport_bundle_read_update_pkg(mportInstance *mport, mportBundleRead *bundle, mportPackageMeta *pkg)
 {
 	char tmpfile2[] = "/tmp/mport.XXXXXXXX";
-	int fd;
+	struct update_journal journal;
+	struct mport_unchanged *unchanged;
+	int backup, fd;
 
 	mport_pkgmeta_logevent(mport, pkg, "Begining update");
 
-	if ((fd = mkstemp(tmpfile2)) == -1) {
-		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't make tmp file: %s", strerror(errno));
+	if (unchanged_new(mport, pkg, &unchanged) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	backup = mport_update_backup(mport);
+
+	if (backup == MPORT_BACKUP_JOURNAL) {
+		switch (journal_begin(mport, pkg, unchanged, &journal)) {
+			case MPORT_OK:
+				break;
+			case MPORT_ERR_WARN:
+				/* somewhere that can't be hard linked; do it the slow way */
+				mport_call_msg_cb(mport, "%s, backing up %s as a package instead", mport_err_string(), pkg->name);
+				backup = MPORT_BACKUP_BUNDLE;
+				break;
+			default:
+				unchanged_free(unchanged);
+				RETURN_CURRENT_ERROR;
+		}
 	}
-  
-	close(fd);
 
-	if (make_backup_bundle(mport, pkg, tmpfile2) != MPORT_OK) {
-		// attempt to clear the temp file
-		(void)mport_rmtree(tmpfile2);
+	if (backup == MPORT_BACKUP_BUNDLE) {
+		if ((fd = mkstemp(tmpfile2)) == -1) {
+			unchanged_free(unchanged);
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't make tmp file: %s", strerror(errno));
+		}
+
+		close(fd);
+
+		if (make_backup_bundle(mport, pkg, tmpfile2) != MPORT_OK) {
+			// attempt to clear the temp file
+			(void)mport_rmtree(tmpfile2);
+			unchanged_free(unchanged);
+			RETURN_CURRENT_ERROR;
+		}
+	}
+
+	if (backup == MPORT_BACKUP_JOURNAL && mport_db_do(mport->db, "SAVEPOINT update_pkg") != MPORT_OK) {
+		journal_commit(&journal);
+		unchanged_free(unchanged);
 		RETURN_CURRENT_ERROR;
 	}
 
 	pkg->action = MPORT_ACTION_UPDATE;
+	bundle->unchanged = unchanged;
 	if (
-        (mport_delete_primative(mport, pkg, 1) != MPORT_OK) ||
+        (mport_delete_primative_except(mport, pkg, 1, unchanged) != MPORT_OK) ||
         (mport_bundle_read_install_pkg(mport, bundle, pkg) != MPORT_OK)
 	) 
 	{
-    		if (install_backup_bundle(mport, tmpfile2) == MPORT_OK) {
-			(void)mport_rmtree(tmpfile2);
-		} else {
-			mport_call_msg_cb(mport, "Error restoring backup package %s", pkg->name);
+		/* undoing it shouldn't lose why it failed */
+		int code = mport_err_code();
+		char *msg = strdup(mport_err_string());
+
+		bundle->unchanged = NULL;
+		switch (backup) {
+			case MPORT_BACKUP_JOURNAL:
+				journal_rollback(mport, pkg, unchanged, &journal);
+				break;
+			case MPORT_BACKUP_BUNDLE:
+				if (install_backup_bundle(mport, tmpfile2) == MPORT_OK) {
+					(void)mport_rmtree(tmpfile2);
+				} else {
+					mport_call_msg_cb(mport, "Error restoring backup package %s", pkg->name);
+				}
+				break;
+			default:
+				break;
+		}
+
+		unchanged_free(unchanged);
+		if (msg != NULL) {
+			(void)mport_set_err(code, msg);
+			free(msg);
 		}
 		RETURN_CURRENT_ERROR;
 	}           
-  
+	bundle->unchanged = NULL;
+
+	if (backup == MPORT_BACKUP_JOURNAL) {
+		if (mport_db_do(mport->db, "RELEASE update_pkg") != MPORT_OK) {
+			journal_rollback(mport, pkg, unchanged, &journal);
+			unchanged_free(unchanged);
+			RETURN_CURRENT_ERROR;
+		}
+		journal_commit(&journal);
+	}
+	unchanged_free(unchanged);
+
 	/* if we can't delete the tmpfile, just move on. */
-	(void)mport_rmtree(tmpfile2);
+	if (backup == MPORT_BACKUP_BUNDLE)
+		(void)mport_rmtree(tmpfile2);
   
 	return (MPORT_OK);
 }
   
+
+static void *
+unchanged_calloc(size_t s, void *data)
+{
+
+	return calloc(1, s);
+}
+
+static void
+unchanged_free_cb(void *p, size_t s, void *data)
+{
+
+	free(p);
+}
+
+static void *
+unchanged_alloc(size_t s, void *data)
+{
+
+	return malloc(s);
+}
+
+static struct ohash_info unchanged_info = {
+	offsetof(struct unchanged_file, path), NULL, unchanged_calloc, unchanged_free_cb, unchanged_alloc
+};
+
+/*
+ * unchanged_new(mport, pkg, unchanged)
+ *
+ * Match the file assets in the stub, with the @cwd they are under, against
+ * the installed ones.  Shells are left out, as the delete unregisters them.
+ */
+static int
+unchanged_new(mportInstance *mport, mportPackageMeta *pkg, struct mport_unchanged **unchanged_p)
+{
+	struct mport_unchanged *u;
+	struct unchanged_file *f;
+	sqlite3_stmt *stmt;
+	const char *data, *checksum, *end;
+	char cwd[FILENAME_MAX], path[FILENAME_MAX];
+	unsigned int slot;
+	int type, step, ret = MPORT_OK;
+
+	*unchanged_p = NULL;
+
+	if ((u = calloc(1, sizeof(struct mport_unchanged))) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	ohash_init(&u->files, 8, &unchanged_info);
+
+	if (mport_db_prepare(mport->db, &stmt,
+	    "SELECT data, checksum FROM assets WHERE pkg=%Q AND type IN (%i, %i, %i, %i) AND checksum IS NOT NULL",
+	    pkg->name, ASSET_FILE, ASSET_SAMPLE, ASSET_FILE_OWNER_MODE, ASSET_SAMPLE_OWNER_MODE) != MPORT_OK) {
+		unchanged_free(u);
+		RETURN_CURRENT_ERROR;
+	}
+
+	while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if ((data = (const char *)sqlite3_column_text(stmt, 0)) == NULL)
+			continue;
+		end = NULL;
+		slot = ohash_qlookupi(&u->files, data, &end);
+		if (ohash_find(&u->files, slot) != NULL)
+			continue;
+		if ((f = ohash_create_entry(&unchanged_info, data, &end)) == NULL ||
+		    (f->checksum = strdup((const char *)sqlite3_column_text(stmt, 1))) == NULL) {
+			free(f);
+			ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+			break;
+		}
+		f->same = false;
+		ohash_insert(&u->files, slot, f);
+	}
+	if (ret == MPORT_OK && step != SQLITE_DONE)
+		ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	sqlite3_finalize(stmt);
+
+	if (ret == MPORT_OK && mport_db_prepare(mport->db, &stmt,
+	    "SELECT type, data, checksum FROM stub.assets WHERE pkg=%Q AND type IN (%i, %i, %i, %i, %i)",
+	    pkg->name, ASSET_CWD, ASSET_FILE, ASSET_SAMPLE, ASSET_FILE_OWNER_MODE, ASSET_SAMPLE_OWNER_MODE) != MPORT_OK)
+		ret = mport_err_code();
+
+	if (ret != MPORT_OK) {
+		unchanged_free(u);
+		RETURN_CURRENT_ERROR;
+	}
+
+	/* paths as do_actual_install() records them */
+	(void)strlcpy(cwd, pkg->prefix, sizeof(cwd));
+	while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+		type = sqlite3_column_int(stmt, 0);
+		data = (const char *)sqlite3_column_text(stmt, 1);
+
+		if (type == ASSET_CWD) {
+			(void)strlcpy(cwd, data == NULL ? pkg->prefix : data, sizeof(cwd));
+			continue;
+		}
+
+		if (data == NULL || (checksum = (const char *)sqlite3_column_text(stmt, 2)) == NULL)
+			continue;
+
+		if (data[0] == '/')
+			(void)strlcpy(path, data, sizeof(path));
+		else if (snprintf(path, sizeof(path), "%s/%s", cwd, data) >= (int)sizeof(path))
+			continue;
+
+		/* a sample is recorded without what follows its name */
+		if (type == ASSET_SAMPLE || type == ASSET_SAMPLE_OWNER_MODE)
+			path[strcspn(path, " \t")] = '\0';
+
+		if ((f = ohash_find(&u->files, ohash_qlookup(&u->files, path))) != NULL && !f->same &&
+		    strcmp(f->checksum, checksum) == 0) {
+			f->same = true;
+			u->nsame++;
+		}
+	}
+	if (step != SQLITE_DONE)
+		ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	sqlite3_finalize(stmt);
+
+	if (ret != MPORT_OK) {
+		unchanged_free(u);
+		RETURN_CURRENT_ERROR;
+	}
+
+	*unchanged_p = u;
+
+	return MPORT_OK;
+}
+
+/* whether path (as recorded in assets) is the same in both versions */
+bool
+mport_unchanged_has(const struct mport_unchanged *u, const char *path)
+{
+	struct unchanged_file *f;
+
+	if (u == NULL || u->nsame == 0)
+		return false;
+
+	f = ohash_find(&u->files, ohash_qlookup((struct ohash *)&u->files, path));
+
+	return f != NULL && f->same;
+}
+
+static void
+unchanged_free(struct mport_unchanged *u)
+{
+	struct unchanged_file *f;
+	unsigned int i;
+
+	if (u == NULL)
+		return;
+
+	for (f = ohash_first(&u->files, &i); f != NULL; f = ohash_next(&u->files, &i)) {
+		free(f->checksum);
+		free(f);
+	}
+	ohash_delete(&u->files);
+	free(u);
+}
+
+/* the installed name of a file asset, as mport_delete_primative() finds it */
+static int
+journal_path(mportInstance *mport, mportPackageMeta *pkg, const char *data, char *path, size_t len)
+{
+	int n;
+
+	if (*data == '/')
+		n = snprintf(path, len, "%s%s", mport->root, data);
+	else
+		n = snprintf(path, len, "%s%s/%s", mport->root, pkg->prefix, data);
+
+	return (n < 0 || (size_t)n >= len) ? -1 : 0;
+}
+
+static int
+journal_cmp(const void *a, const void *b)
+{
+
+	return strcmp(((const struct update_journal_file *)a)->path, ((const struct update_journal_file *)b)->path);
+}
+
+static int
+journal_add(struct update_journal *j, const char *path, const char *aside, bool shell)
+{
+	struct update_journal_file *grown;
+
+	if (j->nfiles == j->capfiles) {
+		j->capfiles = j->capfiles == 0 ? 64 : j->capfiles * 2;
+		if ((grown = realloc(j->files, j->capfiles * sizeof(struct update_journal_file))) == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		j->files = grown;
+	}
+
+	j->files[j->nfiles].path = strdup(path);
+	j->files[j->nfiles].aside = strdup(aside);
+	if (j->files[j->nfiles].path == NULL || j->files[j->nfiles].aside == NULL) {
+		free(j->files[j->nfiles].path);
+		free(j->files[j->nfiles].aside);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+	j->files[j->nfiles].shell = shell;
+	j->nfiles++;
+
+	return MPORT_OK;
+}
+
+/* hard link path aside, if it is there and a file */
+static int
+journal_keep(struct update_journal *j, const char *path, pid_t pid, bool shell)
+{
+	struct stat st;
+	char aside[FILENAME_MAX];
+	int ret;
+
+	if (snprintf(aside, sizeof(aside), "%s.mport-old.%d", path, (int)pid) >= (int)sizeof(aside))
+		RETURN_ERRORX(MPORT_ERR_WARN, "Path too long: %s", path);
+
+	/* gone already, or not ours to keep */
+	if (lstat(path, &st) != 0 || S_ISDIR(st.st_mode))
+		return MPORT_OK;
+
+	if (linkat(AT_FDCWD, path, AT_FDCWD, aside, 0) != 0)
+		RETURN_ERRORX(MPORT_ERR_WARN, "Couldn't link %s: %s", path, strerror(errno));
+
+	if ((ret = journal_add(j, path, aside, shell)) != MPORT_OK)
+		(void)unlink(aside);
+
+	return ret;
+}
+
+/* hard link each entry of the infrastructure directory into infra_aside */
+static int
+journal_infra(struct update_journal *j)
+{
+	struct dirent *de;
+	DIR *dir;
+	char from[FILENAME_MAX], to[FILENAME_MAX];
+	int ret = MPORT_OK;
+
+	if (mkdir(j->infra_aside, 0755) != 0)
+		RETURN_ERRORX(MPORT_ERR_WARN, "Couldn't make %s: %s", j->infra_aside, strerror(errno));
+
+	if ((dir = opendir(j->infra)) == NULL)
+		RETURN_ERRORX(MPORT_ERR_WARN, "Couldn't open %s: %s", j->infra, strerror(errno));
+
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		(void)snprintf(from, sizeof(from), "%s/%s", j->infra, de->d_name);
+		(void)snprintf(to, sizeof(to), "%s/%s", j->infra_aside, de->d_name);
+		if (linkat(AT_FDCWD, from, AT_FDCWD, to, 0) != 0) {
+			ret = SET_ERRORX(MPORT_ERR_WARN, "Couldn't link %s: %s", from, strerror(errno));
+			break;
+		}
+	}
+	closedir(dir);
+
+	return ret;
+}
+
+/*
+ * journal_begin(mport, pkg, journal)
+ *
+ * Hard link every file of the installed pkg, the configs made from its
+ * samples, and its infrastructure directory, aside.  The old inodes then
+ * outlive the update: the delete only unlinks them and the install renames
+ * new files over the names.  Returns MPORT_ERR_WARN, with nothing left
+ * behind, if something can't be linked, or if the delete runs scripts a
+ * rollback couldn't undo, so the caller can fall back to a backup bundle.
+ */
+static int
+journal_begin(mportInstance *mport, mportPackageMeta *pkg, const struct mport_unchanged *unchanged,
+    struct update_journal *j)
+{
+	sqlite3_stmt *stmt;
+	const char *data;
+	char path[FILENAME_MAX], *sample;
+	int ret = MPORT_OK, step, type, count;
+	pid_t pid = getpid();
+
+	(void)memset(j, 0, sizeof(struct update_journal));
+	(void)snprintf(j->infra, sizeof(j->infra), "%s%s/%s-%s", mport->root, MPORT_INST_INFRA_DIR,
+	    pkg->name, pkg->version);
+
+	/* only reinstalling the old version would run what undoes these */
+	if (mport_db_count(mport->db, &count, "SELECT COUNT(*) FROM assets WHERE pkg=%Q AND type IN (%i, %i, %i)",
+	    pkg->name, ASSET_PREUNEXEC, ASSET_UNEXEC, ASSET_POSTUNEXEC) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+	(void)snprintf(path, sizeof(path), "%s/%s", j->infra, MPORT_DEINSTALL_FILE);
+	if (count > 0 || mport_file_exists(path))
+		RETURN_ERRORX(MPORT_ERR_WARN, "%s has deinstall steps", pkg->name);
+
+	if (mport_db_prepare(mport->db, &stmt,
+	    "SELECT data, type FROM assets WHERE pkg=%Q AND type IN (%i, %i, %i, %i, %i)",
+	    pkg->name, ASSET_FILE, ASSET_SAMPLE, ASSET_SHELL, ASSET_FILE_OWNER_MODE, ASSET_SAMPLE_OWNER_MODE) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+		/* files left in place need no copy */
+		if ((data = (const char *)sqlite3_column_text(stmt, 0)) == NULL || mport_unchanged_has(unchanged, data))
+			continue;
+		type = sqlite3_column_int(stmt, 1);
+
+		if (journal_path(mport, pkg, data, path, sizeof(path)) != 0) {
+			ret = SET_ERRORX(MPORT_ERR_WARN, "Path too long: %s", data);
+			break;
+		}
+
+		if ((ret = journal_keep(j, path, pid, type == ASSET_SHELL)) != MPORT_OK)
+			break;
+
+		/* the delete removes the config too when it still matches the sample */
+		if ((type == ASSET_SAMPLE || type == ASSET_SAMPLE_OWNER_MODE) &&
+		    (sample = strcasestr(path, ".sample")) != NULL) {
+			*sample = '\0';
+			if ((ret = journal_keep(j, path, pid, false)) != MPORT_OK)
+				break;
+		}
+	}
+
+	if (ret == MPORT_OK && step != SQLITE_DONE)
+		ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	sqlite3_finalize(stmt);
+
+	/* the directory mport_delete_primative() removes */
+	if (ret == MPORT_OK && mport_file_exists(j->infra)) {
+		(void)snprintf(j->infra_aside, sizeof(j->infra_aside), "%s.mport-old.%d", j->infra, (int)pid);
+		ret = journal_infra(j);
+	}
+
+	if (ret != MPORT_OK) {
+		journal_commit(j);
+		return ret;
+	}
+
+	qsort(j->files, j->nfiles, sizeof(struct update_journal_file), journal_cmp);
+
+	return MPORT_OK;
+}
+
+/* the update went through: drop the links kept aside */
+static void
+journal_commit(struct update_journal *j)
+{
+
+	for (size_t i = 0; i < j->nfiles; i++)
+		(void)unlink(j->files[i].aside);
+
+	if (j->infra_aside[0] != '\0')
+		(void)mport_rmtree(j->infra_aside);
+
+	journal_free(j);
+}
+
+/*
+ * journal_rollback(mport, pkg, journal)
+ *
+ * Undo a failed update: remove the new files that were recorded and didn't
+ * replace an old one, roll the database back to the installed version,
+ * rename the old files back over whatever is there now and register its
+ * shells again.
+ */
+static void
+journal_rollback(mportInstance *mport, mportPackageMeta *pkg, const struct mport_unchanged *unchanged,
+    struct update_journal *j)
+{
+	struct update_journal_file key;
+	sqlite3_stmt *stmt;
+	const char *data;
+	char path[FILENAME_MAX];
+
+	/* the failed install leaves its assets recorded so far */
+	if (mport_db_prepare(mport->db, &stmt,
+	    "SELECT data FROM assets WHERE pkg=%Q AND type IN (%i, %i, %i, %i, %i)",
+	    pkg->name, ASSET_FILE, ASSET_SAMPLE, ASSET_SHELL, ASSET_FILE_OWNER_MODE, ASSET_SAMPLE_OWNER_MODE) == MPORT_OK) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			if ((data = (const char *)sqlite3_column_text(stmt, 0)) == NULL ||
+			    mport_unchanged_has(unchanged, data) ||
+			    journal_path(mport, pkg, data, path, sizeof(path)) != 0)
+				continue;
+			key.path = path;
+			if (bsearch(&key, j->files, j->nfiles, sizeof(struct update_journal_file), journal_cmp) == NULL)
+				(void)unlink(path);
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	if (mport_db_do(mport->db, "ROLLBACK TO update_pkg") != MPORT_OK ||
+	    mport_db_do(mport->db, "RELEASE update_pkg") != MPORT_OK)
+		mport_call_msg_cb(mport, "Error restoring the database entries for %s: %s", pkg->name,
+		    mport_err_string());
+
+	for (size_t i = 0; i < j->nfiles; i++) {
+		if (rename(j->files[i].aside, j->files[i].path) != 0) {
+			mport_call_msg_cb(mport, "Error restoring %s: %s", j->files[i].path, strerror(errno));
+			continue;
+		}
+		/* the new version may have registered it already */
+		if (j->files[i].shell &&
+		    (mport_shell_unregister(j->files[i].path) != MPORT_OK ||
+		    mport_shell_register(j->files[i].path) != MPORT_OK))
+			mport_call_msg_cb(mport, "Could not register shell: %s", j->files[i].path);
+	}
+
+	if (j->infra_aside[0] != '\0') {
+		if (mport_file_exists(j->infra))
+			(void)mport_rmtree(j->infra);
+		if (rename(j->infra_aside, j->infra) != 0)
+			mport_call_msg_cb(mport, "Error restoring %s: %s", j->infra, strerror(errno));
+	}
+
+	mport_pkgmeta_logevent(mport, pkg, "Update rolled back");
+
+	journal_free(j);
+}
+
+static void
+journal_free(struct update_journal *j)
+{
+
+	for (size_t i = 0; i < j->nfiles; i++) {
+		free(j->files[i].path);
+		free(j->files[i].aside);
+	}
+	free(j->files);
+	j->files = NULL;
+	j->nfiles = j->capfiles = 0;
+}
+  
   
 static int make_backup_bundle(mportInstance *mport, mportPackageMeta *pkg, char *tempfile)
 {
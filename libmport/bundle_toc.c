@@ -0,0 +1,348 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The table of contents of a version 6 bundle (see bundle_write.c).  It is
+ * text, the last of the meta files:
+ *
+ *	mport-toc 1 <bytes of chunks>
+ *	<offset> <size> <tar offset> <tar size>
+ *	...
+ *
+ * a line per chunk, offsets counted from the first chunk.  The chunks end
+ * the file, so the first is the file's size less the bytes of chunks in;
+ * the meta files are the stream before it.
+ */
+
+#define TOC_BLOCK (64 * 1024)
+
+/* mport_bundle_toc_parse(text, len, toc)
+ *
+ * Fill toc from the +TOC text given.  Free it with mport_bundle_toc_free().
+ */
+int
+mport_bundle_toc_parse(const char *text, size_t len, struct mport_bundle_toc *toc)
+{
+	struct mport_bundle_chunk *c;
+	int64_t v[4];
+	char *copy, *p, *next;
+	int version;
+
+	memset(toc, 0, sizeof(*toc));
+
+	/* the meta file isn't a string */
+	if ((copy = strndup(text, len)) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	if (strncmp(copy, "mport-toc ", 10) != 0) {
+		free(copy);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Not a bundle table of contents");
+	}
+	p = copy + 10;
+
+	version = (int)strtol(p, &next, 10);
+	if (next == p || version != 1) {
+		free(copy);
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Unknown bundle table of contents version %d", version);
+	}
+	p = next;
+	toc->data = strtoll(p, &next, 10);
+	if (next == p || toc->data < 0) {
+		free(copy);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Bad bundle table of contents");
+	}
+
+	for (p = next; *p != '\0'; ) {
+		while (*p == '\n' || *p == ' ')
+			p++;
+		if (*p == '\0')
+			break;
+
+		for (int i = 0; i < 4; i++) {
+			v[i] = strtoll(p, &next, 10);
+			if (next == p || v[i] < 0) {
+				free(copy);
+				mport_bundle_toc_free(toc);
+				RETURN_ERROR(MPORT_ERR_FATAL, "Bad bundle table of contents");
+			}
+			p = next;
+		}
+
+		if (v[0] + v[1] > toc->data) {
+			free(copy);
+			mport_bundle_toc_free(toc);
+			RETURN_ERROR(MPORT_ERR_FATAL, "Bundle table of contents is past the end of the bundle");
+		}
+
+		if ((c = reallocarray(toc->chunks, toc->nchunks + 1, sizeof(*c))) == NULL) {
+			free(copy);
+			mport_bundle_toc_free(toc);
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		}
+		toc->chunks = c;
+		c = &toc->chunks[toc->nchunks++];
+		c->offset = v[0];
+		c->size = v[1];
+		c->uoffset = v[2];
+		c->usize = v[3];
+	}
+
+	free(copy);
+	return (MPORT_OK);
+}
+
+void
+mport_bundle_toc_free(struct mport_bundle_toc *toc)
+{
+
+	free(toc->chunks);
+	toc->chunks = NULL;
+	toc->nchunks = 0;
+}
+
+/* mport_bundle_toc_load(filename, toc)
+ *
+ * Read +TOC from the bundle at filename, which means reading only its meta
+ * files.  MPORT_ERR_WARN if it has none, as bundles before version 6 don't.
+ */
+int
+mport_bundle_toc_load(const char *filename, struct mport_bundle_toc *toc)
+{
+	struct archive *a;
+	struct archive_entry *entry;
+	const char *file;
+	char *text = NULL;
+	int64_t size;
+	ssize_t got;
+	int ret = MPORT_ERR_WARN;
+
+	memset(toc, 0, sizeof(*toc));
+
+	if ((a = archive_read_new()) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't initialize archive read");
+
+	if (archive_read_support_format_tar(a) != ARCHIVE_OK ||
+	    archive_read_support_filter_xz(a) != ARCHIVE_OK ||
+	    archive_read_support_filter_zstd(a) < ARCHIVE_WARN ||
+	    archive_read_open_filename(a, filename, 10240) != ARCHIVE_OK) {
+		SET_ERRORX(MPORT_ERR_FATAL, "Could not open %s: %s", filename, archive_error_string(a));
+		archive_read_free(a);
+		RETURN_CURRENT_ERROR;
+	}
+
+	while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+		file = archive_entry_pathname(entry);
+
+		if (*file != '+')
+			break;
+		if (strcmp(file, MPORT_BUNDLE_TOC_FILE) != 0)
+			continue;
+
+		size = archive_entry_size(entry);
+		if (size <= 0 || size > TOC_BLOCK * 16 || (text = malloc((size_t)size)) == NULL) {
+			ret = SET_ERRORX(MPORT_ERR_FATAL, "%s: bad %s", filename, MPORT_BUNDLE_TOC_FILE);
+			break;
+		}
+		if ((got = archive_read_data(a, text, (size_t)size)) != size) {
+			ret = SET_ERRORX(MPORT_ERR_FATAL, "%s: %s", filename, archive_error_string(a));
+			break;
+		}
+		ret = mport_bundle_toc_parse(text, (size_t)size, toc);
+		/* the meta files are compressed as the chunks are */
+		if (ret == MPORT_OK)
+			toc->codec = archive_filter_code(a, 0) == ARCHIVE_FILTER_ZSTD ? MPORT_COMPRESS_ZSTD : MPORT_COMPRESS_XZ;
+		break;
+	}
+
+	free(text);
+	archive_read_free(a);
+
+	return (ret);
+}
+
+struct toc_unpack {
+	const unsigned char *base;
+	const struct mport_bundle_toc *toc;
+	int64_t data; /* where the chunks start in the bundle */
+	off_t meta; /* the meta files' bytes in the tar */
+	int fd;
+	pthread_mutex_t lock;
+	size_t next;
+	bool failed;
+};
+
+/* Decompress len bytes at p into fd at off, how ever many there are */
+static int64_t
+toc_inflate(const unsigned char *p, size_t len, int fd, off_t off)
+{
+	struct archive *a;
+	struct archive_entry *entry;
+	char *buf;
+	ssize_t got, w;
+	int64_t total = 0;
+
+	if ((buf = malloc(TOC_BLOCK)) == NULL)
+		return -1;
+
+	if ((a = archive_read_new()) == NULL) {
+		free(buf);
+		return -1;
+	}
+
+	if (archive_read_support_filter_xz(a) != ARCHIVE_OK ||
+	    archive_read_support_filter_zstd(a) < ARCHIVE_WARN ||
+	    archive_read_support_format_raw(a) != ARCHIVE_OK ||
+	    archive_read_open_memory(a, p, len) != ARCHIVE_OK ||
+	    archive_read_next_header(a, &entry) != ARCHIVE_OK) {
+		total = -1;
+		goto done;
+	}
+
+	while ((got = archive_read_data(a, buf, TOC_BLOCK)) > 0) {
+		for (ssize_t o = 0; o < got; o += w) {
+			if ((w = pwrite(fd, buf + o, (size_t)(got - o), off + total + o)) < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				total = -1;
+				goto done;
+			}
+		}
+		total += got;
+	}
+	if (got < 0)
+		total = -1;
+
+done:
+	archive_read_free(a);
+	free(buf);
+
+	return total;
+}
+
+static void *
+toc_unpack_worker(void *arg)
+{
+	struct toc_unpack *u = arg;
+	const struct mport_bundle_chunk *c;
+	size_t i;
+
+	for (;;) {
+		pthread_mutex_lock(&u->lock);
+		i = u->next++;
+		pthread_mutex_unlock(&u->lock);
+		if (i >= u->toc->nchunks || u->failed)
+			break;
+
+		c = &u->toc->chunks[i];
+		if (toc_inflate(u->base + u->data + c->offset, (size_t)c->size, u->fd, u->meta + c->uoffset) != c->usize) {
+			pthread_mutex_lock(&u->lock);
+			u->failed = true;
+			pthread_mutex_unlock(&u->lock);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* mport_bundle_toc_unpack(filename, toc, fd)
+ *
+ * Decompress the bundle at filename into fd, its chunks
+ * MPORT_BUNDLE_UNPACK_JOBS at a time, each written where it belongs.
+ */
+int
+mport_bundle_toc_unpack(const char *filename, const struct mport_bundle_toc *toc, int fd)
+{
+	struct toc_unpack u;
+	struct stat st;
+	pthread_t threads[MPORT_BUNDLE_UNPACK_JOBS];
+	int nthreads = 0, bfd;
+	int64_t meta;
+	void *base;
+
+	if ((bfd = open(filename, O_RDONLY)) == -1)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", filename, strerror(errno));
+	if (fstat(bfd, &st) != 0 || st.st_size <= toc->data) {
+		close(bfd);
+		RETURN_ERRORX(MPORT_ERR_FATAL, "%s is shorter than its table of contents says", filename);
+	}
+	base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, bfd, 0);
+	close(bfd);
+	if (base == MAP_FAILED)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't map %s: %s", filename, strerror(errno));
+
+	memset(&u, 0, sizeof(u));
+	u.base = base;
+	u.toc = toc;
+	u.data = st.st_size - toc->data;
+	u.fd = fd;
+
+	/* the meta files first, their length is where the chunks go */
+	if ((meta = toc_inflate(base, (size_t)u.data, fd, 0)) < 0) {
+		munmap(base, (size_t)st.st_size);
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't decompress %s", filename);
+	}
+	u.meta = (off_t)meta;
+
+	pthread_mutex_init(&u.lock, NULL);
+	for (; nthreads < MPORT_BUNDLE_UNPACK_JOBS && (size_t)nthreads < toc->nchunks; nthreads++) {
+		if (pthread_create(&threads[nthreads], NULL, toc_unpack_worker, &u) != 0)
+			break;
+	}
+	/* if no thread could be had, do it here */
+	if (nthreads == 0)
+		toc_unpack_worker(&u);
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&u.lock);
+
+	munmap(base, (size_t)st.st_size);
+
+	if (u.failed)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't decompress %s", filename);
+
+	return (MPORT_OK);
+}
@@ -35,6 +35,7 @@
  * libmport.
  */
  
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,6 +46,9 @@
 #include <archive.h>
 #include <archive_entry.h>
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 #include "mport.h"
 #include "mport_private.h"
 
@@ -69,6 +73,10 @@ struct link_node {
 
 
 static int lookup_hardlink(mportBundleWrite *, struct archive_entry *, const struct stat *);
+static ssize_t bundle_tar_write(struct archive *, void *, const void *, size_t);
+static ssize_t bundle_out_write(struct archive *, void *, const void *, size_t);
+static struct archive *bundle_stream_open(mportBundleWrite *, archive_write_callback *, void *);
+static int bundle_add_file(mportBundleWrite *, const char *, const char *, char *, bool, const char *);
 static void free_linktable(struct links_table *);
 
 /* 
@@ -79,7 +87,12 @@ static void free_linktable(struct links_table *);
  */
 mportBundleWrite* mport_bundle_write_new(void) 
 {
-  return (mportBundleWrite *)calloc(1, sizeof(mportBundleWrite));
+  mportBundleWrite *bundle = calloc(1, sizeof(mportBundleWrite));
+
+  if (bundle != NULL)
+    bundle->fd = bundle->datafd = -1;
+
+  return bundle;
 }
  
 
@@ -87,31 +100,475 @@ mportBundleWrite* mport_bundle_write_new(void)
  * mport_bundle_write_init(bundle, filename)
  * 
  * set up a bundle for adding files.  Sets the bundle file to
- * filename.
+ * filename.  The bundle is xz compressed, with libarchive's defaults.
  */
 int mport_bundle_write_init(mportBundleWrite *bundle, const char *filename)
 {
+  return mport_bundle_write_init_compressed(bundle, filename, MPORT_COMPRESS_XZ, 0, 1, false);
+}
+
+/*
+ * mport_bundle_write_init_compressed(bundle, filename, codec, level, threads, chunked)
+ *
+ * as mport_bundle_write_init(), compressing with codec at level (0 for the
+ * codec's default) using threads threads (0 for one per CPU).  Threads
+ * are a request: a libarchive or liblzma without them compresses on one,
+ * which still makes a bundle any reader can take.
+ *
+ * The tar itself is written uncompressed to bundle_tar_write().  Unless
+ * chunked, it goes straight on into one compressed stream, a bundle any
+ * version 5 reader takes, so +CONTENTS.db has to be added first.  A
+ * chunked bundle (version 6, see mport_stub_bundle_version()) keeps the
+ * meta files in memory, as they must come first, hands the rest to the
+ * chunk being compressed into a temporary file, and puts a +TOC saying
+ * where the chunks are with the meta files at the end.
+ */
+int mport_bundle_write_init_compressed(mportBundleWrite *bundle, const char *filename, mportCompression codec, int level, int threads, bool chunked)
+{
+  char *tmp;
+
+  bundle->fd = bundle->datafd = -1;
+  bundle->codec = codec;
+  bundle->level = level;
+  bundle->threads = threads;
+  bundle->chunked = chunked;
+
   if ((bundle->filename = strdup(filename)) == NULL)
     RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't dup filename");
-   
+
+  if ((bundle->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", filename, strerror(errno));
+
+  if (!chunked) {
+    if ((bundle->chunk = bundle_stream_open(bundle, bundle_out_write, bundle)) == NULL)
+      RETURN_CURRENT_ERROR;
+  } else if (asprintf(&tmp, "%s.XXXXXX", filename) == -1) {
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  } else {
+    bundle->datafd = mkstemp(tmp);
+    if (bundle->datafd != -1)
+      (void)unlink(tmp);
+    free(tmp);
+    if (bundle->datafd == -1)
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't make a temporary file for %s: %s", filename, strerror(errno));
+  }
+
   if ((bundle->archive = archive_write_new()) == NULL) 
     RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate archive struct");
 
-  if (archive_write_add_filter_xz(bundle->archive) != ARCHIVE_OK)
-    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
-
-  if (archive_write_set_format_pax(bundle->archive) != ARCHIVE_OK)
+  if (archive_write_set_format_pax(bundle->archive) != ARCHIVE_OK ||
+      archive_write_set_bytes_per_block(bundle->archive, 0) != ARCHIVE_OK)
     RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
 
   bundle->links = NULL; 
 
-  if (archive_write_open_filename(bundle->archive, bundle->filename) != ARCHIVE_OK) {
+  if (archive_write_open(bundle->archive, bundle, NULL, bundle_tar_write, NULL) != ARCHIVE_OK) {
     RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive)); 
   }
   
   return MPORT_OK;
 }
 
+/*
+ * mport_compression_parse(name, codec)
+ *
+ * the codec called name ("xz" or "zstd"), for mport.create and the
+ * bundle_compression setting.
+ */
+MPORT_PUBLIC_API int
+mport_compression_parse(const char *name, mportCompression *codec)
+{
+  if (strcmp(name, "xz") == 0)
+    *codec = MPORT_COMPRESS_XZ;
+  else if (strcmp(name, "zstd") == 0)
+    *codec = MPORT_COMPRESS_ZSTD;
+  else
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Unknown compression %s, expected xz or zstd", name);
+
+  return MPORT_OK;
+}
+
+/* a stream of the meta files, straight into the bundle */
+struct bundle_sink {
+  int fd;
+  int64_t len;
+};
+
+static ssize_t
+bundle_fd_write(struct archive *a, int fd, const void *buf, size_t len)
+{
+  ssize_t w;
+
+  for (size_t off = 0; off < len; off += (size_t)w) {
+    if ((w = write(fd, (const char *)buf + off, len - off)) < 0) {
+      if (errno == EINTR) {
+        w = 0;
+        continue;
+      }
+      archive_set_error(a, errno, "%s", strerror(errno));
+      return -1;
+    }
+  }
+
+  return (ssize_t)len;
+}
+
+static ssize_t
+bundle_sink_write(struct archive *a, void *cookie, const void *buf, size_t len)
+{
+  struct bundle_sink *sink = cookie;
+
+  if (bundle_fd_write(a, sink->fd, buf, len) < 0)
+    return -1;
+  sink->len += (int64_t)len;
+
+  return (ssize_t)len;
+}
+
+/* a plain bundle, straight into fd */
+static ssize_t
+bundle_out_write(struct archive *a, void *cookie, const void *buf, size_t len)
+{
+  mportBundleWrite *bundle = cookie;
+
+  return bundle_fd_write(a, bundle->fd, buf, len);
+}
+
+/* a chunk, into datafd */
+static ssize_t
+bundle_chunk_write(struct archive *a, void *cookie, const void *buf, size_t len)
+{
+  mportBundleWrite *bundle = cookie;
+
+  if (bundle_fd_write(a, bundle->datafd, buf, len) < 0)
+    return -1;
+  bundle->datalen += (int64_t)len;
+
+  return (ssize_t)len;
+}
+
+/*
+ * The tar, as the pax writer makes it.  With no blocking every byte
+ * arrives as soon as it is written, so an entry finished is an entry
+ * wholly in the meta files or the chunk it was started in.  Without
+ * chunks, it is all one stream.
+ */
+static ssize_t
+bundle_tar_write(struct archive *a, void *cookie, const void *buf, size_t len)
+{
+  mportBundleWrite *bundle = cookie;
+  unsigned char *m;
+  size_t size;
+
+  if (bundle->discard)
+    return (ssize_t)len;
+
+  if (bundle->in_data || !bundle->chunked) {
+    if (archive_write_data(bundle->chunk, buf, len) != (ssize_t)len) {
+      archive_set_error(a, ARCHIVE_ERRNO_MISC, "%s", archive_error_string(bundle->chunk));
+      return -1;
+    }
+    bundle->udatalen += (int64_t)len;
+    return (ssize_t)len;
+  }
+
+  if (bundle->metalen + len > bundle->metasize) {
+    for (size = bundle->metasize == 0 ? BUFF_SIZE : bundle->metasize; size < bundle->metalen + len; size *= 2)
+      ;
+    if ((m = realloc(bundle->meta, size)) == NULL) {
+      archive_set_error(a, ENOMEM, "Out of memory");
+      return -1;
+    }
+    bundle->meta = m;
+    bundle->metasize = size;
+  }
+  memcpy(bundle->meta + bundle->metalen, buf, len);
+  bundle->metalen += len;
+
+  return (ssize_t)len;
+}
+
+/*
+ * Start one compressed stream, written to cb, with the bundle's codec.
+ * The raw format makes it a plain stream of whatever is written to it.
+ */
+static struct archive *
+bundle_stream_open(mportBundleWrite *bundle, archive_write_callback *cb, void *cookie)
+{
+  struct archive *a;
+  struct archive_entry *entry;
+  const char *module;
+  char buf[16];
+  int r;
+
+  if ((a = archive_write_new()) == NULL) {
+    SET_ERROR(MPORT_ERR_FATAL, "Couldn't allocate archive struct");
+    return NULL;
+  }
+
+  if (bundle->codec == MPORT_COMPRESS_ZSTD) {
+    module = "zstd";
+    r = archive_write_add_filter_zstd(a);
+  } else {
+    module = "xz";
+    r = archive_write_add_filter_xz(a);
+  }
+  if (r != ARCHIVE_OK)
+    goto fail;
+
+  if (bundle->level != 0) {
+    (void)snprintf(buf, sizeof(buf), "%d", bundle->level);
+    if (archive_write_set_filter_option(a, module, "compression-level", buf) != ARCHIVE_OK) {
+      SET_ERRORX(MPORT_ERR_FATAL, "Bad %s compression level %d: %s", module, bundle->level, archive_error_string(a));
+      archive_write_free(a);
+      return NULL;
+    }
+  }
+
+  if (bundle->threads != 1) {
+    (void)snprintf(buf, sizeof(buf), "%d", bundle->threads < 0 ? 0 : bundle->threads);
+    (void)archive_write_set_filter_option(a, module, "threads", buf);
+  }
+
+  if (archive_write_set_format_raw(a) != ARCHIVE_OK ||
+      archive_write_set_bytes_in_last_block(a, 1) != ARCHIVE_OK ||
+      archive_write_open(a, cookie, NULL, cb, NULL) != ARCHIVE_OK)
+    goto fail;
+
+  if ((entry = archive_entry_new()) == NULL) {
+    SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    archive_write_free(a);
+    return NULL;
+  }
+  archive_entry_set_pathname(entry, "bundle");
+  archive_entry_set_filetype(entry, AE_IFREG);
+  r = archive_write_header(a, entry);
+  archive_entry_free(entry);
+  if (r != ARCHIVE_OK)
+    goto fail;
+
+  return a;
+
+fail:
+  SET_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
+  archive_write_free(a);
+  return NULL;
+}
+
+static int
+bundle_stream_close(struct archive *a)
+{
+  int ret = MPORT_OK;
+
+  if (archive_write_close(a) != ARCHIVE_OK)
+    ret = SET_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
+  archive_write_free(a);
+
+  return ret;
+}
+
+static int
+bundle_chunk_open(mportBundleWrite *bundle)
+{
+  struct mport_bundle_chunk *c;
+
+  c = reallocarray(bundle->toc.chunks, bundle->toc.nchunks + 1, sizeof(*c));
+  if (c == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  bundle->toc.chunks = c;
+  c = &bundle->toc.chunks[bundle->toc.nchunks];
+  c->offset = bundle->datalen;
+  c->uoffset = bundle->udatalen;
+  c->size = c->usize = 0;
+
+  if ((bundle->chunk = bundle_stream_open(bundle, bundle_chunk_write, bundle)) == NULL)
+    RETURN_CURRENT_ERROR;
+  bundle->toc.nchunks++;
+
+  return MPORT_OK;
+}
+
+static int
+bundle_chunk_close(mportBundleWrite *bundle)
+{
+  struct mport_bundle_chunk *c = &bundle->toc.chunks[bundle->toc.nchunks - 1];
+  int ret;
+
+  ret = bundle_stream_close(bundle->chunk);
+  bundle->chunk = NULL;
+  c->size = bundle->datalen - c->offset;
+  c->usize = bundle->udatalen - c->uoffset;
+
+  return ret;
+}
+
+/*
+ * Called before each entry: the first that isn't a meta file ends the meta
+ * files, and a full chunk is ended for a new one.  Chunks copied in whole
+ * leave none open, so the next entry starts one.  Without chunks there is
+ * nothing to do.
+ */
+static int
+bundle_next_entry(mportBundleWrite *bundle, const char *path)
+{
+
+  if (!bundle->chunked)
+    return MPORT_OK;
+
+  if (!bundle->in_data) {
+    if (path != NULL && *path == '+')
+      return MPORT_OK;
+    bundle->in_data = true;
+    return bundle_chunk_open(bundle);
+  }
+
+  if (bundle->chunk == NULL)
+    return bundle_chunk_open(bundle);
+
+  if (bundle->udatalen - bundle->toc.chunks[bundle->toc.nchunks - 1].uoffset < MPORT_BUNDLE_CHUNK)
+    return MPORT_OK;
+
+  if (bundle_chunk_close(bundle) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  return bundle_chunk_open(bundle);
+}
+
+static ssize_t
+bundle_toc_entry_write(struct archive *a, void *cookie, const void *buf, size_t len)
+{
+  mportBundleWrite *bundle = cookie;
+
+  /* once +TOC is finished, what follows is the end of an archive we don't want */
+  if (!bundle->in_data)
+    return bundle_tar_write(a, cookie, buf, len);
+
+  return (ssize_t)len;
+}
+
+/* +TOC, appended to the meta files by a tar writer of its own */
+static int
+bundle_write_toc(mportBundleWrite *bundle)
+{
+  struct archive *a;
+  struct archive_entry *entry;
+  char *text = NULL;
+  size_t len = 0;
+  FILE *f;
+  int ret = MPORT_OK;
+
+  if ((f = open_memstream(&text, &len)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  fprintf(f, "mport-toc 1 %jd\n", (intmax_t)bundle->datalen);
+  for (size_t i = 0; i < bundle->toc.nchunks; i++) {
+    struct mport_bundle_chunk *c = &bundle->toc.chunks[i];
+
+    fprintf(f, "%jd %jd %jd %jd\n", (intmax_t)c->offset, (intmax_t)c->size, (intmax_t)c->uoffset, (intmax_t)c->usize);
+  }
+  if (fclose(f) != 0 || text == NULL) {
+    free(text);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+
+  if ((a = archive_write_new()) == NULL || (entry = archive_entry_new()) == NULL) {
+    archive_write_free(a);
+    free(text);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+
+  archive_entry_set_pathname(entry, MPORT_BUNDLE_TOC_FILE);
+  archive_entry_set_filetype(entry, AE_IFREG);
+  archive_entry_set_perm(entry, 0644);
+  archive_entry_set_size(entry, (int64_t)len);
+  archive_entry_set_mtime(entry, time(NULL), 0);
+
+  bundle->in_data = false;
+  if (archive_write_set_format_pax(a) != ARCHIVE_OK ||
+      archive_write_set_bytes_per_block(a, 0) != ARCHIVE_OK ||
+      archive_write_open(a, bundle, NULL, bundle_toc_entry_write, NULL) != ARCHIVE_OK ||
+      archive_write_header(a, entry) != ARCHIVE_OK ||
+      archive_write_data(a, text, len) != (ssize_t)len ||
+      archive_write_finish_entry(a) != ARCHIVE_OK)
+    ret = SET_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
+  bundle->in_data = true;
+
+  archive_write_free(a);
+  archive_entry_free(entry);
+  free(text);
+
+  return ret;
+}
+
+/*
+ * The tar is finished; put the meta files and +TOC at the start of the
+ * bundle as a stream of their own, then the chunks after them.  A plain
+ * bundle only has its stream to end.
+ */
+static int
+bundle_write_out(mportBundleWrite *bundle)
+{
+  struct bundle_sink sink = { bundle->fd, 0 };
+  struct archive *a;
+  char buf[BUFF_SIZE];
+  ssize_t len;
+  int ret;
+
+  if (!bundle->chunked) {
+    if (archive_write_close(bundle->archive) != ARCHIVE_OK)
+      RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+    ret = bundle_stream_close(bundle->chunk);
+    bundle->chunk = NULL;
+    if (ret != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+    goto out;
+  }
+
+  /* a bundle of only meta files still has an end, in a chunk */
+  if (bundle_next_entry(bundle, NULL) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  if (archive_write_close(bundle->archive) != ARCHIVE_OK)
+    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+
+  if (bundle_chunk_close(bundle) != MPORT_OK || bundle_write_toc(bundle) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  if ((a = bundle_stream_open(bundle, bundle_sink_write, &sink)) == NULL)
+    RETURN_CURRENT_ERROR;
+  if (archive_write_data(a, bundle->meta, bundle->metalen) != (ssize_t)bundle->metalen) {
+    SET_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
+    archive_write_free(a);
+    RETURN_CURRENT_ERROR;
+  }
+  if (bundle_stream_close(a) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  if (lseek(bundle->datafd, 0, SEEK_SET) == -1)
+    RETURN_ERROR(MPORT_ERR_FATAL, strerror(errno));
+  while ((len = read(bundle->datafd, buf, sizeof(buf))) > 0) {
+    for (ssize_t off = 0, w; off < len; off += w) {
+      if ((w = write(bundle->fd, buf + off, (size_t)(len - off))) < 0) {
+        if (errno == EINTR) {
+          w = 0;
+          continue;
+        }
+        RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", bundle->filename, strerror(errno));
+      }
+    }
+  }
+  if (len < 0)
+    RETURN_ERROR(MPORT_ERR_FATAL, strerror(errno));
+
+out:
+  if (close(bundle->fd) != 0) {
+    bundle->fd = -1;
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't write %s: %s", bundle->filename, strerror(errno));
+  }
+  bundle->fd = -1;
+
+  return MPORT_OK;
+}
+
 /* 
  * mport_bundle_write_finish(bundle)
  *
@@ -124,19 +581,29 @@ int mport_bundle_write_finish(mportBundleWrite *bundle)
 
   if (bundle == NULL)
       RETURN_ERROR(MPORT_ERR_FATAL, "mport bundle is missing");
- 
-  if (archive_write_free(bundle->archive) != ARCHIVE_OK)
-    ret = SET_ERROR(MPORT_ERR_FATAL, strdup(archive_error_string(bundle->archive)));
+
+  if (bundle->archive != NULL && !bundle->failed && !bundle->part)
+    ret = bundle_write_out(bundle);
+
+  if (bundle->chunk != NULL)
+    archive_write_free(bundle->chunk);
+  if (bundle->archive != NULL)
+    archive_write_free(bundle->archive);
+  if (bundle->fd != -1)
+    close(bundle->fd);
+  if (bundle->datafd != -1)
+    close(bundle->datafd);
 
   free_linktable(bundle->links);
+  mport_bundle_toc_free(&bundle->toc);
  
+  free(bundle->meta);
   free(bundle->filename);
   free(bundle);
   
   return ret;
 }
 
-
 /*
  * mport_bundle_write_add_file(bundle, filename, path)
  *
@@ -145,20 +612,96 @@ int mport_bundle_write_finish(mportBundleWrite *bundle)
  */
 int mport_bundle_write_add_file(mportBundleWrite *bundle, const char *filename, const char *path)
 {
-	struct archive_entry *entry = NULL;
-	struct stat st;
-	int fd = -1, ret = MPORT_OK;
-	ssize_t len;
-	char buff[BUFF_SIZE];
+  return bundle_add_file(bundle, filename, path, NULL, false, NULL);
+}
 
-	if (lstat(filename, &st) != 0) {
-		RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to stat %s: %s", filename, strerror(errno));
-	}
+/*
+ * mport_bundle_write_add_file_hashed(bundle, filename, path, hash)
+ *
+ * As mport_bundle_write_add_file(), and put the checksum of the bytes
+ * archived in hash (MPORT_CHECKSUM_MAX), so the file is read only once.
+ * hash is empty for anything but a regular file.
+ */
+int mport_bundle_write_add_file_hashed(mportBundleWrite *bundle, const char *filename, const char *path, char *hash)
+{
+  return bundle_add_file(bundle, filename, path, hash, false, NULL);
+}
+
+/*
+ * mport_bundle_write_add_first(bundle, filename, path)
+ *
+ * As mport_bundle_write_add_file(), but put it ahead of everything added
+ * so far.  +CONTENTS.db has to come first, but in a chunked bundle it can
+ * be written once the files it lists have been archived and hashed.  A
+ * plain bundle is compressed as it goes, so it has nothing to put ahead of.
+ */
+int mport_bundle_write_add_first(mportBundleWrite *bundle, const char *filename, const char *path)
+{
+  return bundle_add_file(bundle, filename, path, NULL, true, NULL);
+}
+
+/*
+ * mport_bundle_write_add_link(bundle, filename, path, target)
+ *
+ * As mport_bundle_write_add_file(), but archive path as a hard link to
+ * target, a file already in the bundle with the same content.  Nothing of
+ * filename but its stat is read.
+ */
+int mport_bundle_write_add_link(mportBundleWrite *bundle, const char *filename, const char *path, const char *target)
+{
+  return bundle_add_file(bundle, filename, path, NULL, false, target);
+}
+
+/*
+ * Move the meta files' tar from start on to before the rest of them.  The
+ * meta files are small next to the bundle, so a copy does.
+ */
+static int
+bundle_meta_to_front(mportBundleWrite *bundle, size_t start)
+{
+  size_t n = bundle->metalen - start;
+  unsigned char *tail;
+
+  if (start == 0 || n == 0)
+    return MPORT_OK;
+  if ((tail = malloc(n)) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  memcpy(tail, bundle->meta + start, n);
+  memmove(bundle->meta + n, bundle->meta, start);
+  memcpy(bundle->meta, tail, n);
+  free(tail);
+
+  return MPORT_OK;
+}
+
+static int
+bundle_add_file(mportBundleWrite *bundle, const char *filename, const char *path, char *hash, bool first, const char *link)
+{
+  struct archive_entry *entry = NULL;
+  struct mport_hasher hasher;
+  struct stat st;
+  int fd = -1, ret = MPORT_OK;
+  ssize_t len;
+  char buff[BUFF_SIZE];
+  bool in_data = bundle->in_data;
+  size_t start = bundle->metalen;
 
-	entry = archive_entry_new();
-	archive_entry_set_pathname(entry, path);
+  if (hash != NULL)
+    hash[0] = '\0';
 
-  if (!S_ISDIR(st.st_mode) && (st.st_nlink > 1))
+  if (first && !bundle->chunked)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s can only be put first in a chunked bundle", path);
+
+  if (lstat(filename, &st) != 0) {
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to stat %s: %s", filename, strerror(errno));
+  }
+
+  entry = archive_entry_new();
+  archive_entry_set_pathname(entry, path);
+
+  if (link != NULL)
+    archive_entry_copy_hardlink(entry, link);
+  else if (!S_ISDIR(st.st_mode) && (st.st_nlink > 1))
     if (lookup_hardlink(bundle, entry, &st) != MPORT_OK)
       RETURN_CURRENT_ERROR;
   
@@ -182,29 +725,72 @@ int mport_bundle_write_add_file(mportBundleWrite *bundle, const char *filename,
     
   archive_entry_copy_stat(entry, &st);
  
-  /* non-regular files get archived with zero size */
-  if (!S_ISREG(st.st_mode)) {
+  /* non-regular files, and links to content already archived, get archived with zero size */
+  if (!S_ISREG(st.st_mode) || link != NULL) {
     archive_entry_set_size(entry, 0);
   }
   /* make sure we can open the file before its header is put in the archive */
   else if ((fd = open(filename, O_RDONLY)) == -1) {
    RETURN_ERROR(MPORT_ERR_FATAL, strerror(errno));
   }
+
+  if (hash != NULL && fd > -1 && !mport_hasher_init(&hasher, NULL)) {
+    archive_entry_free(entry);
+    close(fd);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Unable to start a checksum");
+  }
+
+  /* the first entry goes to the meta files, wherever the tar is up to */
+  if (first)
+    bundle->in_data = false;
+  else if (bundle_next_entry(bundle, path) != MPORT_OK) {
+    bundle->failed = true;
+    archive_entry_free(entry);
+    if (fd > -1)
+      close(fd);
+    RETURN_CURRENT_ERROR;
+  }
    
-  if (archive_write_header(bundle->archive, entry) != ARCHIVE_OK)
+  if (archive_write_header(bundle->archive, entry) != ARCHIVE_OK) {
+    bundle->failed = true;
+    if (first)
+      bundle->in_data = in_data;
     RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+  }
   
-  /* write the data to the archive if there is data to write */
-  if (archive_entry_size(entry) > 0 && fd > -1) {
+  /*
+   * write the data to the archive if there is data to write; a hard link
+   * has none of its own, but is still read for its checksum
+   */
+  if (fd > -1 && (hash != NULL || (archive_entry_size(entry) > 0 && archive_entry_hardlink(entry) == NULL))) {
+    bool data = archive_entry_size(entry) > 0 && archive_entry_hardlink(entry) == NULL;
+
     len = read(fd, buff, sizeof(buff));
     while (len > 0) {
-      if (archive_write_data(bundle->archive, buff, len) != len) {
+      if (hash != NULL)
+        mport_hasher_update(&hasher, buff, (size_t)len);
+      if (data && archive_write_data(bundle->archive, buff, len) != len) {
         ret = SET_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
         break;
       }
       len = read(fd, buff, sizeof(buff));
     }
+    if (len < 0 && ret == MPORT_OK)
+      ret = SET_ERRORX(MPORT_ERR_FATAL, "Unable to read %s: %s", filename, strerror(errno));
+    if (hash != NULL)
+      mport_hasher_end(&hasher, hash);
+  }
+
+  /* the padding, so the entry ends where it was started */
+  if (ret == MPORT_OK && archive_write_finish_entry(bundle->archive) != ARCHIVE_OK)
+    ret = SET_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+  if (first) {
+    bundle->in_data = in_data;
+    if (ret == MPORT_OK)
+      ret = bundle_meta_to_front(bundle, start);
   }
+  if (ret != MPORT_OK)
+    bundle->failed = true;
    
   archive_entry_free(entry);
  
@@ -225,6 +811,12 @@ int mport_bundle_write_add_entry(mportBundleWrite *bundle, mportBundleRead *inbu
   char buff[BUFF_SIZE];
   size_t size, bytes_to_write;
 
+  /* until it's done, a failure leaves the bundle unfinished */
+  bundle->failed = true;
+
+  if (bundle_next_entry(bundle, archive_entry_pathname(entry)) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
   if (archive_write_header(bundle->archive, entry) != ARCHIVE_OK)
     RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
 
@@ -242,11 +834,262 @@ int mport_bundle_write_add_entry(mportBundleWrite *bundle, mportBundleRead *inbu
 
     size -= bytes_to_write;
   }  
+
+  if (archive_write_finish_entry(bundle->archive) != ARCHIVE_OK)
+    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+
+  bundle->failed = false;
   
   return MPORT_OK;
 }
 
 
+/*
+ * mport_bundle_write_init_part(bundle, tmpdir, codec, level, threads)
+ *
+ * Set up a bundle that is only chunks, compressed as
+ * mport_bundle_write_init_compressed() would, in a temporary file in
+ * tmpdir.  Entries are added as to any bundle; once it is given to
+ * mport_bundle_write_add_part(), free it with mport_bundle_write_finish().
+ * Parts let the entries of several bundles be compressed at once, each on
+ * a thread of its own, and still go into one bundle.
+ */
+int mport_bundle_write_init_part(mportBundleWrite *bundle, const char *tmpdir, mportCompression codec, int level, int threads)
+{
+
+  bundle->fd = bundle->datafd = -1;
+  bundle->part = true;
+  bundle->in_data = true;
+  bundle->codec = codec;
+  bundle->level = level;
+  bundle->threads = threads;
+  bundle->chunked = true;
+
+  if (asprintf(&bundle->filename, "%s/part.XXXXXX", tmpdir) == -1) {
+    bundle->filename = NULL;
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  if ((bundle->datafd = mkstemp(bundle->filename)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't make a temporary file in %s: %s", tmpdir, strerror(errno));
+  (void)unlink(bundle->filename);
+
+  if ((bundle->archive = archive_write_new()) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate archive struct");
+
+  if (archive_write_set_format_pax(bundle->archive) != ARCHIVE_OK ||
+      archive_write_set_bytes_per_block(bundle->archive, 0) != ARCHIVE_OK ||
+      archive_write_open(bundle->archive, bundle, NULL, bundle_tar_write, NULL) != ARCHIVE_OK)
+    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+
+  return MPORT_OK;
+}
+
+/* End the chunk being written, if any, for chunks made elsewhere to follow */
+static int
+bundle_chunks_end(mportBundleWrite *bundle)
+{
+
+  bundle->in_data = true;
+  if (bundle->chunk == NULL)
+    return MPORT_OK;
+
+  return bundle_chunk_close(bundle);
+}
+
+static int
+bundle_chunk_add(mportBundleWrite *bundle, int64_t offset, int64_t size, int64_t uoffset, int64_t usize)
+{
+  struct mport_bundle_chunk *c;
+
+  c = reallocarray(bundle->toc.chunks, bundle->toc.nchunks + 1, sizeof(*c));
+  if (c == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  bundle->toc.chunks = c;
+  c = &bundle->toc.chunks[bundle->toc.nchunks++];
+  c->offset = offset;
+  c->size = size;
+  c->uoffset = uoffset;
+  c->usize = usize;
+
+  return MPORT_OK;
+}
+
+/*
+ * mport_bundle_write_add_part(bundle, part)
+ *
+ * Add the chunks of part, set up by mport_bundle_write_init_part(), to
+ * bundle after whatever it has so far.  They are copied, not compressed
+ * again, so bundle must be chunked too.
+ */
+int mport_bundle_write_add_part(mportBundleWrite *bundle, mportBundleWrite *part)
+{
+  char buf[BUFF_SIZE];
+  int64_t base, ubase;
+  ssize_t len;
+  int r;
+
+  if (!bundle->chunked)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Parts only go into a chunked bundle");
+
+  /* the part's tar is closed without the end of an archive */
+  part->discard = true;
+  r = archive_write_close(part->archive);
+  part->discard = false;
+  if (r != ARCHIVE_OK)
+    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(part->archive));
+  if (bundle_chunks_end(part) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  /* until it's done, a failure leaves the bundle unfinished */
+  bundle->failed = true;
+
+  if (bundle_chunks_end(bundle) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+  base = bundle->datalen;
+  ubase = bundle->udatalen;
+
+  if (lseek(part->datafd, 0, SEEK_SET) == -1)
+    RETURN_ERROR(MPORT_ERR_FATAL, strerror(errno));
+  while ((len = read(part->datafd, buf, sizeof(buf))) > 0) {
+    if (bundle_fd_write(bundle->archive, bundle->datafd, buf, (size_t)len) < 0)
+      RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+  }
+  if (len < 0)
+    RETURN_ERROR(MPORT_ERR_FATAL, strerror(errno));
+
+  for (size_t i = 0; i < part->toc.nchunks; i++) {
+    struct mport_bundle_chunk *c = &part->toc.chunks[i];
+
+    if (bundle_chunk_add(bundle, base + c->offset, c->size, ubase + c->uoffset, c->usize) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
+  bundle->datalen = base + part->datalen;
+  bundle->udatalen = ubase + part->udatalen;
+
+  bundle->failed = false;
+
+  return MPORT_OK;
+}
+
+/*
+ * Decompress the chunk at p into the chunk being written, but for what
+ * follows the first keep bytes of it.  The tar bytes go straight in, as
+ * a chunk starts and ends on an entry's edge.
+ */
+static int
+bundle_chunk_inflate(mportBundleWrite *bundle, const unsigned char *p, size_t len, int64_t keep, int64_t usize)
+{
+  struct archive *a;
+  struct archive_entry *entry;
+  char buf[BUFF_SIZE];
+  ssize_t got;
+  int64_t total = 0;
+  int ret = MPORT_OK;
+
+  if (bundle_next_entry(bundle, NULL) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  if ((a = archive_read_new()) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't initialize archive read");
+
+  if (archive_read_support_filter_xz(a) != ARCHIVE_OK ||
+      archive_read_support_filter_zstd(a) < ARCHIVE_WARN ||
+      archive_read_support_format_raw(a) != ARCHIVE_OK ||
+      archive_read_open_memory(a, p, len) != ARCHIVE_OK ||
+      archive_read_next_header(a, &entry) != ARCHIVE_OK) {
+    SET_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
+    archive_read_free(a);
+    RETURN_CURRENT_ERROR;
+  }
+
+  while ((got = archive_read_data(a, buf, sizeof(buf))) > 0) {
+    if (total < keep) {
+      size_t n = keep - total < got ? (size_t)(keep - total) : (size_t)got;
+
+      if (bundle_tar_write(bundle->archive, bundle, buf, n) < 0) {
+        ret = SET_ERROR(MPORT_ERR_FATAL, archive_error_string(bundle->archive));
+        break;
+      }
+    }
+    total += got;
+  }
+  if (ret == MPORT_OK && got < 0)
+    ret = SET_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
+  else if (ret == MPORT_OK && total != usize)
+    ret = SET_ERROR(MPORT_ERR_FATAL, "Bundle chunk is not the size its table of contents says");
+
+  archive_read_free(a);
+
+  return ret;
+}
+
+/*
+ * mport_bundle_write_add_bundle(bundle, filename, toc)
+ *
+ * Add everything past the meta files of the version 6 bundle at filename,
+ * whose table of contents is toc.  If it was compressed as bundle is, its
+ * chunks are copied as they are; only the last, with the end of its tar,
+ * is decompressed and compressed again without that end.
+ */
+int mport_bundle_write_add_bundle(mportBundleWrite *bundle, const char *filename, const struct mport_bundle_toc *toc)
+{
+  const unsigned char *data;
+  struct stat st;
+  void *base;
+  int fd, ret = MPORT_OK;
+
+  if (!bundle->chunked)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: chunks only go into a chunked bundle", filename);
+
+  if (toc->nchunks == 0 || toc->chunks[toc->nchunks - 1].usize < 1024)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s: bad %s", filename, MPORT_BUNDLE_TOC_FILE);
+
+  if ((fd = open(filename, O_RDONLY)) == -1)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", filename, strerror(errno));
+  if (fstat(fd, &st) != 0 || st.st_size <= toc->data) {
+    close(fd);
+    RETURN_ERRORX(MPORT_ERR_FATAL, "%s is shorter than its table of contents says", filename);
+  }
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't map %s: %s", filename, strerror(errno));
+  data = (const unsigned char *)base + (st.st_size - toc->data);
+
+  /* until it's done, a failure leaves the bundle unfinished */
+  bundle->failed = true;
+
+  for (size_t i = 0; i < toc->nchunks && ret == MPORT_OK; i++) {
+    const struct mport_bundle_chunk *c = &toc->chunks[i];
+    bool last = i + 1 == toc->nchunks;
+
+    if (last || toc->codec != bundle->codec) {
+      /* the end of a tar is two empty records */
+      ret = bundle_chunk_inflate(bundle, data + c->offset, (size_t)c->size, last ? c->usize - 1024 : c->usize, c->usize);
+      continue;
+    }
+
+    if ((ret = bundle_chunks_end(bundle)) != MPORT_OK)
+      break;
+    if (bundle_fd_write(bundle->archive, bundle->datafd, data + c->offset, (size_t)c->size) < 0) {
+      ret = SET_ERRORX(MPORT_ERR_FATAL, "Couldn't copy %s: %s", filename, archive_error_string(bundle->archive));
+      break;
+    }
+    if ((ret = bundle_chunk_add(bundle, bundle->datalen, c->size, bundle->udatalen, c->usize)) != MPORT_OK)
+      break;
+    bundle->datalen += c->size;
+    bundle->udatalen += c->usize;
+  }
+
+  munmap(base, (size_t)st.st_size);
+
+  if (ret == MPORT_OK)
+    bundle->failed = false;
+
+  return ret;
+}
+
+
 /* lookup a file with more than one link in the link table.  If we find an entry
  * for the inode in the table, mark this incoming file as a hardlink to the prior file.
  * Otherwise, insert the new file into the table.
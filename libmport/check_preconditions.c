@@ -27,18 +27,311 @@
  * SUCH DAMAGE.
  */
 
+#include <fnmatch.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ohash.h>
 
 #include "mport.h"
 #include "mport_private.h"
 
+/*
+ * The checks used to be a handful of queries per package, each asking the
+ * OS release afresh, and stopped at the first failure.  They now run
+ * against a snapshot of the packages table and the OS release, read once
+ * and kept on the instance for the life of a batch.  Whatever changes a
+ * package row calls mport_precheck_forget() with its name, and the next
+ * lookup of that name goes back to the database; mport_precheck_reset()
+ * drops the lot.
+ *
+ * Every failure is counted.  With just one, it becomes the error as it
+ * always did; with more, each goes through msg_cb as it is found and the
+ * error says how many there were.
+ */
+
+struct precheck_node {
+	char *version;
+	char *os_release;
+	char *flavor;
+	bool installed;
+	bool clean;
+	bool stale;		/* reread before use */
+	char name[];		/* the ohash key */
+};
+
+struct mport_precheck {
+	struct ohash pkgs;
+	char *os_release;
+};
+
+struct precheck_report {
+	mportInstance *mport;
+	struct mport_precheck *snap;
+	mportPackageMeta **planned;	/* installed ahead of the one checked */
+	int nplanned;
+	int failed;
+	char first[256];
+};
+
+static int check_if_installed(struct precheck_report *, mportPackageMeta *);
+static int check_conflicts(struct precheck_report *, mportPackageMeta *);
+static int check_depends(struct precheck_report *, mportPackageMeta *);
+static int check_if_older_installed(struct precheck_report *, mportPackageMeta *);
+static int check_if_older_os(struct precheck_report *, mportPackageMeta *);
+static int check_one(struct precheck_report *, mportPackageMeta *, long);
+static int precheck_done(struct precheck_report *, int);
+
+static void *
+precheck_calloc(size_t s, void *data)
+{
+
+	return calloc(1, s);
+}
+
+static void
+precheck_free_cb(void *p, size_t s, void *data)
+{
+
+	free(p);
+}
+
+static void *
+precheck_alloc(size_t s, void *data)
+{
+
+	return malloc(s);
+}
+
+static struct ohash_info precheck_info = {
+	offsetof(struct precheck_node, name), NULL, precheck_calloc, precheck_free_cb, precheck_alloc
+};
+
+static void
+precheck_node_clear(struct precheck_node *node)
+{
+
+	free(node->version);
+	free(node->os_release);
+	free(node->flavor);
+	node->version = node->os_release = node->flavor = NULL;
+	node->installed = node->clean = false;
+}
+
+/* Fill node from a row of version, os_release, flavor, status */
+static int
+precheck_node_fill(struct precheck_node *node, sqlite3_stmt *stmt)
+{
+	const char *status = (const char *) sqlite3_column_text(stmt, 3);
+
+	precheck_node_clear(node);
+	node->version = strdup(sqlite3_column_text(stmt, 0) == NULL ? "" : (const char *) sqlite3_column_text(stmt, 0));
+	node->os_release = strdup(sqlite3_column_text(stmt, 1) == NULL ? "" : (const char *) sqlite3_column_text(stmt, 1));
+	if (sqlite3_column_text(stmt, 2) != NULL)
+		node->flavor = strdup((const char *) sqlite3_column_text(stmt, 2));
+	if (node->version == NULL || node->os_release == NULL ||
+	    (sqlite3_column_text(stmt, 2) != NULL && node->flavor == NULL)) {
+		precheck_node_clear(node);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+	node->installed = true;
+	node->clean = status != NULL && strcmp(status, "clean") == 0;
+	node->stale = false;
+
+	return (MPORT_OK);
+}
+
+static struct precheck_node *
+precheck_node_get(struct mport_precheck *snap, const char *name, bool create)
+{
+	struct precheck_node *node;
+	unsigned int slot;
+	const char *end = NULL;
+
+	slot = ohash_qlookupi(&snap->pkgs, name, &end);
+	if ((node = ohash_find(&snap->pkgs, slot)) != NULL || !create)
+		return node;
+
+	if ((node = ohash_create_entry(&precheck_info, name, &end)) == NULL)
+		return NULL;
+
+	node->version = node->os_release = node->flavor = NULL;
+	node->installed = node->clean = node->stale = false;
+	ohash_insert(&snap->pkgs, slot, node);
+
+	return node;
+}
+
+/*
+ * The snapshot, read if there isn't one.  A single pass over the packages
+ * table, which is small next to the assets.
+ */
+static int
+precheck_snapshot(mportInstance *mport, struct mport_precheck **snapp)
+{
+	struct mport_precheck *snap;
+	struct precheck_node *node;
+	sqlite3_stmt *stmt;
+	int ret;
+
+	if ((*snapp = mport->precheck) != NULL)
+		return (MPORT_OK);
+
+	if ((snap = calloc(1, sizeof(struct mport_precheck))) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	ohash_init(&snap->pkgs, 8, &precheck_info);
+	mport->precheck = snap;
+
+	if ((snap->os_release = mport_get_osrelease(mport)) == NULL) {
+		mport_precheck_reset(mport);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Unable to determine OS release");
+	}
+
+	if (mport_db_prepare(mport->db, &stmt, "SELECT version, os_release, flavor, status, pkg FROM packages") != MPORT_OK) {
+		sqlite3_finalize(stmt);
+		mport_precheck_reset(mport);
+		RETURN_CURRENT_ERROR;
+	}
+
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if ((node = precheck_node_get(snap, (const char *) sqlite3_column_text(stmt, 4), true)) == NULL) {
+			SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+			break;
+		}
+		if (precheck_node_fill(node, stmt) != MPORT_OK)
+			break;
+	}
+
+	if (ret != SQLITE_DONE) {
+		if (ret != SQLITE_ROW)
+			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+		sqlite3_finalize(stmt);
+		mport_precheck_reset(mport);
+		RETURN_CURRENT_ERROR;
+	}
+
+	sqlite3_finalize(stmt);
+	*snapp = snap;
 
-static int check_if_installed(mportInstance *mport, mportPackageMeta *);
-static int check_conflicts(mportInstance *mport, mportPackageMeta *);
-static int check_depends(mportInstance *mport, mportPackageMeta *);
-static int check_if_older_installed(mportInstance *, mportPackageMeta *);
-static int check_if_older_os(mportInstance *, mportPackageMeta *);
+	return (MPORT_OK);
+}
+
+/* Reread a forgotten package from the database */
+static int
+precheck_refresh(mportInstance *mport, struct precheck_node *node)
+{
+	sqlite3_stmt *stmt;
+	int ret = MPORT_OK;
+
+	if (mport_db_borrow(mport, &stmt, "SELECT version, os_release, flavor, status FROM packages WHERE pkg=?") != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (sqlite3_bind_text(stmt, 1, node->name, -1, SQLITE_STATIC) != SQLITE_OK) {
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+		mport_db_return(mport, stmt);
+		RETURN_CURRENT_ERROR;
+	}
+
+	switch (sqlite3_step(stmt)) {
+		case SQLITE_ROW:
+			ret = precheck_node_fill(node, stmt);
+			break;
+		case SQLITE_DONE:
+			precheck_node_clear(node);
+			node->stale = false;
+			break;
+		default:
+			ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+			break;
+	}
+
+	mport_db_return(mport, stmt);
+
+	return (ret);
+}
+
+/* The installed package called name, or NULL in *nodep if there isn't one */
+static int
+precheck_lookup(struct precheck_report *r, const char *name, struct precheck_node **nodep)
+{
+	struct precheck_node *node = precheck_node_get(r->snap, name, false);
+
+	*nodep = NULL;
+	if (node == NULL)
+		return (MPORT_OK);
+	if (node->stale && precheck_refresh(r->mport, node) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+	if (node->installed)
+		*nodep = node;
+
+	return (MPORT_OK);
+}
+
+/* Count a failed check; see the comment at the top */
+static void
+precheck_fail(struct precheck_report *r, const char *fmt, ...)
+{
+	char msg[256];
+	va_list args;
+
+	va_start(args, fmt);
+	(void) vsnprintf(msg, sizeof(msg), fmt, args);
+	va_end(args);
+
+	if (r->failed == 0)
+		strlcpy(r->first, msg, sizeof(r->first));
+	else {
+		if (r->failed == 1)
+			mport_call_msg_cb(r->mport, "%s", r->first);
+		mport_call_msg_cb(r->mport, "%s", msg);
+	}
+	r->failed++;
+}
+
+/*
+ * mport_precheck_forget(mport, name)
+ *
+ * The row for name has changed (installed, marked clean, deleted); the next
+ * check of it rereads it.
+ */
+void
+mport_precheck_forget(mportInstance *mport, const char *name)
+{
+	struct precheck_node *node;
+
+	if (mport->precheck == NULL)
+		return;
+
+	if ((node = precheck_node_get(mport->precheck, name, true)) == NULL) {
+		/* can't remember to forget; start over instead */
+		mport_precheck_reset(mport);
+		return;
+	}
+	node->stale = true;
+}
+
+/* Drop the snapshot, the next check reads a new one */
+void
+mport_precheck_reset(mportInstance *mport)
+{
+	struct mport_precheck *snap = mport->precheck;
+	struct precheck_node *node;
+	unsigned int i;
+
+	if (snap == NULL)
+		return;
+
+	for (node = ohash_first(&snap->pkgs, &i); node != NULL; node = ohash_next(&snap->pkgs, &i)) {
+		precheck_node_clear(node);
+		free(node);
+	}
+	ohash_delete(&snap->pkgs);
+	free(snap->os_release);
+	free(snap);
+	mport->precheck = NULL;
+}
 
 /* Run the checks requested by the flags given.
  *
@@ -49,325 +342,302 @@ static int check_if_older_os(mportInstance *, mportPackageMeta *);
  *   MPORT_PRECHECK_DEPENDS    -- Fail if the dependencies are not resolved
  *   MPORT_PRECHECK_OS	       -- Fail if the os version of the installed is older
  *
- * The checks are run in the order listed above.  The first failure
- * encountered is the one reported.   
+ * The checks are run in the order listed above, and all of them are run.
+ * A single failure is the one reported; with more than one, each is passed
+ * to msg_cb and the error gives the count.
  *
  * This function expects that the stub database for the given package is
  * connected.
  */
 int mport_check_preconditions(mportInstance *mport, mportPackageMeta *pack, long flags)
 {
-	if (flags & MPORT_PRECHECK_INSTALLED && check_if_installed(mport, pack) != MPORT_OK)
+	struct precheck_report r = { mport, NULL, NULL, 0, 0, "" };
+
+	return precheck_done(&r, check_one(&r, pack, flags));
+}
+
+/* mport_check_preconditions_all(mport, pkgs, flags)
+ *
+ * Check every package in the NULL terminated pkgs, as they would be
+ * installed in that order: a dependency on one earlier in the list is
+ * met by it.  Fails if any of them does, after checking them all.
+ */
+int
+mport_check_preconditions_all(mportInstance *mport, mportPackageMeta **pkgs, long flags)
+{
+	struct precheck_report r = { mport, NULL, pkgs, 0, 0, "" };
+	int ret = MPORT_OK;
+
+	for (; pkgs[r.nplanned] != NULL; r.nplanned++) {
+		if ((ret = check_one(&r, pkgs[r.nplanned], flags)) != MPORT_OK)
+			break;
+	}
+
+	return precheck_done(&r, ret);
+}
+
+static int
+check_one(struct precheck_report *r, mportPackageMeta *pack, long flags)
+{
+
+	if (precheck_snapshot(r->mport, &r->snap) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (flags & MPORT_PRECHECK_INSTALLED && check_if_installed(r, pack) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
-	if (flags & MPORT_PRECHECK_UPGRADEABLE && check_if_older_installed(mport, pack) != MPORT_OK)
+	if (flags & MPORT_PRECHECK_UPGRADEABLE && check_if_older_installed(r, pack) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
-	if (flags & MPORT_PRECHECK_CONFLICTS && check_conflicts(mport, pack) != MPORT_OK)
+	if (flags & MPORT_PRECHECK_CONFLICTS && check_conflicts(r, pack) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
-	if (flags & MPORT_PRECHECK_DEPENDS && check_depends(mport, pack) != MPORT_OK)
+	if (flags & MPORT_PRECHECK_DEPENDS && check_depends(r, pack) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
-	if (flags & MPORT_PRECHECK_OS && check_if_older_os(mport, pack) != MPORT_OK)
+	if (flags & MPORT_PRECHECK_OS && check_if_older_os(r, pack) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
 	return MPORT_OK;
 }
 
-static int check_if_installed(mportInstance *mport, mportPackageMeta *pack)
+/*
+ * Turn what was counted into the result.  ret is an error other than a
+ * failed check (the database, memory), which wins.  Outside a batch
+ * nothing says when the packages table will next change, so the snapshot
+ * isn't kept.
+ */
+static int
+precheck_done(struct precheck_report *r, int ret)
 {
-	sqlite3_stmt *stmt;
-	const char *inst_version;
-	const char *os_release;
-	char *system_os_release;
+
+	if (!r->mport->batch)
+		mport_precheck_reset(r->mport);
+
+	if (ret != MPORT_OK)
+		return (ret);
+
+	if (r->failed == 1)
+		RETURN_ERROR(MPORT_ERR_FATAL, r->first);
+	if (r->failed > 1)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "%d precondition checks failed", r->failed);
+
+	return MPORT_OK;
+}
+
+static int check_if_installed(struct precheck_report *r, mportPackageMeta *pack)
+{
+	struct precheck_node *node;
 
 	/* check if the package is already installed */
-	if (mport_db_prepare(mport->db, &stmt, "SELECT version, os_release FROM packages WHERE pkg=%Q", pack->name) != MPORT_OK) {
-		sqlite3_finalize(stmt);
+	if (precheck_lookup(r, pack->name, &node) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
-	}
 
 	/* it's possible that the default package with a flavor does not have a prefix, but will appear that way during
 	 * dependency calculation.
 	 */
-	int step = sqlite3_step(stmt);
-	if (step == SQLITE_DONE) {
-		if (pack->flavor != NULL && !mport_starts_with(pack->flavor, pack->name)) {
-			char *full_name;
-			asprintf(&full_name, "%s-%s", pack->flavor, pack->name);
-			if (full_name != NULL) {
-				if (mport_db_prepare(mport->db, &stmt, "SELECT version, os_release FROM packages WHERE pkg=%Q", full_name) !=
-				    MPORT_OK) {
-					sqlite3_finalize(stmt);
-					RETURN_CURRENT_ERROR;
-				}
-				free(full_name);
-				step = sqlite3_step(stmt);
-			}
-		}
-	}
+	if (node == NULL && pack->flavor != NULL && !mport_starts_with(pack->flavor, pack->name)) {
+		char *full_name;
 
-	switch (step) {
-		case SQLITE_DONE:
-			/* No row found. */
-			break;
-		case SQLITE_ROW:
-			/* Row was found */
-			inst_version = sqlite3_column_text(stmt, 0);
-			os_release = sqlite3_column_text(stmt, 1);
-			system_os_release = (char *) mport_get_osrelease(mport);
-
-			/* Different os release version should not be considered the same package */
-			if (strcmp(os_release, system_os_release) != 0) {
-				free(system_os_release);
-				break;
-			}
-			free(system_os_release);
+		if (asprintf(&full_name, "%s-%s", pack->flavor, pack->name) != -1) {
+			int ret = precheck_lookup(r, full_name, &node);
 
-			SET_ERRORX(MPORT_ERR_FATAL, "%s (version %s) is already installed.", pack->name, inst_version);
-			sqlite3_finalize(stmt);
-			RETURN_CURRENT_ERROR;
-		default:
-			/* Some sort of sqlite error */
-			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-			sqlite3_finalize(stmt);
-			RETURN_CURRENT_ERROR;
+			free(full_name);
+			if (ret != MPORT_OK)
+				RETURN_CURRENT_ERROR;
+		}
 	}
 
-	sqlite3_finalize(stmt);
+	/* Different os release version should not be considered the same package */
+	if (node != NULL && strcmp(node->os_release, r->snap->os_release) == 0)
+		precheck_fail(r, "%s (version %s) is already installed.", pack->name, node->version);
+
 	return MPORT_OK;
 }
 
-static int check_conflicts(mportInstance *mport, mportPackageMeta *pack)
+static int check_conflicts(struct precheck_report *r, mportPackageMeta *pack)
 {
+	mportInstance *mport = r->mport;
+	struct precheck_node *node;
 	sqlite3_stmt *stmt;
+	const char *conflict_pkg, *conflict_version;
+	unsigned int i;
 	int ret;
-	const char *inst_name, *inst_version;
 
-	if (mport_db_prepare(mport->db, &stmt,
-	                     "SELECT packages.pkg, packages.version FROM stub.conflicts LEFT JOIN packages ON packages.pkg GLOB stub.conflicts.conflict_pkg AND packages.version GLOB stub.conflicts.conflict_version WHERE stub.conflicts.pkg=%Q AND packages.pkg IS NOT NULL",
-	                     pack->name) != MPORT_OK) {
-		sqlite3_finalize(stmt);
+	if (mport_db_borrow(mport, &stmt, "SELECT conflict_pkg, conflict_version FROM stub.conflicts WHERE pkg=?") != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (sqlite3_bind_text(stmt, 1, pack->name, -1, SQLITE_STATIC) != SQLITE_OK) {
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+		mport_db_return(mport, stmt);
 		RETURN_CURRENT_ERROR;
 	}
 
-	while (1) {
-		ret = sqlite3_step(stmt);
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		conflict_pkg = (const char *) sqlite3_column_text(stmt, 0);
+		conflict_version = (const char *) sqlite3_column_text(stmt, 1);
 
-		if (ret == SQLITE_ROW) {
-			inst_name = (const char *) sqlite3_column_text(stmt, 0);
-			inst_version = (const char *) sqlite3_column_text(stmt, 1);
+		/* as sqlite's GLOB did, a NULL pattern matches nothing */
+		if (conflict_pkg == NULL || conflict_version == NULL)
+			continue;
 
-			SET_ERRORX(MPORT_ERR_FATAL, "Installed package %s-%s conflicts with %s", inst_name, inst_version,
-			           pack->name);
-			sqlite3_finalize(stmt);
-			RETURN_CURRENT_ERROR;
-		} else if (ret == SQLITE_DONE) {
-			/* No conflicts */
-			break;
-		} else {
-			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-			sqlite3_finalize(stmt);
-			RETURN_CURRENT_ERROR;
+		for (node = ohash_first(&r->snap->pkgs, &i); node != NULL; node = ohash_next(&r->snap->pkgs, &i)) {
+			if (node->stale && precheck_refresh(mport, node) != MPORT_OK) {
+				mport_db_return(mport, stmt);
+				RETURN_CURRENT_ERROR;
+			}
+			if (!node->installed || fnmatch(conflict_pkg, node->name, 0) != 0 ||
+			    fnmatch(conflict_version, node->version, 0) != 0)
+				continue;
+
+			precheck_fail(r, "Installed package %s-%s conflicts with %s", node->name, node->version, pack->name);
 		}
 	}
 
-	sqlite3_finalize(stmt);
+	if (ret != SQLITE_DONE) {
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+		mport_db_return(mport, stmt);
+		RETURN_CURRENT_ERROR;
+	}
+
+	mport_db_return(mport, stmt);
 	return MPORT_OK;
 }
 
+/*
+ * The clean, installed package that satisfies a dependency on name.
+ *
+ * package name on dependencies can contain the flavor prefix. native-binutils but there is no guarnatee we stored it
+ * as native-bintuils in master. check for binutils also: any package whose name is what follows a '-' in name, and
+ * whose flavor is as long as what precedes it.
+ */
+static int
+precheck_lookup_depend(struct precheck_report *r, const char *name, struct precheck_node **nodep)
+{
+	const char *dash;
+
+	if (precheck_lookup(r, name, nodep) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+	if (*nodep != NULL && (*nodep)->clean)
+		return (MPORT_OK);
+
+	for (dash = strchr(name, '-'); dash != NULL; dash = strchr(dash + 1, '-')) {
+		if (precheck_lookup(r, dash + 1, nodep) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+		if (*nodep != NULL && (*nodep)->clean && (*nodep)->flavor != NULL &&
+		    strlen((*nodep)->flavor) == (size_t) (dash - name))
+			return (MPORT_OK);
+	}
+
+	*nodep = NULL;
+	return (MPORT_OK);
+}
 
-static int check_depends(mportInstance *mport, mportPackageMeta *pack)
+static int check_depends(struct precheck_report *r, mportPackageMeta *pack)
 {
+	mportInstance *mport = r->mport;
 	sqlite3 *db = mport->db;
-	sqlite3_stmt *stmt, *lookup;
+	sqlite3_stmt *stmt;
+	struct precheck_node *node;
 	const char *depend_pkg, *depend_version, *inst_version;
-	const char *os_release;
-	char *system_os_release;
-	int ret;
+	int ret, i, ok;
 
 	/* check for depends */
-	if (mport_db_prepare(mport->db, &stmt, "SELECT depend_pkgname, depend_pkgversion FROM stub.depends WHERE pkg=%Q",
-	                     pack->name) != MPORT_OK) {
-		sqlite3_finalize(stmt);
+	if (mport_db_borrow(mport, &stmt, "SELECT depend_pkgname, depend_pkgversion FROM stub.depends WHERE pkg=?") != MPORT_OK)
 		RETURN_CURRENT_ERROR;
-	}
 
-	/* package name on dependencies can contain the flavor prefix. native-binutils but there is no guarnatee we stored it as native-bintuils in master. check for binutils also. */
-	if (mport_db_prepare(db, &lookup, "SELECT version, os_release, flavor FROM packages WHERE (pkg=? or (flavor is not null and flavor != '' and pkg=substr(?, length(flavor) + 2) )) AND status='clean'") !=
-	    MPORT_OK) {
-		sqlite3_finalize(stmt);
+	if (sqlite3_bind_text(stmt, 1, pack->name, -1, SQLITE_STATIC) != SQLITE_OK) {
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+		mport_db_return(mport, stmt);
 		RETURN_CURRENT_ERROR;
 	}
 
-	system_os_release = (char *) mport_get_osrelease(mport);
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		depend_pkg = (const char *) sqlite3_column_text(stmt, 0);
+		depend_version = (const char *) sqlite3_column_text(stmt, 1);
 
-	if (system_os_release == NULL) {
-		sqlite3_finalize(stmt);
-		return SET_ERROR(MPORT_ERR_FATAL, "Unable to determine OS release");
-	}
-
-	while (1) {
-		ret = sqlite3_step(stmt);
-
-		if (ret == SQLITE_ROW) {
-			depend_pkg = sqlite3_column_text(stmt, 0);
-			depend_version = sqlite3_column_text(stmt, 1);
+		if (depend_pkg == NULL)
+			continue;
 
-			if (sqlite3_bind_text(lookup, 1, depend_pkg, -1, SQLITE_STATIC) != SQLITE_OK || sqlite3_bind_text(lookup, 2, depend_pkg, -1, SQLITE_STATIC) != SQLITE_OK) {
-				SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-				sqlite3_finalize(lookup);
-				sqlite3_finalize(stmt);
-
-				free(system_os_release);
+		/* one installed ahead of this, in the same run */
+		inst_version = NULL;
+		for (i = 0; i < r->nplanned; i++) {
+			if (strcmp(r->planned[i]->name, depend_pkg) == 0) {
+				inst_version = r->planned[i]->version;
+				break;
+			}
+		}
 
+		if (inst_version == NULL) {
+			if (precheck_lookup_depend(r, depend_pkg, &node) != MPORT_OK) {
+				mport_db_return(mport, stmt);
 				RETURN_CURRENT_ERROR;
 			}
 
-			switch (sqlite3_step(lookup)) {
-				case SQLITE_ROW:
-					inst_version = sqlite3_column_text(lookup, 0);
-					os_release = sqlite3_column_text(lookup, 1);
-					int ok;
-
-					if (strcmp(os_release, system_os_release) != 0) {
-						SET_ERRORX(MPORT_ERR_FATAL,
-						           "%s depends on %s version %s.  Version %s for MidnightBSD %s is installed.",
-						           pack->name, depend_pkg, depend_version == NULL ? "<any>" : depend_version,
-						           inst_version, os_release);
-						sqlite3_finalize(lookup);
-						sqlite3_finalize(stmt);
-						free(system_os_release);
-						RETURN_CURRENT_ERROR;
-					}
-
-					if (depend_version == NULL)
-						/* no minimum version */
-						break;
-
-					ok = mport_version_require_check(inst_version, depend_version);
-
-					if (ok > 0) {
-						sqlite3_finalize(lookup);
-						sqlite3_finalize(stmt);
-						free(system_os_release);
-						RETURN_CURRENT_ERROR;
-					} else if (ok == -1) {
-						SET_ERRORX(MPORT_ERR_FATAL, "%s depends on %s version %s.  Version %s is installed.",
-						           pack->name, depend_pkg, depend_version, inst_version);
-						sqlite3_finalize(lookup);
-						sqlite3_finalize(stmt);
-						free(system_os_release);
-						RETURN_CURRENT_ERROR;
-					}
-
-					break;
-				case SQLITE_DONE:
-					/* this dependency isn't installed. */
-					SET_ERRORX(MPORT_ERR_FATAL, "%s depends on %s, which is not installed.", pack->name, depend_pkg);
-					sqlite3_finalize(lookup);
-					sqlite3_finalize(stmt);
-					free(system_os_release);
-					RETURN_CURRENT_ERROR;
-				default:
-					SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-					sqlite3_finalize(lookup);
-					sqlite3_finalize(stmt);
-					free(system_os_release);
-					RETURN_CURRENT_ERROR;
+			if (node == NULL) {
+				/* this dependency isn't installed. */
+				precheck_fail(r, "%s depends on %s, which is not installed.", pack->name, depend_pkg);
+				continue;
 			}
 
-			sqlite3_reset(lookup);
-			sqlite3_clear_bindings(lookup);
-		} else if (ret == SQLITE_DONE) {
-			/* No more dependencies to check. */
-			sqlite3_finalize(lookup);
-			sqlite3_finalize(stmt);
-			break;
-		} else {
-			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-			sqlite3_finalize(lookup);
-			sqlite3_finalize(stmt);
-			free(system_os_release);
+			inst_version = node->version;
+			if (strcmp(node->os_release, r->snap->os_release) != 0) {
+				precheck_fail(r, "%s depends on %s version %s.  Version %s for MidnightBSD %s is installed.",
+				              pack->name, depend_pkg, depend_version == NULL ? "<any>" : depend_version,
+				              inst_version, node->os_release);
+				continue;
+			}
+		}
+
+		if (depend_version == NULL)
+			/* no minimum version */
+			continue;
+
+		ok = mport_version_require_check(inst_version, depend_version);
+
+		if (ok > 0) {
+			mport_db_return(mport, stmt);
 			RETURN_CURRENT_ERROR;
+		} else if (ok == -1) {
+			precheck_fail(r, "%s depends on %s version %s.  Version %s is installed.",
+			              pack->name, depend_pkg, depend_version, inst_version);
 		}
 	}
 
-	free(system_os_release);
+	if (ret != SQLITE_DONE) {
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+		mport_db_return(mport, stmt);
+		RETURN_CURRENT_ERROR;
+	}
 
+	mport_db_return(mport, stmt);
 	return MPORT_OK;
 }
 
 /* check to see if an older version of a package is installed. */
 static int
-check_if_older_installed(mportInstance *mport, mportPackageMeta *pkg)
+check_if_older_installed(struct precheck_report *r, mportPackageMeta *pkg)
 {
-	sqlite3_stmt *stmt;
-	int ret;
-	const char *os_release;
+	struct precheck_node *node;
 
-	os_release = mport_get_osrelease(mport);
-
-	if (os_release == NULL)
-		return SET_ERROR(MPORT_ERR_FATAL, "Unable to determine OS release");
-
-	if (mport_db_prepare(mport->db, &stmt,
-	                     "SELECT os_release FROM packages WHERE pkg=%Q and ((mport_version_cmp(version, %Q) < 0 and os_release=%Q) or os_release != %Q)",
-	                     pkg->name, pkg->version, os_release, os_release) != MPORT_OK) {
-		free((char*)os_release);
-		sqlite3_finalize(stmt);
+	if (precheck_lookup(r, pkg->name, &node) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
-	}
 
-	switch (sqlite3_step(stmt)) {
-		case SQLITE_ROW:
-			ret = MPORT_OK;
-			break;
-		case SQLITE_DONE:
-			ret = SET_ERRORX(MPORT_ERR_FATAL, "No older version of %s installed", pkg->name);
-			break;
-		default:
-			ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-			break;
-	}
-
-	sqlite3_finalize(stmt);
-	free((char *)os_release);
+	/* one built for another release is always replaced */
+	if (node != NULL && (strcmp(node->os_release, r->snap->os_release) != 0 ||
+	    mport_version_cmp(node->version, pkg->version) < 0))
+		return (MPORT_OK);
 
-	return ret;
+	precheck_fail(r, "No older version of %s installed", pkg->name);
+	return (MPORT_OK);
 }
 
 static int
-check_if_older_os(mportInstance *mport, mportPackageMeta *pkg)
+check_if_older_os(struct precheck_report *r, mportPackageMeta *pkg)
 {
-	sqlite3_stmt *stmt;
-	int ret;
-	const char *os_release;
-
-	os_release = mport_get_osrelease(mport);
+	struct precheck_node *node;
 
-	if (os_release == NULL)
-		return SET_ERROR(MPORT_ERR_FATAL, "Unable to determine OS release");
-
-	if (mport_db_prepare(mport->db, &stmt,
-	                     "SELECT os_release FROM packages WHERE pkg=%Q and mport_version_cmp(os_release, %Q) < 0",
-	                     pkg->name, os_release) != MPORT_OK) {
-		free((char*)os_release);
-		sqlite3_finalize(stmt);
+	if (precheck_lookup(r, pkg->name, &node) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
-	}
-
-	switch (sqlite3_step(stmt)) {
-		case SQLITE_ROW:
-			ret = MPORT_OK;
-			break;
-		case SQLITE_DONE:
-			ret = SET_ERRORX(MPORT_ERR_FATAL, "No older os release version of %s installed", pkg->name);
-			break;
-		default:
-			ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-			break;
-	}
 
-	sqlite3_finalize(stmt);
-	free((char*) os_release);
+	if (node == NULL || mport_version_cmp(node->os_release, r->snap->os_release) >= 0)
+		precheck_fail(r, "No older os release version of %s installed", pkg->name);
 
-	return ret;
+	return (MPORT_OK);
 }
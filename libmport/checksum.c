@@ -0,0 +1,288 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/cdefs.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <md5.h>
+#include <sha256.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef MPORT_BLAKE3
+#include <blake3.h>
+#endif
+#include "mport.h"
+#include "mport_private.h"
+
+/*
+ * Checksums of bundles and installed files.
+ *
+ * A checksum names its algorithm with a prefix, "blake3:", "sha256:" or
+ * "md5:", followed by the lowercase hex digest.  Checksums written before
+ * the prefix existed are bare hex: MD5 when shorter than 34 characters,
+ * SHA256 otherwise.  A file is always hashed the way the checksum it is
+ * checked against was made, and the result written in the same form, so
+ * the two compare as strings.  New checksums are bare SHA256, which every
+ * mport can read, unless libmport is built with BLAKE3 (WITH_BLAKE3).
+ *
+ * Nothing here touches the error state, so any thread may use it.
+ */
+
+#define CHECKSUM_READ_BLOCK (1024 * 1024)
+#define CHECKSUM_MAP_CHUNK (1024 * 1024 * 1024) /* MD5Update() takes an unsigned int */
+
+static const struct {
+	enum mport_checksum_alg alg;
+	const char *prefix;
+} prefixes[] = {
+	{ MPORT_CHECKSUM_BLAKE3, "blake3:" },
+	{ MPORT_CHECKSUM_SHA256, "sha256:" },
+	{ MPORT_CHECKSUM_MD5, "md5:" },
+};
+
+static const char *checksum_prefix(enum mport_checksum_alg);
+
+
+/* mport_checksum_parse(checksum, alg, prefixed)
+ *
+ * The algorithm checksum was made with, and whether it carries a prefix.
+ * Returns false for a prefix this mport doesn't know.
+ */
+bool
+mport_checksum_parse(const char *checksum, enum mport_checksum_alg *alg, bool *prefixed)
+{
+	const char *colon;
+
+	if ((colon = strchr(checksum, ':')) == NULL) {
+		*alg = strlen(checksum) < 34 ? MPORT_CHECKSUM_MD5 : MPORT_CHECKSUM_SHA256;
+		*prefixed = false;
+		return true;
+	}
+
+	for (size_t i = 0; i < nitems(prefixes); i++) {
+		if (strncmp(checksum, prefixes[i].prefix, (size_t) (colon - checksum + 1)) == 0 &&
+		    prefixes[i].prefix[colon - checksum + 1] == '\0') {
+			*alg = prefixes[i].alg;
+			*prefixed = true;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* mport_checksum_digest(checksum)
+ *
+ * The hex digest of checksum, without any prefix.
+ */
+const char *
+mport_checksum_digest(const char *checksum)
+{
+	const char *colon = strchr(checksum, ':');
+
+	return colon == NULL ? checksum : colon + 1;
+}
+
+/* mport_hasher_init(h, like)
+ *
+ * Start hashing with the algorithm and in the form of the checksum like, or
+ * the default for new checksums if like is NULL.  Returns false if the
+ * algorithm isn't available.
+ */
+bool
+mport_hasher_init(struct mport_hasher *h, const char *like)
+{
+
+	if (like == NULL) {
+#ifdef MPORT_BLAKE3
+		h->alg = MPORT_CHECKSUM_BLAKE3;
+		h->prefixed = true;
+#else
+		h->alg = MPORT_CHECKSUM_SHA256;
+		h->prefixed = false;
+#endif
+	} else if (!mport_checksum_parse(like, &h->alg, &h->prefixed)) {
+		return false;
+	}
+
+	switch (h->alg) {
+		case MPORT_CHECKSUM_MD5:
+			MD5Init(&h->ctx.md5);
+			break;
+		case MPORT_CHECKSUM_SHA256:
+			SHA256_Init(&h->ctx.sha256);
+			break;
+		case MPORT_CHECKSUM_BLAKE3:
+#ifdef MPORT_BLAKE3
+			blake3_hasher_init(&h->ctx.blake3);
+			break;
+#else
+			return false;
+#endif
+	}
+
+	return true;
+}
+
+void
+mport_hasher_update(struct mport_hasher *h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	switch (h->alg) {
+		case MPORT_CHECKSUM_MD5:
+			for (size_t n; len > 0; p += n, len -= n) {
+				n = len < CHECKSUM_MAP_CHUNK ? len : CHECKSUM_MAP_CHUNK;
+				MD5Update(&h->ctx.md5, p, (unsigned int) n);
+			}
+			break;
+		case MPORT_CHECKSUM_SHA256:
+			SHA256_Update(&h->ctx.sha256, p, len);
+			break;
+		case MPORT_CHECKSUM_BLAKE3:
+#ifdef MPORT_BLAKE3
+			blake3_hasher_update(&h->ctx.blake3, p, len);
+#endif
+			break;
+	}
+}
+
+/* mport_hasher_end(h, out)
+ *
+ * Finish, writing the checksum, prefixed if the one h was started like was,
+ * into out, which holds MPORT_CHECKSUM_MAX.
+ */
+void
+mport_hasher_end(struct mport_hasher *h, char *out)
+{
+	char *digest = out;
+#ifdef MPORT_BLAKE3
+	static const char hex[] = "0123456789abcdef";
+	uint8_t raw[BLAKE3_OUT_LEN];
+#endif
+
+	if (h->prefixed) {
+		(void) strlcpy(out, checksum_prefix(h->alg), MPORT_CHECKSUM_MAX);
+		digest = out + strlen(out);
+	}
+
+	switch (h->alg) {
+		case MPORT_CHECKSUM_MD5:
+			(void) MD5End(&h->ctx.md5, digest);
+			break;
+		case MPORT_CHECKSUM_SHA256:
+			(void) SHA256_End(&h->ctx.sha256, digest);
+			break;
+		case MPORT_CHECKSUM_BLAKE3:
+#ifdef MPORT_BLAKE3
+			blake3_hasher_finalize(&h->ctx.blake3, raw, sizeof(raw));
+			for (size_t i = 0; i < sizeof(raw); i++) {
+				digest[i * 2] = hex[raw[i] >> 4];
+				digest[i * 2 + 1] = hex[raw[i] & 0xf];
+			}
+			digest[sizeof(raw) * 2] = '\0';
+#else
+			*digest = '\0';
+#endif
+			break;
+	}
+}
+
+/* mport_checksum_file(path, like, out)
+ *
+ * Hash path as mport_hasher_init(like) would, reading it in large blocks.
+ * It isn't mapped: a file truncated while it is read, as an installed one
+ * can be under mport verify, would be SIGBUS rather than a short read.
+ * Returns false, with errno set, if it can't be read or the algorithm
+ * isn't available.
+ */
+bool
+mport_checksum_file(const char *path, const char *like, char *out)
+{
+	struct mport_hasher h;
+	unsigned char *buf;
+	off_t off = 0;
+	ssize_t n;
+	int fd;
+
+	if (!mport_hasher_init(&h, like)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if ((buf = malloc(CHECKSUM_READ_BLOCK)) == NULL) {
+		close(fd);
+		return false;
+	}
+
+	(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (;;) {
+		if ((n = pread(fd, buf, CHECKSUM_READ_BLOCK, off)) > 0) {
+			mport_hasher_update(&h, buf, (size_t) n);
+			off += n;
+		} else if (n == 0 || errno != EINTR) {
+			break;
+		}
+	}
+	free(buf);
+	close(fd);
+
+	mport_hasher_end(&h, out);
+
+	return n == 0;
+}
+
+/* mport_checksum_matches(path, checksum)
+ *
+ * Whether path hashes to checksum, in whatever algorithm that was made.
+ */
+bool
+mport_checksum_matches(const char *path, const char *checksum)
+{
+	char hash[MPORT_CHECKSUM_MAX];
+
+	return checksum != NULL && mport_checksum_file(path, checksum, hash) && strcmp(hash, checksum) == 0;
+}
+
+static const char *
+checksum_prefix(enum mport_checksum_alg alg)
+{
+
+	for (size_t i = 0; i < nitems(prefixes); i++) {
+		if (prefixes[i].alg == alg)
+			return prefixes[i].prefix;
+	}
+
+	return "";
+}
@@ -94,13 +94,15 @@ mport_clean_oldpackages(mportInstance *mport)
 				                        path, strerror(errno));
 				mport_call_msg_cb(mport, "%s\n", mport_err_string());
 			} else {
+				mport_hash_cache_forget(mport, path);
 				deleted++;
 			}
-		} else if (mport_verify_hash(path, (*indexEntry)->hash) == 0) {
+		} else if (mport_verify_bundle(mport, path, (*indexEntry)->hash) == 0) {
 			if (unlink(path) < 0) {
 				error_code = SET_ERRORX(MPORT_ERR_FATAL, "Could not delete file %s: %s", path, strerror(errno));
 				mport_call_msg_cb(mport, "%s\n", mport_err_string());
 			} else {
+				mport_hash_cache_forget(mport, path);
 				deleted++;
 			}
 			mport_index_entry_free_vec(indexEntry);
@@ -32,6 +32,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,7 +46,7 @@
 
 static int create_stub_db(mportInstance *, sqlite3 **, const char *);
 
-static int insert_assetlist(sqlite3 *, mportAssetList *, mportPackageMeta *, mportCreateExtras *);
+static int insert_assetlist(sqlite3 *, mportAssetList *, mportPackageMeta *);
 
 static int insert_meta(mportInstance *, sqlite3 *, mportPackageMeta *, mportCreateExtras *);
 
@@ -55,11 +56,16 @@ static int insert_conflicts(sqlite3 *, mportPackageMeta *, mportCreateExtras *);
 
 static int insert_categories(sqlite3 *, mportPackageMeta *);
 
-static int archive_files(mportAssetList *, mportPackageMeta *, mportCreateExtras *, const char *);
+static int archive_files(mportInstance *, sqlite3 *, mportAssetList *, mportPackageMeta *, mportCreateExtras *, const char *);
+static int archive_compression(mportInstance *, const mportCreateExtras *, mportCompression *, int *, int *);
 
 static int archive_metafiles(mportBundleWrite *, mportPackageMeta *, mportCreateExtras *);
 
-static int archive_assetlistfiles(mportBundleWrite *, mportPackageMeta *, mportCreateExtras *, mportAssetList *);
+static int archive_assetlistfiles(mportBundleWrite *, mportPackageMeta *, mportCreateExtras *, mportAssetList *, bool, bool);
+
+static int hash_assetlistfiles(mportPackageMeta *, mportCreateExtras *, mportAssetList *);
+
+static int finish_stub_db(sqlite3 *, mportAssetList *, mportPackageMeta *, bool);
 
 static int clean_up(const char *);
 
@@ -81,18 +87,11 @@ mport_create_primative(mportInstance *mport, mportAssetList *assetlist, mportPac
 	if ((error_code = create_stub_db(mport, &db, tmpdir)) != MPORT_OK)
 		goto CLEANUP;
 
-	if ((error_code = insert_assetlist(db, assetlist, pack, extra)) != MPORT_OK)
-		goto CLEANUP;
-
 	if ((error_code = insert_meta(mport, db, pack, extra)) != MPORT_OK)
 		goto CLEANUP;
 
-	if (sqlite3_close(db) != SQLITE_OK) {
-		error_code = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-		goto CLEANUP;
-	}
-
-	error_code = archive_files(assetlist, pack, extra, tmpdir); /* cleanup will run next which is the desired action */
+	/* the assets go in the stub as they are archived, then the stub itself */
+	error_code = archive_files(mport, db, assetlist, pack, extra, tmpdir); /* cleanup will run next which is the desired action */
 
 	CLEANUP:
 	clean_up(tmpdir);
@@ -120,19 +119,16 @@ create_stub_db(mportInstance *mport, sqlite3 **db, const char *tmpdir)
 	return mport_generate_stub_schema(mport, *db);
 }
 
+/*
+ * The assets, with the checksums hash_assetlistfiles() took, or that
+ * archive_assetlistfiles() took of the bytes it archived.
+ */
 static int
-insert_assetlist(sqlite3 *db, mportAssetList *assetlist, mportPackageMeta *pack, mportCreateExtras *extra)
+insert_assetlist(sqlite3 *db, mportAssetList *assetlist, mportPackageMeta *pack)
 {
 	mportAssetListEntry *e = NULL;
 	sqlite3_stmt *stmnt = NULL;
 	char sql[] = "INSERT INTO assets (pkg, type, data, checksum, owner, grp, mode) VALUES (?,?,?,?,?,?,?)";
-	char hash[65];
-	char file[FILENAME_MAX];
-	char cwd[FILENAME_MAX];
-	struct stat st;
-
-	strlcpy(cwd, extra->sourcedir, FILENAME_MAX);
-	strlcat(cwd, pack->prefix, FILENAME_MAX);
 
 	if (mport_db_prepare(db, &stmnt, sql) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
@@ -142,84 +138,24 @@ insert_assetlist(sqlite3 *db, mportAssetList *assetlist, mportPackageMeta *pack,
 		if (e->type == ASSET_COMMENT)
 			continue;
 
-		if (e->type == ASSET_CWD) {
-			strlcpy(cwd, extra->sourcedir, FILENAME_MAX);
-			if (e->data == NULL) {
-				strlcat(cwd, pack->prefix, FILENAME_MAX);
-			} else {
-				strlcat(cwd, e->data, FILENAME_MAX);
-			}
-		}
-
-		if (sqlite3_bind_text(stmnt, 1, pack->name, -1, SQLITE_STATIC) != SQLITE_OK) {
-			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-		}
-		if (sqlite3_bind_int(stmnt, 2, e->type) != SQLITE_OK) {
-			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-		}
-		if (sqlite3_bind_text(stmnt, 3, e->data, -1, SQLITE_STATIC) != SQLITE_OK) {
-			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-		}
-		// 4 is computed below
-		if (sqlite3_bind_text(stmnt, 5, e->owner, -1, SQLITE_STATIC) != SQLITE_OK) {
-			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-		}
-		if (sqlite3_bind_text(stmnt, 6, e->group, -1, SQLITE_STATIC) != SQLITE_OK) {
-			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-		}
-		if (sqlite3_bind_text(stmnt, 7, e->mode, -1, SQLITE_STATIC) != SQLITE_OK) {
-			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-		}
-
-		if (e->type == ASSET_FILE || e->type == ASSET_SAMPLE || e->type == ASSET_SHELL ||
-		    e->type == ASSET_FILE_OWNER_MODE || e->type == ASSET_SAMPLE_OWNER_MODE) {
-			/* Don't prepend cwd onto absolute file paths (this is useful for update) */
-			if (e->data[0] == '/') {
-				(void) snprintf(file, FILENAME_MAX, "%s%s", extra->sourcedir, e->data);
-			} else {
-				(void) snprintf(file, FILENAME_MAX, "%s/%s", cwd, e->data);
-			}
-
-			if (e->type == ASSET_SAMPLE || e->type == ASSET_SAMPLE_OWNER_MODE) {
-				for (int ch = 0; ch < FILENAME_MAX; ch++) {
-					if (file[ch] == '\0')
-						break;
-					if (file[ch] == ' ' || file[ch] == '\t')
-						file[ch] = '\0';
-				}
-			}
-
-			if (lstat(file, &st) != 0) {
-				// if we have a backup, we can safely ignore some missing files
-				if (extra->is_backup) {
-					// hack: mark it as a comment, so it gets ignored later
-					e->type = ASSET_COMMENT;
-					goto reset;
-				}
-				sqlite3_finalize(stmnt);
-				RETURN_ERRORX(MPORT_ERR_FATAL, "Could not stat %s: %s", file, strerror(errno));
-			}
-
-			if (S_ISREG(st.st_mode)) {
-				if (SHA256_File(file, hash) == NULL)
-					RETURN_ERRORX(MPORT_ERR_FATAL, "File not found: %s", file);
-
-				if (sqlite3_bind_text(stmnt, 4, hash, -1, SQLITE_STATIC) != SQLITE_OK)
-					RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-			} else {
-				sqlite3_bind_null(stmnt, 4);
-			}
-		} else {
-			if (sqlite3_bind_null(stmnt, 4) != SQLITE_OK) {
-				RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-			}
+		if (sqlite3_bind_text(stmnt, 1, pack->name, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_int(stmnt, 2, e->type) != SQLITE_OK ||
+		    sqlite3_bind_text(stmnt, 3, e->data, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(stmnt, 4, e->checksum, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(stmnt, 5, e->owner, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(stmnt, 6, e->group, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_bind_text(stmnt, 7, e->mode, -1, SQLITE_STATIC) != SQLITE_OK) {
+			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+			sqlite3_finalize(stmnt);
+			RETURN_CURRENT_ERROR;
 		}
 
 		if (sqlite3_step(stmnt) != SQLITE_DONE) {
-			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+			sqlite3_finalize(stmnt);
+			RETURN_CURRENT_ERROR;
 		}
 
-		reset:
 		sqlite3_clear_bindings(stmnt);
 		sqlite3_reset(stmnt);
 	}
@@ -507,33 +443,114 @@ insert_depends(sqlite3 *db, mportPackageMeta *pack, mportCreateExtras *extra)
 }
 
 
+/*
+ * How to compress: what extra asks for, else the bundle_compression
+ * settings, else xz at its default level on one thread.
+ */
+static int
+archive_compression(mportInstance *mport, const mportCreateExtras *extra, mportCompression *codec, int *level, int *threads)
+{
+	char *name;
+
+	*codec = extra->compression;
+	if (*codec == MPORT_COMPRESS_DEFAULT) {
+		*codec = MPORT_COMPRESS_XZ;
+		if ((name = mport_setting_lookup(mport, MPORT_SETTING_BUNDLE_COMPRESSION)) != NULL) {
+			int ret = mport_compression_parse(name, codec);
+
+			free(name);
+			if (ret != MPORT_OK)
+				RETURN_CURRENT_ERROR;
+		}
+	}
+
+	*level = extra->compression_level;
+	if (*level == 0)
+		*level = mport_setting_get_int(mport, MPORT_SETTING_BUNDLE_COMPRESSION_LEVEL, 0);
+
+	/* the setting's 0 is one per CPU, as libarchive has it */
+	*threads = extra->compression_threads;
+	if (*threads == 0)
+		*threads = mport_setting_get_int(mport, MPORT_SETTING_BUNDLE_COMPRESSION_THREADS, 1);
+	else if (*threads == MPORT_COMPRESS_THREADS_AUTO)
+		*threads = 0;
+
+	return MPORT_OK;
+}
+
+/* the assets, the bundle version, and db closed, ready to be archived */
+static int
+finish_stub_db(sqlite3 *db, mportAssetList *assetlist, mportPackageMeta *pack, bool chunks)
+{
+
+	if (insert_assetlist(db, assetlist, pack) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (mport_stub_bundle_version(db, chunks) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (sqlite3_close(db) != SQLITE_OK)
+		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+
+	return MPORT_OK;
+}
+
+/*
+ * Archive everything, and close db once the assets are in it.  A plain
+ * bundle is compressed as it is written, so +CONTENTS.db, which ALWAYS
+ * GOES FIRST, needs the checksums before any file is archived: each file
+ * is hashed, then read again to archive it.  A chunked bundle keeps its
+ * meta files aside until the end, so each file is read once, its
+ * checksum taken as it is archived, and the stub put first last.
+ */
 static int
-archive_files(mportAssetList *assetlist, mportPackageMeta *pack, mportCreateExtras *extra, const char *tmpdir)
+archive_files(mportInstance *mport, sqlite3 *db, mportAssetList *assetlist, mportPackageMeta *pack, mportCreateExtras *extra, const char *tmpdir)
 {
 	mportBundleWrite *bundle;
 	char filename[FILENAME_MAX];
+	mportCompression codec;
+	int level, threads;
+	bool dedup, chunks;
+
+	if (archive_compression(mport, extra, &codec, &level, &threads) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+	dedup = extra->dedup || mport_setting_get_int(mport, MPORT_SETTING_BUNDLE_DEDUP, 0) != 0;
+	/* chunks make a version 6 bundle, which older mports refuse */
+	chunks = extra->chunks || mport_setting_get_int(mport, MPORT_SETTING_BUNDLE_CHUNKS, 0) != 0;
 
 	bundle = mport_bundle_write_new();
 
-	if (mport_bundle_write_init(bundle, extra->pkg_filename) != MPORT_OK)
+	if (mport_bundle_write_init_compressed(bundle, extra->pkg_filename, codec, level, threads, chunks) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
-	/* First step - +CONTENTS.db ALWAYS GOES FIRST!!! */
 	(void) snprintf(filename, FILENAME_MAX, "%s/%s", tmpdir, MPORT_STUB_DB_FILE);
-	if (mport_bundle_write_add_file(bundle, filename, MPORT_STUB_DB_FILE))
-		RETURN_CURRENT_ERROR;
+
+	/* First step - +CONTENTS.db ALWAYS GOES FIRST!!! */
+	if (!chunks) {
+		if (hash_assetlistfiles(pack, extra, assetlist) != MPORT_OK ||
+		    finish_stub_db(db, assetlist, pack, chunks) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+		if (mport_bundle_write_add_file(bundle, filename, MPORT_STUB_DB_FILE))
+			RETURN_CURRENT_ERROR;
+	}
 
 	/* second step - the meta files */
 	if (archive_metafiles(bundle, pack, extra) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
-	/* last step - the real files from the assetlist */
-	if (archive_assetlistfiles(bundle, pack, extra, assetlist) != MPORT_OK)
+	/* third step - the real files from the assetlist */
+	if (archive_assetlistfiles(bundle, pack, extra, assetlist, dedup, !chunks) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
-	mport_bundle_write_finish(bundle);
+	/* last step, if chunked - +CONTENTS.db, put ahead of the rest */
+	if (chunks) {
+		if (finish_stub_db(db, assetlist, pack, chunks) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+		if (mport_bundle_write_add_first(bundle, filename, MPORT_STUB_DB_FILE))
+			RETURN_CURRENT_ERROR;
+	}
 
-	return MPORT_OK;
+	return mport_bundle_write_finish(bundle);
 }
 
 
@@ -572,48 +589,255 @@ archive_metafiles(mportBundleWrite *bundle, mportPackageMeta *pack, mportCreateE
 	return MPORT_OK;
 }
 
+/*
+ * With dedup, files are hashed before they are archived, and one with the
+ * content of a file already archived is archived as a hard link to it.
+ * Installed, they share an inode, so only files that would be installed
+ * alike are linked: plain files in the same @cwd, with the same owner,
+ * group and mode both on disk and in the plist.
+ */
+struct dedup_node {
+	const mportAssetListEntry *e;	/* the first file with the content */
+	const char *cwd;
+	struct stat st;
+	char hash[];			/* the ohash key */
+};
+
+static void *
+dedup_calloc(size_t s, void *data)
+{
+
+	return calloc(1, s);
+}
+
+static void
+dedup_free(void *p, size_t s, void *data)
+{
+
+	free(p);
+}
+
+static void *
+dedup_alloc(size_t s, void *data)
+{
+
+	return malloc(s);
+}
+
+static struct ohash_info dedup_info = {
+	offsetof(struct dedup_node, hash), NULL, dedup_calloc, dedup_free, dedup_alloc
+};
+
+static bool
+dedup_same(const char *a, const char *b)
+{
+
+	return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static bool
+dedup_candidate(const mportAssetListEntry *e, const struct stat *st)
+{
+
+	return (e->type == ASSET_FILE || e->type == ASSET_FILE_OWNER_MODE) && *e->data != '/' &&
+	    S_ISREG(st->st_mode) && st->st_nlink == 1 && st->st_size > 0;
+}
+
+static int
+archive_dedup(mportBundleWrite *bundle, struct ohash *content, const char *filename, const char *cwd,
+              const mportAssetListEntry *e, const struct stat *st, const char *hash)
+{
+	struct dedup_node *node;
+	const char *end = NULL;
+	unsigned int slot;
+
+	slot = ohash_qlookupi(content, hash, &end);
+	if ((node = ohash_find(content, slot)) != NULL) {
+		if (node->st.st_size == st->st_size && node->st.st_mode == st->st_mode &&
+		    node->st.st_uid == st->st_uid && node->st.st_gid == st->st_gid &&
+		    strcmp(node->cwd, cwd) == 0 && node->e->type == e->type &&
+		    dedup_same(node->e->owner, e->owner) && dedup_same(node->e->group, e->group) &&
+		    dedup_same(node->e->mode, e->mode))
+			return mport_bundle_write_add_link(bundle, filename, e->data, node->e->data);
+	} else if ((node = ohash_create_entry(&dedup_info, hash, &end)) != NULL) {
+		/* without memory for it, the content just isn't shared */
+		node->e = e;
+		node->cwd = cwd;
+		node->st = *st;
+		ohash_insert(content, slot, node);
+	}
+
+	return mport_bundle_write_add_file(bundle, filename, e->data);
+}
+
+/*
+ * The file on disk that e, in @cwd cwd, is archived from, or false if it
+ * isn't one of the assets with a file.
+ */
+static bool
+asset_source(const mportCreateExtras *extra, const char *cwd, const mportAssetListEntry *e, char *filename)
+{
+
+	if (e->type != ASSET_FILE && e->type != ASSET_SAMPLE && e->type != ASSET_SAMPLE_OWNER_MODE &&
+	    e->type != ASSET_SHELL && e->type != ASSET_FILE_OWNER_MODE) {
+		return false;
+	}
+
+	/* don't prepend the cwd if the path is abs. */
+	if (*(e->data) == '/') {
+		(void) snprintf(filename, FILENAME_MAX, "%s%s", extra->sourcedir, e->data);
+	} else {
+		(void) snprintf(filename, FILENAME_MAX, "%s/%s/%s", extra->sourcedir, cwd, e->data);
+	}
+
+	if (e->type == ASSET_SAMPLE || e->type == ASSET_SAMPLE_OWNER_MODE) {
+		// eat the second filename if it exists.
+		for (int ch = 0; ch < FILENAME_MAX; ch++) {
+			if (filename[ch] == '\0')
+				break;
+			if (filename[ch] == ' ' || filename[ch] == '\t') {
+				filename[ch] = '\0';
+				break;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* lstat the source of e; false, with the error set, if the bundle can't do without it */
+static bool
+asset_stat(const mportCreateExtras *extra, mportAssetListEntry *e, const char *filename, struct stat *st, int *ret)
+{
+
+	if (lstat(filename, st) == 0)
+		return true;
+
+	// if we have a backup, we can safely ignore some missing files
+	if (extra->is_backup) {
+		// hack: mark it as a comment, so it gets ignored later
+		e->type = ASSET_COMMENT;
+		*ret = MPORT_OK;
+	} else {
+		*ret = SET_ERRORX(MPORT_ERR_FATAL, "Could not stat %s: %s", filename, strerror(errno));
+	}
+
+	return false;
+}
+
+/* keep hash as e's checksum, in the default algorithm for new checksums */
+static int
+asset_checksum(mportAssetListEntry *e, const char *hash)
+{
+
+	free(e->checksum);
+	e->checksum = NULL;
+	if (hash[0] != '\0' && (e->checksum = strdup(hash)) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	return MPORT_OK;
+}
+
+/* the checksum of each regular file, ahead of archiving them */
 static int
-archive_assetlistfiles(mportBundleWrite *bundle, mportPackageMeta *pack, mportCreateExtras *extra,
-                       mportAssetList *assetlist)
+hash_assetlistfiles(mportPackageMeta *pack, mportCreateExtras *extra, mportAssetList *assetlist)
 {
 	mportAssetListEntry *e = NULL;
 	char filename[FILENAME_MAX];
+	char hash[MPORT_CHECKSUM_MAX];
 	char *cwd = pack->prefix;
+	struct stat st;
+	int ret = MPORT_OK;
 
 	STAILQ_FOREACH(e, assetlist, next)
 	{
 		if (e->type == ASSET_CWD)
 			cwd = e->data == NULL ? pack->prefix : e->data;
 
-		if (e->type != ASSET_FILE && e->type != ASSET_SAMPLE && e->type != ASSET_SAMPLE_OWNER_MODE &&
-		    e->type != ASSET_SHELL && e->type != ASSET_FILE_OWNER_MODE) {
+		if (!asset_source(extra, cwd, e, filename))
+			continue;
+
+		if (!asset_stat(extra, e, filename, &st, &ret)) {
+			if (ret != MPORT_OK)
+				break;
 			continue;
 		}
 
-		/* don't prepend the cwd if the path is abs. */
-		if (*(e->data) == '/') {
-			(void) snprintf(filename, FILENAME_MAX, "%s%s", extra->sourcedir, e->data);
-		} else {
-			(void) snprintf(filename, FILENAME_MAX, "%s/%s/%s", extra->sourcedir, cwd, e->data);
+		hash[0] = '\0';
+		if (S_ISREG(st.st_mode) && !mport_checksum_file(filename, NULL, hash)) {
+			ret = SET_ERRORX(MPORT_ERR_FATAL, "Unable to read %s: %s", filename, strerror(errno));
+			break;
 		}
 
-		if (e->type == ASSET_SAMPLE || e->type == ASSET_SAMPLE_OWNER_MODE) {
-			// eat the second filename if it exists.
-			for (int ch = 0; ch < FILENAME_MAX; ch++) {
-				if (filename[ch] == '\0')
-					break;
-				if (filename[ch] == ' ' || filename[ch] == '\t') {
-					filename[ch] = '\0';
-					break;
-				}
+		if ((ret = asset_checksum(e, hash)) != MPORT_OK)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * The files, hashed as they are archived unless hashed says
+ * hash_assetlistfiles() has been over them already.
+ */
+static int
+archive_assetlistfiles(mportBundleWrite *bundle, mportPackageMeta *pack, mportCreateExtras *extra,
+                       mportAssetList *assetlist, bool dedup, bool hashed)
+{
+	mportAssetListEntry *e = NULL;
+	char filename[FILENAME_MAX];
+	char hash[MPORT_CHECKSUM_MAX];
+	char *cwd = pack->prefix;
+	struct stat st;
+	struct ohash content;
+	struct dedup_node *node;
+	unsigned int i;
+	int ret = MPORT_OK;
+
+	if (dedup)
+		ohash_init(&content, 6, &dedup_info);
+
+	STAILQ_FOREACH(e, assetlist, next)
+	{
+		if (e->type == ASSET_CWD)
+			cwd = e->data == NULL ? pack->prefix : e->data;
+
+		if (!asset_source(extra, cwd, e, filename))
+			continue;
+
+		if (!asset_stat(extra, e, filename, &st, &ret)) {
+			if (ret != MPORT_OK)
+				break;
+			continue;
+		}
+
+		if (dedup && dedup_candidate(e, &st)) {
+			if (hashed && e->checksum != NULL) {
+				(void) strlcpy(hash, e->checksum, sizeof(hash));
+			} else if (!mport_checksum_file(filename, NULL, hash)) {
+				ret = SET_ERRORX(MPORT_ERR_FATAL, "Unable to read %s: %s", filename, strerror(errno));
+				break;
 			}
+			ret = archive_dedup(bundle, &content, filename, cwd, e, &st, hash);
+		} else if (hashed) {
+			ret = mport_bundle_write_add_file(bundle, filename, e->data);
+		} else {
+			ret = mport_bundle_write_add_file_hashed(bundle, filename, e->data, hash);
 		}
+		if (ret != MPORT_OK)
+			break;
 
-		if (mport_bundle_write_add_file(bundle, filename, e->data) != MPORT_OK)
-			RETURN_CURRENT_ERROR;
+		if (!hashed && (ret = asset_checksum(e, hash)) != MPORT_OK)
+			break;
 	}
 
-	return MPORT_OK;
+	if (dedup) {
+		for (node = ohash_first(&content, &i); node != NULL; node = ohash_next(&content, &i))
+			free(node);
+		ohash_delete(&content);
+	}
+
+	return ret;
 }
 
 
@@ -0,0 +1,354 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The mportd protocol.  A client connects to the daemon's socket and sends
+ * one message: MPORT_DAEMON_MAGIC and then the command's arguments, each
+ * NUL terminated, with its stdout and stderr passed along as SCM_RIGHTS.
+ * The daemon answers with an int32_t: MPORT_DAEMON_DECLINED if the client
+ * should run the command itself, or MPORT_DAEMON_ACCEPTED before it writes
+ * anything, and then, once the command has run writing straight to those,
+ * its exit status.  A client that hears neither within MPORT_DAEMON_TIMEOUT
+ * runs the command itself.  A SOCK_SEQPACKET socket keeps each message in
+ * one piece, so neither side needs framing of its own.
+ */
+
+#define MPORT_DAEMON_MAGIC "mportd/1"
+#define MPORT_DAEMON_TIMEOUT 5 /* seconds for a request, or for the daemon to take it */
+#define MPORT_DAEMON_FDS_MAX 8 /* descriptors a request can carry, to be seen and closed */
+
+static int
+daemon_address(struct sockaddr_un *sun, const char *path)
+{
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlcpy(sun->sun_path, path, sizeof(sun->sun_path)) >= sizeof(sun->sun_path))
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Socket path too long: %s", path);
+
+	return (MPORT_OK);
+}
+
+/*
+ * mport_daemon_request(path, argc, argv, status)
+ *
+ * Have the mportd listening on path run argv, writing to this process's
+ * stdout and stderr.  Returns MPORT_OK with the command's exit status in
+ * *status, or MPORT_ERR_WARN if no daemon took the request, in time or
+ * at all, in which case the caller runs it itself.  Once the daemon has
+ * accepted the request it is its; a daemon that goes away before the
+ * status is MPORT_ERR_FATAL, as some of the output may have been written
+ * already.
+ */
+MPORT_PUBLIC_API int
+mport_daemon_request(const char *path, int argc, char *const argv[], int *status)
+{
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct timeval tv = { MPORT_DAEMON_TIMEOUT, 0 };
+	char buf[MPORT_DAEMON_REQUEST_MAX];
+	char control[CMSG_SPACE(2 * sizeof(int))];
+	size_t len;
+	int32_t result;
+	ssize_t got;
+	int fd, fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+
+	if (argc < 1 || argc > MPORT_DAEMON_ARGS_MAX)
+		RETURN_ERRORX(MPORT_ERR_WARN, "mportd takes 1 to %d arguments", MPORT_DAEMON_ARGS_MAX);
+
+	len = strlcpy(buf, MPORT_DAEMON_MAGIC, sizeof(buf)) + 1;
+	for (int i = 0; i < argc; i++) {
+		size_t n = strlen(argv[i]) + 1;
+
+		if (len + n > sizeof(buf))
+			RETURN_ERROR(MPORT_ERR_WARN, "Command too long for mportd");
+		memcpy(buf + len, argv[i], n);
+		len += n;
+	}
+
+	if (daemon_address(&sun, path) != MPORT_OK)
+		return (MPORT_ERR_WARN);
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1)
+		RETURN_ERRORX(MPORT_ERR_WARN, "socket: %s", strerror(errno));
+
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		close(fd);
+		RETURN_ERRORX(MPORT_ERR_WARN, "No mportd at %s: %s", path, strerror(errno));
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)len) {
+		close(fd);
+		RETURN_ERRORX(MPORT_ERR_WARN, "Couldn't send to mportd: %s", strerror(errno));
+	}
+
+	/* a daemon that is stuck, or stopped, doesn't get to hold the command up */
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	do {
+		got = recv(fd, &result, sizeof(result), 0);
+	} while (got == -1 && errno == EINTR);
+
+	if (got != sizeof(result) || result != MPORT_DAEMON_ACCEPTED) {
+		close(fd);
+		if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			RETURN_ERROR(MPORT_ERR_WARN, "mportd didn't answer in time");
+		if (got == sizeof(result) && result == MPORT_DAEMON_DECLINED)
+			RETURN_ERROR(MPORT_ERR_WARN, "mportd declined the request");
+		RETURN_ERROR(MPORT_ERR_WARN, "mportd went away without taking the request");
+	}
+
+	/* the command is running, for as long as it takes */
+	tv.tv_sec = 0;
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	do {
+		got = recv(fd, &result, sizeof(result), 0);
+	} while (got == -1 && errno == EINTR);
+	close(fd);
+
+	if (got != sizeof(result))
+		RETURN_ERROR(MPORT_ERR_FATAL, "mportd went away without answering");
+
+	*status = result;
+
+	return (MPORT_OK);
+}
+
+/*
+ * mport_daemon_listen(path, gid)
+ *
+ * The daemon's listening socket on path, replacing one left behind by a
+ * daemon that is no longer running, or -1.  Only root and group gid, or
+ * the daemon's own group for (gid_t)-1, may connect.
+ */
+int
+mport_daemon_listen(const char *path, gid_t gid)
+{
+	struct sockaddr_un sun;
+	int fd, probe;
+
+	if (daemon_address(&sun, path) != MPORT_OK)
+		return (-1);
+
+	/* a socket someone still answers on belongs to a running daemon */
+	if ((probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) != -1) {
+		if (connect(probe, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+			close(probe);
+			SET_ERRORX(MPORT_ERR_FATAL, "mportd is already running on %s", path);
+			return (-1);
+		}
+		close(probe);
+	}
+	(void)unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+		SET_ERRORX(MPORT_ERR_FATAL, "socket: %s", strerror(errno));
+		return (-1);
+	}
+
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1 || chmod(path, 0660) == -1 ||
+	    (gid != (gid_t)-1 && chown(path, (uid_t)-1, gid) == -1) || listen(fd, 64) == -1) {
+		SET_ERRORX(MPORT_ERR_FATAL, "Couldn't listen on %s: %s", path, strerror(errno));
+		close(fd);
+		return (-1);
+	}
+
+	return (fd);
+}
+
+/*
+ * mport_daemon_accept(listenfd, req)
+ *
+ * Wait for the next client.  Nothing of the request is read, so a client
+ * that never sends one can't hold the caller up: whoever serves it reads
+ * it with mport_daemon_receive(), or answers MPORT_DAEMON_DECLINED
+ * unread, and then closes it with mport_daemon_done().
+ */
+int
+mport_daemon_accept(int listenfd, mportDaemonRequest *req)
+{
+
+	memset(req, 0, sizeof(*req));
+	req->out = req->err = -1;
+
+	if ((req->sock = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+		if (errno == EINTR)
+			RETURN_ERROR(MPORT_ERR_WARN, "Interrupted");
+		RETURN_ERRORX(MPORT_ERR_FATAL, "accept: %s", strerror(errno));
+	}
+
+	return (MPORT_OK);
+}
+
+/*
+ * mport_daemon_receive(req)
+ *
+ * Read the request of the client mport_daemon_accept() took, waiting at
+ * most MPORT_DAEMON_TIMEOUT; MPORT_ERR_WARN for one that was malformed or
+ * never came, which is just closed.
+ */
+int
+mport_daemon_receive(mportDaemonRequest *req)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct timeval tv = { MPORT_DAEMON_TIMEOUT, 0 };
+	char control[CMSG_SPACE(MPORT_DAEMON_FDS_MAX * sizeof(int))];
+	ssize_t len;
+	size_t off;
+	bool malformed = false;
+
+	(void)setsockopt(req->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (getpeereid(req->sock, &req->uid, &req->gid) == -1) {
+		mport_daemon_done(req);
+		RETURN_ERRORX(MPORT_ERR_WARN, "getpeereid: %s", strerror(errno));
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = req->buf;
+	iov.iov_len = sizeof(req->buf) - 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if ((len = recvmsg(req->sock, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+		mport_daemon_done(req);
+		RETURN_ERROR(MPORT_ERR_WARN, "No request");
+	}
+
+	/* one pair, stdout and stderr; anything else received is closed, and the request refused */
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		size_t nfds;
+		int fds[MPORT_DAEMON_FDS_MAX];
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (nfds > MPORT_DAEMON_FDS_MAX)
+			nfds = MPORT_DAEMON_FDS_MAX;
+		memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+
+		if (nfds == 2 && req->out == -1) {
+			req->out = fds[0];
+			req->err = fds[1];
+			continue;
+		}
+
+		for (size_t i = 0; i < nfds; i++)
+			close(fds[i]);
+		malformed = true;
+	}
+
+	if (malformed || req->out == -1 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+		mport_daemon_done(req);
+		RETURN_ERROR(MPORT_ERR_WARN, "Malformed request");
+	}
+
+	/* the magic, then the arguments; a message that doesn't end in NUL gets one */
+	req->buf[len] = '\0';
+	if (strcmp(req->buf, MPORT_DAEMON_MAGIC) != 0) {
+		mport_daemon_done(req);
+		RETURN_ERROR(MPORT_ERR_WARN, "Not an mportd request");
+	}
+
+	for (off = strlen(req->buf) + 1; off < (size_t)len && req->argc < MPORT_DAEMON_ARGS_MAX;
+	    off += strlen(req->buf + off) + 1)
+		req->argv[req->argc++] = req->buf + off;
+	req->argv[req->argc] = NULL;
+
+	if (req->argc == 0) {
+		mport_daemon_done(req);
+		RETURN_ERROR(MPORT_ERR_WARN, "Empty request");
+	}
+
+	return (MPORT_OK);
+}
+
+/*
+ * mport_daemon_reply(req, status)
+ *
+ * Tell the client MPORT_DAEMON_DECLINED, or MPORT_DAEMON_ACCEPTED and
+ * later how the command went.  An accept the client isn't there for any
+ * more fails, and the command must not run.
+ */
+int
+mport_daemon_reply(mportDaemonRequest *req, int status)
+{
+	int32_t result = status;
+
+	if (send(req->sock, &result, sizeof(result), MSG_NOSIGNAL) != sizeof(result))
+		RETURN_ERRORX(MPORT_ERR_WARN, "Couldn't answer the client: %s", strerror(errno));
+
+	return (MPORT_OK);
+}
+
+/* mport_daemon_done(req): close the request's socket and the client's descriptors */
+void
+mport_daemon_done(mportDaemonRequest *req)
+{
+
+	if (req->out != -1)
+		close(req->out);
+	if (req->err != -1)
+		close(req->err);
+	if (req->sock != -1)
+		close(req->sock);
+	req->out = req->err = req->sock = -1;
+}
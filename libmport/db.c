@@ -41,6 +41,51 @@ static int mport_upgrade_master_schema_6to7(sqlite3 *);
 static int mport_upgrade_master_schema_7to8(sqlite3 *);
 static int mport_upgrade_master_schema_8to9(sqlite3 *);
 static int mport_upgrade_master_schema_9to10(sqlite3 *);
+static int mport_upgrade_master_schema_10to11(sqlite3 *);
+static int mport_upgrade_master_schema_11to12(sqlite3 *);
+static int mport_upgrade_master_schema_12to13(sqlite3 *);
+static int mport_upgrade_master_schema_13to14(sqlite3 *);
+static int mport_upgrade_master_schema_14to15(sqlite3 *);
+static int mport_upgrade_master_schema_15to16(sqlite3 *);
+static bool db_backoff(int, int *);
+
+/*
+ * Whether to retry after sqlite returned code, sleeping first with an
+ * exponential backoff.  The busy timeout set on every instance already
+ * waits out ordinary locks; this is for what it doesn't cover, such as
+ * SQLITE_LOCKED or a busy handler that gave up to avoid a deadlock.
+ */
+static bool
+db_backoff(int code, int *attempt)
+{
+
+	if ((code & 0xff) != SQLITE_BUSY && (code & 0xff) != SQLITE_LOCKED)
+		return false;
+
+	if (*attempt >= MPORT_DB_RETRIES)
+		return false;
+
+	usleep(10000U << *attempt);
+	(*attempt)++;
+
+	return true;
+}
+
+/* mport_db_step(sqlite3_stmt *stmt)
+ *
+ * sqlite3_step(), retrying with backoff while the database is busy.
+ */
+int
+mport_db_step(sqlite3_stmt *stmt)
+{
+	int attempt = 0;
+	int sqlcode;
+
+	while (db_backoff(sqlcode = sqlite3_step(stmt), &attempt))
+		sqlite3_reset(stmt);
+
+	return sqlcode;
+}
 
 /* mport_db_do(sqlite3 *db, const char *sql, ...)
  * 
@@ -65,24 +110,21 @@ mport_db_do(sqlite3 *db, const char *fmt, ...)
 	if (sql == NULL)
 		RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate memory for sql statement");
 
-	int sqlcode = sqlite3_exec(db, sql, 0, 0, 0);
+	int attempt = 0;
+	int sqlcode;
+
 	/* if we get an error code, we want to run it again in some cases */
-	if (sqlcode == SQLITE_BUSY || sqlcode == SQLITE_LOCKED) {
-		sleep(1);
-		if (sqlite3_exec(db, sql, 0, 0, 0) != SQLITE_OK) {
-			err = (char *) sqlite3_errmsg(db);
-			result = MPORT_ERR_FATAL;
-		}
-	} else if (sqlcode != SQLITE_OK) {
+	while (db_backoff(sqlcode = sqlite3_exec(db, sql, 0, 0, 0), &attempt))
+		;
+
+	if (sqlcode != SQLITE_OK) {
 		err = (char *) sqlite3_errmsg(db);
 		result = MPORT_ERR_FATAL;
+		SET_ERRORX(result, "sql error preparing '%s' : %s", sql, err);
 	}
 
 	sqlite3_free(sql);
 
-	if (result == MPORT_ERR_FATAL)
-		SET_ERRORX(result, "sql error preparing '%s' : %s", sql, err);
-
 	return result;
 }
 
@@ -108,22 +150,20 @@ mport_db_prepare(sqlite3 *db, sqlite3_stmt **stmt, const char *fmt, ...)
 	if (sql == NULL)
 		RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate memory for sql statement");
 
-	int sqlcode = sqlite3_prepare_v2(db, sql, -1, stmt, NULL);
-	if (sqlcode == SQLITE_BUSY || sqlcode == SQLITE_LOCKED) {
-		sleep(1);
-		if (sqlite3_prepare_v2(db, sql, -1, stmt, NULL) != SQLITE_OK) {
-			err = (char *) sqlite3_errmsg(db);
-			result = MPORT_ERR_FATAL;
-		}
-	} else if (sqlcode != SQLITE_OK) {
+	int attempt = 0;
+	int sqlcode;
+
+	while (db_backoff(sqlcode = sqlite3_prepare_v2(db, sql, -1, stmt, NULL), &attempt))
+		;
+
+	if (sqlcode != SQLITE_OK) {
 		err = (char *) sqlite3_errmsg(db);
 		result = MPORT_ERR_FATAL;
+		SET_ERRORX(result, "sql error preparing '%s' : %s", sql, err);
 	}
 
 	sqlite3_free(sql);
 
-	if (result == MPORT_ERR_FATAL)
-		SET_ERRORX(result, "sql error preparing '%s' : %s", sql, err);
 	return result;
 }
 
@@ -143,25 +183,24 @@ mport_db_count(sqlite3 *db, int *count, const char *fmt, ...)
 	if (sql == NULL)
 		RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate memory for sql statement");
 
-	sqlite3_stmt *stmt;
-	int sqlcode = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
-	if (sqlcode == SQLITE_BUSY || sqlcode == SQLITE_LOCKED) {
-		sleep(2);
-		if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-			err = (char *) sqlite3_errmsg(db);
-			result = MPORT_ERR_FATAL;
-		}
-	} else if (sqlcode != SQLITE_OK) {
+	sqlite3_stmt *stmt = NULL;
+	int attempt = 0;
+	int sqlcode;
+
+	while (db_backoff(sqlcode = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL), &attempt))
+		;
+
+	if (sqlcode != SQLITE_OK) {
 		err = (char *) sqlite3_errmsg(db);
 		result = MPORT_ERR_FATAL;
+		SET_ERRORX(result, "sql error preparing '%s' : %s", sql, err);
+		sqlite3_free(sql);
+		return result;
 	}
 
 	sqlite3_free(sql);
 
-	if (result == MPORT_ERR_FATAL)
-		SET_ERRORX(result, "sql error preparing '%s' : %s", sql, err);
-
-	if (sqlite3_step(stmt) != SQLITE_ROW) {
+	if (mport_db_step(stmt) != SQLITE_ROW) {
 		sqlite3_finalize(stmt);
 		return result;
 	}
@@ -207,6 +246,42 @@ mport_attach_stub_db(sqlite3 *db, const char *dir)
 }
 
 
+/* mport_attach_stub_db_mem(sqlite *db, unsigned char *buf, size_t len)
+ *
+ * Attaches a stub database image read from a bundle as 'stub', like
+ * mport_attach_stub_db() but without a file behind it.  The stub is
+ * read only, and buf must stay around until it is detached.
+ *
+ * Returns MPORT_OK on success.
+ */
+int
+mport_attach_stub_db_mem(sqlite3 *db, unsigned char *buf, size_t len)
+{
+	int rc;
+
+	/* header bytes 18 and 19 are 2 in WAL mode, which an image can't open */
+	if (len >= 100 && buf[18] == 2 && buf[19] == 2)
+		buf[18] = buf[19] = 1;
+
+	if (mport_db_do(db, "ATTACH ':memory:' AS stub") != MPORT_OK) {
+		/* it might be attached already on error */
+		if (mport_detach_stub_db(db) != MPORT_OK ||
+		    mport_db_do(db, "ATTACH ':memory:' AS stub") != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+	}
+
+	rc = sqlite3_deserialize(db, "stub", buf, (sqlite3_int64)len, (sqlite3_int64)len,
+	    SQLITE_DESERIALIZE_READONLY);
+	if (rc != SQLITE_OK) {
+		SET_ERRORX(MPORT_ERR_FATAL, "Couldn't load the stub database: %s", sqlite3_errstr(rc));
+		(void)mport_detach_stub_db(db);
+		RETURN_CURRENT_ERROR;
+	}
+
+	return (MPORT_OK);
+}
+
+
 /* mport_detach_stub_db(sqlite *db) 
  *
  * The inverse of mport_attach_stub_db().
@@ -244,7 +319,7 @@ mport_generate_stub_schema(mportInstance *mport, sqlite3 *db)
 	asprintf(&sql, "INSERT INTO meta VALUES (\"os_release\", \"%s\")", ptr);
 
 	RUN_SQL(db, "CREATE TABLE meta (field text NOT NULL, value text NOT NULL)");
-	RUN_SQL(db, "INSERT INTO meta VALUES (\"bundle_format_version\", " MPORT_BUNDLE_VERSION_STR ")");
+	RUN_SQL(db, "INSERT INTO meta VALUES (\"bundle_format_version\", " MPORT_BUNDLE_VERSION_PLAIN_STR ")");
 	RUN_SQL(db, sql);
 	RUN_SQL(db,
 	        "CREATE TABLE assets (pkg text not NULL, type int NOT NULL, data text, checksum text, owner text, grp text, mode text)");
@@ -259,6 +334,31 @@ mport_generate_stub_schema(mportInstance *mport, sqlite3 *db)
 	return (MPORT_OK);
 }
 
+/*
+ * mport_stub_bundle_version(db, chunked)
+ *
+ * Stamp the stub, once its assets are in, with the oldest bundle format
+ * that can read it: 6 if the bundle is chunked or any checksum has its
+ * algorithm's prefix, which readers from before 6 take for a bad hash,
+ * and otherwise the 5 mport_generate_stub_schema() left there.
+ */
+int
+mport_stub_bundle_version(sqlite3 *db, bool chunked)
+{
+	int prefixed = 0;
+
+	if (!chunked && mport_db_count(db, &prefixed,
+	    "SELECT COUNT(*) FROM assets WHERE instr(checksum, ':') > 0") != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (!chunked && prefixed == 0)
+		return (MPORT_OK);
+
+	RUN_SQL(db, "UPDATE meta SET value=" MPORT_BUNDLE_VERSION_STR " WHERE field='bundle_format_version'");
+
+	return (MPORT_OK);
+}
+
 int
 mport_upgrade_master_schema(sqlite3 *db, int databaseVersion)
 {
@@ -274,6 +374,12 @@ mport_upgrade_master_schema(sqlite3 *db, int databaseVersion)
 			mport_upgrade_master_schema_6to7(db);
 			mport_upgrade_master_schema_7to8(db);
 			mport_upgrade_master_schema_8to9(db);
+			mport_upgrade_master_schema_10to11(db);
+			mport_upgrade_master_schema_11to12(db);
+			mport_upgrade_master_schema_12to13(db);
+			mport_upgrade_master_schema_13to14(db);
+			mport_upgrade_master_schema_14to15(db);
+			mport_upgrade_master_schema_15to16(db);
 			mport_set_database_version(db);
 			break;
 		case 2:
@@ -299,8 +405,26 @@ mport_upgrade_master_schema(sqlite3 *db, int databaseVersion)
 		case 9:
 			/* falls through */
 	        mport_upgrade_master_schema_9to10(db);
-			mport_set_database_version(db);
 		case 10:
+			/* falls through */
+			mport_upgrade_master_schema_10to11(db);
+		case 11:
+			/* falls through */
+			mport_upgrade_master_schema_11to12(db);
+		case 12:
+			/* falls through */
+			mport_upgrade_master_schema_12to13(db);
+		case 13:
+			/* falls through */
+			mport_upgrade_master_schema_13to14(db);
+		case 14:
+			/* falls through */
+			mport_upgrade_master_schema_14to15(db);
+		case 15:
+			/* falls through */
+			mport_upgrade_master_schema_15to16(db);
+			mport_set_database_version(db);
+		case 16:
 			break;
 		default:
 			RETURN_ERROR(MPORT_ERR_FATAL, "Invalid master database version");
@@ -394,12 +518,72 @@ mport_upgrade_master_schema_9to10(sqlite3 *db)
 	return (MPORT_OK);
 }
 
+static int
+mport_upgrade_master_schema_10to11(sqlite3 *db)
+{
+	RUN_SQL(db, "CREATE TABLE IF NOT EXISTS hash_cache (path text NOT NULL, size int64 NOT NULL, mtime int64 NOT NULL, ino int64 NOT NULL, hash text NOT NULL)");
+	RUN_SQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS hash_cache_path ON hash_cache (path)");
+
+	return (MPORT_OK);
+}
+
+/* version_key holds mport_version_key(version), so versions compare as plain text */
+static int
+mport_upgrade_master_schema_11to12(sqlite3 *db)
+{
+	RUN_SQL(db, "ALTER TABLE packages ADD COLUMN version_key text");
+	RUN_SQL(db, "UPDATE packages SET version_key = mport_version_key(version)");
+
+	return (MPORT_OK);
+}
+
+/* file path to owner lookups, for which and conflict checks */
+static int
+mport_upgrade_master_schema_12to13(sqlite3 *db)
+{
+	RUN_SQL(db, "CREATE INDEX IF NOT EXISTS assets_data ON assets (data)");
+
+	return (MPORT_OK);
+}
+
+/* the stat fingerprint of each installed file, see mport_fingerprint_matches() */
+static int
+mport_upgrade_master_schema_13to14(sqlite3 *db)
+{
+	RUN_SQL(db, "ALTER TABLE assets ADD COLUMN size int64");
+	RUN_SQL(db, "ALTER TABLE assets ADD COLUMN mtime int64");
+	RUN_SQL(db, "ALTER TABLE assets ADD COLUMN ino int64");
+
+	return (MPORT_OK);
+}
+
+/* the last hash mport verify checked for each file, see verify.c */
+static int
+mport_upgrade_master_schema_14to15(sqlite3 *db)
+{
+	RUN_SQL(db, "CREATE TABLE IF NOT EXISTS verify_ledger (pkg text NOT NULL, data text NOT NULL, size int64 NOT NULL, mtime int64 NOT NULL, ino int64 NOT NULL, hash text NOT NULL, verified int64 NOT NULL)");
+	RUN_SQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS verify_ledger_asset ON verify_ledger (pkg, data)");
+
+	return (MPORT_OK);
+}
+
+/* ctime joins the stat fingerprint, see mport_fingerprint_matches() */
+static int
+mport_upgrade_master_schema_15to16(sqlite3 *db)
+{
+	RUN_SQL(db, "ALTER TABLE assets ADD COLUMN ctime int64");
+	RUN_SQL(db, "ALTER TABLE hash_cache ADD COLUMN ctime int64");
+	RUN_SQL(db, "ALTER TABLE verify_ledger ADD COLUMN ctime int64");
+
+	return (MPORT_OK);
+}
+
 int
 mport_generate_master_schema(sqlite3 *db)
 {
 
 	RUN_SQL(db,
-	        "CREATE TABLE IF NOT EXISTS packages (pkg text NOT NULL, version text NOT NULL, origin text NOT NULL, prefix text NOT NULL, lang text, options text, status text default 'dirty', comment text, os_release text NOT NULL default '1.0', cpe text, locked int NOT NULL default '0', deprecated text default '', expiration_date int64 NOT NULL default '0', no_provide_shlib int default '0', flavor text default '', automatic int default '0', install_date int64 NOT NULL default '0', type int NOT NULL default '0')");
+	        "CREATE TABLE IF NOT EXISTS packages (pkg text NOT NULL, version text NOT NULL, origin text NOT NULL, prefix text NOT NULL, lang text, options text, status text default 'dirty', comment text, os_release text NOT NULL default '1.0', cpe text, locked int NOT NULL default '0', deprecated text default '', expiration_date int64 NOT NULL default '0', no_provide_shlib int default '0', flavor text default '', automatic int default '0', install_date int64 NOT NULL default '0', type int NOT NULL default '0', version_key text)");
 	RUN_SQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS packages_pkg ON packages (pkg)");
 	RUN_SQL(db, "CREATE INDEX IF NOT EXISTS packages_origin ON packages (origin)");
 
@@ -413,8 +597,9 @@ mport_generate_master_schema(sqlite3 *db)
 	RUN_SQL(db, "CREATE INDEX IF NOT EXISTS log_pkg ON log (pkg, version)");
 
 	RUN_SQL(db,
-	        "CREATE TABLE IF NOT EXISTS assets (pkg text NOT NULL, type int NOT NULL, data text, checksum text, owner text, grp text, mode text)");
+	        "CREATE TABLE IF NOT EXISTS assets (pkg text NOT NULL, type int NOT NULL, data text, checksum text, owner text, grp text, mode text, size int64, mtime int64, ino int64, ctime int64)");
 	RUN_SQL(db, "CREATE INDEX IF NOT EXISTS assets_pkg ON assets (pkg)");
+	RUN_SQL(db, "CREATE INDEX IF NOT EXISTS assets_data ON assets (data)");
 
 	RUN_SQL(db, "CREATE TABLE IF NOT EXISTS categories (pkg text NOT NULL, category text NOT NULL)");
 	RUN_SQL(db, "CREATE INDEX IF NOT EXISTS categories_pkg ON categories (pkg, category)");
@@ -422,6 +607,12 @@ mport_generate_master_schema(sqlite3 *db)
 	RUN_SQL(db, "CREATE TABLE IF NOT EXISTS settings (name text NOT NULL, val text NOT NULL)");
 	RUN_SQL(db, "CREATE INDEX IF NOT EXISTS settings_name ON settings (name)");
 
+	RUN_SQL(db, "CREATE TABLE IF NOT EXISTS hash_cache (path text NOT NULL, size int64 NOT NULL, mtime int64 NOT NULL, ino int64 NOT NULL, hash text NOT NULL, ctime int64)");
+	RUN_SQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS hash_cache_path ON hash_cache (path)");
+
+	RUN_SQL(db, "CREATE TABLE IF NOT EXISTS verify_ledger (pkg text NOT NULL, data text NOT NULL, size int64 NOT NULL, mtime int64 NOT NULL, ino int64 NOT NULL, hash text NOT NULL, verified int64 NOT NULL, ctime int64)");
+	RUN_SQL(db, "CREATE UNIQUE INDEX IF NOT EXISTS verify_ledger_asset ON verify_ledger (pkg, data)");
+
 	mport_set_database_version(db);
 
 	return (MPORT_OK);
@@ -34,8 +34,6 @@
 #include <errno.h>
 #include <string.h>
 #include <sqlite3.h>
-#include <md5.h>
-#include <sha256.h>
 #include <stdlib.h>
 #include <libgen.h>
 #include <syslog.h>
@@ -50,63 +48,81 @@ static int run_special_unexec(mportInstance *, mportPackageMeta *);
 static int run_pkg_deinstall(mportInstance *, mportPackageMeta *, const char *);
 static int delete_pkg_infra(mportInstance *, mportPackageMeta *);
 static int check_for_upwards_depends(mportInstance *, mportPackageMeta *);
+static int stop_services(mportInstance *, const char *);
+
+struct delete_batch;
+static int delete_one(mportInstance *, mportPackageMeta *, int, const struct mport_unchanged *, struct delete_batch *);
+static int delete_pkg(mportInstance *, mportPackageMeta *, int, const struct mport_unchanged *, struct delete_batch *);
+static void delete_batch_dir(struct delete_batch *, const char *, bool);
 
 MPORT_PUBLIC_API int
 mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force)
+{
+
+	return delete_one(mport, pack, force, NULL, NULL);
+}
+
+/*
+ * mport_delete_primative_except(mport, pack, force, unchanged)
+ *
+ * Delete pack, leaving the files in unchanged where they are: an update
+ * is about to install the same files again.  unchanged may be NULL.
+ */
+int
+mport_delete_primative_except(mportInstance *mport, mportPackageMeta *pack, int force,
+    const struct mport_unchanged *unchanged)
+{
+
+	return delete_one(mport, pack, force, unchanged, NULL);
+}
+
+/* delete_pkg(), as one traced phase */
+static int
+delete_one(mportInstance *mport, mportPackageMeta *pack, int force, const struct mport_unchanged *unchanged,
+    struct delete_batch *batch)
+{
+	int ret;
+
+	mport_trace_begin(mport, MPORT_TRACE_DELETE, pack->name);
+	ret = delete_pkg(mport, pack, force, unchanged, batch);
+	mport_trace_end(mport, MPORT_TRACE_DELETE, ret == MPORT_OK ? 1 : 0, 0, ret);
+
+	return (ret);
+}
+
+/*
+ * Delete one package.  Inside mport_delete_packages() (batch isn't NULL)
+ * the services were stopped and the progress bar started for the whole
+ * set, files are unlinked without being hashed first, directories are left
+ * for the end and the database rows are deleted for the set at once.
+ */
+static int
+delete_pkg(mportInstance *mport, mportPackageMeta *pack, int force, const struct mport_unchanged *unchanged,
+    struct delete_batch *batch)
 {
 	sqlite3_stmt *stmt;
-	int ret, current, total;
+	int ret, total;
 	mportAssetListEntryType type;
-	const char *data, *checksum, *cwd, *service, *rc_script;
+	const char *data, *checksum, *cwd;
 	struct stat st;
-	char hash[65];
+	char hash[MPORT_CHECKSUM_MAX];
 
 	if (force == 0) {
 		if (check_for_upwards_depends(mport, pack) != MPORT_OK)
 			RETURN_CURRENT_ERROR;
 	}
 
-	mport_call_progress_init_cb(mport, "Deleting %s-%s", pack->name, pack->version);
-
-	/* stop any services that might exist; this replaces @stopdaemon */
-	if (mport_db_prepare(mport->db, &stmt,
-		"select * from assets where data like '/usr/local/etc/rc.d/%%' and type=%i and pkg=%Q",
-		ASSET_FILE, pack->name) != MPORT_OK)
+	if (batch == NULL && stop_services(mport, pack->name) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
-	while (1) {
-		ret = sqlite3_step(stmt);
-		if (ret != SQLITE_ROW) {
-			break;
-		}
-
-		rc_script = sqlite3_column_text(stmt, 0);
-		if (rc_script == NULL)
-			continue;
-		service = basename((char *)rc_script);
-		if (mport_xsystem(mport, "/usr/sbin/service %s onestop", service) != 0) {
-			mport_call_msg_cb(mport, "Unable to stop service %s\n", service);
-		}
-	}
-
 	/* get the file count for the progress meter */
-	if (mport_db_prepare(mport->db, &stmt,
-		"SELECT COUNT(*) FROM assets WHERE (type=%i or type=%i or type=%i or type=%i or type=%i) AND pkg=%Q",
-		ASSET_FILE, ASSET_SAMPLE, ASSET_SAMPLE_OWNER_MODE, ASSET_SHELL,
-		ASSET_FILE_OWNER_MODE, pack->name) != MPORT_OK)
-		RETURN_CURRENT_ERROR;
-
-	switch (sqlite3_step(stmt)) {
-	case SQLITE_ROW:
-
-		total = sqlite3_column_int(stmt, 0) + 1;
-		current = 0;
-		sqlite3_finalize(stmt);
-		break;
-	default:
-		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-		sqlite3_finalize(stmt);
-		RETURN_CURRENT_ERROR;
+	if (batch == NULL) {
+		if (mport_db_count(mport->db, &total,
+			"SELECT COUNT(*) FROM assets WHERE (type=%i or type=%i or type=%i or type=%i or type=%i) AND pkg=%Q",
+			ASSET_FILE, ASSET_SAMPLE, ASSET_SAMPLE_OWNER_MODE, ASSET_SHELL,
+			ASSET_FILE_OWNER_MODE, pack->name) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+		total++; /* the database update */
 	}
 
 	if (mport_lock_islocked(pack) == MPORT_LOCKED) {
@@ -114,6 +130,9 @@ mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force)
 		RETURN_CURRENT_ERROR;
 	}
 
+	if (batch == NULL)
+		mport_progress_begin(mport, MPORT_PHASE_DELETE, total, "Deleting %s-%s", pack->name, pack->version);
+
 	if (mport_db_do(mport->db, "UPDATE packages SET status='dirty' WHERE pkg=%Q", pack->name) !=
 	    MPORT_OK)
 		RETURN_CURRENT_ERROR;
@@ -127,7 +146,7 @@ mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force)
 	if (run_pkg_deinstall(mport, pack, "DEINSTALL") != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
-	if (mport_db_prepare(mport->db, &stmt, "SELECT type,data,checksum FROM assets WHERE pkg=%Q",
+	if (mport_db_prepare(mport->db, &stmt, "SELECT type,data,checksum,size,mtime,ino,ctime FROM assets WHERE pkg=%Q",
 		pack->name) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
@@ -166,7 +185,7 @@ mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force)
 
 		switch (type) {
 		case ASSET_RMEMPTY:
-			(mport->progress_step_cb)(++current, total, file);
+			mport_progress_step(mport, 0, file);
 			if (lstat(file, &st) != 0) {
 				mport_call_msg_cb(
 				    mport, "Can't stat %s: %s", file, strerror(errno));
@@ -189,7 +208,7 @@ mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force)
 		case ASSET_SAMPLE:
 			/* falls through */
 		case ASSET_SAMPLE_OWNER_MODE:
-			(mport->progress_step_cb)(++current, total, file);
+			mport_progress_step(mport, 0, file);
 
 			if (lstat(file, &st) != 0) {
 				mport_call_msg_cb(
@@ -197,67 +216,46 @@ mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force)
 				break; /* next asset */
 			}
 
-			if (S_ISREG(st.st_mode)) {
+			/* the update brings the same file, no need to read or remove it */
+			if (S_ISREG(st.st_mode) && data != NULL && mport_unchanged_has(unchanged, data))
+				break;
+
+			/* a batch only reads a file to decide on the config made from a sample */
+			if (S_ISREG(st.st_mode) &&
+			    (batch == NULL || type == ASSET_SAMPLE || type == ASSET_SAMPLE_OWNER_MODE)) {
 				if (checksum == NULL) {
 					mport_call_msg_cb(mport, "Checksum mismatch: %s", file);
-				} else if (strlen(checksum) < 34) {
-					if (MD5File(file, hash) == NULL)
-						mport_call_msg_cb(mport, "Can't MD5 %s: %s", file,
-						    strerror(errno));
-
-					if (hash == NULL || strcmp(hash, checksum) != 0)
-						mport_call_msg_cb(
-						    mport, "Checksum mismatch: %s", file);
-				} else {
-					if (SHA256_File(file, hash) == NULL)
-						mport_call_msg_cb(mport, "Can't SHA256 %s: %s",
-						    file, strerror(errno));
-
-					if (hash == NULL || strcmp(hash, checksum) != 0)
-						mport_call_msg_cb(
-						    mport, "Checksum mismatch: %s", file);
+				} else if (mport_fingerprint_matches(mport, &st, stmt, 3)) {
+					/* untouched since the install, no need to read it */
+					(void) strlcpy(hash, checksum, sizeof(hash));
+				} else if (!mport_checksum_file(file, checksum, hash)) {
+					mport_call_msg_cb(mport, "Can't hash %s: %s", file, strerror(errno));
+					hash[0] = '\0';
+				} else if (strcmp(hash, checksum) != 0) {
+					mport_call_msg_cb(mport, "Checksum mismatch: %s", file);
 				}
 
-				if (type == ASSET_SAMPLE || type == ASSET_SAMPLE_OWNER_MODE) {
-					char sample_hash[65];
+				if (checksum != NULL && (type == ASSET_SAMPLE || type == ASSET_SAMPLE_OWNER_MODE)) {
+					char sample_hash[MPORT_CHECKSUM_MAX];
 					char nonSample[FILENAME_MAX];
 					strlcpy(nonSample, file, FILENAME_MAX);
 					char *sptr = strcasestr(nonSample, ".sample");
 					if (sptr != NULL) {
 						sptr[0] = '\0'; /* hack off .sample */
 
-						if (strlen(checksum) < 34) {
-							if (MD5File(nonSample, sample_hash) ==
-							    NULL) {
-								mport_call_msg_cb(mport,
-								    "Could not check file %s, review and remove manually.",
-								    nonSample);
-							} else if (strcmp(sample_hash, hash) == 0) {
-								if (unlink(nonSample) != 0)
-									mport_call_msg_cb(mport,
-									    "Could not unlink %s: %s",
-									    file, strerror(errno));
-							} else {
+						if (!mport_checksum_file(nonSample, checksum, sample_hash)) {
+							mport_call_msg_cb(mport,
+							    "Could not check file %s, review and remove manually.",
+							    nonSample);
+						} else if (strcmp(sample_hash, hash) == 0) {
+							if (unlink(nonSample) != 0)
 								mport_call_msg_cb(mport,
-								    "File does not match sample, remove file %s manually.",
-								    nonSample);
-							}
+								    "Could not unlink %s: %s",
+								    file, strerror(errno));
 						} else {
-							if (SHA256_File(nonSample, sample_hash) ==
-							    NULL) {
-								mport_call_msg_cb(mport,
-								    "Could not check file %s, review and remove manually.",
-								    nonSample);
-							} else if (strcmp(sample_hash, hash) == 0) {
-								if (unlink(nonSample) != 0)
-									mport_call_msg_cb(mport,
-									    "Could not unlink %s: %s",
-									    file, strerror(errno));
-							} else {
-								mport_call_msg_cb(mport,
-								    "File does not match sample, remove file %s manually.",
-								    nonSample);
-							}
+							mport_call_msg_cb(mport,
+							    "File does not match sample, remove file %s manually.",
+							    nonSample);
 						}
 					}
 				}
@@ -281,8 +279,8 @@ mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force)
 			}
 			break;
 		case ASSET_LDCONFIG:
-			if (mport_xsystem(mport,
-				"/usr/sbin/service ldconfig restart > /dev/null") != MPORT_OK) {
+			/* after the libraries are gone; in a batch, once at its end */
+			if (mport_trigger_run(mport, type, data) != MPORT_OK) {
 				mport_call_msg_cb(
 				    mport, "Could not run ldconfig: %s", mport_err_string());
 			}
@@ -291,7 +289,10 @@ mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force)
 		case ASSET_DIRRM:
 		case ASSET_DIRRMTRY:
 		case ASSET_DIR_OWNER_MODE:
-			if (mport_rmdir(file, type == ASSET_DIRRMTRY ? 1 : 0) != MPORT_OK) {
+			if (batch != NULL) {
+				/* once all of the set's files are gone */
+				delete_batch_dir(batch, file, type == ASSET_DIRRMTRY);
+			} else if (mport_rmdir(file, type == ASSET_DIRRMTRY ? 1 : 0) != MPORT_OK) {
 				mport_call_msg_cb(mport, "Could not remove directory '%s': %s",
 				    file, mport_err_string());
 			}
@@ -315,30 +316,46 @@ mport_delete_primative(mportInstance *mport, mportPackageMeta *pack, int force)
 	if (run_pkg_deinstall(mport, pack, "POST-DEINSTALL") != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
-	if (mport_db_do(mport->db, "BEGIN TRANSACTION") != MPORT_OK)
-		RETURN_CURRENT_ERROR;
-
-	if (mport_db_do(mport->db, "DELETE FROM assets WHERE pkg=%Q", pack->name) != MPORT_OK)
-		RETURN_CURRENT_ERROR;
+	if (batch != NULL) {
+		/* the rows go with the rest of the set's */
+		if (mport_db_do(mport->db, "UPDATE temp.delete_set SET done=1 WHERE pkg=%Q", pack->name) != MPORT_OK ||
+		    delete_pkg_infra(mport, pack) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
 
-	if (mport_db_do(mport->db, "DELETE FROM depends WHERE pkg=%Q", pack->name) != MPORT_OK)
-		RETURN_CURRENT_ERROR;
+		mport_pkgmeta_logevent(mport, pack, "Package deleted");
+		syslog(LOG_NOTICE, "%s-%s deinstalled", pack->name, pack->version);
 
-	if (mport_db_do(mport->db, "DELETE FROM packages WHERE pkg=%Q", pack->name) != MPORT_OK)
-		RETURN_CURRENT_ERROR;
+		return (MPORT_OK);
+	}
 
-	if (mport_db_do(mport->db, "DELETE FROM categories WHERE pkg=%Q", pack->name) != MPORT_OK)
+	/* a savepoint, so this nests inside mport_batch_begin() */
+	mport_trace_begin(mport, MPORT_TRACE_DB, pack->name);
+	if (mport_db_do(mport->db, "SAVEPOINT delete_pkg") != MPORT_OK) {
+		mport_trace_end(mport, MPORT_TRACE_DB, 0, 0, mport_err_code());
 		RETURN_CURRENT_ERROR;
+	}
 
-	if (delete_pkg_infra(mport, pack) != MPORT_OK)
+	if (mport_db_do(mport->db, "DELETE FROM assets WHERE pkg=%Q", pack->name) != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM depends WHERE pkg=%Q", pack->name) != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM packages WHERE pkg=%Q", pack->name) != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM categories WHERE pkg=%Q", pack->name) != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM verify_ledger WHERE pkg=%Q", pack->name) != MPORT_OK ||
+	    delete_pkg_infra(mport, pack) != MPORT_OK) {
+		(void) sqlite3_exec(mport->db, "ROLLBACK TO delete_pkg; RELEASE delete_pkg", NULL, NULL, NULL);
+		mport_trace_end(mport, MPORT_TRACE_DB, 0, 0, mport_err_code());
 		RETURN_CURRENT_ERROR;
+	}
 
-	if (mport_db_do(mport->db, "COMMIT TRANSACTION") != MPORT_OK)
+	if (mport_db_do(mport->db, "RELEASE delete_pkg") != MPORT_OK) {
+		mport_trace_end(mport, MPORT_TRACE_DB, 0, 0, mport_err_code());
 		RETURN_CURRENT_ERROR;
+	}
+	mport_trace_end(mport, MPORT_TRACE_DB, 1, 0, MPORT_OK);
+	mport_precheck_forget(mport, pack->name);
 
-	(mport->progress_step_cb)(++current, total, "DB Updated");
+	mport_progress_step(mport, 0, "DB Updated");
 
-	(mport->progress_free_cb)();
+	mport_progress_end(mport);
 
 	mport_pkgmeta_logevent(mport, pack, "Package deleted");
 	syslog(LOG_NOTICE, "%s-%s deinstalled", pack->name, pack->version);
@@ -384,22 +401,10 @@ run_unldconfig(mportInstance *mport, mportPackageMeta *pkg)
 
 		switch (type) {
 		case ASSET_LDCONFIG:
-			if (mport_xsystem(mport,
-				"/usr/sbin/service ldconfig restart > /dev/null") != MPORT_OK) {
-				goto UNLDCONFIG_ERROR;
-			}
-			break;
 		case ASSET_LDCONFIG_LINUX:
-			if (data == NULL) {
-				if (mport_xsystem(mport, "/compat/linux/sbin/ldconfig") !=
-				    MPORT_OK) {
-					goto UNLDCONFIG_ERROR;
-				}
-			} else {
-				if (mport_xsystem(mport, "%s/sbin/ldconfig", data) != MPORT_OK) {
-					goto UNLDCONFIG_ERROR;
-				}
-			}
+			/* once per batch, see trigger.c */
+			if (mport_trigger_run(mport, type, data) != MPORT_OK)
+				goto UNLDCONFIG_ERROR;
 			break;
 		default:
 			break;
@@ -453,19 +458,9 @@ run_special_unexec(mportInstance *mport, mportPackageMeta *pkg)
 
 		switch (type) {
 		case ASSET_GLIB_SCHEMAS:
-			if (mport_file_exists("/usr/local/bin/glib-compile-schemas") &&
-			    mport_xsystem(mport,
-				"/usr/local/bin/glib-compile-schemas %s/share/glib-2.0/schemas > /dev/null || true",
-				data == NULL ? pkg->prefix : data) != MPORT_OK) {
-				goto SPECIAL_ERROR;
-			}
-			break;
 		case ASSET_INFO:
-			if (mport_file_exists("/usr/local/bin/indexinfo") &&
-			    mport_xsystem(mport, "/usr/local/bin/indexinfo %s",
-				data == NULL ? pkg->prefix : data) != MPORT_OK) {
+			if (mport_trigger_run(mport, type, data == NULL ? pkg->prefix : data) != MPORT_OK)
 				goto SPECIAL_ERROR;
-			}
 			break;
 		case ASSET_KLD:
 			if (mport_xsystem(mport, "/usr/sbin/kldxref %s", data) != MPORT_OK) {
@@ -480,12 +475,8 @@ run_special_unexec(mportInstance *mport, mportPackageMeta *pkg)
 			}
 			break;
 		case ASSET_DESKTOP_FILE_UTILS:
-			if (mport_file_exists("/usr/local/bin/update-desktop-database") &&
-			    mport_xsystem(mport,
-				"/usr/local/bin/update-desktop-database -q > /dev/null || true") !=
-				MPORT_OK) {
+			if (mport_trigger_run(mport, type, NULL) != MPORT_OK)
 				goto SPECIAL_ERROR;
-			}
 			break;
 		default:
 			break;
@@ -568,8 +559,10 @@ run_pkg_deinstall(mportInstance *mport, mportPackageMeta *pack, const char *mode
 		if (chmod(file, 755) != 0)
 			RETURN_ERRORX(MPORT_ERR_FATAL, "chmod(%s, 755): %s", file, strerror(errno));
 
-		if ((ret = mport_xsystem(mport, "PKG_PREFIX=%s %s %s %s", pack->prefix, file,
-			 pack->name, mode)) != 0)
+		mport_trace_begin(mport, MPORT_TRACE_SCRIPT, pack->name);
+		ret = mport_xsystem(mport, "PKG_PREFIX=%s %s %s %s", pack->prefix, file, pack->name, mode);
+		mport_trace_end(mport, MPORT_TRACE_SCRIPT, 0, 0, ret == 0 ? MPORT_OK : MPORT_ERR_FATAL);
+		if (ret != 0)
 			RETURN_ERRORX(MPORT_ERR_FATAL, "%s %s returned non-zero: %i",
 			    MPORT_INSTALL_FILE, mode, ret);
 	}
@@ -653,3 +646,385 @@ check_for_upwards_depends(mportInstance *mport, mportPackageMeta *pack)
 	sqlite3_finalize(stmt);
 	return (MPORT_OK);
 }
+
+/*
+ * Stop the services a package installed, or the whole of
+ * mport_delete_packages() set if pkg is NULL; this replaces @stopdaemon.
+ */
+static int
+stop_services(mportInstance *mport, const char *pkg)
+{
+	sqlite3_stmt *stmt;
+	const char *service, *rc_script;
+	char script[FILENAME_MAX];
+
+	if (pkg != NULL) {
+		if (mport_db_prepare(mport->db, &stmt,
+			"select data from assets where data like '/usr/local/etc/rc.d/%%' and type=%i and pkg=%Q",
+			ASSET_FILE, pkg) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+	} else if (mport_db_prepare(mport->db, &stmt,
+		"select data from assets where data like '/usr/local/etc/rc.d/%%' and type=%i and "
+		"pkg in (select pkg from temp.delete_set)", ASSET_FILE) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		rc_script = sqlite3_column_text(stmt, 0);
+		if (rc_script == NULL)
+			continue;
+		(void)strlcpy(script, rc_script, sizeof(script));
+		service = basename(script);
+		if (mport_xsystem(mport, "/usr/sbin/service %s onestop", service) != 0) {
+			mport_call_msg_cb(mport, "Unable to stop service %s\n", service);
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	return (MPORT_OK);
+}
+
+
+/* What mport_delete_packages() holds for the whole set */
+struct delete_dir {
+	char *path;
+	bool try; /* every package listing it used @dirrmtry */
+};
+
+struct delete_batch {
+	struct delete_dir *dirs;
+	size_t ndirs;
+	size_t capdirs;
+	bool nomem;
+};
+
+struct delete_node {
+	mportPackageMeta *pack;
+	size_t *rdeps; /* members of the set that depend on this one */
+	size_t nrdeps;
+	size_t caprdeps;
+	int state; /* 0 unseen, 1 being ordered, 2 ordered */
+	size_t pos; /* in the order */
+	bool deleted;
+};
+
+static void
+delete_batch_dir(struct delete_batch *b, const char *path, bool try)
+{
+	struct delete_dir *grown;
+
+	if (b->ndirs == b->capdirs) {
+		b->capdirs = b->capdirs == 0 ? 64 : b->capdirs * 2;
+		if ((grown = realloc(b->dirs, b->capdirs * sizeof(struct delete_dir))) == NULL) {
+			b->nomem = true;
+			return;
+		}
+		b->dirs = grown;
+	}
+
+	if ((b->dirs[b->ndirs].path = strdup(path)) == NULL) {
+		b->nomem = true;
+		return;
+	}
+	b->dirs[b->ndirs++].try = try;
+}
+
+/* deepest first: a directory sorts after every path under it, so reverse it */
+static int
+delete_dir_cmp(const void *a, const void *b)
+{
+
+	return strcmp(((const struct delete_dir *)b)->path, ((const struct delete_dir *)a)->path);
+}
+
+/* remove the set's directories once each, children before parents */
+static void
+delete_batch_dirs(mportInstance *mport, struct delete_batch *b)
+{
+	size_t i, j;
+
+	qsort(b->dirs, b->ndirs, sizeof(struct delete_dir), delete_dir_cmp);
+
+	for (i = 0; i < b->ndirs; i = j) {
+		bool try = b->dirs[i].try;
+
+		for (j = i + 1; j < b->ndirs && strcmp(b->dirs[i].path, b->dirs[j].path) == 0; j++)
+			try = try && b->dirs[j].try;
+
+		if (mport_rmdir(b->dirs[i].path, try ? 1 : 0) != MPORT_OK)
+			mport_call_msg_cb(mport, "Could not remove directory '%s': %s", b->dirs[i].path,
+			    mport_err_string());
+	}
+
+	for (i = 0; i < b->ndirs; i++)
+		free(b->dirs[i].path);
+	free(b->dirs);
+}
+
+static int
+delete_node_cmp(const void *a, const void *b)
+{
+
+	return strcmp(((const struct delete_node *)a)->pack->name, ((const struct delete_node *)b)->pack->name);
+}
+
+static struct delete_node *
+delete_node_find(struct delete_node *nodes, size_t n, const char *name)
+{
+	mportPackageMeta key;
+	struct delete_node k;
+
+	key.name = (char *)name;
+	k.pack = &key;
+
+	return bsearch(&k, nodes, n, sizeof(struct delete_node), delete_node_cmp);
+}
+
+/* dependents before what they depend on; a cycle is cut where it is found */
+static void
+delete_order(struct delete_node *nodes, size_t i, size_t *order, size_t *norder)
+{
+
+	if (nodes[i].state != 0)
+		return;
+
+	nodes[i].state = 1;
+	for (size_t d = 0; d < nodes[i].nrdeps; d++)
+		delete_order(nodes, nodes[i].rdeps[d], order, norder);
+	nodes[i].state = 2;
+
+	nodes[i].pos = *norder;
+	order[(*norder)++] = i;
+}
+
+/* fill temp.delete_set, and nodes from packs with the edges between them */
+static int
+delete_load(mportInstance *mport, mportPackageMeta **packs, struct delete_node *nodes, size_t n)
+{
+	struct delete_node *from, *to;
+	sqlite3_stmt *stmt;
+	size_t *grown;
+	int step;
+
+	if (mport_db_do(mport->db,
+		"CREATE TEMP TABLE IF NOT EXISTS delete_set (pkg text PRIMARY KEY, done int NOT NULL DEFAULT 0)") != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM temp.delete_set") != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (mport_db_prepare(mport->db, &stmt, "INSERT OR IGNORE INTO temp.delete_set (pkg) VALUES (?)") != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	for (size_t i = 0; i < n; i++) {
+		nodes[i].pack = packs[i];
+		if (sqlite3_bind_text(stmt, 1, packs[i]->name, -1, SQLITE_STATIC) != SQLITE_OK ||
+		    sqlite3_step(stmt) != SQLITE_DONE) {
+			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+			sqlite3_finalize(stmt);
+			RETURN_CURRENT_ERROR;
+		}
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+
+	qsort(nodes, n, sizeof(struct delete_node), delete_node_cmp);
+
+	if (mport_db_prepare(mport->db, &stmt,
+		"SELECT pkg, depend_pkgname FROM depends WHERE pkg IN (SELECT pkg FROM temp.delete_set) "
+		"AND depend_pkgname IN (SELECT pkg FROM temp.delete_set)") != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+		from = delete_node_find(nodes, n, (const char *)sqlite3_column_text(stmt, 0));
+		to = delete_node_find(nodes, n, (const char *)sqlite3_column_text(stmt, 1));
+		if (from == NULL || to == NULL || from == to)
+			continue;
+
+		if (to->nrdeps == to->caprdeps) {
+			to->caprdeps = to->caprdeps == 0 ? 4 : to->caprdeps * 2;
+			if ((grown = realloc(to->rdeps, to->caprdeps * sizeof(size_t))) == NULL) {
+				sqlite3_finalize(stmt);
+				RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+			}
+			to->rdeps = grown;
+		}
+		to->rdeps[to->nrdeps++] = (size_t)(from - nodes);
+	}
+	if (step != SQLITE_DONE) {
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+		sqlite3_finalize(stmt);
+		RETURN_CURRENT_ERROR;
+	}
+	sqlite3_finalize(stmt);
+
+	return (MPORT_OK);
+}
+
+/* unless forced, nothing outside the set may depend on what is in it */
+static int
+delete_check_outside(mportInstance *mport)
+{
+	sqlite3_stmt *stmt;
+	int ret = MPORT_OK;
+
+	if (mport_db_prepare(mport->db, &stmt,
+		"SELECT depend_pkgname, pkg FROM depends WHERE depend_pkgname IN (SELECT pkg FROM temp.delete_set) "
+		"AND pkg NOT IN (SELECT pkg FROM temp.delete_set) LIMIT 1") != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	switch (sqlite3_step(stmt)) {
+	case SQLITE_ROW:
+		ret = SET_ERRORX(MPORT_ERR_FATAL, "%s is depended on by %s, which is not being deleted.",
+		    sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 1));
+		break;
+	case SQLITE_DONE:
+		break;
+	default:
+		ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	}
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+/*
+ * mport_delete_packages(mport, packs, force)
+ *
+ * Delete a set of installed packages (NULL terminated), such as everything
+ * installed or what autoremove found.  The order is worked out once, so a
+ * package goes before everything it depends on, and services are stopped,
+ * files removed and the database updated for the whole set in one
+ * transaction.  Directories are removed at the end, once each however many
+ * packages list them.  Files are not hashed before removal as they are by
+ * mport_delete_primative(), except samples.
+ *
+ * A package that fails to delete keeps everything in the set it depends on,
+ * and the rest carry on.  Unless force is set, the whole set is refused if
+ * a package outside it depends on one in it.
+ */
+MPORT_PUBLIC_API int
+mport_delete_packages(mportInstance *mport, mportPackageMeta **packs, int force)
+{
+	struct delete_batch batch;
+	struct delete_node *nodes, *node, *keeper;
+	size_t *order;
+	size_t n = 0, norder = 0, errors = 0;
+	int total = 0;
+	bool own_batch = false;
+	int ret = MPORT_OK;
+
+	if (packs == NULL)
+		return (MPORT_OK);
+	while (packs[n] != NULL)
+		n++;
+	if (n == 0)
+		return (MPORT_OK);
+
+	nodes = calloc(n, sizeof(struct delete_node));
+	order = calloc(n, sizeof(size_t));
+	if (nodes == NULL || order == NULL) {
+		free(nodes);
+		free(order);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+	memset(&batch, 0, sizeof(batch));
+
+	/* one transaction for the set, unless the caller has one open */
+	if (!mport->batch) {
+		if (mport_batch_begin(mport) != MPORT_OK) {
+			ret = mport_err_code();
+			goto done;
+		}
+		own_batch = true;
+	}
+
+	if (delete_load(mport, packs, nodes, n) != MPORT_OK ||
+	    (force == 0 && delete_check_outside(mport) != MPORT_OK) ||
+	    mport_db_count(mport->db, &total,
+		"SELECT COUNT(*) FROM assets WHERE type IN (%i, %i, %i, %i, %i) AND pkg IN (SELECT pkg FROM temp.delete_set)",
+		ASSET_FILE, ASSET_SAMPLE, ASSET_SAMPLE_OWNER_MODE, ASSET_SHELL, ASSET_FILE_OWNER_MODE) != MPORT_OK ||
+	    stop_services(mport, NULL) != MPORT_OK) {
+		ret = mport_err_code();
+		goto done;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		delete_order(nodes, i, order, &norder);
+
+	/* each was appended after its dependents, so go from the front */
+	mport_progress_begin(mport, MPORT_PHASE_DELETE, total, "Deleting %zu packages", n);
+
+	for (size_t o = 0; o < norder; o++) {
+		node = &nodes[order[o]];
+		keeper = NULL;
+
+		/* ones after it in the order are in a cycle with it */
+		for (size_t d = 0; d < node->nrdeps && keeper == NULL; d++) {
+			if (nodes[node->rdeps[d]].pos < node->pos && !nodes[node->rdeps[d]].deleted)
+				keeper = &nodes[node->rdeps[d]];
+		}
+
+		if (keeper != NULL) {
+			mport_call_msg_cb(mport, "Keeping %s-%s: %s-%s still depends on it", node->pack->name,
+			    node->pack->version, keeper->pack->name, keeper->pack->version);
+			errors++;
+			continue;
+		}
+
+		if (delete_one(mport, node->pack, 1, NULL, &batch) != MPORT_OK) {
+			mport_call_msg_cb(mport, "Unable to delete %s-%s: %s", node->pack->name, node->pack->version,
+			    mport_err_string());
+			errors++;
+			continue;
+		}
+		node->deleted = true;
+	}
+
+	mport_trace_begin(mport, MPORT_TRACE_DB, NULL);
+	if (mport_db_do(mport->db, "DELETE FROM assets WHERE pkg IN (SELECT pkg FROM temp.delete_set WHERE done)") != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM depends WHERE pkg IN (SELECT pkg FROM temp.delete_set WHERE done)") != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM packages WHERE pkg IN (SELECT pkg FROM temp.delete_set WHERE done)") != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM categories WHERE pkg IN (SELECT pkg FROM temp.delete_set WHERE done)") != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM verify_ledger WHERE pkg IN (SELECT pkg FROM temp.delete_set WHERE done)") != MPORT_OK ||
+	    mport_db_do(mport->db, "DELETE FROM temp.delete_set") != MPORT_OK)
+		ret = mport_err_code();
+	mport_trace_end(mport, MPORT_TRACE_DB, (long)(norder - errors), 0, ret);
+	mport_precheck_reset(mport);
+
+	delete_batch_dirs(mport, &batch);
+	batch.dirs = NULL;
+	batch.ndirs = 0;
+	if (batch.nomem)
+		mport_call_msg_cb(mport, "Out of memory, some directories were left behind.");
+
+	mport_progress_end(mport);
+
+done:
+	if (own_batch && ret == MPORT_OK) {
+		ret = mport_batch_end(mport);
+	} else if (own_batch) {
+		/* keep what was deleted, and why the rest wasn't */
+		int code = mport_err_code();
+		char *msg = strdup(mport_err_string());
+
+		(void) mport_batch_end(mport);
+		if (msg != NULL) {
+			(void) mport_set_err(code, msg);
+			free(msg);
+		}
+	}
+
+	for (size_t d = 0; d < batch.ndirs; d++)
+		free(batch.dirs[d].path);
+	free(batch.dirs);
+	for (size_t i = 0; i < n; i++)
+		free(nodes[i].rdeps);
+	free(nodes);
+	free(order);
+
+	if (ret != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (errors > 0)
+		RETURN_ERRORX(MPORT_ERR_WARN, "%zu of %zu packages could not be deleted", errors, n);
+
+	return (MPORT_OK);
+}
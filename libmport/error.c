@@ -32,8 +32,13 @@
 #include <string.h>
 #include <stdarg.h>
 
-static int mport_err;
-static char err_msg[256];
+/*
+ * The last error, one for each thread, so threads running their own
+ * instances (or a worker inside one) don't overwrite each other's errors.
+ * mport_err_code() and mport_err_string() read the calling thread's.
+ */
+static _Thread_local int mport_err;
+static _Thread_local char err_msg[256];
 
 /* This goes with the error codes in mport.h */
 static char default_error_msg[] = "An error occurred.";
@@ -50,7 +55,8 @@ mport_err_code(void) {
 
 /* mport_err_string()
  *
- * Return the current error string (if any).  Do not free this memory, it is static. 
+ * Return the current error string (if any).  Do not free this memory, it is
+ * the calling thread's, and good until its next error.
  */
 MPORT_PUBLIC_API const char *
 mport_err_string(void) {
@@ -91,18 +97,17 @@ mport_set_err(int code, const char *msg) {
 int
 mport_set_errx(int code, const char *fmt, ...) {
     va_list args;
-    char *err;
-    int ret;
+    char err[sizeof(err_msg)];
+    int len;
 
+    /*
+     * Formatted apart from err_msg, which may be one of the arguments.
+     * Longer messages are cut short as mport_set_err() would; one that
+     * can't be formatted at all gets the default message.
+     */
     va_start(args, fmt);
-    if (vasprintf(&err, fmt, args) == -1) {
-        fprintf(stderr, "fatal error: mport_set_errx can't format the string.\n");
-        exit(255);
-    }
-    ret = mport_set_err(code, err);
-    free(err);
-
+    len = vsnprintf(err, sizeof(err), fmt, args);
     va_end(args);
 
-    return ret;
+    return mport_set_err(code, len < 0 ? NULL : err);
 }
@@ -37,72 +37,107 @@
 #include <sys/stat.h>
 #include <fetch.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <archive.h>
+#include <sha256.h>
 
 #define BUFFSIZE 1024 * 8
 
-static int fetch(mportInstance *, const char *, const char *);
+static int fetch(mportInstance *, mportFetchXfer *);
+static int fetch_mirror(mportInstance *, mportFetchSession *, int, const char *, mportFetchXfer *);
+static void fetch_progress(mportFetchXfer *);
+static int fetch_index_delta(mportInstance *, mportFetchSession *, int, time_t);
+static time_t fetch_index_since(mportInstance *);
+static void fetch_index_stamp(mportInstance *, const mportFetchXfer *);
+static int xfer_decompress(mportFetchXfer *, FILE *, FILE *);
+static ssize_t xfer_read(struct archive *, void *, const void **);
+static int hash_prefix(SHA256_CTX *, int, off_t);
+static int xfer_run(mportFetchXfer *);
+static void xfer_read_error(mportFetchXfer *, int);
+static void xfer_get_error(mportFetchXfer *, int);
+static int errno_code(int);
 
 
 /* mport_fetch_index(mport)
  *
  * Fetch the index from a remote, or the bootstrap if we don't currently
  * have an index. If the current index is recentish, then don't do
- * anything.
+ * anything.  The requests are conditional on the Last-Modified time of the
+ * index we have, so an unchanged index costs a single round trip.
  */
 int
 mport_fetch_index(mportInstance *mport)
 {
-	char **mirrors = NULL;
-	char **mirrorsPtr = NULL;
-	char *url = NULL;
-	char *osrel;
-	int mirrorCount = 0;
-	
+	mportFetchSession *session;
+	mportFetchXfer xfer;
+	mportFetchStats stats;
+	struct timespec start;
+	time_t since;
+	int *order;
+	int count;
+
 	MPORT_CHECK_FOR_INDEX(mport, "mport_fetch_index()");
- 
-	if (mport_index_get_mirror_list(mport, &mirrors, &mirrorCount) != MPORT_OK)
+
+	if ((session = mport_fetch_session(mport)) == NULL)
 		RETURN_CURRENT_ERROR;
 
 #ifdef DEBUGGING 
-	fprintf(stderr, "Mirror count is %d\n", mirrorCount);
+	fprintf(stderr, "Mirror count is %d\n", session->nmirrors);
 #endif
- 
-	mirrorsPtr = mirrors;
-	osrel = mport_get_osrelease(mport);
-	 
-	while (mirrorsPtr != NULL) {
-		if (*mirrorsPtr == NULL)
-			break;
-		asprintf(&url, "%s/%s/%s/%s", *mirrorsPtr,  MPORT_ARCH, osrel, MPORT_INDEX_FILE_SOURCE);
 
-		if (url == NULL) {
-			for (int mi = 0; mi < mirrorCount; mi++)
-				free(mirrors[mi]);
-			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	if ((order = calloc(session->nmirrors + 1, sizeof(int))) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	count = mport_fetch_session_order(session, order);
+	since = fetch_index_since(mport);
+
+	if (count > 0) {
+		if (fetch_index_delta(mport, session, order[0], since) == MPORT_OK) {
+			free(order);
+			return MPORT_OK;
 		}
+		/* the full fetch is the fallback, and reports its own errors */
+		mport_set_err(MPORT_OK, NULL);
+	}
 
-		if (fetch(mport, url, MPORT_INDEX_FILE_BZ2) == MPORT_OK) {
-			mport_decompress_bzip2(MPORT_INDEX_FILE_BZ2, MPORT_INDEX_FILE);
-			free(url);
-			for (int mi = 0; mi < mirrorCount; mi++)
-				free(mirrors[mi]);
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.dest = MPORT_INDEX_FILE;
+	xfer.decompress = true;
+	xfer.ims = since;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.file = MPORT_INDEX_FILE_SOURCE;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (int i = 0; i < count; i++) {
+		if (fetch_mirror(mport, session, order[i], MPORT_INDEX_FILE_SOURCE, &xfer) == MPORT_OK) {
+			stats.ok = true;
+			stats.mirror = session->mirrors[order[i]];
+			stats.retries = i;
+			mport_fetch_stats_report(mport, &stats, &start, &xfer);
+			free(order);
+			fetch_index_stamp(mport, &xfer);
+			/* left behind by versions that decompressed in a second pass */
+			(void)unlink(MPORT_INDEX_FILE_BZ2);
 			return MPORT_OK;
 		}
-		free(url);
-		mirrorsPtr++;
 	}
 
-	free(osrel);
+	if (count > 0) {
+		stats.retries = count - 1;
+		mport_fetch_stats_report(mport, &stats, &start, &xfer);
+	}
+
+	free(order);
 
 	/* fallback to mport bootstrap site in a pinch */
 	if (mport_fetch_bootstrap_index(mport) == MPORT_OK)
 		return MPORT_OK;
-	
-	for (int mi = 0; mi < mirrorCount; mi++) 
-		free(mirrors[mi]);
 
-	free(mirrors);
 	RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to fetch index file: %s", mport_err_string());
 }
 
@@ -116,16 +151,29 @@ mport_fetch_index(mportInstance *mport)
 int
 mport_fetch_bootstrap_index(mportInstance *mport)
 {
+	mportFetchXfer xfer;
 	int result;
 	char *url;
 	char *osrel;
+	char *repository;
 
 	osrel = mport_get_osrelease(mport);
+	repository = mport_repository(mport);
 
-	asprintf(&url, "%s/%s/%s/%s", MPORT_BOOTSTRAP_INDEX_URL, MPORT_ARCH, osrel, MPORT_INDEX_FILE_SOURCE);
+	asprintf(&url, "%s/%s/%s/%s", repository != NULL ? repository : MPORT_BOOTSTRAP_INDEX_URL, MPORT_ARCH, osrel,
+	    MPORT_INDEX_FILE_SOURCE);
+	free(repository);
 
-	result = fetch(mport, url, MPORT_INDEX_FILE_BZ2);
-	mport_decompress_bzip2(MPORT_INDEX_FILE_BZ2, MPORT_INDEX_FILE);
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.url = url;
+	xfer.dest = MPORT_INDEX_FILE;
+	xfer.decompress = true;
+
+	result = fetch(mport, &xfer);
+	if (result == MPORT_OK) {
+		fetch_index_stamp(mport, &xfer);
+		(void)unlink(MPORT_INDEX_FILE_BZ2);
+	}
 
 	free(url);
 	free(osrel);
@@ -142,17 +190,18 @@ mport_fetch_bootstrap_index(mportInstance *mport)
 int
 mport_fetch_bundle(mportInstance *mport, const char *directory, const char *filename)
 {
-	char **mirrors;
-	char **mirrorsPtr;
-	char *url;
+	mportFetchSession *session;
+	mportFetchXfer xfer;
+	mportFetchStats stats;
+	struct timespec start;
 	char *dest;
-	char *osrel;
-	int mirrorCount = 0;
+	int *order;
+	int count;
 	struct stat sb;
 
 	MPORT_CHECK_FOR_INDEX(mport, "mport_fetch_bundle()");
 	
-	if (mport_index_get_mirror_list(mport, &mirrors, &mirrorCount) != MPORT_OK)
+	if ((session = mport_fetch_session(mport)) == NULL)
 		RETURN_CURRENT_ERROR;
 
 	if (stat(directory == NULL ? MPORT_FETCH_STAGING_DIR : directory, &sb) != 0 || ! S_ISDIR(sb.st_mode)) {
@@ -161,102 +210,484 @@ mport_fetch_bundle(mportInstance *mport, const char *directory, const char *file
 		}
 	}
 		
-	asprintf(&dest, "%s/%s", directory == NULL ? MPORT_FETCH_STAGING_DIR : directory, filename);
- 
-	mirrorsPtr = mirrors;
-	osrel = mport_get_osrelease(mport);
- 
-	while (mirrorsPtr != NULL) {
-		if (*mirrorsPtr == NULL)
-			break;
-		asprintf(&url, "%s/%s/%s/%s", *mirrorsPtr,  MPORT_ARCH, osrel, filename);
+	if (asprintf(&dest, "%s/%s", directory == NULL ? MPORT_FETCH_STAGING_DIR : directory, filename) == -1)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
 
-		if (fetch(mport, url, dest) == MPORT_OK) {
-			free(url);
-			url = NULL;
+	if ((order = calloc(session->nmirrors + 1, sizeof(int))) == NULL) {
+		free(dest);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+
+	count = mport_fetch_session_order(session, order);
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.dest = dest;
+	xfer.resume = true;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.file = filename;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mport_trace_begin(mport, MPORT_TRACE_FETCH, filename);
+
+	for (int i = 0; i < count; i++) {
+		if (fetch_mirror(mport, session, order[i], filename, &xfer) == MPORT_OK) {
+			if (xfer.hash[0] != '\0')
+				mport_hash_cache_put(mport, dest, xfer.hash);
+			stats.ok = true;
+			stats.mirror = session->mirrors[order[i]];
+			stats.retries = i;
+			mport_fetch_stats_report(mport, &stats, &start, &xfer);
+			mport_trace_end(mport, MPORT_TRACE_FETCH, i + 1, stats.bytes, MPORT_OK);
+			free(order);
 			free(dest);
-			dest = NULL;
-			for (int mi = 0; mi < mirrorCount; mi++)
-				free(mirrors[mi]);
 			return MPORT_OK;
 		} 
-		
-		free(url);
-		url = NULL;
-		mirrorsPtr++;
 	}
 
-	free(osrel);
+	if (count > 0) {
+		stats.retries = count - 1;
+		mport_fetch_stats_report(mport, &stats, &start, &xfer);
+	}
+	mport_trace_end(mport, MPORT_TRACE_FETCH, count, 0, count == 0 ? MPORT_ERR_FATAL : mport_err_code());
+
+	free(order);
 	free(dest);
-	for (int mi = 0; mi < mirrorCount; mi++)
-		free(mirrors[mi]);
+
+	if (count == 0)
+		RETURN_ERROR(MPORT_ERR_FATAL, "No mirrors available.");
 
 	RETURN_CURRENT_ERROR; 
 }
 
 
+/*
+ * fetch file from one mirror in the session into xfer->dest, and record how
+ * it went.  The caller sets up everything in xfer but the url.
+ */
+static int
+fetch_mirror(mportInstance *mport, mportFetchSession *session, int mirror, const char *file, mportFetchXfer *xfer)
+{
+	char *url;
+	int ret;
+
+	if (asprintf(&url, "%s/%s/%s/%s", session->mirrors[mirror], MPORT_ARCH, session->osrel, file) == -1)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	xfer->url = url;
+
+	ret = fetch(mport, xfer);
+	mport_fetch_session_mark(session, mirror, xfer, ret);
+
+	xfer->url = NULL;
+	free(url);
+
+	return ret;
+}
+
+
+/* mport_fetch_stats_report(mport, stats, start, xfer)
+ *
+ * Fill in the timing of stats, for a file whose first attempt began at start
+ * and whose last attempt was xfer, and pass it to the fetch_stats callback
+ * and, with the fetch_log setting, the log table.  The caller sets file,
+ * mirror, ok and retries.  Neither can fail the fetch, so the error state
+ * is left alone.
+ */
+void
+mport_fetch_stats_report(mportInstance *mport, mportFetchStats *stats, const struct timespec *start, const mportFetchXfer *xfer)
+{
+	char *val;
+	char *sql;
+
+	stats->elapsed = mport_elapsed_ms(start);
+	stats->bytes = stats->ok ? xfer->transferred : 0;
+	stats->rate = stats->ok && xfer->elapsed > 0 ? (long)(xfer->transferred * 1000 / xfer->elapsed) : 0;
+
+	if (mport->fetch_stats_cb != NULL)
+		(mport->fetch_stats_cb)(stats);
+
+	if ((val = mport_setting_lookup(mport, MPORT_SETTING_FETCH_LOG)) == NULL)
+		return;
+
+	if (strcasecmp(val, "yes") == 0 || strcasecmp(val, "true") == 0) {
+		if (stats->ok)
+			sql = sqlite3_mprintf("INSERT INTO log (pkg, version, date, msg) VALUES (%Q, '', %lld, "
+			    "'fetched from ' || %Q || ': %lld bytes in %ld ms, %ld bytes/s, %d retries')",
+			    stats->file, (long long)mport_get_time(), stats->mirror, (long long)stats->bytes,
+			    stats->elapsed, stats->rate, stats->retries);
+		else
+			sql = sqlite3_mprintf("INSERT INTO log (pkg, version, date, msg) VALUES (%Q, '', %lld, "
+			    "'fetch failed after %d attempts in %ld ms')",
+			    stats->file, (long long)mport_get_time(), stats->retries + 1, stats->elapsed);
+
+		if (sql != NULL)
+			(void)sqlite3_exec(mport->db, sql, NULL, NULL, NULL);
+		sqlite3_free(sql);
+	}
+
+	free(val);
+}
+
+
+/*
+ * try to bring the index up to date with a delta from one mirror.  Anything
+ * other than MPORT_OK means a full index fetch is needed.
+ */
+static int
+fetch_index_delta(mportInstance *mport, mportFetchSession *session, int mirror, time_t since)
+{
+	mportFetchXfer xfer;
+	char *url;
+	int ret;
+
+	/* without a serial there's nothing to apply a delta to; not an error */
+	if (mport_index_delta_version(mport) == 0)
+		return MPORT_ERR_WARN;
+
+	if (asprintf(&url, "%s/%s/%s/%s", session->mirrors[mirror], MPORT_ARCH, session->osrel, MPORT_INDEX_DELTA_SOURCE) == -1)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.url = url;
+	xfer.dest = MPORT_INDEX_DELTA_FILE;
+	xfer.decompress = true;
+	xfer.ims = since;
+
+	ret = fetch(mport, &xfer);
+
+	/* not every mirror publishes deltas; that says nothing about its health */
+	if (ret == MPORT_OK || xfer.errcode != FETCH_UNAVAIL)
+		mport_fetch_session_mark(session, mirror, &xfer, ret);
+
+	free(url);
+
+	/* deltas are published with the index; no newer delta, no newer index */
+	if (ret != MPORT_OK || xfer.unchanged)
+		return ret;
+
+	if ((ret = mport_index_apply_delta(mport, MPORT_INDEX_DELTA_FILE)) == MPORT_OK)
+		fetch_index_stamp(mport, &xfer);
+
+	unlink(MPORT_INDEX_DELTA_FILE);
+
+	return ret;
+}
+
+
+/* the Last-Modified time of the index we have, 0 if unknown */
+static time_t
+fetch_index_since(mportInstance *mport)
+{
+	char *val;
+	time_t since = 0;
+
+	if ((val = mport_setting_get(mport, MPORT_SETTING_INDEX_LAST_MODIFIED)) != NULL) {
+		since = (time_t)strtoll(val, NULL, 10);
+		free(val);
+	}
+
+	return since;
+}
+
+
+/* remember when the index we just fetched was last modified */
+static void
+fetch_index_stamp(mportInstance *mport, const mportFetchXfer *xfer)
+{
+	char *val;
+
+	if (xfer->unchanged)
+		return;
+
+	if (asprintf(&val, "%jd", (intmax_t)xfer->mtime) == -1)
+		return;
+
+	/* a failure only costs us a full download next time */
+	(void)mport_setting_set(mport, MPORT_SETTING_INDEX_LAST_MODIFIED, val);
+	free(val);
+}
+
+
+/* run xfer with the instance's progress callbacks, setting the error on failure */
+static int
+fetch(mportInstance *mport, mportFetchXfer *xfer) 
+{
+
+	xfer->progress = fetch_progress;
+	xfer->cookie = mport;
+
+	mport_progress_begin(mport, MPORT_PHASE_FETCH, 1, "Downloading %s", xfer->url);
+
+	if (mport_fetch_xfer(xfer) != MPORT_OK)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "%s", xfer->errmsg);
+
+	mport_progress_set(mport, 1, 1, xfer->got, xfer->size > xfer->got ? xfer->size : xfer->got, NULL);
+	mport_progress_end(mport);
+
+	return MPORT_OK;
+}
+
+
+static void
+fetch_progress(mportFetchXfer *xfer)
+{
+	mportInstance *mport = xfer->cookie;
+	char rate[32];
+
+	if (xfer->elapsed > 0)
+		(void)snprintf(rate, sizeof(rate), "%.1f KB/s", (double)xfer->transferred * 1000 / 1024 / xfer->elapsed);
+	else
+		rate[0] = '\0';
+
+	mport_progress_set(mport, 0, 1, xfer->got, xfer->size, rate);
+}
+
+
+/* mport_fetch_xfer(xfer)
+ *
+ * Copy xfer->url to xfer->dest.  This does not touch the instance, the error
+ * state or the UI callbacks, so it is safe to run from a worker thread; on
+ * failure the reason is left in xfer->errmsg.  xfer->progress, if set, is
+ * called after every buffer written.
+ *
+ * The data goes to dest.part and is only renamed over dest once complete.
+ * If xfer->resume is set, a .part left behind by an earlier attempt (from
+ * any mirror) is continued with a range request rather than started over,
+ * and a failed transfer leaves the .part in place for the next try.
+ *
+ * If xfer->decompress is set, the download is decompressed on the way to
+ * disk in the same pass, with the compression detected from the data; got
+ * and size then count compressed bytes.
+ *
+ * If xfer->ims is set the request is conditional: when the remote has not
+ * changed since then, xfer->unchanged is set and MPORT_OK returned without
+ * touching dest.
+ *
+ * Unless decompressing, the SHA256 of dest is computed as it is written and
+ * left in xfer->hash, so it need not be read back to be verified.
+ */
+int
+mport_fetch_xfer(mportFetchXfer *xfer)
+{
+	int ret;
+
+	/* not while a probe has fetchTimeout shortened */
+	mport_fetch_timeout_hold();
+	ret = xfer_run(xfer);
+	mport_fetch_timeout_release();
+
+	return ret;
+}
+
 static int
-fetch(mportInstance *mport, const char *url, const char *dest) 
+xfer_run(mportFetchXfer *xfer)
 {
 	FILE *remote = NULL;
 	FILE *local = NULL;
+	struct url *u = NULL;
 	struct url_stat ustat;
+	struct stat st;
+	char part[FILENAME_MAX];
 	char buffer[BUFFSIZE];
 	char *ptr = NULL;
-	size_t size;																	
-	size_t got = 0;
+	SHA256_CTX ctx;
+	off_t offset = 0;
+	size_t size;
 	size_t wrote;
-	
-	if ((local = fopen(dest, "w")) == NULL) {
-		RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to open %s: %s", dest, strerror(errno));
+	int fd;
+
+	xfer->got = 0;
+	xfer->size = -1;
+	xfer->errcode = 0;
+	xfer->elapsed = 0;
+	xfer->transferred = 0;
+	xfer->unchanged = false;
+	xfer->mtime = 0;
+	xfer->hash[0] = '\0';
+	clock_gettime(CLOCK_MONOTONIC, &xfer->started);
+
+	if (snprintf(part, sizeof(part), "%s.part", xfer->dest) >= (int)sizeof(part)) {
+		(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Path too long: %s", xfer->dest);
+		return MPORT_ERR_FATAL;
 	}
 
-	mport_call_progress_init_cb(mport, "Downloading %s", url);
-	
-	if ((remote = fetchXGetURL(url, &ustat, "p")) == NULL) {
-		fclose(local);
-		unlink(dest);
-		RETURN_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, fetchLastErrString);
+	if (xfer->resume && !xfer->decompress && stat(part, &st) == 0 && S_ISREG(st.st_mode))
+		offset = st.st_size;
+
+	if ((u = fetchParseURL(xfer->url)) == NULL) {
+		xfer->errcode = FETCH_URL;
+		(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Invalid URL: %s", xfer->url);
+		return MPORT_ERR_FATAL;
 	}
-	
+	u->offset = offset;
+	u->ims_time = xfer->ims;
+
+	errno = 0;
+	if ((remote = fetchXGet(u, &ustat, xfer->ims != 0 ? "pi" : "p")) == NULL) {
+		xfer_get_error(xfer, errno);
+		if (xfer->ims != 0 && xfer->errcode == FETCH_UNCHANGED) {
+			fetchFreeURL(u);
+			xfer->errcode = 0;
+			xfer->errmsg[0] = '\0';
+			xfer->unchanged = true;
+			xfer->elapsed = mport_elapsed_ms(&xfer->started);
+			return MPORT_OK;
+		}
+
+		fetchFreeURL(u);
+
+		/* a complete .part gets a range error; the stat tells us it's done */
+		if (offset > 0 && fetchStatURL(xfer->url, &ustat, "p") == 0 && ustat.size == offset) {
+			xfer->got = xfer->size = offset;
+			xfer->mtime = ustat.mtime;
+			goto done;
+		}
+
+		return MPORT_ERR_FATAL;
+	}
+
+	/* libfetch reports the offset the server actually honoured; 0 if it ignored the range */
+	offset = u->offset;
+	fetchFreeURL(u);
+
+	if ((fd = open(part, O_RDWR | O_CREAT, 0644)) == -1 || ftruncate(fd, offset) != 0 ||
+	    hash_prefix(&ctx, fd, offset) != 0 ||
+	    lseek(fd, offset, SEEK_SET) == -1 || (local = fdopen(fd, "w")) == NULL) {
+		(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Unable to open %s: %s", part, strerror(errno));
+		if (fd != -1)
+			close(fd);
+		fclose(remote);
+		return MPORT_ERR_FATAL;
+	}
+
+	xfer->size = ustat.size;
+	xfer->mtime = ustat.mtime;
+	xfer->got = offset;
+
+	if (xfer->decompress) {
+		if (xfer_decompress(xfer, remote, local) != MPORT_OK) {
+			fclose(local);
+			fclose(remote);
+			unlink(part);
+			return MPORT_ERR_FATAL;
+		}
+		goto written;
+	}
+
 	while (1) {
 		size = fread(buffer, 1, BUFFSIZE, remote);
-		
-		if (size < BUFFSIZE) {
-			if (ferror(remote)) {
-				fclose(local);
-				fclose(remote);
-				unlink(dest);
-				RETURN_ERRORX(MPORT_ERR_FATAL, "Fetch error: %s: %s", url, fetchLastErrString);	 
-			} else if (feof(remote)) {
-				/* do nothing */
-			} 
-		} 
-	
-		got += size;
-	
-		(mport->progress_step_cb)(got, ustat.size, "XXX Rate");
+
+		if (size < BUFFSIZE && ferror(remote)) {
+			xfer_read_error(xfer, errno);
+			fclose(local);
+			fclose(remote);
+			if (!xfer->resume)
+				unlink(part);
+			return MPORT_ERR_FATAL;
+		}
+
+		xfer->got += size;
+		xfer->transferred += size;
+		xfer->elapsed = mport_elapsed_ms(&xfer->started);
+		SHA256_Update(&ctx, buffer, size);
+
+		if (xfer->progress != NULL)
+			(xfer->progress)(xfer);
 
 		for (ptr = buffer; size > 0; ptr += wrote, size -= wrote) {
 			wrote = fwrite(ptr, 1, size, local);
 			if (wrote < size) {
-				fclose(local); fclose(remote);
-				unlink(dest);
-				RETURN_ERRORX(MPORT_ERR_FATAL, "Write error %s: %s", dest, strerror(errno));
+				fclose(local);
+				fclose(remote);
+				unlink(part);
+				(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Write error %s: %s", part, strerror(errno));
+				return MPORT_ERR_FATAL;
 			}
 		}
 
 		if (feof(remote))
 			break;
 	}
-	
-	fclose(local);
+
+	SHA256_End(&ctx, xfer->hash);
+
+written:
 	fclose(remote);
-	(mport->progress_free_cb)();
+	xfer->elapsed = mport_elapsed_ms(&xfer->started);
+	if (fclose(local) != 0) {
+		unlink(part);
+		(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Write error %s: %s", part, strerror(errno));
+		return MPORT_ERR_FATAL;
+	}
+
+done:
+	if (rename(part, xfer->dest) != 0) {
+		(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Unable to rename %s: %s", part, strerror(errno));
+		return MPORT_ERR_FATAL;
+	}
 
 	return MPORT_OK;
 }
 
+
+/*
+ * fetchLastErrCode and fetchLastErrString are shared by the whole process,
+ * so with transfers on several threads they belong to whichever failed
+ * last.  A failure is described from the errno its own call left wherever
+ * that says anything.
+ */
+
+/* a read from the remote failed with err */
+static void
+xfer_read_error(mportFetchXfer *xfer, int err)
+{
+
+	xfer->errcode = errno_code(err);
+	(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Fetch error: %s: %s", xfer->url, strerror(err));
+}
+
+/*
+ * fetchXGet() failed, leaving err in errno.  When the connection itself
+ * failed that is the reason; otherwise the server turned the request down,
+ * which libfetch only reports through its globals.
+ */
+static void
+xfer_get_error(mportFetchXfer *xfer, int err)
+{
+
+	if ((xfer->errcode = errno_code(err)) != FETCH_UNKNOWN) {
+		(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Fetch error: %s: %s", xfer->url, strerror(err));
+		return;
+	}
+
+	xfer->errcode = fetchLastErrCode;
+	(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Fetch error: %s: %s", xfer->url, fetchLastErrString);
+}
+
+/* the FETCH_ code libfetch gives a network errno, FETCH_UNKNOWN for anything else */
+static int
+errno_code(int err)
+{
+
+	switch (err) {
+		case ETIMEDOUT:
+			return FETCH_TIMEOUT;
+		case ECONNREFUSED:
+		case EHOSTDOWN:
+			return FETCH_DOWN;
+		case ENETDOWN:
+		case ENETUNREACH:
+		case ENETRESET:
+		case EHOSTUNREACH:
+		case ECONNABORTED:
+		case ECONNRESET:
+		case EPIPE:
+			return FETCH_NETWORK;
+		default:
+			return FETCH_UNKNOWN;
+	}
+}
+
 /**
  * Download a package. Top level, public method.
  *
@@ -267,9 +698,8 @@ fetch(mportInstance *mport, const char *url, const char *dest)
 int
 mport_download(mportInstance *mport, const char *packageName, bool includeDependencies, char **path) {
 	mportIndexEntry **indexEntry = NULL;
-	mportDependsEntry **depends = NULL;
-	mportDependsEntry **depends_orig = NULL;
-	bool existed = true;
+	mportIndexEntry **closure = NULL;
+	bool existed, ok;
 	int retryCount = 0;
 
 	if (mport_index_lookup_pkgname(mport, packageName, &indexEntry) != MPORT_OK) {
@@ -294,25 +724,24 @@ mport_download(mportInstance *mport, const char *packageName, bool includeDepend
 		RETURN_CURRENT_ERROR;
 	}
 
+	existed = mport_file_exists(*path);
+
 	if (includeDependencies) {
-		mport_index_depends_list(mport, (*indexEntry)->pkgname, (*indexEntry)->version, &depends_orig);
-		depends = depends_orig;
-
-		while (*depends != NULL) {
-			char *dpath;
-			if (mport_download(mport, (*depends)->d_pkgname, includeDependencies, &dpath) != MPORT_OK) {
-     			mport_call_msg_cb(mport, "%s", mport_err_string());
-     			mport_index_depends_free_vec(depends_orig);
-				return mport_err_code();
-			}
-			free(dpath);
-			depends++;
+		/* the closure includes the package itself, so it is fetched alongside its dependencies */
+		if (mport_index_depends_closure(mport, (*indexEntry)->pkgname, (*indexEntry)->version, &closure) != MPORT_OK ||
+		    mport_fetch_bundles(mport, mport->outputPath, closure) != MPORT_OK) {
+			mport_call_msg_cb(mport, "%s", mport_err_string());
+			mport_index_entry_free_vec(closure);
+			free(*path);
+			*path = NULL;
+			mport_index_entry_free_vec(indexEntry);
+			return mport_err_code();
 		}
-		mport_index_depends_free_vec(depends_orig);
+		mport_index_entry_free_vec(closure);
 	}
 
 getfile:
-	if (!mport_file_exists(*path)) {
+	if (!mport_file_exists(*path) && mport_package_cache_fetch(mport, (*indexEntry)->hash, *path) != MPORT_OK) {
 		if (mport_fetch_bundle(mport, mport->outputPath, (*indexEntry)->bundlefile) != MPORT_OK) {
 			mport_call_msg_cb(mport, "Error fetching package %s, %s", packageName, mport_err_string());
 			free(*path);
@@ -325,7 +754,10 @@ getfile:
 		existed = false;
 	}
 
-	if (!mport_verify_hash(*path, (*indexEntry)->hash)) {
+	mport_trace_begin(mport, MPORT_TRACE_VERIFY, *path);
+	ok = mport_verify_bundle(mport, *path, (*indexEntry)->hash);
+	mport_trace_end(mport, MPORT_TRACE_VERIFY, 1, 0, ok ? MPORT_OK : MPORT_ERR_FATAL);
+	if (!ok) {
 		if (existed) {
 			if (unlink(*path) == 0)	{
 				retryCount++;
@@ -342,6 +774,8 @@ getfile:
 		RETURN_CURRENT_ERROR;
 	}
 
+	mport_package_cache_store(mport, (*indexEntry)->hash, *path);
+
 	if (!existed)
 		mport_call_msg_cb(mport, "Package %s saved as %s\n", packageName, *path);
 	else
@@ -353,3 +787,107 @@ getfile:
 	return (0);
 }
 
+
+
+/* archive(3) read callback feeding the raw download to the decompressor */
+struct xfer_stream {
+	mportFetchXfer *xfer;
+	FILE *remote;
+	char buffer[BUFFSIZE];
+};
+
+static ssize_t
+xfer_read(struct archive *a, void *cookie, const void **buf)
+{
+	struct xfer_stream *s = cookie;
+	size_t size;
+
+	size = fread(s->buffer, 1, sizeof(s->buffer), s->remote);
+	if (size < sizeof(s->buffer) && ferror(s->remote)) {
+		int err = errno;
+
+		xfer_read_error(s->xfer, err);
+		archive_set_error(a, err, "%s", strerror(err));
+		return -1;
+	}
+
+	s->xfer->got += size;
+	s->xfer->transferred += size;
+	s->xfer->elapsed = mport_elapsed_ms(&s->xfer->started);
+	if (s->xfer->progress != NULL)
+		(s->xfer->progress)(s->xfer);
+
+	*buf = s->buffer;
+
+	return (ssize_t)size;
+}
+
+
+/* decompress remote into local as it arrives, whatever it was compressed with */
+static int
+xfer_decompress(mportFetchXfer *xfer, FILE *remote, FILE *local)
+{
+	struct archive *a;
+	struct archive_entry *entry;
+	struct xfer_stream s;
+	char buffer[BUFFSIZE];
+	ssize_t size;
+	int ret = MPORT_OK;
+
+	s.xfer = xfer;
+	s.remote = remote;
+
+	if ((a = archive_read_new()) == NULL) {
+		(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Out of memory.");
+		return MPORT_ERR_FATAL;
+	}
+
+	archive_read_support_filter_all(a);
+	archive_read_support_format_raw(a);
+
+	if (archive_read_open(a, &s, NULL, xfer_read, NULL) != ARCHIVE_OK ||
+	    archive_read_next_header(a, &entry) != ARCHIVE_OK) {
+		(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Unable to read %s: %s", xfer->url, archive_error_string(a));
+		archive_read_free(a);
+		return MPORT_ERR_FATAL;
+	}
+
+	while ((size = archive_read_data(a, buffer, sizeof(buffer))) > 0) {
+		if (fwrite(buffer, 1, size, local) < (size_t)size) {
+			(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Write error %s: %s", xfer->dest, strerror(errno));
+			ret = MPORT_ERR_FATAL;
+			break;
+		}
+	}
+
+	if (size < 0) {
+		(void)snprintf(xfer->errmsg, sizeof(xfer->errmsg), "Unable to decompress %s: %s", xfer->url, archive_error_string(a));
+		ret = MPORT_ERR_FATAL;
+	}
+
+	archive_read_free(a);
+
+	return ret;
+}
+
+
+/* start ctx off with the first len bytes of fd, the part of a .part we already have */
+static int
+hash_prefix(SHA256_CTX *ctx, int fd, off_t len)
+{
+	char buffer[BUFFSIZE];
+	off_t done = 0;
+	ssize_t size;
+
+	SHA256_Init(ctx);
+
+	while (done < len) {
+		size = pread(fd, buffer, MIN((off_t)sizeof(buffer), len - done), done);
+		if (size <= 0)
+			return -1;
+		SHA256_Update(ctx, buffer, size);
+		done += size;
+	}
+
+	return 0;
+}
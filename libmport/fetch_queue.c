@@ -0,0 +1,735 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/cdefs.h>
+
+#include "mport.h"
+#include "mport_private.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Parallel bundle downloads.
+ *
+ * The main thread does everything that touches the database, the error state
+ * and the UI callbacks: it builds the job list, reports combined progress and
+ * records the results.  Worker threads only run mport_fetch_xfer(), check the
+ * hash it computed against the index and hand the outcome back under the
+ * queue lock.
+ *
+ * mport_fetch_bundles() downloads a list and waits for all of it.  The
+ * mport_fetch_queue_*() functions do the same in the background, so
+ * mport_plan_execute() can install one step while later ones download: the
+ * workers stay within a window of jobs and a byte budget of downloads not yet
+ * released, and the installer waits for each bundle as it comes to it.
+ */
+
+#define FETCH_QUEUE_TICK_MS 250
+
+enum job_state {
+	JOB_PENDING, JOB_RUNNING, JOB_DONE, JOB_FAILED
+};
+
+struct mport_fetch_queue;
+
+struct fetch_job {
+	mportIndexEntry *entry;
+	char *dest;
+	enum job_state state;
+	unsigned char *tried;	/* one flag per mirror */
+	off_t got;
+	off_t size;
+	mportFetchXfer xfer;
+	struct mport_fetch_queue *queue;
+	struct timespec start;	/* of the first attempt */
+	int attempts;
+	int served;		/* session mirror that succeeded, -1 if none */
+	bool verified;		/* the worker matched the index hash */
+	bool checked;		/* the main thread has recorded the outcome */
+	bool released;		/* no longer counts against the window or budget */
+};
+
+struct mport_fetch_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct fetch_job *jobs;
+	int njobs;
+	int finished;
+	int failed;
+	mportFetchSession *session;
+	int *order;		/* mirrors, best first */
+	int nmirrors;
+	int *active;		/* connections per mirror */
+	int mirror_limit;
+	pthread_t threads[MPORT_MAX_FETCH_JOBS];
+	int nthreads;
+	bool stop;
+	int base;		/* the first job not yet released */
+	int window;		/* jobs past base that may start, 0 for all */
+	off_t budget;		/* bytes downloaded and not released, 0 for no limit */
+	mport_fetch_ready_cb ready;
+	void *ready_cookie;
+};
+
+static struct fetch_job * queue_next(struct mport_fetch_queue *, int *);
+static bool queue_over_budget(struct mport_fetch_queue *);
+static struct fetch_job * queue_find(struct mport_fetch_queue *, mportIndexEntry *);
+static void *fetch_worker(void *);
+static void job_progress(mportFetchXfer *);
+static void job_check(mportInstance *, struct mport_fetch_queue *, struct fetch_job *);
+static void report_progress(mportInstance *, struct mport_fetch_queue *);
+static void tick(struct timespec *);
+
+
+/* mport_fetch_bundles(mport, directory, entries)
+ *
+ * Download the bundles for a NULL terminated vector of index entries into
+ * directory (MPORT_FETCH_STAGING_DIR if NULL).  Bundles that are already
+ * present with the right hash are skipped, as are duplicates.  The number of
+ * concurrent transfers comes from the fetch_jobs setting and the number of
+ * transfers against any one mirror from fetch_mirror_jobs.
+ *
+ * Every bundle is attempted; if any of them fail the error names how many.
+ */
+MPORT_PUBLIC_API int
+mport_fetch_bundles(mportInstance *mport, const char *directory, mportIndexEntry **entries)
+{
+	struct mport_fetch_queue *q;
+
+	MPORT_CHECK_FOR_INDEX(mport, "mport_fetch_bundles()");
+
+	if (entries == NULL || *entries == NULL)
+		return MPORT_OK;
+
+	if (mport_fetch_queue_new(mport, NULL, NULL, &q) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	for (int i = 0; entries[i] != NULL; i++) {
+		if (mport_fetch_queue_add(mport, q, entries[i], directory) != MPORT_OK) {
+			mport_fetch_queue_free(q);
+			RETURN_CURRENT_ERROR;
+		}
+	}
+
+	if (mport_fetch_queue_start(mport, q, 0, 0) != MPORT_OK) {
+		mport_fetch_queue_free(q);
+		RETURN_CURRENT_ERROR;
+	}
+
+	return mport_fetch_queue_finish(mport, q);
+}
+
+
+/* mport_fetch_queue_new(mport, ready, cookie, queue)
+ *
+ * An empty download queue.  ready, if not NULL, is called from a worker
+ * thread with each bundle's path once it is downloaded and matches the
+ * index, and from mport_fetch_queue_add() for bundles already on disk; it
+ * must not touch the instance.
+ */
+int
+mport_fetch_queue_new(mportInstance *mport, mport_fetch_ready_cb ready, void *cookie, struct mport_fetch_queue **queue)
+{
+	struct mport_fetch_queue *q;
+
+	*queue = NULL;
+
+	if ((q = calloc(1, sizeof(struct mport_fetch_queue))) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	q->ready = ready;
+	q->ready_cookie = cookie;
+
+	if ((q->session = mport_fetch_session(mport)) == NULL) {
+		free(q);
+		RETURN_CURRENT_ERROR;
+	}
+
+	if (q->session->nmirrors == 0) {
+		free(q);
+		RETURN_ERROR(MPORT_ERR_FATAL, "No mirrors available.");
+	}
+
+	if ((q->order = calloc(q->session->nmirrors, sizeof(int))) == NULL ||
+	    (q->active = calloc(q->session->nmirrors, sizeof(int))) == NULL) {
+		free(q->order);
+		free(q);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+	q->nmirrors = mport_fetch_session_order(q->session, q->order);
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	*queue = q;
+
+	return MPORT_OK;
+}
+
+
+/* mport_fetch_queue_add(mport, queue, entry, directory)
+ *
+ * Queue entry's bundle for directory (MPORT_FETCH_STAGING_DIR if NULL),
+ * unless it is already there with the right hash or already queued.  Jobs
+ * are started in the order they are added.  Only before
+ * mport_fetch_queue_start().
+ */
+int
+mport_fetch_queue_add(mportInstance *mport, struct mport_fetch_queue *q, mportIndexEntry *entry, const char *directory)
+{
+	struct fetch_job *jobs;
+	struct fetch_job *job;
+	struct stat sb;
+	char *dest;
+
+	if (entry->bundlefile == NULL)
+		return MPORT_OK;
+
+	if (directory == NULL)
+		directory = MPORT_FETCH_STAGING_DIR;
+
+	if (stat(directory, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+		if (mkdir(directory, S_IRWXU | S_IRWXG) != 0)
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Unable to create %s: %s", directory, strerror(errno));
+	}
+
+	if (asprintf(&dest, "%s/%s", directory, entry->bundlefile) == -1)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	for (int i = 0; i < q->njobs; i++) {
+		if (strcmp(q->jobs[i].dest, dest) == 0) {
+			free(dest);
+			return MPORT_OK;
+		}
+	}
+
+	if (!mport_file_exists(dest))
+		(void)mport_package_cache_fetch(mport, entry->hash, dest);
+
+	if (mport_file_exists(dest) && entry->hash != NULL && mport_verify_bundle(mport, dest, entry->hash)) {
+		if (q->ready != NULL)
+			(q->ready)(q->ready_cookie, dest);
+		free(dest);
+		return MPORT_OK;
+	}
+
+	if ((jobs = realloc(q->jobs, (q->njobs + 1) * sizeof(struct fetch_job))) == NULL) {
+		free(dest);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+	q->jobs = jobs;
+
+	job = &q->jobs[q->njobs];
+	memset(job, 0, sizeof(struct fetch_job));
+	job->served = -1;
+	job->entry = entry;
+	job->dest = dest;
+	job->state = JOB_PENDING;
+	job->size = -1;
+
+	if ((job->tried = calloc(q->nmirrors, 1)) == NULL) {
+		free(dest);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+
+	q->njobs++;
+
+	return MPORT_OK;
+}
+
+
+/* mport_fetch_queue_start(mport, queue, window, budget)
+ *
+ * Start the workers.  At most window jobs past the first unreleased one
+ * are started, and none while budget bytes of downloads are waiting to be
+ * released; 0 lifts either limit.  Without threads everything is
+ * downloaded before this returns.
+ */
+int
+mport_fetch_queue_start(mportInstance *mport, struct mport_fetch_queue *q, int window, off_t budget)
+{
+	int nthreads;
+
+	if (q->njobs == 0)
+		return MPORT_OK;
+
+	q->window = window > 0 ? window : 0;
+	q->budget = budget > 0 ? budget : 0;
+
+	q->mirror_limit = mport_setting_get_int(mport, MPORT_SETTING_FETCH_MIRROR_JOBS, MPORT_DEFAULT_FETCH_MIRROR_JOBS);
+	if (q->mirror_limit < 1)
+		q->mirror_limit = 1;
+
+	nthreads = mport_setting_get_int(mport, MPORT_SETTING_FETCH_JOBS, MPORT_DEFAULT_FETCH_JOBS);
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > MPORT_MAX_FETCH_JOBS)
+		nthreads = MPORT_MAX_FETCH_JOBS;
+	if (nthreads > q->njobs)
+		nthreads = q->njobs;
+
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&q->threads[q->nthreads], NULL, fetch_worker, q) != 0)
+			break;
+		q->nthreads++;
+	}
+
+	if (q->nthreads == 0) {
+		/* no threads to be had, do the work ourselves, all of it */
+		q->window = 0;
+		q->budget = 0;
+		mport_progress_begin(mport, MPORT_PHASE_FETCH, q->njobs, "Downloading %d packages", q->njobs);
+		fetch_worker(q);
+		report_progress(mport, q);
+		mport_progress_end(mport);
+	}
+
+	return MPORT_OK;
+}
+
+
+/* mport_fetch_queue_wait(mport, queue, entry)
+ *
+ * Wait for entry's bundle, showing its progress if it isn't there yet.
+ * Returns MPORT_OK if it downloaded and verified, or if it wasn't queued.
+ */
+int
+mport_fetch_queue_wait(mportInstance *mport, struct mport_fetch_queue *q, mportIndexEntry *entry)
+{
+	struct fetch_job *job;
+	struct timespec ts;
+	bool shown = false;
+
+	if (q == NULL || (job = queue_find(q, entry)) == NULL)
+		return MPORT_OK;
+
+	pthread_mutex_lock(&q->lock);
+	while (job->state == JOB_PENDING || job->state == JOB_RUNNING) {
+		if (!shown) {
+			pthread_mutex_unlock(&q->lock);
+			mport_progress_begin(mport, MPORT_PHASE_FETCH, 1, "Downloading %s", entry->bundlefile);
+			shown = true;
+			pthread_mutex_lock(&q->lock);
+			continue;
+		}
+
+		tick(&ts);
+		pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+
+		if (job->size > 0) {
+			off_t got = job->got, size = job->size;
+
+			pthread_mutex_unlock(&q->lock);
+			mport_progress_set(mport, 0, 1, got, size, entry->pkgname);
+			pthread_mutex_lock(&q->lock);
+		}
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	if (shown)
+		mport_progress_end(mport);
+
+	job_check(mport, q, job);
+
+	if (job->state != JOB_DONE)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Error fetching package %s: %s", entry->pkgname, job->xfer.errmsg);
+
+	return MPORT_OK;
+}
+
+
+/* mport_fetch_queue_release(queue, entry)
+ *
+ * Entry's bundle has been used (or given up on), so it no longer holds up
+ * the downloads behind it.
+ */
+void
+mport_fetch_queue_release(struct mport_fetch_queue *q, mportIndexEntry *entry)
+{
+	struct fetch_job *job;
+
+	if (q == NULL || (job = queue_find(q, entry)) == NULL)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	job->released = true;
+	while (q->base < q->njobs && q->jobs[q->base].released)
+		q->base++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+/* mport_fetch_queue_finish(mport, queue)
+ *
+ * Wait for everything still queued, with one progress line for the lot,
+ * record the outcomes and free the queue.  If any bundle failed the error
+ * names how many.
+ */
+int
+mport_fetch_queue_finish(mportInstance *mport, struct mport_fetch_queue *q)
+{
+	struct timespec ts;
+	int ret = MPORT_OK;
+	int njobs = q->njobs;
+
+	if (q->nthreads > 0) {
+		mport_progress_begin(mport, MPORT_PHASE_FETCH, q->njobs, "Downloading %d packages",
+		    q->njobs - q->finished);
+
+		pthread_mutex_lock(&q->lock);
+		/* nothing is waiting to be released any more */
+		q->window = 0;
+		q->budget = 0;
+		pthread_cond_broadcast(&q->cond);
+
+		while (q->finished < q->njobs) {
+			tick(&ts);
+			pthread_cond_timedwait(&q->cond, &q->lock, &ts);
+
+			pthread_mutex_unlock(&q->lock);
+			report_progress(mport, q);
+			pthread_mutex_lock(&q->lock);
+		}
+		pthread_mutex_unlock(&q->lock);
+
+		report_progress(mport, q);
+		mport_progress_end(mport);
+	}
+
+	for (int i = 0; i < q->njobs; i++)
+		job_check(mport, q, &q->jobs[i]);
+
+	if (q->failed > 0)
+		ret = SET_ERRORX(MPORT_ERR_FATAL, "Unable to fetch %d of %d packages.", q->failed, njobs);
+
+	mport_fetch_queue_free(q);
+
+	return ret;
+}
+
+
+/* mport_fetch_queue_free(queue)
+ *
+ * Stop starting downloads, wait out the ones running and free the queue.
+ * Partial downloads are kept, to be resumed.
+ */
+void
+mport_fetch_queue_free(struct mport_fetch_queue *q)
+{
+
+	if (q == NULL)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	q->stop = true;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+
+	for (int i = 0; i < q->nthreads; i++)
+		pthread_join(q->threads[i], NULL);
+
+	pthread_cond_destroy(&q->cond);
+	pthread_mutex_destroy(&q->lock);
+
+	for (int i = 0; i < q->njobs; i++) {
+		free(q->jobs[i].dest);
+		free(q->jobs[i].tried);
+	}
+	free(q->jobs);
+
+	free(q->order);
+	free(q->active);
+	free(q);
+}
+
+
+static struct fetch_job *
+queue_find(struct mport_fetch_queue *q, mportIndexEntry *entry)
+{
+	for (int i = 0; i < q->njobs; i++) {
+		if (q->jobs[i].entry == entry)
+			return &q->jobs[i];
+	}
+
+	return NULL;
+}
+
+
+/*
+ * True when the downloads nobody has released yet add up to the budget.
+ * There's always room for one, so a bundle bigger than the budget still
+ * gets fetched.  Called with the queue lock held.
+ */
+static bool
+queue_over_budget(struct mport_fetch_queue *q)
+{
+	off_t held = 0;
+	int outstanding = 0;
+
+	if (q->budget == 0)
+		return false;
+
+	for (int i = q->base; i < q->njobs; i++) {
+		struct fetch_job *job = &q->jobs[i];
+
+		if (job->released || (job->state != JOB_RUNNING && job->state != JOB_DONE))
+			continue;
+		held += job->size > job->got ? job->size : job->got;
+		outstanding++;
+	}
+
+	return outstanding > 0 && held >= q->budget;
+}
+
+
+/*
+ * Pick the next pending job inside the window along with the first mirror
+ * it hasn't tried that has a free connection slot.  Mirrors are tried in
+ * the order the fetch session ranks them, jobs in the order they were
+ * added.  Called with the queue lock held.
+ */
+static struct fetch_job *
+queue_next(struct mport_fetch_queue *q, int *mirror)
+{
+	int end = q->window == 0 ? q->njobs : q->base + q->window;
+	bool over = queue_over_budget(q), behind = false;
+
+	if (end > q->njobs)
+		end = q->njobs;
+
+	for (int i = 0; i < end; i++) {
+		struct fetch_job *job = &q->jobs[i];
+
+		if (job->state != JOB_PENDING) {
+			if (job->state == JOB_RUNNING && !job->released)
+				behind = true;
+			continue;
+		}
+
+		/*
+		 * Over budget, only the download the installer needs next may
+		 * start; a retry can be behind bundles it hasn't reached yet.
+		 */
+		if (over && behind)
+			return NULL;
+		behind = true;
+
+		for (int m = 0; m < q->nmirrors; m++) {
+			if (!job->tried[m] && q->active[m] < q->mirror_limit) {
+				*mirror = m;
+				return job;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+static void *
+fetch_worker(void *arg)
+{
+	struct mport_fetch_queue *q = arg;
+	struct fetch_job *job;
+	char *url;
+	int m, ret;
+
+	pthread_mutex_lock(&q->lock);
+
+	while (q->finished < q->njobs && !q->stop) {
+		if ((job = queue_next(q, &m)) == NULL) {
+			pthread_cond_wait(&q->cond, &q->lock);
+			continue;
+		}
+
+		job->state = JOB_RUNNING;
+		job->tried[m] = 1;
+		job->got = 0;
+		if (job->attempts++ == 0)
+			clock_gettime(CLOCK_MONOTONIC, &job->start);
+		q->active[m]++;
+
+		if (asprintf(&url, "%s/%s/%s/%s", q->session->mirrors[q->order[m]], MPORT_ARCH, q->session->osrel,
+		    job->entry->bundlefile) == -1)
+			url = NULL;
+
+		pthread_mutex_unlock(&q->lock);
+
+		if (url == NULL) {
+			(void)snprintf(job->xfer.errmsg, sizeof(job->xfer.errmsg), "Out of memory.");
+			job->xfer.errcode = 0;
+			ret = MPORT_ERR_FATAL;
+		} else {
+			job->xfer.url = url;
+			job->xfer.dest = job->dest;
+			job->xfer.resume = true;
+			job->xfer.progress = job_progress;
+			job->xfer.cookie = job;
+			job->queue = q;
+			ret = mport_fetch_xfer(&job->xfer);
+			free(url);
+		}
+
+		/* the hash came with the transfer, so checking it costs nothing */
+		if (ret == MPORT_OK && job->entry->hash != NULL && job->xfer.hash[0] != '\0') {
+			if (strncmp(job->xfer.hash, job->entry->hash, 65) == 0) {
+				job->verified = true;
+				if (q->ready != NULL)
+					(q->ready)(q->ready_cookie, job->dest);
+			}
+		}
+
+		pthread_mutex_lock(&q->lock);
+
+		q->active[m]--;
+		mport_fetch_session_mark(q->session, q->order[m], &job->xfer, ret);
+
+		if (ret == MPORT_OK) {
+			job->state = JOB_DONE;
+			job->served = q->order[m];
+			q->finished++;
+		} else {
+			job->state = JOB_FAILED;
+			for (int i = 0; i < q->nmirrors; i++) {
+				if (!job->tried[i]) {
+					job->state = JOB_PENDING;
+					break;
+				}
+			}
+			if (job->state == JOB_FAILED)
+				q->finished++;
+		}
+
+		pthread_cond_broadcast(&q->cond);
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+
+static void
+job_progress(mportFetchXfer *xfer)
+{
+	struct fetch_job *job = xfer->cookie;
+
+	pthread_mutex_lock(&job->queue->lock);
+	job->got = xfer->got;
+	job->size = xfer->size;
+	pthread_mutex_unlock(&job->queue->lock);
+}
+
+
+/*
+ * Record a finished job's outcome, once: the workers hashed what they
+ * wrote, and the database is only touched from here.
+ */
+static void
+job_check(mportInstance *mport, struct mport_fetch_queue *q, struct fetch_job *job)
+{
+
+	if (job->checked || job->state == JOB_PENDING || job->state == JOB_RUNNING)
+		return;
+	job->checked = true;
+
+	if (job->state == JOB_DONE && job->xfer.hash[0] != '\0')
+		mport_hash_cache_put(mport, job->dest, job->xfer.hash);
+
+	if (job->state == JOB_DONE && !job->verified && !mport_verify_bundle(mport, job->dest, job->entry->hash)) {
+		(void)unlink(job->dest);
+		mport_hash_cache_forget(mport, job->dest);
+		(void)snprintf(job->xfer.errmsg, sizeof(job->xfer.errmsg), "%s fails hash verification.", job->entry->bundlefile);
+		job->state = JOB_FAILED;
+	}
+
+	if (job->state == JOB_DONE)
+		mport_package_cache_store(mport, job->entry->hash, job->dest);
+
+	if (job->attempts > 0) {
+		mportFetchStats stats;
+
+		memset(&stats, 0, sizeof(stats));
+		stats.file = job->entry->bundlefile;
+		stats.ok = job->state == JOB_DONE;
+		stats.mirror = stats.ok ? q->session->mirrors[job->served] : NULL;
+		stats.retries = job->attempts - 1;
+		mport_fetch_stats_report(mport, &stats, &job->start, &job->xfer);
+	}
+
+	if (job->state != JOB_DONE) {
+		mport_call_msg_cb(mport, "Error fetching package %s: %s", job->entry->pkgname, job->xfer.errmsg);
+		q->failed++;
+	}
+}
+
+
+/* one progress line for the whole queue, in kilobytes */
+static void
+report_progress(mportInstance *mport, struct mport_fetch_queue *q)
+{
+	off_t got = 0, total = 0;
+	int done;
+	char msg[64];
+
+	pthread_mutex_lock(&q->lock);
+	for (int i = 0; i < q->njobs; i++) {
+		got += q->jobs[i].got;
+		total += q->jobs[i].size > q->jobs[i].got ? q->jobs[i].size : q->jobs[i].got;
+	}
+	done = q->finished;
+	pthread_mutex_unlock(&q->lock);
+
+	if (total == 0)
+		return;
+
+	(void)snprintf(msg, sizeof(msg), "%d/%d packages", done, q->njobs);
+	mport_progress_set(mport, done, q->njobs, got, total, msg);
+}
+
+
+/* FETCH_QUEUE_TICK_MS from now, for pthread_cond_timedwait() */
+static void
+tick(struct timespec *ts)
+{
+
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_nsec += FETCH_QUEUE_TICK_MS * 1000000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
@@ -0,0 +1,475 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/cdefs.h>
+
+#include "mport.h"
+#include "mport_private.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fetch.h>
+
+/*
+ * Per instance fetch state.
+ *
+ * libfetch closes the connection after every request, so the expensive part
+ * of a bundle fetch that we can actually avoid is everything around the
+ * transfer: looking up the mirror list, working out the OS release (which may
+ * spawn midnightbsd-version) and, worst of all, waiting on a slow or dead
+ * mirror before falling through to the next.  The session keeps the first
+ * two for the life of the instance and ranks the mirrors.
+ *
+ * Each mirror has a score: the time in ms it took to connect and pull a
+ * small sample of the index.  Scores are probed concurrently, kept in the
+ * settings table as "mirror_score:<url>" and reprobed once they are older than
+ * mirror_score_ttl seconds.  During a session, transfers feed back into the
+ * score, so a mirror that fails or crawls drops down the order, and mirrors
+ * that couldn't be reached at all go to the back.
+ */
+
+#define PROBE_BYTES	(32 * 1024)
+#define PROBE_TIMEOUT	5	/* seconds */
+#define FAIL_PENALTY	5000	/* ms added to a mirror's score each time it fails */
+
+struct mirror_probe {
+	char *url;
+	int score;
+};
+
+/*
+ * libfetch has one fetchTimeout for the whole process, which every
+ * connection reads.  Transfers hold this shared, so a probe only shortens it
+ * once none are running, and none start until it is put back.
+ */
+static pthread_rwlock_t timeout_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int load_scores(mportInstance *, mportFetchSession *, bool *);
+static void probe_mirrors(mportInstance *, mportFetchSession *, const bool *);
+static void *probe_mirror(void *);
+
+
+/* mport_fetch_session(mport)
+ *
+ * Return the fetch session for this instance, creating it on first use.
+ * Returns NULL and sets the error if the mirror list couldn't be loaded.
+ */
+mportFetchSession *
+mport_fetch_session(mportInstance *mport)
+{
+	mportFetchSession *s;
+	bool *stale;
+
+	if (mport->fetch_session != NULL)
+		return mport->fetch_session;
+
+	if (!(mport->flags & MPORT_INST_HAVE_INDEX)) {
+		SET_ERROR(MPORT_ERR_FATAL, "Attempt to use mport_fetch_session() before loading index.");
+		return NULL;
+	}
+
+	if ((s = calloc(1, sizeof(mportFetchSession))) == NULL) {
+		SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		return NULL;
+	}
+
+	if (mport_index_get_mirror_list(mport, &s->mirrors, &s->nmirrors) != MPORT_OK) {
+		mport_fetch_session_free(s);
+		return NULL;
+	}
+
+	if ((s->down = calloc(s->nmirrors + 1, sizeof(bool))) == NULL ||
+	    (s->score = calloc(s->nmirrors + 1, sizeof(int))) == NULL ||
+	    (stale = calloc(s->nmirrors + 1, sizeof(bool))) == NULL ||
+	    (s->osrel = mport_get_osrelease(mport)) == NULL) {
+		mport_fetch_session_free(s);
+		SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		return NULL;
+	}
+
+	/* with a single mirror there is nothing to rank */
+	if (load_scores(mport, s, stale) > 0 && s->nmirrors > 1)
+		probe_mirrors(mport, s, stale);
+
+	free(stale);
+	mport->fetch_session = s;
+
+	return s;
+}
+
+
+/* mport_fetch_session_reset(mport)
+ *
+ * Throw away the session, for when the index or the settings it was built
+ * from have changed.
+ */
+void
+mport_fetch_session_reset(mportInstance *mport)
+{
+
+	mport_fetch_session_free(mport->fetch_session);
+	mport->fetch_session = NULL;
+}
+
+
+/* mport_set_repository(mport, url)
+ *
+ * Fetch the index and packages from url and nothing else for the rest of
+ * this instance, ahead of the repository setting.  It is laid out as a
+ * mirror is, and can be a file:// URL for a local copy.  NULL goes back to
+ * the setting or the index's mirrors.
+ */
+MPORT_PUBLIC_API int
+mport_set_repository(mportInstance *mport, const char *url)
+{
+	char *copy = NULL;
+
+	if (url != NULL && (copy = strdup(url)) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	free(mport->repository);
+	mport->repository = copy;
+	mport_fetch_session_reset(mport);
+
+	return (MPORT_OK);
+}
+
+
+/* mport_repository(mport)
+ *
+ * The repository used in place of the mirrors, or NULL for the mirrors.
+ * The caller frees it.
+ */
+char *
+mport_repository(mportInstance *mport)
+{
+	char *url;
+
+	if (mport->repository != NULL)
+		return strdup(mport->repository);
+
+	if ((url = mport_setting_get(mport, MPORT_SETTING_REPOSITORY)) != NULL && *url == '\0') {
+		free(url);
+		url = NULL;
+	}
+
+	return url;
+}
+
+
+void
+mport_fetch_session_free(mportFetchSession *s)
+{
+
+	if (s == NULL)
+		return;
+
+	for (int i = 0; i < s->nmirrors; i++)
+		free(s->mirrors[i]);
+	free(s->mirrors);
+	free(s->down);
+	free(s->score);
+	free(s->osrel);
+	free(s);
+}
+
+
+/* mport_fetch_session_order(s, order)
+ *
+ * Fill order (nmirrors long) with mirror indexes in the order they should be
+ * tried: best score first, with mirrors that are known to be down pushed to
+ * the back.  Ties keep index order.  Returns the count.
+ */
+int
+mport_fetch_session_order(mportFetchSession *s, int *order)
+{
+
+	for (int i = 0; i < s->nmirrors; i++) {
+		int j = i;
+
+		while (j > 0) {
+			int prev = order[j - 1];
+
+			if (s->down[prev] < s->down[i] ||
+			    (s->down[prev] == s->down[i] && s->score[prev] <= s->score[i]))
+				break;
+
+			order[j] = prev;
+			j--;
+		}
+		order[j] = i;
+	}
+
+	return s->nmirrors;
+}
+
+
+/* mport_fetch_session_mark(s, mirror, xfer, ret)
+ *
+ * Record the outcome of a transfer against mirror.  A completed transfer
+ * blends its speed into the score; a failure costs a penalty, and failing to
+ * connect at all marks the mirror down.  A missing file says nothing about
+ * the mirror's connectivity, but still counts against it.
+ */
+void
+mport_fetch_session_mark(mportFetchSession *s, int mirror, const mportFetchXfer *xfer, int ret)
+{
+
+	if (mirror < 0 || mirror >= s->nmirrors)
+		return;
+
+	if (ret == MPORT_OK) {
+		s->down[mirror] = false;
+
+		/* too small a transfer to say much about throughput */
+		if (xfer->transferred >= PROBE_BYTES) {
+			long observed = xfer->elapsed * PROBE_BYTES / xfer->transferred;
+
+			s->score[mirror] = (int)((3L * s->score[mirror] + observed) / 4);
+		}
+		return;
+	}
+
+	s->score[mirror] += FAIL_PENALTY;
+	if (s->score[mirror] > MPORT_MIRROR_UNREACHABLE)
+		s->score[mirror] = MPORT_MIRROR_UNREACHABLE;
+
+	switch (xfer->errcode) {
+		case FETCH_RESOLV:
+		case FETCH_NETWORK:
+		case FETCH_TIMEOUT:
+		case FETCH_DOWN:
+		case FETCH_UNAVAIL:
+			s->down[mirror] = true;
+			break;
+		default:
+			break;
+	}
+}
+
+
+/* mport_mirror_rank(mport)
+ *
+ * Probe every mirror in the current region now, regardless of the age of the
+ * stored scores, and print them best first.
+ */
+MPORT_PUBLIC_API int
+mport_mirror_rank(mportInstance *mport)
+{
+	mportFetchSession *s;
+	bool *all;
+	int *order;
+
+	MPORT_CHECK_FOR_INDEX(mport, "mport_mirror_rank()");
+
+	if ((s = mport_fetch_session(mport)) == NULL)
+		RETURN_CURRENT_ERROR;
+
+	if ((all = calloc(s->nmirrors + 1, sizeof(bool))) == NULL ||
+	    (order = calloc(s->nmirrors + 1, sizeof(int))) == NULL) {
+		free(all);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+
+	for (int i = 0; i < s->nmirrors; i++) {
+		all[i] = true;
+		s->down[i] = false;
+	}
+
+	probe_mirrors(mport, s, all);
+	mport_fetch_session_order(s, order);
+
+	mport_call_msg_cb(mport, "Score\tURL");
+	for (int i = 0; i < s->nmirrors; i++) {
+		if (s->score[order[i]] >= MPORT_MIRROR_UNREACHABLE)
+			mport_call_msg_cb(mport, "-\t%s", s->mirrors[order[i]]);
+		else
+			mport_call_msg_cb(mport, "%dms\t%s", s->score[order[i]], s->mirrors[order[i]]);
+	}
+
+	free(all);
+	free(order);
+
+	return MPORT_OK;
+}
+
+
+/* fill in stored scores; flag the mirrors that are missing one or whose score has expired */
+static int
+load_scores(mportInstance *mport, mportFetchSession *s, bool *stale)
+{
+	sqlite3_stmt *stmt;
+	time_t now = time(NULL);
+	int ttl;
+	int count = 0;
+
+	ttl = mport_setting_get_int(mport, MPORT_SETTING_MIRROR_SCORE_TTL, MPORT_DAY);
+
+	for (int i = 0; i < s->nmirrors; i++) {
+		long long when = 0;
+		int score = 0;
+
+		stale[i] = true;
+
+		if (mport_db_prepare(mport->db, &stmt, "SELECT val FROM settings WHERE name=%Q||%Q",
+		    MPORT_SETTING_MIRROR_SCORE_PREFIX, s->mirrors[i]) != MPORT_OK) {
+			sqlite3_finalize(stmt);
+			count++;
+			continue;
+		}
+
+		if (sqlite3_step(stmt) == SQLITE_ROW &&
+		    sscanf((const char *)sqlite3_column_text(stmt, 0), "%d %lld", &score, &when) == 2) {
+			s->score[i] = score;
+			stale[i] = (now - (time_t)when) > ttl;
+		}
+
+		sqlite3_finalize(stmt);
+
+		if (stale[i])
+			count++;
+	}
+
+	return count;
+}
+
+
+/* mport_fetch_timeout_hold()
+ *
+ * Keep fetchTimeout as it is until mport_fetch_timeout_release(), for the
+ * length of a transfer.
+ */
+void
+mport_fetch_timeout_hold(void)
+{
+
+	pthread_rwlock_rdlock(&timeout_lock);
+}
+
+void
+mport_fetch_timeout_release(void)
+{
+
+	pthread_rwlock_unlock(&timeout_lock);
+}
+
+
+/* probe the flagged mirrors, all at once, and store their new scores */
+static void
+probe_mirrors(mportInstance *mport, mportFetchSession *s, const bool *which)
+{
+	struct mirror_probe *probes;
+	pthread_t *threads;
+	bool *started;
+	int oldTimeout;
+	char name[MPORT_URL_MAX + sizeof(MPORT_SETTING_MIRROR_SCORE_PREFIX)];
+	char val[64];
+
+	probes = calloc(s->nmirrors, sizeof(struct mirror_probe));
+	threads = calloc(s->nmirrors, sizeof(pthread_t));
+	started = calloc(s->nmirrors, sizeof(bool));
+	if (probes == NULL || threads == NULL || started == NULL)
+		goto done;
+
+	pthread_rwlock_wrlock(&timeout_lock);
+	oldTimeout = fetchTimeout;
+	fetchTimeout = PROBE_TIMEOUT;
+
+	for (int i = 0; i < s->nmirrors; i++) {
+		if (!which[i])
+			continue;
+
+		if (asprintf(&probes[i].url, "%s/%s/%s/%s", s->mirrors[i], MPORT_ARCH, s->osrel, MPORT_INDEX_FILE_SOURCE) == -1) {
+			probes[i].url = NULL;
+			probes[i].score = MPORT_MIRROR_UNREACHABLE;
+			continue;
+		}
+
+		if (pthread_create(&threads[i], NULL, probe_mirror, &probes[i]) == 0)
+			started[i] = true;
+		else
+			probe_mirror(&probes[i]);
+	}
+
+	for (int i = 0; i < s->nmirrors; i++) {
+		if (!which[i])
+			continue;
+
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		free(probes[i].url);
+
+		s->score[i] = probes[i].score;
+
+		(void)snprintf(name, sizeof(name), "%s%s", MPORT_SETTING_MIRROR_SCORE_PREFIX, s->mirrors[i]);
+		(void)snprintf(val, sizeof(val), "%d %lld", probes[i].score, (long long)time(NULL));
+		(void)mport_setting_set(mport, name, val);
+	}
+
+	fetchTimeout = oldTimeout;
+	pthread_rwlock_unlock(&timeout_lock);
+
+done:
+	free(probes);
+	free(threads);
+	free(started);
+}
+
+
+/* time the connect plus a PROBE_BYTES sample; runs on its own thread */
+static void *
+probe_mirror(void *arg)
+{
+	struct mirror_probe *p = arg;
+	struct timespec start;
+	char buffer[4096];
+	size_t got = 0, size;
+	FILE *remote;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if ((remote = fetchXGetURL(p->url, NULL, "p")) == NULL) {
+		p->score = MPORT_MIRROR_UNREACHABLE;
+		return NULL;
+	}
+
+	while (got < PROBE_BYTES && (size = fread(buffer, 1, sizeof(buffer), remote)) > 0)
+		got += size;
+
+	if (ferror(remote)) {
+		p->score = MPORT_MIRROR_UNREACHABLE;
+	} else {
+		p->score = (int)mport_elapsed_ms(&start);
+	}
+
+	fclose(remote);
+
+	return NULL;
+}
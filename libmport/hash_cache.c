@@ -0,0 +1,205 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A cache of file hashes, keyed by path and the file's size, mtime, inode
+ * and ctime, so that a bundle which hasn't changed since it was last hashed is
+ * not read again.  It is only an optimization: failing to read or update it
+ * never fails the caller, and does not touch the error state.
+ */
+
+/* mport_hash_cache_put(mport, path, hash)
+ *
+ * Record that path, as it is on disk now, hashes to hash.
+ */
+void
+mport_hash_cache_put(mportInstance *mport, const char *path, const char *hash)
+{
+	sqlite3_stmt *stmt;
+	struct stat st;
+
+	if (hash == NULL || stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+
+	if (sqlite3_prepare_v2(mport->db,
+	    "INSERT OR REPLACE INTO hash_cache (path, size, mtime, ino, ctime, hash) VALUES (?, ?, ?, ?, ?, ?)",
+	    -1, &stmt, NULL) != SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		return;
+	}
+
+	sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 2, (sqlite3_int64)st.st_size);
+	sqlite3_bind_int64(stmt, 3, mport_stat_mtime(&st));
+	sqlite3_bind_int64(stmt, 4, (sqlite3_int64)st.st_ino);
+	sqlite3_bind_int64(stmt, 5, mport_stat_ctime(&st));
+	sqlite3_bind_text(stmt, 6, hash, -1, SQLITE_STATIC);
+	(void)sqlite3_step(stmt);
+	sqlite3_finalize(stmt);
+}
+
+
+/* mport_hash_cache_forget(mport, path)
+ *
+ * Drop any cached hash for path, for when it is deleted.
+ */
+void
+mport_hash_cache_forget(mportInstance *mport, const char *path)
+{
+
+	(void)mport_db_do(mport->db, "DELETE FROM hash_cache WHERE path=%Q", path);
+}
+
+
+/* mport_hash_cache_file(mport, path)
+ *
+ * The SHA256 hash of path, from the cache if the file is unchanged since it
+ * was last hashed.  Must free result; NULL if the file can't be read.
+ */
+char *
+mport_hash_cache_file(mportInstance *mport, const char *path)
+{
+	sqlite3_stmt *stmt;
+	struct stat st;
+	char *hash = NULL;
+
+	if (stat(path, &st) != 0)
+		return NULL;
+
+	if (sqlite3_prepare_v2(mport->db,
+	    "SELECT hash FROM hash_cache WHERE path=? AND size=? AND mtime=? AND ino=? AND ctime=?",
+	    -1, &stmt, NULL) == SQLITE_OK) {
+		sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 2, (sqlite3_int64)st.st_size);
+		sqlite3_bind_int64(stmt, 3, mport_stat_mtime(&st));
+		sqlite3_bind_int64(stmt, 4, (sqlite3_int64)st.st_ino);
+		sqlite3_bind_int64(stmt, 5, mport_stat_ctime(&st));
+
+		if (sqlite3_step(stmt) == SQLITE_ROW)
+			hash = strdup((const char *)sqlite3_column_text(stmt, 0));
+	}
+	sqlite3_finalize(stmt);
+
+	if (hash != NULL)
+		return hash;
+
+	if ((hash = mport_hash_file(path)) != NULL)
+		mport_hash_cache_put(mport, path, hash);
+
+	return hash;
+}
+
+
+/* mport_verify_bundle(mport, path, hash)
+ *
+ * mport_verify_hash(), reusing the hash cache.  Returns 1 if path hashes to
+ * hash, 0 otherwise.
+ */
+MPORT_PUBLIC_API int
+mport_verify_bundle(mportInstance *mport, const char *path, const char *hash)
+{
+	enum mport_checksum_alg alg;
+	bool prefixed;
+	char *filehash;
+	int ret;
+
+	if (hash == NULL || !mport_checksum_parse(hash, &alg, &prefixed))
+		return 0;
+
+	/* the cache only holds SHA256 */
+	if (alg != MPORT_CHECKSUM_SHA256)
+		return mport_verify_hash(path, hash);
+
+	if ((filehash = mport_hash_cache_file(mport, path)) == NULL)
+		return 0;
+
+	ret = strncmp(filehash, mport_checksum_digest(hash), 65) == 0;
+	free(filehash);
+
+	return ret;
+}
+
+
+/* mport_stat_mtime(st)
+ *
+ * st's mtime in nanoseconds, as hash_cache and assets keep it.
+ */
+int64_t
+mport_stat_mtime(const struct stat *st)
+{
+
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+
+/* mport_stat_ctime(st)
+ *
+ * st's ctime in nanoseconds.  Unlike the mtime it can't be set back by
+ * hand, so a file rewritten and then touch -r'd still shows as changed.
+ */
+int64_t
+mport_stat_ctime(const struct stat *st)
+{
+
+	return (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+}
+
+
+/* mport_fingerprint_matches(mport, st, stmt, col)
+ *
+ * Whether the file st describes is the one that was installed, going by the
+ * size, mtime, inode and ctime in columns col to col + 3 of stmt, so it
+ * needn't be hashed.  Rows from before master schema 14 have no fingerprint,
+ * nor any ctime from before 16, and never match, nor does anything with
+ * MPORT_INST_DEEP set.
+ */
+bool
+mport_fingerprint_matches(mportInstance *mport, const struct stat *st, sqlite3_stmt *stmt, int col)
+{
+
+	if ((mport->flags & MPORT_INST_DEEP) != 0 || !S_ISREG(st->st_mode))
+		return false;
+
+	for (int i = col; i < col + 4; i++) {
+		if (sqlite3_column_type(stmt, i) == SQLITE_NULL)
+			return false;
+	}
+
+	return sqlite3_column_int64(stmt, col) == (sqlite3_int64)st->st_size &&
+	    sqlite3_column_int64(stmt, col + 1) == mport_stat_mtime(st) &&
+	    sqlite3_column_int64(stmt, col + 2) == (sqlite3_int64)st->st_ino &&
+	    sqlite3_column_int64(stmt, col + 3) == mport_stat_ctime(st);
+}
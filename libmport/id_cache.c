@@ -0,0 +1,212 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Owner, group and mode lookups for one package install.  Every file with
+ * @owner/@group or its own owner and mode used to cost a getpwnam() or
+ * getgrnam() (slow with LDAP or NIS behind nsswitch) and a setmode(); a
+ * package only uses a handful of distinct names and modes, so they are
+ * looked up once each and kept in plain arrays.
+ *
+ * Names that don't resolve aren't remembered, so a user added by an exec
+ * line part way through the package is picked up.  The cache is meant to
+ * live for one install; scripts between packages may change the accounts.
+ */
+
+struct id_name {
+	char *name;
+	union {
+		uid_t uid;
+		gid_t gid;
+		void *set;	/* from setmode() */
+	} u;
+};
+
+struct id_list {
+	struct id_name *items;
+	int count;
+	int size;
+};
+
+struct mport_id_cache {
+	struct id_list users;
+	struct id_list groups;
+	struct id_list modes;
+};
+
+static struct id_name * id_find(struct id_list *, const char *);
+static struct id_name * id_add(struct id_list *, const char *);
+static void id_list_free(struct id_list *, bool);
+
+
+struct mport_id_cache *
+mport_id_cache_new(void)
+{
+
+	return calloc(1, sizeof(struct mport_id_cache));
+}
+
+/* mport_get_uid(), looking each name up once */
+uid_t
+mport_id_cache_uid(struct mport_id_cache *cache, const char *username)
+{
+	struct id_name *n;
+	uid_t uid;
+
+	if (username == NULL || *username == '\0')
+		return 0; /* root */
+
+	if (cache != NULL && (n = id_find(&cache->users, username)) != NULL)
+		return n->u.uid;
+
+	if ((uid = mport_get_uid(username)) == 0 && strcmp(username, "root") != 0)
+		return 0; /* unknown, maybe not yet */
+
+	if (cache != NULL && (n = id_add(&cache->users, username)) != NULL)
+		n->u.uid = uid;
+
+	return uid;
+}
+
+/* mport_get_gid(), looking each name up once */
+gid_t
+mport_id_cache_gid(struct mport_id_cache *cache, const char *group)
+{
+	struct id_name *n;
+	gid_t gid;
+
+	if (group == NULL || *group == '\0')
+		return 0; /* wheel */
+
+	if (cache != NULL && (n = id_find(&cache->groups, group)) != NULL)
+		return n->u.gid;
+
+	if ((gid = mport_get_gid(group)) == 0 && strcmp(group, "wheel") != 0)
+		return 0;
+
+	if (cache != NULL && (n = id_add(&cache->groups, group)) != NULL)
+		n->u.gid = gid;
+
+	return gid;
+}
+
+/*
+ * setmode(mode), compiled once.  The set belongs to the cache and must not
+ * be freed; NULL if mode doesn't parse.
+ */
+const void *
+mport_id_cache_mode(struct mport_id_cache *cache, const char *mode)
+{
+	struct id_name *n;
+	void *set;
+
+	if (cache == NULL || mode == NULL)
+		return NULL;
+
+	if ((n = id_find(&cache->modes, mode)) != NULL)
+		return n->u.set;
+
+	if ((set = setmode(mode)) == NULL)
+		return NULL;
+
+	if ((n = id_add(&cache->modes, mode)) == NULL) {
+		/* can't keep it, and can't hand out one the caller has to free */
+		free(set);
+		return NULL;
+	}
+	n->u.set = set;
+
+	return set;
+}
+
+void
+mport_id_cache_free(struct mport_id_cache *cache)
+{
+
+	if (cache == NULL)
+		return;
+
+	id_list_free(&cache->users, false);
+	id_list_free(&cache->groups, false);
+	id_list_free(&cache->modes, true);
+	free(cache);
+}
+
+
+static struct id_name *
+id_find(struct id_list *list, const char *name)
+{
+
+	for (int i = 0; i < list->count; i++) {
+		if (strcmp(list->items[i].name, name) == 0)
+			return &list->items[i];
+	}
+
+	return NULL;
+}
+
+static struct id_name *
+id_add(struct id_list *list, const char *name)
+{
+	struct id_name *grown;
+
+	if (list->count == list->size) {
+		int size = list->size == 0 ? 8 : list->size * 2;
+
+		if ((grown = realloc(list->items, size * sizeof(struct id_name))) == NULL)
+			return NULL;
+		list->items = grown;
+		list->size = size;
+	}
+
+	if ((list->items[list->count].name = strdup(name)) == NULL)
+		return NULL;
+
+	return &list->items[list->count++];
+}
+
+static void
+id_list_free(struct id_list *list, bool sets)
+{
+
+	for (int i = 0; i < list->count; i++) {
+		free(list->items[i].name);
+		if (sets)
+			free(list->items[i].u.set);
+	}
+
+	free(list->items);
+}
@@ -35,52 +35,150 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stddef.h>
 
-MPORT_PUBLIC_API int 
-mport_import(mportInstance *mport,  char  *path)
+static int import_read(mportInstance *, FILE *, mportPlan *, int *, int *);
+static int import_add(mportInstance *, mportPlan *, const char *);
+
+/*
+ * mport_import(mport, path)
+ *
+ * Install the packages listed in path, one name a line as mport_export()
+ * writes them, or on standard input if path is NULL.  Blank lines and
+ * anything after a # are skipped.  The whole list is resolved into one
+ * plan, so shared dependencies are planned once and in order, and it runs
+ * as one batch: the bundles download and unpack ahead of the installer,
+ * and the triggers run once at the end.  With a repository set (see
+ * mport_set_repository()) nothing is fetched from anywhere else, which is
+ * how images and jails are built offline.  A summary of the time spent in
+ * each phase is shown at the end.
+ *
+ * Names the index doesn't have are reported and skipped, and the import
+ * then ends with MPORT_ERR_WARN.
+ */
+MPORT_PUBLIC_API int
+mport_import(mportInstance *mport, char *path)
 {
 	FILE *file;
-	bool console = false;
-	char name[1024];
+	mportPlan *plan = NULL;
+	int listed = 0, missing = 0;
+	int ret;
 
-	if (path == NULL)
-		console = true;
-	
-	if (!console && !mport_file_exists(path)) {
-		RETURN_ERROR(MPORT_ERR_FATAL, "File exists at export path");
+	MPORT_CHECK_FOR_INDEX(mport, "mport_import()");
+
+	if (path == NULL) {
+		file = stdin;
+	} else if ((file = fopen(path, "r")) == NULL) {
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open import file %s: %s", path, strerror(errno));
 	}
 
-	if (!console) {
-		file = fopen(path, "r");
-		if (file == NULL)
-			RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open import file %s", path, strerror(errno));
+	mport_trace_totals_begin(mport);
+	mport_trace_begin(mport, MPORT_TRACE_IMPORT, path);
+
+	mport_trace_begin(mport, MPORT_TRACE_PLAN, path);
+	if ((ret = mport_plan_new(mport, &plan)) == MPORT_OK)
+		ret = import_read(mport, file, plan, &listed, &missing);
+	mport_trace_end(mport, MPORT_TRACE_PLAN, listed, 0, ret);
+
+	if (file != stdin)
+		fclose(file);
+
+	if (ret == MPORT_OK) {
+		mport_call_msg_cb(mport, "%d packages listed, %zu to install or update", listed, plan->nsteps);
+		ret = mport_plan_execute(mport, plan);
 	}
 
-	while (!feof(file)) {
-		if (console) {
-			fgets(name, 1024, stdin);
-		} else {
-			fgets(name, 1024, file); 
+	mport_trace_end(mport, MPORT_TRACE_IMPORT, ret == MPORT_OK ? (long)plan->nsteps : 0, 0, ret);
+	mport_trace_totals_report(mport);
+	mport_plan_free(plan);
+
+	if (ret != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (missing > 0)
+		RETURN_ERRORX(MPORT_ERR_WARN, "%d of %d listed packages were not found in the index", missing, listed);
+
+	return (MPORT_OK);
+}
+
+/* add every package named in file to plan */
+static int
+import_read(mportInstance *mport, FILE *file, mportPlan *plan, int *listed, int *missing)
+{
+	char line[1024];
+	char *name, *end;
+	int ret;
+
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if ((end = strchr(line, '#')) != NULL)
+			*end = '\0';
+
+		for (name = line; isspace((unsigned char)*name); name++)
+			;
+		for (end = name + strlen(name); end > name && isspace((unsigned char)end[-1]); end--)
+			;
+		*end = '\0';
+
+		if (*name == '\0')
+			continue;
+		(*listed)++;
+
+		if ((ret = import_add(mport, plan, name)) == MPORT_ERR_WARN) {
+			mport_call_msg_cb(mport, "%s", mport_err_string());
+			(*missing)++;
+		} else if (ret != MPORT_OK) {
+			RETURN_CURRENT_ERROR;
 		}
-		
-		for (int i = 0; i < 1024; i++) {
-        	if (name[i] == '\n') {
-				name[i] = '\0';
+	}
+
+	if (ferror(file))
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't read import file: %s", strerror(errno));
+
+	return (MPORT_OK);
+}
+
+/*
+ * Add name to plan.  It may be an alias, or a glob matching one package,
+ * as with mport_install(); a glob matching several only picks the one
+ * named exactly.  MPORT_ERR_WARN if the index has no such package.
+ */
+static int
+import_add(mportInstance *mport, mportPlan *plan, const char *name)
+{
+	mportIndexEntry **e;
+	int pick = -1;
+	int ret;
+
+	if (mport_index_lookup_pkgname(mport, name, &e) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (e == NULL || e[0] == NULL) {
+		mport_index_entry_free_vec(e);
+		RETURN_ERRORX(MPORT_ERR_WARN, "%s is not in the index", name);
+	}
+
+	if (e[1] == NULL) {
+		pick = 0;
+	} else {
+		for (int i = 0; e[i] != NULL; i++) {
+			if (strcmp(e[i]->pkgname, name) == 0) {
+				pick = i;
 				break;
 			}
 		}
-		
-		mport_call_msg_cb(mport, "Installing %s", name);
-		mport_install(mport, name,  NULL, NULL, MPORT_EXPLICIT);
 	}
 
-	if (!console) {
-		fclose(file);
+	if (pick == -1) {
+		mport_index_entry_free_vec(e);
+		RETURN_ERRORX(MPORT_ERR_WARN, "%s matches more than one package", name);
 	}
-	
-	return (MPORT_OK);
+
+	ret = mport_plan_add(mport, plan, e[pick]->pkgname, e[pick]->version, MPORT_EXPLICIT);
+	mport_index_entry_free_vec(e);
+
+	return (ret);
 }
 
 MPORT_PUBLIC_API int 
@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stddef.h>
+#include <ctype.h>
 
 static int index_is_recentish(void);
 
@@ -47,7 +48,16 @@ static int lookup_alias(mportInstance *, const char *, char **);
 
 static int attach_index_db(sqlite3 *db);
 
-static void populate_row(sqlite3_stmt *stmt, mportIndexEntry *e);
+static void index_attached(mportInstance *);
+
+static void index_version_key_build(mportInstance *);
+
+static void index_fulltext_build(mportInstance *);
+
+static int index_fulltext_query(const char *, char **);
+
+static int index_iter_open(mportInstance *, mportIndexIter **, sqlite3_stmt *, bool, char *);
+
 
 /*
  * Loads the index database.  The index contains a list of bundles that are
@@ -64,6 +74,20 @@ mport_index_load(mportInstance *mport)
 {
 	bool noIndex = mport->noIndex;
 
+	/*
+	 * A read only instance never refreshes the index, so there is nothing
+	 * to decide until a query needs it; see mport_index_attach().
+	 */
+	if (mport->flags & MPORT_INST_READONLY) {
+		if (mport->flags & MPORT_INST_HAVE_INDEX)
+			return (MPORT_OK);
+		if (!mport_file_exists(MPORT_INDEX_FILE))
+			RETURN_ERROR(MPORT_ERR_FATAL, "No index file is present; run mport index first");
+
+		mport->flags |= MPORT_INST_HAVE_INDEX | MPORT_INST_INDEX_DEFERRED;
+		return (MPORT_OK);
+	}
+
 	char *autoupdate = mport_setting_get(mport, MPORT_SETTING_REPO_AUTOUPDATE);
 	if (autoupdate != NULL && (strcmp("FALSE", autoupdate) == 0 || strcmp("false", autoupdate) == 0 ||
 			strcmp("NO", autoupdate) == 0 || strcmp("no", autoupdate) == 0)) {
@@ -76,6 +100,7 @@ mport_index_load(mportInstance *mport)
 		}
 
 		mport->flags |= MPORT_INST_HAVE_INDEX;
+		index_attached(mport);
 
 		if (!index_is_recentish() && !noIndex && access(MPORT_INDEX_FILE, W_OK) == 0) {
 			if (index_last_checked_recentish(mport))
@@ -97,6 +122,8 @@ mport_index_load(mportInstance *mport)
 		}
 
 		mport->flags |= MPORT_INST_HAVE_INDEX;
+		index_attached(mport);
+
 		if (index_update_last_checked(mport) != MPORT_OK) {
 			RETURN_CURRENT_ERROR;
 		}
@@ -105,6 +132,31 @@ mport_index_load(mportInstance *mport)
 	return (MPORT_OK);
 }
 
+/*
+ * mport_index_attach(mport)
+ *
+ * Attach the index mport_index_load() left for later, before the first
+ * query against it.  Every entry point into idx comes through here, most of
+ * them by way of MPORT_CHECK_FOR_INDEX().
+ */
+int
+mport_index_attach(mportInstance *mport)
+{
+
+	if (!(mport->flags & MPORT_INST_INDEX_DEFERRED))
+		return (MPORT_OK);
+
+	if (attach_index_db(mport->db) != MPORT_OK) {
+		mport->flags &= ~(MPORT_INST_HAVE_INDEX | MPORT_INST_INDEX_DEFERRED);
+		RETURN_CURRENT_ERROR;
+	}
+
+	mport->flags &= ~MPORT_INST_INDEX_DEFERRED;
+	index_attached(mport);
+
+	return (MPORT_OK);
+}
+
 static int
 attach_index_db(sqlite3 *db)
 {
@@ -117,6 +169,193 @@ attach_index_db(sqlite3 *db)
 }
 
 
+/*
+ * Derive what we keep alongside a freshly attached index.  None of it is
+ * required, so failures are silent and only cost speed.
+ */
+static void
+index_attached(mportInstance *mport)
+{
+
+	index_version_key_build(mport);
+	index_fulltext_build(mport);
+}
+
+/*
+ * Add a version_key column to idx.packages, as the master packages table
+ * has, so that version comparisons against the index are plain text
+ * comparisons.  Like the full text table it goes away with the index file.
+ */
+static void
+index_version_key_build(mportInstance *mport)
+{
+	sqlite3_stmt *stmt;
+
+	mport->flags &= ~MPORT_INST_INDEX_VERSION_KEY;
+
+	if (sqlite3_prepare_v2(mport->db, "SELECT version_key FROM idx.packages LIMIT 0", -1, &stmt, NULL) == SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		mport->flags |= MPORT_INST_INDEX_VERSION_KEY;
+		return;
+	}
+
+	if ((mport->flags & MPORT_INST_READONLY) || access(MPORT_INDEX_FILE, W_OK) != 0)
+		return;
+
+	if (sqlite3_exec(mport->db, "BEGIN TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+		return;
+
+	if (sqlite3_exec(mport->db, "ALTER TABLE idx.packages ADD COLUMN version_key text", NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(mport->db, "UPDATE idx.packages SET version_key = mport_version_key(version)", NULL, NULL,
+	                 NULL) != SQLITE_OK ||
+	    sqlite3_exec(mport->db, "COMMIT TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+		(void) sqlite3_exec(mport->db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+		return;
+	}
+
+	mport->flags |= MPORT_INST_INDEX_VERSION_KEY;
+}
+
+/*
+ * Build the full text index over package names and comments, unless the
+ * attached index already carries one.  It lives in the index file itself,
+ * so a freshly downloaded index drops it, and applying a delta drops it
+ * explicitly.  Searching falls back to pattern matching when the table
+ * can't be built: sqlite without FTS5, or an index file we can't write.
+ */
+static void
+index_fulltext_build(mportInstance *mport)
+{
+	sqlite3_stmt *stmt;
+	int exists = 0;
+
+	if ((mport->flags & MPORT_INST_READONLY) || access(MPORT_INDEX_FILE, W_OK) != 0)
+		return;
+
+	if (sqlite3_prepare_v2(mport->db, "SELECT 1 FROM idx.sqlite_master WHERE name='packages_fts'", -1, &stmt,
+	                       NULL) != SQLITE_OK)
+		return;
+	exists = sqlite3_step(stmt) == SQLITE_ROW;
+	sqlite3_finalize(stmt);
+
+	if (exists)
+		return;
+
+	/* not fatal; errors are left in sqlite rather than mport_err */
+	if (sqlite3_exec(mport->db, "BEGIN TRANSACTION", NULL, NULL, NULL) != SQLITE_OK)
+		return;
+
+	if (sqlite3_exec(mport->db,
+	                 "CREATE VIRTUAL TABLE idx.packages_fts USING fts5(pkg, comment, prefix='2 3')",
+	                 NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(mport->db,
+	                 "INSERT INTO idx.packages_fts (rowid, pkg, comment) SELECT rowid, pkg, comment FROM idx.packages",
+	                 NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(mport->db, "COMMIT TRANSACTION", NULL, NULL, NULL) != SQLITE_OK) {
+		(void) sqlite3_exec(mport->db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+	}
+}
+
+/*
+ * Turn free form search terms into an FTS5 query: every word must match,
+ * each as a prefix, with quoting so that punctuation in package names
+ * ("py39-foo", "c++") is taken literally.  The result is sqlite3_malloc'd.
+ */
+static int
+index_fulltext_query(const char *terms, char **query)
+{
+	sqlite3_str *q;
+	const char *p;
+	bool inword = false;
+
+	if ((q = sqlite3_str_new(NULL)) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	for (p = terms; *p != '\0'; p++) {
+		if (isspace((unsigned char) *p)) {
+			if (inword)
+				sqlite3_str_appendall(q, "\"* ");
+			inword = false;
+			continue;
+		}
+
+		if (!inword)
+			sqlite3_str_appendchar(q, 1, '"');
+		inword = true;
+
+		if (*p == '"')
+			sqlite3_str_appendchar(q, 1, '"');
+		sqlite3_str_appendchar(q, 1, *p);
+	}
+
+	if (inword)
+		sqlite3_str_appendall(q, "\"*");
+
+	if (sqlite3_str_errcode(q) != SQLITE_OK || sqlite3_str_length(q) == 0) {
+		sqlite3_free(sqlite3_str_finish(q));
+		RETURN_ERROR(MPORT_ERR_FATAL, "Search terms required");
+	}
+
+	*query = sqlite3_str_finish(q);
+
+	return MPORT_OK;
+}
+
+/*
+ * Full text search of package names and comments.  Every word in terms must
+ * match the start of a word in either one, and the best matches, weighting
+ * names over comments, come first.  The results stream through an iterator
+ * as with mport_index_iter_search().
+ *
+ * Without the full text index, this degrades to a substring match of the
+ * whole of terms against the name or comment, in index order.
+ */
+MPORT_PUBLIC_API int
+mport_index_fulltext_search(mportInstance *mport, mportIndexIter **iter_p, const char *terms)
+{
+	sqlite3_stmt *stmt = NULL;
+	char *query;
+	char *like;
+	int ret;
+
+	if (mport == NULL) {
+		RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
+	}
+
+	MPORT_CHECK_FOR_INDEX(mport, "mport_index_fulltext_search()")
+
+	if (terms == NULL) {
+		RETURN_ERROR(MPORT_ERR_FATAL, "Search terms required");
+	}
+
+	if (index_fulltext_query(terms, &query) != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
+	}
+
+	if (sqlite3_prepare_v2(mport->db,
+	                       "SELECT p.pkg, p.version, p.comment, p.bundlefile, p.license, p.hash, p.type "
+	                       "FROM idx.packages_fts f JOIN idx.packages p ON p.rowid = f.rowid "
+	                       "WHERE packages_fts MATCH ? ORDER BY bm25(packages_fts, 10.0, 1.0)",
+	                       -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_bind_text(stmt, 1, query, -1, sqlite3_free) != SQLITE_OK) {
+			sqlite3_finalize(stmt);
+			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+		}
+
+		return index_iter_open(mport, iter_p, stmt, false, NULL);
+	}
+	sqlite3_free(query);
+
+	if ((like = sqlite3_mprintf("%%%s%%", terms)) == NULL) {
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+
+	ret = mport_index_iter_search(mport, iter_p, "pkg LIKE %Q OR comment LIKE %Q", like, like);
+	sqlite3_free(like);
+
+	return ret;
+}
+
 /**
  * mport_index_load is typically preferred.  This function is only used to force
  * a download of the index manually by the user.
@@ -129,6 +368,10 @@ mport_index_get(mportInstance *mport)
 		RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
 	}
 
+	if (mport_index_attach(mport) != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
+	}
+
 	if (!(mport->flags & MPORT_INST_HAVE_INDEX)) {
 		if (mport_fetch_bootstrap_index(mport) != MPORT_OK) {
 			RETURN_CURRENT_ERROR;
@@ -142,19 +385,27 @@ mport_index_get(mportInstance *mport)
 
 	/* if we were already attached, reconnect refreshed index. */
 	if (mport->flags & MPORT_INST_HAVE_INDEX) {
+		/* cached statements and lookups may refer to the old idx */
+		mport_db_cache_reset(mport);
+		mport_index_cache_reset(mport);
+
 		if (mport_db_do(mport->db, "DETACH idx") != MPORT_OK) {
 			RETURN_CURRENT_ERROR;
 		}
 
-		mport->flags &= ~MPORT_INST_HAVE_INDEX;
+		mport->flags &= ~(MPORT_INST_HAVE_INDEX | MPORT_INST_INDEX_VERSION_KEY);
 
 		if (attach_index_db(mport->db) != MPORT_OK) {
 			RETURN_CURRENT_ERROR;
 		}
 
 		mport->flags |= MPORT_INST_HAVE_INDEX;
+		index_attached(mport);
 	}
 
+	/* the mirror list may have changed with the index */
+	mport_fetch_session_reset(mport);
+
 	if (index_update_last_checked(mport) != MPORT_OK) {
 		RETURN_CURRENT_ERROR;
 	}
@@ -162,6 +413,129 @@ mport_index_get(mportInstance *mport)
 	return (MPORT_OK);
 }
 
+/* mport_index_outdated(mport, outdated)
+ *
+ * Find every installed package that mport_index_check() would report as
+ * having an update, in a single query: either the index has a newer
+ * version, or the same version built for a newer OS release than the one
+ * installed.  Packages the index no longer has at all are included too,
+ * with a NULL index_version.  outdated is set to a NULL terminated vector,
+ * empty if everything is current; free it with
+ * mport_index_outdated_free_vec().
+ */
+MPORT_PUBLIC_API int
+mport_index_outdated(mportInstance *mport, mportOutdatedEntry ***outdated)
+{
+	sqlite3_stmt *stmt;
+	mportOutdatedEntry **e = NULL, **grown;
+	const char *same, *older;
+	char *os_release;
+	int n = 0, len = 0;
+	int step;
+	int ret = MPORT_OK;
+
+	if (mport == NULL) {
+		RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
+	}
+
+	MPORT_CHECK_FOR_INDEX(mport, "mport_index_outdated()")
+
+	if ((os_release = mport_get_osrelease(mport)) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Unable to determine OS release");
+
+	/* compare precomputed keys when the index has them */
+	if (mport->flags & MPORT_INST_INDEX_VERSION_KEY) {
+		same = "installed.version_key = i.version_key";
+		older = "installed.version_key < i.version_key";
+	} else {
+		same = "mport_version_cmp(installed.version, i.version) = 0";
+		older = "mport_version_cmp(installed.version, i.version) < 0";
+	}
+
+	/* aliases are resolved first so the join can use the index on idx.packages */
+	if (mport_db_prepare(mport->db, &stmt,
+	    "WITH installed AS (SELECT p.pkg, p.version, p.version_key, p.os_release, COALESCE(a.pkg, p.pkg) AS ipkg "
+	    "FROM packages p LEFT JOIN idx.aliases a ON a.alias = p.pkg) "
+	    "SELECT installed.pkg, installed.version, installed.os_release, i.version, "
+	    "CASE WHEN i.pkg IS NULL THEN 0 ELSE %s END "
+	    "FROM installed LEFT JOIN idx.packages i ON i.pkg = installed.ipkg "
+	    "WHERE CASE WHEN i.pkg IS NULL THEN 1 ELSE %s OR "
+	    "(%s AND mport_version_cmp(installed.os_release, %Q) < 0) END "
+	    "GROUP BY installed.pkg ORDER BY installed.pkg", same, older, same, os_release) != MPORT_OK) {
+		free(os_release);
+		sqlite3_finalize(stmt);
+		RETURN_CURRENT_ERROR;
+	}
+	free(os_release);
+
+	while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (n + 1 >= len) {
+			len = len == 0 ? 32 : len * 2;
+			if ((grown = realloc(e, len * sizeof(mportOutdatedEntry *))) == NULL) {
+				ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+				goto DONE;
+			}
+			e = grown;
+		}
+
+		if ((e[n] = calloc(1, sizeof(mportOutdatedEntry))) == NULL) {
+			ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+			goto DONE;
+		}
+		e[n + 1] = NULL;
+
+		e[n]->pkgname = strdup((const char *) sqlite3_column_text(stmt, 0));
+		e[n]->version = strdup((const char *) sqlite3_column_text(stmt, 1));
+		e[n]->os_release = strdup((const char *) sqlite3_column_text(stmt, 2));
+		if (sqlite3_column_type(stmt, 3) != SQLITE_NULL)
+			e[n]->index_version = strdup((const char *) sqlite3_column_text(stmt, 3));
+		e[n]->os_only = sqlite3_column_int(stmt, 4) != 0;
+		n++;
+
+		if (e[n - 1]->pkgname == NULL || e[n - 1]->version == NULL || e[n - 1]->os_release == NULL ||
+		    (e[n - 1]->index_version == NULL && sqlite3_column_type(stmt, 3) != SQLITE_NULL)) {
+			ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+			goto DONE;
+		}
+	}
+
+	if (step != SQLITE_DONE)
+		ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	else if (e == NULL && (e = calloc(1, sizeof(mportOutdatedEntry *))) == NULL)
+		ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+DONE:
+	sqlite3_finalize(stmt);
+
+	if (ret != MPORT_OK) {
+		mport_index_outdated_free_vec(e);
+		e = NULL;
+	}
+	*outdated = e;
+
+	return ret;
+}
+
+
+MPORT_PUBLIC_API void
+mport_index_outdated_free_vec(mportOutdatedEntry **e)
+{
+
+	if (e == NULL)
+		return;
+
+	for (mportOutdatedEntry **p = e; *p != NULL; p++) {
+		free((*p)->pkgname);
+		free((*p)->version);
+		free((*p)->os_release);
+		free((*p)->index_version);
+		free(*p);
+	}
+
+	free(e);
+}
+
+
 MPORT_PUBLIC_API int
 mport_index_check(mportInstance *mport, mportPackageMeta *pack) {
 	mportIndexEntry **indexEntries, **indexEntries_orig;
@@ -265,6 +639,23 @@ mport_index_get_mirror_list(mportInstance *mport, char ***list_p, int *list_size
 	int len;
 	sqlite3_stmt *stmt;
 	char *mirror_region;
+	char *repository;
+
+	/* a local or mirrored repository stands in for the index's mirrors */
+	if ((repository = mport_repository(mport)) != NULL) {
+		if ((list = calloc(2, sizeof(char *))) == NULL) {
+			free(repository);
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		}
+		list[0] = repository;
+		*list_p = list;
+		*list_size = 1;
+		return (MPORT_OK);
+	}
+
+	if (mport_index_attach(mport) != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
+	}
 
 	mirror_region = mport_setting_get(mport, MPORT_SETTING_MIRROR_REGION);
 	if (mirror_region == NULL) {
@@ -320,6 +711,10 @@ mport_index_print_mirror_list(mportInstance *mport)
 	int ret;
 	sqlite3_stmt *stmt;
 
+	if (mport_index_attach(mport) != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
+	}
+
 	if (mport_db_prepare(mport->db, &stmt, "SELECT country, mirror FROM idx.mirrors ORDER BY country") != MPORT_OK) {
 		sqlite3_finalize(stmt);
 		RETURN_CURRENT_ERROR;
@@ -344,256 +739,512 @@ mport_index_print_mirror_list(mportInstance *mport)
 }
 
 /*
- * Looks up a pkgname from the index and fills a vector of index entries
- * with the result.
+ * Streaming cursors over idx.packages.
  *
- * Globbing is supported, and the alias list is consulted.  The calling code
- * is responsible for freeing the memory allocated.  See
- * mport_index_entry_free_vec()
+ * An iterator steps one row at a time and hands back the same entry on
+ * every call.  The strings in it point straight at the sqlite row and are
+ * only valid until the next call to mport_index_iter_next() or
+ * mport_index_iter_free(); copy anything that has to outlive that.
  */
-MPORT_PUBLIC_API int
-mport_index_lookup_pkgname(mportInstance *mport, const char *pkgname, mportIndexEntry ***entry_vec)
-{
-	char *lookup = NULL;
-	int count;
-	int i = 0, step;
+struct _IndexIter {
+	mportInstance *mport;
 	sqlite3_stmt *stmt;
-	int ret = MPORT_OK;
-	mportIndexEntry **e = NULL;
+	bool borrowed;
+	char *bound; /* text bound to stmt, owned by the iterator */
+	mportIndexEntry entry;
+};
 
-	if (mport == NULL) {
-		RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
+#define INDEX_COLUMNS "pkg, version, comment, bundlefile, license, hash, type"
+
+static int
+index_iter_open(mportInstance *mport, mportIndexIter **iter_p, sqlite3_stmt *stmt, bool borrowed, char *bound)
+{
+	mportIndexIter *iter;
+
+	if ((iter = calloc(1, sizeof(mportIndexIter))) == NULL) {
+		if (borrowed)
+			mport_db_return(mport, stmt);
+		else
+			sqlite3_finalize(stmt);
+		free(bound);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
 	}
 
-	MPORT_CHECK_FOR_INDEX(mport, "mport_index_lookup_pkgname()")
+	iter->mport = mport;
+	iter->stmt = stmt;
+	iter->borrowed = borrowed;
+	iter->bound = bound;
+	*iter_p = iter;
 
-	if (lookup_alias(mport, pkgname, &lookup) != MPORT_OK) {
-		RETURN_CURRENT_ERROR;
+	return MPORT_OK;
+}
+
+static void
+index_iter_release(mportIndexIter *iter)
+{
+
+	if (iter->stmt == NULL)
+		return;
+
+	if (iter->borrowed)
+		mport_db_return(iter->mport, iter->stmt);
+	else
+		sqlite3_finalize(iter->stmt);
+	iter->stmt = NULL;
+}
+
+static int
+index_iter_vsearch(mportInstance *mport, mportIndexIter **iter_p, const char *fmt, va_list args)
+{
+	sqlite3_stmt *stmt = NULL;
+	char *where;
+
+	if (mport == NULL) {
+		RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
 	}
 
-	if (mport_db_count(mport->db, &count, "SELECT count(*) FROM idx.packages  WHERE pkg GLOB %Q", lookup) != MPORT_OK) {
+	if (mport_index_attach(mport) != MPORT_OK) {
 		RETURN_CURRENT_ERROR;
 	}
 
-	e = (mportIndexEntry **) calloc((size_t) count + 1, sizeof(mportIndexEntry *));
-	if (e == NULL) {
-		free(lookup);
-		RETURN_ERROR(MPORT_ERR_FATAL, "Could not allocate memory for index entries");
+	if ((where = sqlite3_vmprintf(fmt, args)) == NULL) {
+		RETURN_ERROR(MPORT_ERR_FATAL, "Could not build where clause");
 	}
-	*entry_vec = e;
 
-	if (count == 0) {
-		free(lookup);
-		return MPORT_OK;
+	if (mport_db_prepare(mport->db, &stmt, "SELECT " INDEX_COLUMNS " FROM idx.packages WHERE %s", where) != MPORT_OK) {
+		sqlite3_free(where);
+		sqlite3_finalize(stmt);
+		RETURN_CURRENT_ERROR;
 	}
+	sqlite3_free(where);
 
-	if (mport_db_prepare(mport->db, &stmt,
-	                     "SELECT pkg, version, comment, bundlefile, license, hash FROM idx.packages WHERE pkg GLOB %Q",
-	                     lookup) != MPORT_OK) {
-		ret = mport_err_code();
-		goto DONE;
-	}
+	return index_iter_open(mport, iter_p, stmt, false, NULL);
+}
 
-	while (1) {
-		step = sqlite3_step(stmt);
+/* Globbing lookup of a package name, after resolving aliases */
+static int
+index_iter_lookup(mportInstance *mport, mportIndexIter **iter_p, const char *pkgname)
+{
+	sqlite3_stmt *stmt;
+	char *lookup = NULL;
 
-		if (step == SQLITE_ROW) {
-			if ((e[i] = (mportIndexEntry *) calloc(1, sizeof(mportIndexEntry))) == NULL) {
-				ret = MPORT_ERR_FATAL;
-				goto DONE;
-			}
+	if (lookup_alias(mport, pkgname, &lookup) != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
+	}
 
-			populate_row(stmt, e[i]);
+	if (lookup == NULL) {
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
 
-			if (e[i]->pkgname == NULL || e[i]->version == NULL || e[i]->comment == NULL || e[i]->license == NULL ||
-			    e[i]->bundlefile == NULL) {
-				ret = MPORT_ERR_FATAL;
-				goto DONE;
-			}
+	if (mport_db_borrow(mport, &stmt, "SELECT " INDEX_COLUMNS " FROM idx.packages WHERE pkg GLOB ?") != MPORT_OK) {
+		free(lookup);
+		RETURN_CURRENT_ERROR;
+	}
 
-			i++;
-		} else if (step == SQLITE_DONE) {
-			e[i] = NULL;
-			goto DONE;
-		} else {
-			ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-			goto DONE;
-		}
+	if (sqlite3_bind_text(stmt, 1, lookup, -1, SQLITE_STATIC) != SQLITE_OK) {
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+		mport_db_return(mport, stmt);
+		free(lookup);
+		RETURN_CURRENT_ERROR;
 	}
 
-	DONE:
-	free(lookup);
-	sqlite3_finalize(stmt);
-	return ret;
+	return index_iter_open(mport, iter_p, stmt, true, lookup);
 }
 
-
-/* mport_index_search(mportInstance *mport, mportIndexEntry ***entry_vec, const char *where, ...)
- *
- * Allocate and populate the index meta for the given package in the index.
- *
- * 'where' and the vargs are used to be build a where clause.  For example to search by
- * name:
- *
- * mport_index_search(mport, &indexEntries, "pkg=%Q", name);
- *
- * indexEntries is set to an empty allocated list and MPORT_OK is returned if no packages where found.
+/*
+ * Open an iterator over the index entries matching a where clause built
+ * from fmt and the vargs, as with mport_index_search().
  */
 MPORT_PUBLIC_API int
-mport_index_search(mportInstance *mport, mportIndexEntry ***entry_vec, const char *fmt, ...)
+mport_index_iter_search(mportInstance *mport, mportIndexIter **iter_p, const char *fmt, ...)
 {
 	va_list args;
-	sqlite3_stmt *stmt;
-	int ret = MPORT_OK;
-	int len;
-	int i = 0, step;
-	char *where;
-	mportIndexEntry **e;
+	int ret;
 
 	va_start(args, fmt);
-	where = sqlite3_vmprintf(fmt, args);
+	ret = index_iter_vsearch(mport, iter_p, fmt, args);
 	va_end(args);
 
+	return ret;
+}
+
+/* Open an iterator over every entry in the index */
+MPORT_PUBLIC_API int
+mport_index_iter_list(mportInstance *mport, mportIndexIter **iter_p)
+{
+	sqlite3_stmt *stmt = NULL;
+
 	if (mport == NULL) {
 		RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
 	}
 
-	sqlite3 *db = mport->db;
-
-	if (where == NULL) {
-		RETURN_ERROR(MPORT_ERR_FATAL, "Could not build where clause");
+	if (mport_index_attach(mport) != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
 	}
 
-	if (mport_db_count(mport->db, &len, "SELECT count(*) FROM idx.packages  WHERE %s", where) != MPORT_OK) {
+	if (mport_db_prepare(mport->db, &stmt, "SELECT " INDEX_COLUMNS " FROM idx.packages") != MPORT_OK) {
+		sqlite3_finalize(stmt);
 		RETURN_CURRENT_ERROR;
 	}
 
-	e = (mportIndexEntry **) calloc((size_t) len + 1, sizeof(mportIndexEntry *));
-	if (e == NULL) {
-		sqlite3_free(where);
-		RETURN_ERROR(MPORT_ERR_FATAL, "Could not allocate memory");
-	}
-	*entry_vec = e;
+	return index_iter_open(mport, iter_p, stmt, false, NULL);
+}
 
-	if (len == 0) {
-		sqlite3_free(where);
+/*
+ * Step to the next row.  *entry is set to the iterator's entry, or to NULL
+ * once the rows are exhausted; the statement is released at that point.
+ */
+MPORT_PUBLIC_API int
+mport_index_iter_next(mportIndexIter *iter, mportIndexEntry **entry)
+{
+	sqlite3_stmt *stmt;
+	mportIndexEntry *e;
+
+	*entry = NULL;
+
+	if (iter == NULL || iter->stmt == NULL)
 		return MPORT_OK;
+
+	stmt = iter->stmt;
+	e = &iter->entry;
+
+	switch (sqlite3_step(stmt)) {
+		case SQLITE_ROW:
+			e->pkgname = (char *) sqlite3_column_text(stmt, 0);
+			e->version = (char *) sqlite3_column_text(stmt, 1);
+			e->comment = (char *) sqlite3_column_text(stmt, 2);
+			e->bundlefile = (char *) sqlite3_column_text(stmt, 3);
+			e->license = (char *) sqlite3_column_text(stmt, 4);
+			e->hash = (char *) sqlite3_column_text(stmt, 5);
+			if (sqlite3_column_type(stmt, 6) == SQLITE_INTEGER)
+				e->type = sqlite3_column_int(stmt, 6);
+			else
+				e->type = 0;
+
+			if (e->pkgname == NULL || e->version == NULL || e->bundlefile == NULL) {
+				RETURN_ERROR(MPORT_ERR_FATAL, "Malformed index entry");
+			}
+
+			*entry = e;
+			return MPORT_OK;
+		case SQLITE_DONE:
+			index_iter_release(iter);
+			return MPORT_OK;
+		default:
+			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(iter->mport->db));
 	}
+}
 
-	if (mport_db_prepare(db, &stmt,
-	                     "SELECT pkg, version, comment, bundlefile, license, hash, type FROM idx.packages WHERE %s", where) !=
-	    MPORT_OK) {
-		sqlite3_free(where);
-		sqlite3_finalize(stmt);
-		RETURN_CURRENT_ERROR;
+MPORT_PUBLIC_API void
+mport_index_iter_free(mportIndexIter *iter)
+{
+
+	if (iter == NULL)
+		return;
+
+	index_iter_release(iter);
+	free(iter->bound);
+	free(iter);
+}
+
+/* strdup(), passing NULL through */
+static char *
+index_strdup(const char *s)
+{
+
+	return s == NULL ? NULL : strdup(s);
+}
+
+static mportIndexEntry *
+index_entry_dup(const mportIndexEntry *src)
+{
+	mportIndexEntry *e;
+
+	if ((e = calloc(1, sizeof(mportIndexEntry))) == NULL)
+		return NULL;
+
+	e->pkgname = strdup(src->pkgname);
+	e->version = strdup(src->version);
+	e->bundlefile = strdup(src->bundlefile);
+	e->comment = strdup(src->comment != NULL ? src->comment : "");
+	e->license = strdup(src->license != NULL ? src->license : "");
+	e->hash = index_strdup(src->hash);
+	e->type = src->type;
+
+	if (e->pkgname == NULL || e->version == NULL || e->comment == NULL || e->license == NULL ||
+	    e->bundlefile == NULL || (src->hash != NULL && e->hash == NULL)) {
+		mport_index_entry_free(e);
+		return NULL;
+	}
+
+	return e;
+}
+
+/* A deep copy of a NULL terminated vector, or NULL if out of memory */
+static mportIndexEntry **
+index_entry_vec_dup(mportIndexEntry **src)
+{
+	mportIndexEntry **e;
+	size_t len = 0;
+
+	if (src == NULL)
+		return NULL;
+
+	while (src[len] != NULL)
+		len++;
+
+	if ((e = calloc(len + 1, sizeof(mportIndexEntry *))) == NULL)
+		return NULL;
+
+	for (size_t i = 0; i < len; i++) {
+		if ((e[i] = index_entry_dup(src[i])) == NULL) {
+			mport_index_entry_free_vec(e);
+			return NULL;
+		}
+	}
+
+	return e;
+}
+
+/*
+ * Drain an iterator into a NULL terminated vector of copies, growing the
+ * vector as rows arrive.  The iterator is freed in every case.
+ */
+static int
+index_iter_collect(mportIndexIter *iter, mportIndexEntry ***entry_vec)
+{
+	mportIndexEntry **e, **grown, *row;
+	size_t len = 0, cap = 16;
+
+	*entry_vec = NULL;
+
+	if ((e = calloc(cap + 1, sizeof(mportIndexEntry *))) == NULL) {
+		mport_index_iter_free(iter);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Could not allocate memory for index entries");
 	}
 
 	while (1) {
-		step = sqlite3_step(stmt);
+		if (mport_index_iter_next(iter, &row) != MPORT_OK) {
+			mport_index_entry_free_vec(e);
+			mport_index_iter_free(iter);
+			RETURN_CURRENT_ERROR;
+		}
 
-		if (step == SQLITE_ROW) {
-			if ((e[i] = (mportIndexEntry *) calloc(1, sizeof(mportIndexEntry))) == NULL) {
-				ret = MPORT_ERR_FATAL;
-				break;
+		if (row == NULL)
+			break;
+
+		if (len == cap) {
+			cap *= 2;
+			if ((grown = realloc(e, (cap + 1) * sizeof(mportIndexEntry *))) == NULL) {
+				mport_index_entry_free_vec(e);
+				mport_index_iter_free(iter);
+				RETURN_ERROR(MPORT_ERR_FATAL, "Could not allocate memory for index entries");
 			}
+			e = grown;
+		}
 
-			populate_row(stmt, e[i]);
+		if ((e[len] = index_entry_dup(row)) == NULL) {
+			mport_index_entry_free_vec(e);
+			mport_index_iter_free(iter);
+			RETURN_ERROR(MPORT_ERR_FATAL, "Could not allocate memory for index entries");
+		}
+		e[++len] = NULL;
+	}
 
-			if (e[i]->pkgname == NULL || e[i]->version == NULL || e[i]->comment == NULL || e[i]->license == NULL ||
-			    e[i]->bundlefile == NULL) {
-				ret = MPORT_ERR_FATAL;
-				break;
-			}
+	mport_index_iter_free(iter);
+	*entry_vec = e;
 
-			i++;
-		} else if (step == SQLITE_DONE) {
-			e[i] = NULL;
-			break;
-		} else {
-			ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	return MPORT_OK;
+}
+
+/*
+ * Drain an iterator into a result set: the same vector, with the entries
+ * and their strings laid out in the set's blocks.  The iterator is freed
+ * in every case, and *set_p is only set on success.
+ */
+static int
+index_iter_collect_set(mportIndexIter *iter, mportResultSet **set_p, mportIndexEntry ***entry_vec)
+{
+	mportResultSet *set;
+	mportIndexEntry *row, *e;
+	static mportIndexEntry *empty[] = { NULL };
+
+	*set_p = NULL;
+	*entry_vec = NULL;
+
+	if ((set = mport_result_set_new()) == NULL) {
+		mport_index_iter_free(iter);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Could not allocate memory for index entries");
+	}
+
+	while (1) {
+		if (mport_index_iter_next(iter, &row) != MPORT_OK) {
+			mport_result_set_free(set);
+			mport_index_iter_free(iter);
+			RETURN_CURRENT_ERROR;
+		}
+
+		if (row == NULL)
 			break;
+
+		if ((e = mport_result_set_alloc(set, sizeof(mportIndexEntry))) == NULL)
+			goto oom;
+
+		e->pkgname = mport_result_set_strdup(set, row->pkgname);
+		e->version = mport_result_set_strdup(set, row->version);
+		e->bundlefile = mport_result_set_strdup(set, row->bundlefile);
+		e->comment = mport_result_set_strdup(set, row->comment != NULL ? row->comment : "");
+		e->license = mport_result_set_strdup(set, row->license != NULL ? row->license : "");
+		e->hash = mport_result_set_strdup(set, row->hash);
+		e->type = row->type;
+
+		if (e->pkgname == NULL || e->version == NULL || e->comment == NULL || e->license == NULL ||
+		    e->bundlefile == NULL || (row->hash != NULL && e->hash == NULL))
+			goto oom;
+
+		if (mport_result_set_push(set, e) != MPORT_OK) {
+			mport_result_set_free(set);
+			mport_index_iter_free(iter);
+			RETURN_CURRENT_ERROR;
 		}
 	}
 
-	sqlite3_free(where);
-	sqlite3_finalize(stmt);
+	mport_index_iter_free(iter);
 
-	return ret;
-}
+	/* like index_iter_collect(), no rows is an empty vector rather than NULL */
+	*entry_vec = (mportIndexEntry **) mport_result_set_vec(set);
+	if (*entry_vec == NULL)
+		*entry_vec = empty;
+	*set_p = set;
+
+	return MPORT_OK;
 
+oom:
+	mport_result_set_free(set);
+	mport_index_iter_free(iter);
+	RETURN_ERROR(MPORT_ERR_FATAL, "Could not allocate memory for index entries");
+}
 
+/*
+ * Looks up a pkgname from the index and fills a vector of index entries
+ * with the result.
+ *
+ * Globbing is supported, and the alias list is consulted.  The calling code
+ * is responsible for freeing the memory allocated.  See
+ * mport_index_entry_free_vec()
+ */
 MPORT_PUBLIC_API int
-mport_index_list(mportInstance *mport, mportIndexEntry ***entry_vec)
+mport_index_lookup_pkgname(mportInstance *mport, const char *pkgname, mportIndexEntry ***entry_vec)
 {
-	sqlite3_stmt *stmt;
-	int ret = MPORT_OK;
-	int len;
-	int i = 0, step;
-	sqlite3 *db = mport->db;
-	mportIndexEntry **e;
+	mportIndexIter *iter;
+	mportIndexEntry **cached;
 
-	if (mport_db_count(mport->db, &len, "SELECT count(*) FROM idx.packages") != MPORT_OK)
-		RETURN_CURRENT_ERROR;
+	if (mport == NULL) {
+		RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
+	}
 
-	e = (mportIndexEntry **) calloc((size_t) len + 1, sizeof(mportIndexEntry *));
-	*entry_vec = e;
+	MPORT_CHECK_FOR_INDEX(mport, "mport_index_lookup_pkgname()")
 
-	if (len == 0) {
+	if ((cached = mport_index_cache_entries(mport, pkgname)) != NULL) {
+		if ((*entry_vec = index_entry_vec_dup(cached)) == NULL) {
+			RETURN_ERROR(MPORT_ERR_FATAL, "Could not allocate memory for index entries");
+		}
 		return MPORT_OK;
 	}
 
-	if (mport_db_prepare(db, &stmt, "SELECT pkg, version, comment, bundlefile, license, hash FROM idx.packages") !=
-	    MPORT_OK) {
-		sqlite3_finalize(stmt);
+	if (index_iter_lookup(mport, &iter, pkgname) != MPORT_OK) {
 		RETURN_CURRENT_ERROR;
 	}
 
-	while (1) {
-		step = sqlite3_step(stmt);
+	if (index_iter_collect(iter, entry_vec) != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
+	}
 
-		if (step == SQLITE_ROW) {
-			if ((e[i] = (mportIndexEntry *) calloc(1, sizeof(mportIndexEntry))) == NULL) {
-				ret = MPORT_ERR_FATAL;
-				break;
-			}
+	/* the same names come up again and again during an upgrade */
+	mport_index_cache_set_entries(mport, pkgname, index_entry_vec_dup(*entry_vec));
 
-			populate_row(stmt, e[i]);
+	return MPORT_OK;
+}
 
-			if (e[i]->pkgname == NULL || e[i]->version == NULL || e[i]->comment == NULL || e[i]->license == NULL ||
-			    e[i]->bundlefile == NULL) {
-				ret = MPORT_ERR_FATAL;
-				break;
-			}
 
-			i++;
-		} else if (step == SQLITE_DONE) {
-			e[i] = NULL;
-			break;
-		} else {
-			ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-			break;
-		}
+/* mport_index_search(mportInstance *mport, mportIndexEntry ***entry_vec, const char *where, ...)
+ *
+ * Allocate and populate the index meta for the given package in the index.
+ *
+ * 'where' and the vargs are used to be build a where clause.  For example to search by
+ * name:
+ *
+ * mport_index_search(mport, &indexEntries, "pkg=%Q", name);
+ *
+ * indexEntries is set to an empty allocated list and MPORT_OK is returned if no packages where found.
+ * Callers that only walk the results once should use mport_index_iter_search().
+ */
+MPORT_PUBLIC_API int
+mport_index_search(mportInstance *mport, mportIndexEntry ***entry_vec, const char *fmt, ...)
+{
+	va_list args;
+	mportIndexIter *iter;
+	int ret;
+
+	va_start(args, fmt);
+	ret = index_iter_vsearch(mport, &iter, fmt, args);
+	va_end(args);
+
+	if (ret != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
 	}
 
-	sqlite3_finalize(stmt);
+	return index_iter_collect(iter, entry_vec);
+}
 
-	return ret;
+
+MPORT_PUBLIC_API int
+mport_index_list(mportInstance *mport, mportIndexEntry ***entry_vec)
+{
+	mportIndexIter *iter;
+
+	if (mport_index_iter_list(mport, &iter) != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
+	}
+
+	return index_iter_collect(iter, entry_vec);
 }
 
-static void
-populate_row(sqlite3_stmt *stmt, mportIndexEntry *e)
+
+/*
+ * mport_index_search() and mport_index_list() into a result set.  The
+ * vector belongs to the set: free it with mport_result_set_free(), not
+ * mport_index_entry_free_vec().
+ */
+MPORT_PUBLIC_API int
+mport_index_search_set(mportInstance *mport, mportResultSet **set, mportIndexEntry ***entry_vec, const char *fmt, ...)
 {
+	va_list args;
+	mportIndexIter *iter;
+	int ret;
+
+	va_start(args, fmt);
+	ret = index_iter_vsearch(mport, &iter, fmt, args);
+	va_end(args);
+
+	if (ret != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
+	}
+
+	return index_iter_collect_set(iter, set, entry_vec);
+}
+
 
-	e->pkgname = strdup((const char *) sqlite3_column_text(stmt, 0));
-	e->version = strdup((const char *) sqlite3_column_text(stmt, 1));
-	e->comment = strdup((const char *) sqlite3_column_text(stmt, 2));
-	e->bundlefile = strdup((const char *) sqlite3_column_text(stmt, 3));
-	e->license = strdup((const char *) sqlite3_column_text(stmt, 4));
-	e->hash = strdup((const char *) sqlite3_column_text(stmt, 5));
+MPORT_PUBLIC_API int
+mport_index_list_set(mportInstance *mport, mportResultSet **set, mportIndexEntry ***entry_vec)
+{
+	mportIndexIter *iter;
 
-	if (sqlite3_column_type(stmt, 6) == SQLITE_INTEGER) {
-        e->type = sqlite3_column_int(stmt, 6);
+	if (mport_index_iter_list(mport, &iter) != MPORT_OK) {
+		RETURN_CURRENT_ERROR;
 	}
+
+	return index_iter_collect_set(iter, set, entry_vec);
 }
 
 
@@ -601,11 +1252,23 @@ static int
 lookup_alias(mportInstance *mport, const char *query, char **result)
 {
 	sqlite3_stmt *stmt;
+	const char *cached;
 	int ret = MPORT_OK;
 
-	if (mport_db_prepare(mport->db, &stmt, "SELECT pkg FROM idx.aliases WHERE alias=%Q", query) != MPORT_OK)
+	if ((cached = mport_index_cache_alias(mport, query)) != NULL) {
+		*result = strdup(cached);
+		return MPORT_OK;
+	}
+
+	if (mport_db_borrow(mport, &stmt, "SELECT pkg FROM idx.aliases WHERE alias=?") != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
+	if (sqlite3_bind_text(stmt, 1, query, -1, SQLITE_STATIC) != SQLITE_OK) {
+		ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+		mport_db_return(mport, stmt);
+		return ret;
+	}
+
 	switch (sqlite3_step(stmt)) {
 		case SQLITE_ROW:
 			*result = strdup((const char *) sqlite3_column_text(stmt, 0));
@@ -618,7 +1281,10 @@ lookup_alias(mportInstance *mport, const char *query, char **result)
 			break;
 	}
 
-	sqlite3_finalize(stmt);
+	mport_db_return(mport, stmt);
+
+	if (ret == MPORT_OK && *result != NULL)
+		mport_index_cache_set_alias(mport, query, *result);
 
 	return ret;
 }
@@ -0,0 +1,183 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ohash.h>
+
+/*
+ * Index lookups remembered for the life of an attached index.  An upgrade
+ * resolves the same names over and over (checking, installing, fetching
+ * each package), and every resolution was an alias query plus a lookup.
+ * Entries are keyed by the name as the caller gave it, and hold the alias
+ * it resolves to and the index entries a lookup of it returned, each
+ * filled in the first time it is asked for.
+ *
+ * Whatever swaps out idx must call mport_index_cache_reset().  Like the
+ * statement cache, this only saves work: failing to allocate just means
+ * the next lookup goes to the database again.
+ */
+
+struct index_cache_node {
+	char *alias;			/* NULL until resolved */
+	mportIndexEntry **entries;	/* NULL until looked up */
+	char name[];			/* the ohash key */
+};
+
+struct mport_index_cache {
+	struct ohash names;
+};
+
+static void *
+index_cache_calloc(size_t s, void *data)
+{
+
+	return calloc(1, s);
+}
+
+static void
+index_cache_free_cb(void *p, size_t s, void *data)
+{
+
+	free(p);
+}
+
+static void *
+index_cache_alloc(size_t s, void *data)
+{
+
+	return malloc(s);
+}
+
+static struct ohash_info index_cache_info = {
+	offsetof(struct index_cache_node, name), NULL, index_cache_calloc, index_cache_free_cb, index_cache_alloc
+};
+
+static struct index_cache_node *
+index_cache_node(mportInstance *mport, const char *name, bool create)
+{
+	struct mport_index_cache *cache = mport->index_cache;
+	struct index_cache_node *node;
+	unsigned int slot;
+	const char *end = NULL;
+
+	if (cache == NULL) {
+		if (!create || (cache = calloc(1, sizeof(struct mport_index_cache))) == NULL)
+			return NULL;
+		ohash_init(&cache->names, 6, &index_cache_info);
+		mport->index_cache = cache;
+	}
+
+	slot = ohash_qlookupi(&cache->names, name, &end);
+	if ((node = ohash_find(&cache->names, slot)) != NULL || !create)
+		return node;
+
+	if ((node = ohash_create_entry(&index_cache_info, name, &end)) == NULL)
+		return NULL;
+
+	node->alias = NULL;
+	node->entries = NULL;
+	ohash_insert(&cache->names, slot, node);
+
+	return node;
+}
+
+/* The package name that name is an alias for, or NULL if not yet known */
+const char *
+mport_index_cache_alias(mportInstance *mport, const char *name)
+{
+	struct index_cache_node *node = index_cache_node(mport, name, false);
+
+	return node == NULL ? NULL : node->alias;
+}
+
+void
+mport_index_cache_set_alias(mportInstance *mport, const char *name, const char *alias)
+{
+	struct index_cache_node *node = index_cache_node(mport, name, true);
+
+	if (node == NULL || node->alias != NULL)
+		return;
+
+	node->alias = strdup(alias);
+}
+
+/*
+ * The entries a lookup of name returned, or NULL if it hasn't been looked
+ * up.  The vector belongs to the cache; callers hand out copies.
+ */
+mportIndexEntry **
+mport_index_cache_entries(mportInstance *mport, const char *name)
+{
+	struct index_cache_node *node = index_cache_node(mport, name, false);
+
+	return node == NULL ? NULL : node->entries;
+}
+
+/* Remember entries for name; the cache takes them over, or frees them */
+void
+mport_index_cache_set_entries(mportInstance *mport, const char *name, mportIndexEntry **entries)
+{
+	struct index_cache_node *node = index_cache_node(mport, name, true);
+
+	if (node == NULL || node->entries != NULL) {
+		mport_index_entry_free_vec(entries);
+		return;
+	}
+
+	node->entries = entries;
+}
+
+/* mport_index_cache_reset(mport)
+ *
+ * Forget everything, for when the attached index changes.
+ */
+void
+mport_index_cache_reset(mportInstance *mport)
+{
+	struct mport_index_cache *cache = mport->index_cache;
+	struct index_cache_node *node;
+	unsigned int i;
+
+	if (cache == NULL)
+		return;
+
+	for (node = ohash_first(&cache->names, &i); node != NULL; node = ohash_next(&cache->names, &i)) {
+		free(node->alias);
+		mport_index_entry_free_vec(node->entries);
+		free(node);
+	}
+
+	ohash_delete(&cache->names);
+	free(cache);
+	mport->index_cache = NULL;
+}
@@ -0,0 +1,186 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <sys/types.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Index deltas.
+ *
+ * A full index carries a serial number in its user_version pragma.  Rather
+ * than downloading the whole index again, a client whose index has a serial
+ * can fetch index.delta.db.bz2 from its mirror: a small sqlite database
+ * holding every change since some older serial.  It looks like this:
+ *
+ *   meta(name, val)                    'base' is the oldest serial the delta
+ *                                      applies to, 'version' the serial it
+ *                                      brings the index up to
+ *   changed(pkg, delta_version)        packages added, changed or removed,
+ *                                      and the serial that touched them
+ *   packages, depends                  the current rows for every package in
+ *                                      changed, same columns as the index
+ *   aliases, mirrors                   complete copies of those tables
+ *
+ * A package listed in changed with no rows in packages has been removed.
+ * Deltas are cumulative, so only changes newer than our serial are applied.
+ */
+
+static int delta_meta(sqlite3 *, const char *, int *);
+
+
+/* mport_index_delta_version(mport)
+ *
+ * The serial of the attached index, 0 if it has none (and so can't take a delta).
+ */
+int
+mport_index_delta_version(mportInstance *mport)
+{
+	sqlite3_stmt *stmt;
+	int version = 0;
+
+	if (!(mport->flags & MPORT_INST_HAVE_INDEX) || mport_index_attach(mport) != MPORT_OK)
+		return 0;
+
+	if (sqlite3_prepare_v2(mport->db, "PRAGMA idx.user_version", -1, &stmt, NULL) == SQLITE_OK &&
+	    sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+
+	sqlite3_finalize(stmt);
+
+	return version;
+}
+
+
+/* mport_index_apply_delta(mport, deltafile)
+ *
+ * Apply the delta database deltafile to the attached index in a single
+ * transaction.  Returns MPORT_OK if the index is now current (including when
+ * it already was), MPORT_ERR_WARN if the index is too old for this delta and
+ * needs a full fetch, and MPORT_ERR_FATAL if anything went wrong applying it,
+ * in which case the index is left as it was.
+ */
+int
+mport_index_apply_delta(mportInstance *mport, const char *deltafile)
+{
+	sqlite3 *db = mport->db;
+	int local, base, target;
+	int ret = MPORT_OK;
+
+	MPORT_CHECK_FOR_INDEX(mport, "mport_index_apply_delta()");
+
+	if ((local = mport_index_delta_version(mport)) == 0)
+		RETURN_ERROR(MPORT_ERR_WARN, "Index has no serial, a full fetch is needed.");
+
+	if (mport_db_do(db, "ATTACH %Q AS delta", deltafile) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (delta_meta(db, "base", &base) != MPORT_OK || delta_meta(db, "version", &target) != MPORT_OK) {
+		ret = mport_err_code();
+		goto DETACH;
+	}
+
+	if (local >= target)
+		goto DETACH;
+
+	if (local < base) {
+		ret = SET_ERRORX(MPORT_ERR_WARN, "Index serial %d predates delta base %d.", local, base);
+		goto DETACH;
+	}
+
+	if (mport_db_do(db, "BEGIN TRANSACTION") != MPORT_OK) {
+		ret = mport_err_code();
+		goto DETACH;
+	}
+
+	if (mport_db_do(db, "CREATE TEMP TABLE delta_pkgs AS SELECT DISTINCT pkg FROM delta.changed WHERE delta_version > %d", local) != MPORT_OK ||
+	    mport_db_do(db, "DELETE FROM idx.depends WHERE pkg IN (SELECT pkg FROM temp.delta_pkgs)") != MPORT_OK ||
+	    mport_db_do(db, "DELETE FROM idx.packages WHERE pkg IN (SELECT pkg FROM temp.delta_pkgs)") != MPORT_OK ||
+	    mport_db_do(db, "INSERT INTO idx.packages SELECT *%s FROM delta.packages WHERE pkg IN (SELECT pkg FROM temp.delta_pkgs)",
+	        (mport->flags & MPORT_INST_INDEX_VERSION_KEY) ? ", mport_version_key(version)" : "") != MPORT_OK ||
+	    mport_db_do(db, "INSERT INTO idx.depends SELECT * FROM delta.depends WHERE pkg IN (SELECT pkg FROM temp.delta_pkgs)") != MPORT_OK ||
+	    mport_db_do(db, "DELETE FROM idx.aliases") != MPORT_OK ||
+	    mport_db_do(db, "INSERT INTO idx.aliases SELECT * FROM delta.aliases") != MPORT_OK ||
+	    mport_db_do(db, "DELETE FROM idx.mirrors") != MPORT_OK ||
+	    mport_db_do(db, "INSERT INTO idx.mirrors SELECT * FROM delta.mirrors") != MPORT_OK ||
+	    mport_db_do(db, "DROP TABLE IF EXISTS idx.packages_fts") != MPORT_OK ||
+	    mport_db_do(db, "PRAGMA idx.user_version=%d", target) != MPORT_OK ||
+	    mport_db_do(db, "DROP TABLE temp.delta_pkgs") != MPORT_OK) {
+		ret = mport_err_code();
+		(void)mport_db_do(db, "ROLLBACK TRANSACTION");
+		(void)mport_db_do(db, "DROP TABLE IF EXISTS temp.delta_pkgs");
+		goto DETACH;
+	}
+
+	if (mport_db_do(db, "COMMIT TRANSACTION") != MPORT_OK) {
+		ret = mport_err_code();
+		(void)mport_db_do(db, "ROLLBACK TRANSACTION");
+	} else {
+		/* lookups made before the delta may be stale */
+		mport_index_cache_reset(mport);
+	}
+
+DETACH:
+	if (mport_db_do(db, "DETACH delta") != MPORT_OK && ret == MPORT_OK)
+		ret = mport_err_code();
+
+	return ret;
+}
+
+
+static int
+delta_meta(sqlite3 *db, const char *name, int *val)
+{
+	sqlite3_stmt *stmt;
+	int ret = MPORT_OK;
+
+	if (mport_db_prepare(db, &stmt, "SELECT val FROM delta.meta WHERE name=%Q", name) != MPORT_OK) {
+		sqlite3_finalize(stmt);
+		RETURN_CURRENT_ERROR;
+	}
+
+	switch (sqlite3_step(stmt)) {
+		case SQLITE_ROW:
+			*val = sqlite3_column_int(stmt, 0);
+			break;
+		case SQLITE_DONE:
+			ret = SET_ERRORX(MPORT_ERR_FATAL, "Index delta has no %s.", name);
+			break;
+		default:
+			ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+			break;
+	}
+
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
@@ -128,6 +128,36 @@ DONE:
 }
 
 
+/*
+ * Fill entry_vec with the index entries for pkgname/version and everything it
+ * depends on, directly or not.  Each package appears once, no matter how many
+ * times it shows up in the tree, and cycles in the index are harmless.  A
+ * dependency is the index entry of the version it asks for, or else the
+ * newest the index has for that name, as plan_load() picks them.
+ *
+ * The calling code is responsible for freeing the memory allocated.  See
+ * mport_index_entry_free_vec()
+ */
+MPORT_PUBLIC_API int
+mport_index_depends_closure(mportInstance *mport, const char *pkgname, const char *version, mportIndexEntry ***entry_vec)
+{
+
+	MPORT_CHECK_FOR_INDEX(mport, "mport_index_depends_closure()")
+
+	return mport_index_search(mport, entry_vec,
+	    "rowid IN (WITH RECURSIVE closure(rid, pkg, version) AS ("
+	    "SELECT rowid, pkg, version FROM idx.packages WHERE pkg=%Q AND version=%Q "
+	    "UNION "
+	    "SELECT p.rowid, p.pkg, p.version FROM idx.depends d "
+	    "JOIN closure c ON d.pkg=c.pkg AND d.version=c.version "
+	    "JOIN idx.packages p ON p.pkg=d.d_pkg AND (p.version=d.d_version OR ("
+	    "NOT EXISTS (SELECT 1 FROM idx.packages x WHERE x.pkg=d.d_pkg AND x.version=d.d_version) AND "
+	    "NOT EXISTS (SELECT 1 FROM idx.packages n WHERE n.pkg=p.pkg AND "
+	    "mport_version_key(n.version) > mport_version_key(p.version))))) "
+	    "SELECT rid FROM closure)", pkgname, version);
+}
+
+
 /* free a vector of mportDependsEntry structs */
 MPORT_PUBLIC_API void
 mport_index_depends_free_vec(mportDependsEntry **depends)
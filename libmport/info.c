@@ -46,6 +46,7 @@ mport_info(mportInstance *mport, const char *packageName) {
 	int no_shlib_provided = 0;
 	char *info_text = NULL;
 	time_t expirationDate, installDate;
+	char expirationBuf[32], installBuf[32]; /* ctime(3) returns one static buffer, both dates printed from it */
 	char *options;
 	char *desc;
 	mportAutomatic automatic;
@@ -70,7 +71,7 @@ mport_info(mportInstance *mport, const char *packageName) {
 		return (NULL);
 	}
 
-	if (mport_pkgmeta_search_master(mport, &packs, "pkg=%Q", packageName) != MPORT_OK) {
+	if (mport_pkgmeta_get(mport, &packs, packageName) != MPORT_OK) {
 		return (NULL);
 	}
 
@@ -135,8 +136,8 @@ mport_info(mportInstance *mport, const char *packageName) {
 	         automatic == MPORT_EXPLICIT ? "yes" : "no",
 	         no_shlib_provided ? "yes" : "no",
 	         deprecated,
-	         expirationDate == 0 ? "" : ctime(&expirationDate),
-	         installDate == 0 ? "\n" : ctime(&installDate),
+	         expirationDate == 0 ? "" : ctime_r(&expirationDate, expirationBuf),
+	         installDate == 0 ? "\n" : ctime_r(&installDate, installBuf),
 	         (*indexEntry)->comment,
 	         options,
 			 type == MPORT_TYPE_APP ? "Application" : "System", 
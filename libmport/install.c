@@ -84,26 +84,44 @@ mport_install(mportInstance *mport, const char *pkgname, const char *version, co
     }
   }
  
-  asprintf(&filename, "%s/%s", MPORT_FETCH_STAGING_DIR, e[e_loc]->bundlefile);
+  ret = mport_install_entry(mport, e[e_loc], prefix, automatic, NULL);
+
+  mport_index_entry_free_vec(e);
+  e = NULL;
+  
+  return ret;
+}
+
+/*
+ * Fetch, verify and install the bundle for an index entry.  unpacked, if
+ * not NULL, is the same bundle already decompressed (see unpack_queue.c);
+ * the bundle itself is still what gets verified.
+ */
+int
+mport_install_entry(mportInstance *mport, mportIndexEntry *entry, const char *prefix, mportAutomatic automatic,
+    const char *unpacked)
+{
+  char *filename;
+  int ret;
+
+  asprintf(&filename, "%s/%s", MPORT_FETCH_STAGING_DIR, entry->bundlefile);
   if (filename == NULL) {
-    mport_index_entry_free_vec(e);
-    e = NULL;
     RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
   }
 
-  if (!mport_file_exists(filename)) {
-    if (mport_fetch_bundle(mport, MPORT_LOCAL_PKG_PATH, e[e_loc]->bundlefile) != MPORT_OK) {
+  if (!mport_file_exists(filename) && mport_package_cache_fetch(mport, entry->hash, filename) != MPORT_OK) {
+    unpacked = NULL;
+    if (mport_fetch_bundle(mport, MPORT_LOCAL_PKG_PATH, entry->bundlefile) != MPORT_OK) {
       free(filename);
       filename = NULL;
-      mport_index_entry_free_vec(e);
-      e = NULL;
       RETURN_CURRENT_ERROR;
     }
   }
 
-  if (mport_verify_hash(filename, e[e_loc]->hash) == 0) {
-  	mport_index_entry_free_vec(e);
-
+  mport_trace_begin(mport, MPORT_TRACE_VERIFY, filename);
+  ret = mport_verify_bundle(mport, filename, entry->hash);
+  mport_trace_end(mport, MPORT_TRACE_VERIFY, 1, 0, ret ? MPORT_OK : MPORT_ERR_FATAL);
+  if (ret == 0) {
   	if (unlink(filename) == 0) {
 	    free(filename);
       filename = NULL;
@@ -114,73 +132,40 @@ mport_install(mportInstance *mport, const char *pkgname, const char *version, co
   		RETURN_ERROR(MPORT_ERR_FATAL, "Package failed hash verification, but could not be removed.\n");
   	}
   }
+
+  mport_package_cache_store(mport, entry->hash, filename);
  
-  ret = mport_install_primative(mport, filename, prefix, automatic);
+  ret = mport_install_primative(mport, unpacked != NULL ? unpacked : filename, prefix, automatic);
 
   free(filename);
   filename = NULL;
-  mport_index_entry_free_vec(e);
-  e = NULL;
   
   return ret;
 }
 
-/* recursive function */
+/*
+ * Install packageName and whatever it depends on, updating dependencies
+ * that are installed but out of date.  See mport_plan_add().
+ */
 int
 mport_install_depends(mportInstance *mport, const char *packageName, const char *version, mportAutomatic automatic) {
-	mportPackageMeta **packs;
-	mportDependsEntry **depends;
-	mportDependsEntry **depends_orig;
+	mportPlan *plan = NULL;
+	int ret;
 
 	if (packageName == NULL || version == NULL) {
 		RETURN_ERROR(MPORT_ERR_WARN, "Dependency name or version is null");
 	}
 
-	mport_index_depends_list(mport, packageName, version, &depends_orig);
-	depends = depends_orig;
- 
-	if (mport_pkgmeta_search_master(mport, &packs, "pkg=%Q", packageName) != MPORT_OK) {
+	if (mport_plan_new(mport, &plan) != MPORT_OK ||
+	    mport_plan_add(mport, plan, packageName, version, automatic) != MPORT_OK ||
+	    mport_plan_execute(mport, plan) != MPORT_OK) {
 		mport_call_msg_cb(mport, "%s", mport_err_string());
-		return mport_err_code();
-	}
-
-	if (packs == NULL && depends == NULL) {
-		/* Package is not installed and there are no dependencies */
-		if (mport_install(mport, packageName, version, NULL, automatic) != MPORT_OK) {
-			mport_call_msg_cb(mport, "%s", mport_err_string());
-			return mport_err_code();
-		}
-	} else if (packs == NULL) {
-		/* Package is not installed */
-		while (*depends != NULL) {
-			if (mport_install_depends(mport, (*depends)->d_pkgname, (*depends)->d_version, MPORT_AUTOMATIC) != MPORT_OK) {
-     			mport_call_msg_cb(mport, "%s", mport_err_string());
-     			mport_index_depends_free_vec(depends_orig);
-				return mport_err_code();
-			}
-			depends++;
-		}
-		if (mport_install(mport, packageName, version, NULL, automatic) != MPORT_OK) {
-			mport_call_msg_cb(mport, "%s", mport_err_string());
-			mport_index_depends_free_vec(depends_orig);
-			return mport_err_code();
-		}
-		mport_index_depends_free_vec(depends_orig);
+		ret = mport_err_code();
 	} else {
-		/* already installed, double check we are on the latest */
-		mport_index_depends_free_vec(depends_orig);
-
-		if (mport_check_preconditions(mport, packs[0], MPORT_PRECHECK_UPGRADEABLE) == MPORT_OK) {
-			if (mport_update(mport, packageName) != MPORT_OK) {
-				mport_call_msg_cb(mport, "%s", mport_err_string());
-				mport_pkgmeta_vec_free(packs);
-				return mport_err_code();
-			}
-		}
-
-        // TODO: fix crash on nested calls
-		//mport_pkgmeta_vec_free(packs);
+		ret = MPORT_OK;
 	}
 
-	return (MPORT_OK);
-}
\ No newline at end of file
+	mport_plan_free(plan);
+
+	return (ret);
+}
@@ -32,12 +32,28 @@
 #include <stdlib.h>
 #include <string.h>
 
+static int install_bundle(mportInstance *, const char *, const char *, mportAutomatic, long *);
+
 MPORT_PUBLIC_API int
 mport_install_primative(mportInstance *mport, const char *filename, const char *prefix, mportAutomatic automatic)
+{
+	long installed = 0;
+	int ret;
+
+	mport_trace_begin(mport, MPORT_TRACE_INSTALL, filename);
+	ret = install_bundle(mport, filename, prefix, automatic, &installed);
+	mport_trace_end(mport, MPORT_TRACE_INSTALL, installed, 0, ret);
+
+	return ret;
+}
+
+static int
+install_bundle(mportInstance *mport, const char *filename, const char *prefix, mportAutomatic automatic,
+    long *installed)
 {
 	mportBundleRead *bundle;
 	mportPackageMeta **pkgs, *pkg;
-	int i;
+	int i, ret;
 	bool error = false;
 
 	if ((bundle = mport_bundle_read_new()) == NULL)
@@ -46,7 +62,10 @@ mport_install_primative(mportInstance *mport, const char *filename, const char *
 	if (mport_bundle_read_init(bundle, filename) != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
-	if (mport_bundle_read_prep_for_install(mport, bundle) != MPORT_OK)
+	mport_trace_begin(mport, MPORT_TRACE_STUB, filename);
+	ret = mport_bundle_read_prep_for_install(mport, bundle);
+	mport_trace_end(mport, MPORT_TRACE_STUB, 0, 0, ret);
+	if (ret != MPORT_OK)
 		RETURN_CURRENT_ERROR;
 
 	if (mport_pkgmeta_read_stub(mport, &pkgs) != MPORT_OK)
@@ -63,16 +82,28 @@ mport_install_primative(mportInstance *mport, const char *filename, const char *
 			if ((pkg->prefix = strdup(prefix)) == NULL) /* all hope is lost! bail */
 				RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
 		}
+	}
+
+	/* all of them, so every reason not to install is reported at once */
+	mport_trace_begin(mport, MPORT_TRACE_PRECHECK, filename);
+	ret = mport_check_preconditions_all(mport, pkgs, MPORT_PRECHECK_INSTALLED | MPORT_PRECHECK_DEPENDS |
+	                                                 MPORT_PRECHECK_CONFLICTS);
+	mport_trace_end(mport, MPORT_TRACE_PRECHECK, i, 0, ret);
+	if (ret != MPORT_OK) {
+		mport_call_msg_cb(mport, "Unable to install %s: %s", filename, mport_err_string());
+		error = true;
+	}
+
+	for (i = 0; !error && *(pkgs + i) != NULL; i++) {
+		pkg = pkgs[i];
 
-		if ((mport_check_preconditions(mport, pkg, MPORT_PRECHECK_INSTALLED | MPORT_PRECHECK_DEPENDS |
-		                                           MPORT_PRECHECK_CONFLICTS) != MPORT_OK)
-		    ||
-		    (mport_bundle_read_install_pkg(mport, bundle, pkg) != MPORT_OK)) {
+		if (mport_bundle_read_install_pkg(mport, bundle, pkg) != MPORT_OK) {
 			mport_call_msg_cb(mport, "Unable to install %s-%s: %s", pkg->name, pkg->version,
 			                  mport_err_string());
 			error = true;
 			break; /* do not keep going if we have a package failure! */
 		}
+		(*installed)++;
 	}
 
 	if (mport_bundle_read_finish(mport, bundle) != MPORT_OK)
@@ -51,10 +51,26 @@ mport_instance_new(void) {
 MPORT_PUBLIC_API int
 mport_instance_init(mportInstance *mport, const char *root, const char *outputPath, bool noIndex) {
 
+	return mport_instance_init_flags(mport, root, outputPath, noIndex, 0);
+}
+
+/**
+ * mport_instance_init() with flags.  MPORT_INIT_READONLY opens master.db
+ * read only, for query tools: nothing is created or upgraded, the index is
+ * never fetched or checked for age, and with WAL the instance neither waits
+ * on nor holds up a writer.  Starting one is the open and a read of the
+ * schema version; mport_index_load() only notes that the index is there,
+ * and it is attached by the first query that uses it.  Use
+ * mport_snapshot_begin() for a consistent view across queries.
+ */
+MPORT_PUBLIC_API int
+mport_instance_init_flags(mportInstance *mport, const char *root, const char *outputPath, bool noIndex, int flags) {
+
 	char dir[FILENAME_MAX];
+	bool readonly = (flags & MPORT_INIT_READONLY) != 0;
 	mport->flags = 0;
 
-	mport->noIndex = noIndex;
+	mport->noIndex = noIndex || readonly;
 
 	if (root != NULL) {
 		mport->root = strdup(root);
@@ -68,25 +84,33 @@ mport_instance_init(mportInstance *mport, const char *root, const char *outputPa
 		mport->outputPath = strdup(outputPath);
 	}
 
-	(void) snprintf(dir, FILENAME_MAX, "%s/%s", mport->root, MPORT_INST_DIR);
+	if (!readonly) {
+		(void) snprintf(dir, FILENAME_MAX, "%s/%s", mport->root, MPORT_INST_DIR);
 
-	if (mport_mkdir(dir) != MPORT_OK) {
-		RETURN_CURRENT_ERROR;
-	}
+		if (mport_mkdir(dir) != MPORT_OK) {
+			RETURN_CURRENT_ERROR;
+		}
 
-	(void) snprintf(dir, FILENAME_MAX, "%s/%s", mport->root, MPORT_INST_INFRA_DIR);
+		(void) snprintf(dir, FILENAME_MAX, "%s/%s", mport->root, MPORT_INST_INFRA_DIR);
 
-	if (mport_mkdir(dir) != MPORT_OK) {
-		RETURN_CURRENT_ERROR;
+		if (mport_mkdir(dir) != MPORT_OK) {
+			RETURN_CURRENT_ERROR;
+		}
 	}
 
 	/* dir is a file here, just trying to save memory */
 	(void) snprintf(dir, FILENAME_MAX, "%s/%s", mport->root, MPORT_MASTER_DB_FILE);
-	if (sqlite3_open(dir, &(mport->db)) != 0) {
+	if (sqlite3_open_v2(dir, &(mport->db), readonly ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+	                    NULL) != SQLITE_OK) {
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
 		sqlite3_close(mport->db);
-		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+		mport->db = NULL;
+		RETURN_CURRENT_ERROR;
 	}
 
+	/* wait out other writers, rather than failing on the first SQLITE_BUSY */
+	sqlite3_busy_timeout(mport->db, MPORT_DB_BUSY_TIMEOUT);
+
 	if (sqlite3_create_function(mport->db, "mport_version_cmp", 2, SQLITE_ANY, NULL, &mport_version_cmp_sqlite,
 								NULL,
 								NULL) != SQLITE_OK) {
@@ -94,6 +118,12 @@ mport_instance_init(mportInstance *mport, const char *root, const char *outputPa
 		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
 	}
 
+	if (sqlite3_create_function(mport->db, "mport_version_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+								&mport_version_key_sqlite, NULL, NULL) != SQLITE_OK) {
+		sqlite3_close(mport->db);
+		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+	}
+
 
 	/* set the default UI callbacks */
 	mport->msg_cb = &mport_default_msg_cb;
@@ -103,6 +133,17 @@ mport_instance_init(mportInstance *mport, const char *root, const char *outputPa
 	mport->confirm_cb = &mport_default_confirm_cb;
 
 	int db_version = mport_get_database_version(mport->db);
+
+	if (readonly) {
+		mport->flags |= MPORT_INST_READONLY;
+
+		if (db_version != MPORT_MASTER_VERSION)
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Master database is at version %d, expected %d; run mport as root to upgrade it",
+			    db_version, MPORT_MASTER_VERSION);
+
+		return (MPORT_OK);
+	}
+
 	if (db_version < 1) {
 		/* new, create tables */
 		mport_generate_master_schema(mport->db);
@@ -114,6 +155,119 @@ mport_instance_init(mportInstance *mport, const char *root, const char *outputPa
 	return mport_upgrade_master_schema(mport->db, db_version);
 }
 
+/**
+ * Start a read transaction, so that the queries up to mport_snapshot_end()
+ * see the master database as it was at the first of them.  In WAL mode
+ * this doesn't block writers, and their commits aren't seen until the end.
+ */
+MPORT_PUBLIC_API int
+mport_snapshot_begin(mportInstance *mport) {
+
+	if (!sqlite3_get_autocommit(mport->db))
+		RETURN_ERROR(MPORT_ERR_FATAL, "A transaction is already open");
+
+	return mport_db_do(mport->db, "BEGIN DEFERRED TRANSACTION");
+}
+
+MPORT_PUBLIC_API int
+mport_snapshot_end(mportInstance *mport) {
+
+	if (sqlite3_get_autocommit(mport->db))
+		return (MPORT_OK);
+
+	/* nothing was written, so this only releases the snapshot */
+	return mport_db_do(mport->db, "COMMIT TRANSACTION");
+}
+
+/**
+ * Install several packages with far fewer syncs.  Between mport_batch_begin()
+ * and mport_batch_end() everything a package writes (its row, depends,
+ * assets, log entries and the final flip to clean) is one transaction,
+ * committed when its bundle is closed; the stub database can't be
+ * detached inside a transaction, so that's as wide as it can be.  Those
+ * commits don't wait for the disk: the WAL is synced every
+ * MPORT_BATCH_COMMIT packages and at the end.  A crash can lose the last
+ * few packages' rows, but only whole packages, so none is left looking
+ * complete when it isn't.
+ */
+MPORT_PUBLIC_API int
+mport_batch_begin(mportInstance *mport) {
+
+	if (mport->batch)
+		RETURN_ERROR(MPORT_ERR_FATAL, "A batch is already open");
+
+	if (mport_db_do(mport->db, "PRAGMA synchronous=NORMAL") != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	mport->batch = true;
+	mport->batch_pending = 0;
+
+	return mport_batch_resume(mport);
+}
+
+/**
+ * Commit and sync the batch, then run the triggers (ldconfig and so on)
+ * it held back.  This is also the way out after a failed install: what
+ * completed stays installed, as it would have without one.
+ */
+MPORT_PUBLIC_API int
+mport_batch_end(mportInstance *mport) {
+	int ret = MPORT_OK;
+
+	if (!mport->batch)
+		return (MPORT_OK);
+
+	mport->batch = false;
+	mport->batch_pending = 0;
+
+	if (!sqlite3_get_autocommit(mport->db))
+		ret = mport_db_do(mport->db, "COMMIT TRANSACTION");
+
+	if (mport_db_do(mport->db, "PRAGMA synchronous=FULL") != MPORT_OK ||
+	    mport_db_do(mport->db, "PRAGMA wal_checkpoint(PASSIVE)") != MPORT_OK)
+		ret = mport_err_code();
+
+	/* the ldconfig and cache rebuilds held back for the batch, once each */
+	if (mport_trigger_flush(mport) != MPORT_OK)
+		ret = mport_err_code();
+
+	mport_precheck_reset(mport);
+
+	return ret;
+}
+
+/**
+ * Commit the package in progress, before its stub is detached.  Every
+ * MPORT_BATCH_COMMIT packages the WAL is checkpointed, which syncs it.
+ */
+int
+mport_batch_pause(mportInstance *mport) {
+
+	if (!mport->batch || sqlite3_get_autocommit(mport->db))
+		return (MPORT_OK);
+
+	if (mport_db_do(mport->db, "COMMIT TRANSACTION") != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (++mport->batch_pending >= MPORT_BATCH_COMMIT) {
+		mport->batch_pending = 0;
+		if (mport_db_do(mport->db, "PRAGMA wal_checkpoint(PASSIVE)") != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+	}
+
+	return (MPORT_OK);
+}
+
+/* Open the transaction for the next package */
+int
+mport_batch_resume(mportInstance *mport) {
+
+	if (!mport->batch || !sqlite3_get_autocommit(mport->db))
+		return (MPORT_OK);
+
+	return mport_db_do(mport->db, "BEGIN IMMEDIATE TRANSACTION");
+}
+
 /**
  * Get the mport database schema version.
  */
@@ -172,11 +326,26 @@ mport_set_progress_free_cb(mportInstance *mport, mport_progress_free_cb cb) {
     mport->progress_free_cb = cb;
 }
 
+/*
+ * Set a callback for structured progress: phase, counts and bytes, at the
+ * same throttled rate the step callback is called.  The init, step and free
+ * callbacks are still called; set them to NULL to draw only from events.
+ */
+MPORT_PUBLIC_API void
+mport_set_progress_event_cb(mportInstance *mport, mport_progress_event_cb cb) {
+    mport->progress_event_cb = cb;
+}
+
 MPORT_PUBLIC_API void
 mport_set_confirm_cb(mportInstance *mport, mport_confirm_cb cb) {
     mport->confirm_cb = cb;
 }
 
+MPORT_PUBLIC_API void
+mport_set_fetch_stats_cb(mportInstance *mport, mport_fetch_stats_cb cb) {
+    mport->fetch_stats_cb = cb;
+}
+
 /* callers for the callbacks (only for msg at the moment) */
 void
 mport_call_msg_cb(mportInstance *mport, const char *fmt, ...) {
@@ -215,12 +384,21 @@ mport_call_progress_init_cb(mportInstance *mport, const char *fmt, ...) {
 
 MPORT_PUBLIC_API int
 mport_instance_free(mportInstance *mport) {
+    mport_db_cache_reset(mport);
+    mport_index_cache_reset(mport);
+    mport_trigger_reset(mport);
+    mport_progress_reset(mport);
+    mport_precheck_reset(mport);
+    mport_trace_reset(mport);
+
     if (sqlite3_close(mport->db) != SQLITE_OK) {
         RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
     }
 
+    mport_fetch_session_reset(mport);
     free(mport->root);
 	free(mport->outputPath);
+	free(mport->repository);
     free(mport);
     return MPORT_OK;
 }
@@ -30,6 +30,10 @@
 
 #include <archive.h>
 #include <archive_entry.h>
+#include <ohash.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -37,25 +41,99 @@
 #include "mport.h"
 #include "mport_private.h"
 
-/* build a hashtable with pkgname keys, values are a struct with fields for
- * filename, and boolean is_in_db */
-struct table_entry {
-  char *file;
-  short is_in_db;
-  char *name;
-  struct table_entry *next;
+/*
+ * Every input is read twice: for its stub, which goes into the merged
+ * stub database, and for its files.  Both are done on merge_jobs threads,
+ * ahead of the merge, in the order the merge takes the inputs.  When the
+ * bundle_chunks setting has the merge write a chunked bundle, an input
+ * with a table of contents in the codec being written has its chunks
+ * copied as they are (see mport_bundle_write_add_bundle()); any other has
+ * its files compressed again into a part of its own, which is then copied.
+ * Otherwise the bundle is one stream, so the inputs' files are read and
+ * compressed into it in turn, and only their stubs are extracted ahead.
+ */
+
+enum { MERGE_PENDING, MERGE_DONE, MERGE_FAILED };
+
+struct merge_input {
+  const char *file;
+  char *stub;			/* its stub database, extracted */
+  struct mport_bundle_toc toc;
+  bool chunked;			/* toc is in the codec being written */
+  mportBundleWrite *part;	/* its files, compressed again for a chunked merge */
+  bool queued;			/* its files go where its first package is */
+  int state;			/* of the job running on it */
+  char *err;			/* why the job failed */
 };
 
-#define TABLE_SIZE 128
+struct merge_pkg {
+  size_t input;
+  char name[];			/* the ohash key */
+};
 
-static int build_stub_db(mportInstance *, sqlite3 **, const char *, const char *, const char **, struct table_entry **);
-static int archive_metafiles(mportBundleWrite *, sqlite3 *, struct table_entry **);
-static int archive_package_files(mportBundleWrite *, sqlite3 *, struct table_entry **);
+struct merge {
+  const char *tmpdir;
+  mportCompression codec;
+  int level;
+  int threads;
+  bool chunked;			/* writing a version 6 bundle */
+  struct merge_input *inputs;
+  size_t ninputs;
+  struct ohash pkgs;		/* package name => the input it is from */
+  size_t *order;		/* the inputs, by their first package */
+  size_t norder;
+
+  /* the jobs, taken in order */
+  int (*job)(struct merge *, struct merge_input *);
+  size_t *jobs;
+  size_t njobs;
+  size_t next;
+  bool stop;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  pthread_t workers[MPORT_MAX_INSTALL_JOBS];
+  int nworkers;
+  int maxworkers;
+};
+
+static int merge_settings(mportInstance *, struct merge *);
+static void merge_start(struct merge *, int (*)(struct merge *, struct merge_input *), size_t *, size_t);
+static int merge_wait(struct merge *, struct merge_input *);
+static void merge_stop(struct merge *);
+static void merge_free(struct merge *);
+static int merge_extract(struct merge *, struct merge_input *);
+static int merge_input_files(mportBundleWrite *, struct merge_input *);
+static int merge_pack(struct merge *, struct merge_input *);
+static int build_stub_db(mportInstance *, sqlite3 **, const char *, struct merge *);
+static int order_inputs(sqlite3 *, struct merge *);
+static int archive_metafiles(mportBundleWrite *, struct merge *);
+static int archive_package_files(mportBundleWrite *, struct merge *);
 static int extract_stub_db(const char *, const char *);
 
-static struct table_entry * find_in_table(struct table_entry **, const char *);
-static int insert_into_table(struct table_entry **, const char *, const char *);
-static uint32_t SuperFastHash(const char *);
+static void *
+merge_calloc(size_t s, void *data)
+{
+
+  return calloc(1, s);
+}
+
+static void
+merge_free_cb(void *p, size_t s, void *data)
+{
+
+  free(p);
+}
+
+static void *
+merge_alloc(size_t s, void *data)
+{
+
+  return malloc(s);
+}
+
+static struct ohash_info merge_pkg_info = {
+  offsetof(struct merge_pkg, name), NULL, merge_calloc, merge_free_cb, merge_alloc
+};
 
 #include <err.h>
 
@@ -70,91 +148,359 @@ static uint32_t SuperFastHash(const char *);
 MPORT_PUBLIC_API int
 mport_merge_primative(mportInstance *mport, const char **filenames, const char *outfile)
 {
-  sqlite3 *db;
-  mportBundleWrite *bundle;
-  struct table_entry **table;
+  sqlite3 *db = NULL;
+  mportBundleWrite *bundle = NULL;
+  struct merge m;
   char tmpdir[] = "/tmp/mport.XXXXXXXX";
-  char *dbfile;
-  
-  if ((table = (struct table_entry **)calloc(TABLE_SIZE, sizeof(struct table_entry *))) == NULL)
-    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate hash table.");
+  char *dbfile = NULL, *msg;
+  int ret;
   
   DIAG("mport_merge_primative(%p, %s)", filenames, outfile)
   
-  if (mkdtemp(tmpdir) == NULL)
-    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't make temp directory.");
-  if (asprintf(&dbfile, "%s/%s", tmpdir, "merged.db") == -1)
-    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't build merge database name.");
+  memset(&m, 0, sizeof(m));
+  for (; filenames[m.ninputs] != NULL; m.ninputs++)
+    ;
+  if ((m.inputs = calloc(m.ninputs, sizeof(struct merge_input))) == NULL ||
+      (m.order = calloc(m.ninputs, sizeof(size_t))) == NULL) {
+    free(m.inputs);
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  }
+  ohash_init(&m.pkgs, 6, &merge_pkg_info);
+  pthread_mutex_init(&m.lock, NULL);
+  pthread_cond_init(&m.done, NULL);
+
+  if (mkdtemp(tmpdir) == NULL) {
+    ret = SET_ERROR(MPORT_ERR_FATAL, "Couldn't make temp directory.");
+    goto DONE;
+  }
+  m.tmpdir = tmpdir;
+  
+  for (size_t i = 0; i < m.ninputs; i++) {
+    m.inputs[i].file = filenames[i];
+    if (asprintf(&m.inputs[i].stub, "%s/pkg-%zu.db", tmpdir, i) == -1) {
+      m.inputs[i].stub = NULL;
+      ret = SET_ERROR(MPORT_ERR_FATAL, "Couldn't make stub db tempfile.");
+      goto DONE;
+    }
+  }
+
+  if (asprintf(&dbfile, "%s/%s", tmpdir, "merged.db") == -1) {
+    dbfile = NULL;
+    ret = SET_ERROR(MPORT_ERR_FATAL, "Couldn't build merge database name.");
+    goto DONE;
+  }
+
+  if ((ret = merge_settings(mport, &m)) != MPORT_OK)
+    goto DONE;
   
   DIAG("Building stub")
 
   /* this function merges the stub databases into one db. */      
-  if (build_stub_db(mport, &db, tmpdir, dbfile, filenames, table) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
+  if ((ret = build_stub_db(mport, &db, dbfile, &m)) != MPORT_OK)
+    goto DONE;
   
   DIAG("Stub complete: %s", dbfile)
+
+  if ((ret = order_inputs(db, &m)) != MPORT_OK)
+    goto DONE;
+
+  /* the inputs not copied as they are get compressed while the rest goes on */
+  merge_start(&m, merge_pack, m.order, m.norder);
     
   /* set up the bundle, and add our new stub database to it. */
-  if ((bundle = mport_bundle_write_new()) == NULL)
-    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't alloca bundle struct.");
-  if (mport_bundle_write_init(bundle, outfile) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
+  if ((bundle = mport_bundle_write_new()) == NULL) {
+    ret = SET_ERROR(MPORT_ERR_FATAL, "Couldn't alloca bundle struct.");
+    goto DONE;
+  }
+  if ((ret = mport_bundle_write_init_compressed(bundle, outfile, m.codec, m.level, m.threads, m.chunked)) != MPORT_OK)
+    goto DONE;
    
   DIAG("Adding %s", dbfile)
     
-  if (mport_bundle_write_add_file(bundle, dbfile, MPORT_STUB_DB_FILE) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
+  if ((ret = mport_bundle_write_add_file(bundle, dbfile, MPORT_STUB_DB_FILE)) != MPORT_OK)
+    goto DONE;
   
   DIAG("Adding metafiles")
   /* add all the meta files in the correct order */
-  if (archive_metafiles(bundle, db, table) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
+  if ((ret = archive_metafiles(bundle, &m)) != MPORT_OK)
+    goto DONE;
 
   DIAG("Adding realfiles")
   /* add all the other files */     
-  if (archive_package_files(bundle, db, table) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
+  if ((ret = archive_package_files(bundle, &m)) != MPORT_OK)
+    goto DONE;
 
   DIAG("Realfiles complete")
   
-  if (mport_bundle_write_finish(bundle) != MPORT_OK)
-    RETURN_CURRENT_ERROR;
- 
- /*if (mport_rmtree(tmpdir) != MPORT_OK)
-   RETURN_CURRENT_ERROR; */
+  ret = mport_bundle_write_finish(bundle);
+  bundle = NULL;
+
+DONE:
+  /* keep the error over what cleaning up does */
+  msg = ret == MPORT_OK ? NULL : strdup(mport_err_string());
+  merge_stop(&m);
+  if (bundle != NULL) {
+    bundle->failed = true;
+    mport_bundle_write_finish(bundle);
+    (void)unlink(outfile);
+  }
+  if (db != NULL)
+    sqlite3_close(db);
+  merge_free(&m);
+  pthread_cond_destroy(&m.done);
+  pthread_mutex_destroy(&m.lock);
+  free(dbfile);
+  if (m.tmpdir != NULL)
+    (void)mport_rmtree(tmpdir);
+  if (msg != NULL) {
+    mport_set_err(ret, msg);
+    free(msg);
+  }
  
- return MPORT_OK;
+  return ret;
+}
+
+
+/* the codec bundles are written with, whether in chunks, and how many jobs run at once */
+static int
+merge_settings(mportInstance *mport, struct merge *m)
+{
+  char *name;
+  int ret = MPORT_OK;
+
+  m->codec = MPORT_COMPRESS_XZ;
+  if ((name = mport_setting_lookup(mport, MPORT_SETTING_BUNDLE_COMPRESSION)) != NULL) {
+    ret = mport_compression_parse(name, &m->codec);
+    free(name);
+  }
+  m->level = mport_setting_get_int(mport, MPORT_SETTING_BUNDLE_COMPRESSION_LEVEL, 0);
+  m->threads = mport_setting_get_int(mport, MPORT_SETTING_BUNDLE_COMPRESSION_THREADS, 1);
+  m->chunked = mport_setting_get_int(mport, MPORT_SETTING_BUNDLE_CHUNKS, 0) != 0;
+
+  m->maxworkers = mport_setting_get_int(mport, MPORT_SETTING_MERGE_JOBS, mport_default_install_jobs());
+  if (m->maxworkers < 0)
+    m->maxworkers = 0;
+  if (m->maxworkers > MPORT_MAX_INSTALL_JOBS)
+    m->maxworkers = MPORT_MAX_INSTALL_JOBS;
+
+  return ret;
+}
+
+
+static void *
+merge_worker(void *arg)
+{
+  struct merge *m = arg;
+  struct merge_input *in;
+  int ret;
+
+  for (;;) {
+    pthread_mutex_lock(&m->lock);
+    if (m->stop || m->next >= m->njobs) {
+      pthread_mutex_unlock(&m->lock);
+      break;
+    }
+    in = &m->inputs[m->jobs[m->next++]];
+    pthread_mutex_unlock(&m->lock);
+
+    ret = m->job(m, in);
+
+    pthread_mutex_lock(&m->lock);
+    if (ret != MPORT_OK)
+      in->err = strdup(mport_err_string());
+    in->state = ret == MPORT_OK ? MERGE_DONE : MERGE_FAILED;
+    pthread_cond_broadcast(&m->done);
+    pthread_mutex_unlock(&m->lock);
+  }
+
+  return NULL;
+}
+
+/*
+ * Run job on the inputs in jobs, in that order, on as many workers as
+ * merge_jobs allows.  With none, merge_wait() runs each as it is needed.
+ */
+static void
+merge_start(struct merge *m, int (*job)(struct merge *, struct merge_input *), size_t *jobs, size_t njobs)
+{
+
+  m->job = job;
+  m->jobs = jobs;
+  m->njobs = njobs;
+  m->next = 0;
+  m->stop = false;
+  for (size_t i = 0; i < njobs; i++)
+    m->inputs[jobs[i]].state = MERGE_PENDING;
+
+  for (m->nworkers = 0; m->nworkers < m->maxworkers && (size_t)m->nworkers < njobs; m->nworkers++) {
+    if (pthread_create(&m->workers[m->nworkers], NULL, merge_worker, m) != 0)
+      break;
+  }
+}
+
+/* wait for the job on in, and give its error as the merge's */
+static int
+merge_wait(struct merge *m, struct merge_input *in)
+{
+  int state;
+
+  if (m->nworkers == 0) {
+    if (in->state == MERGE_PENDING)
+      in->state = m->job(m, in) == MPORT_OK ? MERGE_DONE : MERGE_FAILED;
+    if (in->state == MERGE_DONE)
+      return MPORT_OK;
+    RETURN_CURRENT_ERROR;
+  }
+
+  pthread_mutex_lock(&m->lock);
+  while ((state = in->state) == MERGE_PENDING)
+    pthread_cond_wait(&m->done, &m->lock);
+  pthread_mutex_unlock(&m->lock);
+
+  if (state == MERGE_DONE)
+    return MPORT_OK;
+  RETURN_ERRORX(MPORT_ERR_FATAL, "%s: %s", in->file, in->err == NULL ? "Out of memory." : in->err);
+}
+
+/* stop the workers, once each is through the job it is on */
+static void
+merge_stop(struct merge *m)
+{
+
+  pthread_mutex_lock(&m->lock);
+  m->stop = true;
+  pthread_mutex_unlock(&m->lock);
+
+  for (int i = 0; i < m->nworkers; i++)
+    pthread_join(m->workers[i], NULL);
+  m->nworkers = 0;
+}
+
+static void
+merge_free(struct merge *m)
+{
+  struct merge_pkg *pkg;
+  unsigned int i;
+
+  for (pkg = ohash_first(&m->pkgs, &i); pkg != NULL; pkg = ohash_next(&m->pkgs, &i))
+    free(pkg);
+  ohash_delete(&m->pkgs);
+
+  for (size_t n = 0; n < m->ninputs; n++) {
+    struct merge_input *in = &m->inputs[n];
+
+    if (in->part != NULL)
+      mport_bundle_write_finish(in->part);
+    mport_bundle_toc_free(&in->toc);
+    free(in->stub);
+    free(in->err);
+  }
+
+  free(m->inputs);
+  free(m->order);
+}
+
+
+/* the stub of an input, and its table of contents if it has one */
+static int
+merge_extract(struct merge *m, struct merge_input *in)
+{
+  int ret;
+
+  if (extract_stub_db(in->file, in->stub) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  if ((ret = mport_bundle_toc_load(in->file, &in->toc)) == MPORT_ERR_FATAL)
+    RETURN_CURRENT_ERROR;
+  in->chunked = m->chunked && ret == MPORT_OK && in->toc.nchunks > 0 && in->toc.codec == m->codec;
+
+  return MPORT_OK;
+}
+
+/* the files of an input, as entries of bundle */
+static int
+merge_input_files(mportBundleWrite *bundle, struct merge_input *in)
+{
+  mportBundleRead *inbundle;
+  struct archive_entry *entry;
+  int ret = MPORT_OK;
+
+  if ((inbundle = mport_bundle_read_new()) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  if (mport_bundle_read_init(inbundle, in->file) != MPORT_OK) {
+    mport_bundle_read_finish(NULL, inbundle);
+    RETURN_CURRENT_ERROR;
+  }
+
+  while (ret == MPORT_OK) {
+    if ((ret = mport_bundle_read_next_entry(inbundle, &entry)) != MPORT_OK || entry == NULL)
+      break;
+    if (*archive_entry_pathname(entry) == '+')
+      continue;
+
+    DIAG("Adding realfile: %s", archive_entry_pathname(entry));
+
+    ret = mport_bundle_write_add_entry(bundle, inbundle, entry);
+  }
+
+  if (ret != MPORT_OK) {
+    mport_bundle_read_finish(NULL, inbundle);
+    RETURN_CURRENT_ERROR;
+  }
+
+  return mport_bundle_read_finish(NULL, inbundle);
+}
+
+/* the files of an input a chunked merge can't copy as they are, compressed again */
+static int
+merge_pack(struct merge *m, struct merge_input *in)
+{
+
+  if (in->chunked || !m->chunked)
+    return MPORT_OK;
+
+  if ((in->part = mport_bundle_write_new()) == NULL)
+    RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+  if (mport_bundle_write_init_part(in->part, m->tmpdir, m->codec, m->level, m->threads) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
+
+  return merge_input_files(in->part, in);
 }
 
 
 /* This function goes through each file, and builds up the merged database as
- * filename `dbfile`.  It also builds up the hashtable of package -> filename pairs.
- * When this function is done, db points to a readonly sqlite object representing
- * the merged db.
+ * filename `dbfile`.  It also builds up the hashtable of package -> input pairs.
+ * The inputs' stubs are extracted on the workers while the ones before them are
+ * merged.  When this function is done, db points to a readonly sqlite object
+ * representing the merged db.
  */
-static int build_stub_db(mportInstance *mport, sqlite3 **db,  const char *tmpdir,  const char *dbfile,  const char **filenames, struct table_entry **table)
+static int build_stub_db(mportInstance *mport, sqlite3 **db, const char *dbfile, struct merge *m)
 {
-  char *tmpdbfile;
-  const char *name;
-  const char *file = NULL;
+  struct merge_input *in;
+  struct merge_pkg *pkg;
+  const char *name, *end;
+  unsigned int slot;
   int made_table = 0, ret;
   sqlite3_stmt *stmt;
   
-  if (asprintf(&tmpdbfile, "%s/%s", tmpdir, "pkg.db") == -1)
-    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't make stub db tempfile.");
-  
   if (sqlite3_open(dbfile, db) != SQLITE_OK)
     RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(*db));
   
   if (mport_generate_stub_schema(mport, *db) != MPORT_OK)
     RETURN_CURRENT_ERROR;
+
+  for (size_t i = 0; i < m->ninputs; i++)
+    m->order[i] = i;
+  merge_start(m, merge_extract, m->order, m->ninputs);
     
-  for (file = *filenames; file != NULL; file = *(++filenames)) {
-    DIAG("Visiting %s", file)
-    if (extract_stub_db(file, tmpdbfile) != MPORT_OK)
+  for (size_t i = 0; i < m->ninputs; i++) {
+    in = &m->inputs[i];
+
+    DIAG("Visiting %s", in->file)
+    if (merge_wait(m, in) != MPORT_OK)
       RETURN_CURRENT_ERROR;
 
-    if (mport_db_do(*db, "ATTACH %Q AS subbundle", tmpdbfile) != MPORT_OK)
+    if (mport_db_do(*db, "ATTACH %Q AS subbundle", in->stub) != MPORT_OK)
       RETURN_CURRENT_ERROR;
     
     if (mport_db_do(*db, "BEGIN TRANSACTION") != MPORT_OK)
@@ -176,7 +522,7 @@ static int build_stub_db(mportInstance *mport, sqlite3 **db,  const char *tmpdir
     if (mport_db_do(*db, "INSERT INTO depends SELECT * FROM subbundle.depends") != MPORT_OK) 
       RETURN_CURRENT_ERROR;
 
-    /* build our hashtable (pkgname => metadata) up */      
+    /* build our hashtable (pkgname => input) up; the first input to have a package keeps it */
     if (mport_db_prepare(*db, &stmt, "SELECT pkg FROM subbundle.packages") != MPORT_OK) {
       sqlite3_finalize(stmt);
       RETURN_CURRENT_ERROR;
@@ -187,10 +533,16 @@ static int build_stub_db(mportInstance *mport, sqlite3 **db,  const char *tmpdir
       
       if (ret == SQLITE_ROW) {
         name = sqlite3_column_text(stmt, 0);
-        if (insert_into_table(table, name, file) != MPORT_OK) {
+        end = NULL;
+        slot = ohash_qlookupi(&m->pkgs, name, &end);
+        if (ohash_find(&m->pkgs, slot) != NULL)
+          continue;
+        if ((pkg = ohash_create_entry(&merge_pkg_info, name, &end)) == NULL) {
           sqlite3_finalize(stmt);
-          RETURN_CURRENT_ERROR;
+          RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate table entry");
         }
+        pkg->input = i;
+        ohash_insert(&m->pkgs, slot, pkg);
       } else if (ret == SQLITE_DONE) {
         break;
       } else {
@@ -206,7 +558,9 @@ static int build_stub_db(mportInstance *mport, sqlite3 **db,  const char *tmpdir
       RETURN_CURRENT_ERROR;  
     if (mport_db_do(*db, "DETACH subbundle") != MPORT_OK)
       RETURN_CURRENT_ERROR;    
+    (void)unlink(in->stub);
   }
+  merge_stop(m);
 
   /* just have to sort the packages (going from unsorted to packages), no big deal... ;) */
   while (1) {
@@ -246,6 +600,9 @@ static int build_stub_db(mportInstance *mport, sqlite3 **db,  const char *tmpdir
   
   if (pkgs != unsort) 
     RETURN_ERRORX(MPORT_ERR_FATAL, "Sorted (%i) and unsorted (%i) counts do no match.", pkgs, unsort);
+
+  if (mport_stub_bundle_version(*db, m->chunked) != MPORT_OK)
+    RETURN_CURRENT_ERROR;
     
       
   /* Close the stub database handle, and reopen as read only to ensure that we don't
@@ -260,201 +617,122 @@ static int build_stub_db(mportInstance *mport, sqlite3 **db,  const char *tmpdir
 }
 
 
-static int archive_metafiles(mportBundleWrite *bundle, sqlite3 *db, struct table_entry **table) 
+/*
+ * The inputs in the order of the merged packages: each input's files (and
+ * meta files) go where the first of its packages is.
+ */
+static int
+order_inputs(sqlite3 *db, struct merge *m)
 {
+  struct merge_input *in;
+  struct merge_pkg *pkg;
   sqlite3_stmt *stmt;
-  int ret, sret;
-  char *filename;
   const char *pkgname;
-  struct table_entry *match = NULL;
-  mportBundleRead *inbundle= NULL;
-  struct archive_entry *entry;
-  
-  ret = MPORT_OK;
-        
+  int ret;
+
   if (mport_db_prepare(db, &stmt, "SELECT pkg FROM packages") != MPORT_OK) {
-	  sqlite3_finalize(stmt);
-	  RETURN_CURRENT_ERROR;
+    sqlite3_finalize(stmt);
+    RETURN_CURRENT_ERROR;
   }
-    
-  while (1) {
-    sret = sqlite3_step(stmt);
-    
-    if (sret == SQLITE_DONE) {
-      goto DONE;
-    } else if (sret != SQLITE_ROW) {
-      ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-      goto DONE;
-    } 
-    
-    /* at this point, ret must be SQLITE_ROW */
-    pkgname  = sqlite3_column_text(stmt, 0);
-    match = find_in_table(table, pkgname);
-    
-    if (match == NULL) {
-      ret = SET_ERRORX(MPORT_ERR_FATAL, "Couldn't find package '%s' in filename table.", pkgname);
-      goto DONE;
-    }
-    
-    filename = match->file;
-    
-    if ((inbundle = mport_bundle_read_new()) == NULL) {
-      SET_ERROR(MPORT_ERR_FATAL, "Couldn't allocate bundle");
-      goto DONE;
-    }
 
-    
-    if (mport_bundle_read_init(inbundle, filename) != MPORT_OK) {
-      ret = mport_bundle_read_finish(NULL, inbundle);
-      goto DONE;
-    }
+  m->norder = 0;
+  while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+    pkgname = sqlite3_column_text(stmt, 0);
 
-    
-    /* skip the sub db */
-    if (mport_bundle_read_next_entry(inbundle, &entry) != MPORT_OK) {
-      ret = mport_bundle_read_finish(NULL, inbundle);
-      goto DONE;
-    }
-    if (archive_read_data_skip(inbundle->archive) != ARCHIVE_OK) {
-      ret = mport_bundle_read_finish(NULL, inbundle);
-      ret = SET_ERRORX(MPORT_ERR_FATAL, "Unable to read %s: %s", filename, archive_error_string(inbundle->archive));
-      goto DONE;
-    }
-    
-    
-    while (1) {
-      if (mport_bundle_read_next_entry(inbundle, &entry) != MPORT_OK) {
-        ret = mport_bundle_read_finish(NULL, inbundle);
-        goto DONE;
-      } 
-      
-      if (*(archive_entry_pathname(entry)) != '+')
-        break;
-      
-      DIAG("Adding %s", archive_entry_pathname(entry))
-      
-      if ((ret = mport_bundle_write_add_entry(bundle, inbundle, entry)) != MPORT_OK) {
-        DIAG("bundle add entry failed")
-        ret = mport_bundle_read_finish(NULL, inbundle);
-        goto DONE;
-      }
+    if ((pkg = ohash_find(&m->pkgs, ohash_qlookup(&m->pkgs, pkgname))) == NULL) {
+      sqlite3_finalize(stmt);
+      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't find package '%s' in filename table.", pkgname);
     }
 
-    ret = mport_bundle_read_finish(NULL, inbundle);    
+    in = &m->inputs[pkg->input];
+    if (!in->queued) {
+      in->queued = true;
+      m->order[m->norder++] = pkg->input;
+    }
   }
-  
-  DONE:
+
+  if (ret != SQLITE_DONE) {
+    SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
     sqlite3_finalize(stmt);
-    return ret;
-}
+    RETURN_CURRENT_ERROR;
+  }
+  sqlite3_finalize(stmt);
 
+  return MPORT_OK;
+}
 
 
-static int archive_package_files(mportBundleWrite *bundle, sqlite3 *db, struct table_entry **table)
+/* the meta files of every input but their stubs and tables of contents, which are the merge's own */
+static int archive_metafiles(mportBundleWrite *bundle, struct merge *m) 
 {
-  sqlite3_stmt *stmt, *files;
-  int ret;
-  struct table_entry *cur;
-  const char *pkgname;
-  const char *file;
+  int ret = MPORT_OK;
+  const char *filename, *path;
   mportBundleRead *inbundle;
   struct archive_entry *entry;
   
-  if (mport_db_prepare(db, &stmt, "SELECT pkg FROM packages") != MPORT_OK) {
-	  sqlite3_finalize(stmt);
-	  RETURN_CURRENT_ERROR;
-  }
-  
-  while (1) {
-    ret = sqlite3_step(stmt);
-    
-    if (ret == SQLITE_DONE)
-      break;
+  for (size_t i = 0; i < m->norder && ret == MPORT_OK; i++) {
+    filename = m->inputs[m->order[i]].file;
     
-    if (ret != SQLITE_ROW) {
-      SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-      sqlite3_finalize(stmt);
-      RETURN_CURRENT_ERROR;
-    }
-    
-    pkgname = sqlite3_column_text(stmt, 0);
-    cur     = find_in_table(table, pkgname);
-    
-    if (cur == NULL) {
-      sqlite3_finalize(stmt);
-      RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't find package '%s' in bundle hash table", pkgname);
-    }
-    
-    file = cur->file;
-        
     if ((inbundle = mport_bundle_read_new()) == NULL)
-      RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-        
+      RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate bundle");
     
-    if (mport_bundle_read_init(inbundle, file) != MPORT_OK) {
-      mport_bundle_read_finish(NULL, inbundle);
-      RETURN_CURRENT_ERROR;
-    }
-    
-    if (mport_bundle_read_skip_metafiles(inbundle) != MPORT_OK) {
+    if (mport_bundle_read_init(inbundle, filename) != MPORT_OK) {
       mport_bundle_read_finish(NULL, inbundle);
-      sqlite3_finalize(stmt);
       RETURN_CURRENT_ERROR;
     }
 
-    if (mport_db_prepare(db, &files, "SELECT data FROM assets WHERE pkg=%Q AND (type=%i or type=%i or type=%i)", pkgname, ASSET_FILE, ASSET_SAMPLE, ASSET_SAMPLE_OWNER_MODE) != MPORT_OK) {
-      mport_bundle_read_finish(NULL, inbundle);
-      sqlite3_finalize(stmt);
-      RETURN_CURRENT_ERROR;
-    }
-    
-    while (1) {
-      int fret = sqlite3_step(files);
+    while ((ret = mport_bundle_read_next_entry(inbundle, &entry)) == MPORT_OK && entry != NULL) {
+      path = archive_entry_pathname(entry);
 
-      if (fret == SQLITE_DONE) {
-        sqlite3_finalize(files);
+      if (*path != '+')
         break;
-      } else if (fret != SQLITE_ROW) {
-        SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-        sqlite3_finalize(stmt);
-        sqlite3_finalize(files);
-        mport_bundle_read_finish(NULL, inbundle);
-        RETURN_CURRENT_ERROR;
-      }
-      
-      file = sqlite3_column_text(files, 0);
+      if (strcmp(path, MPORT_STUB_DB_FILE) == 0 || strcmp(path, MPORT_BUNDLE_TOC_FILE) == 0)
+        continue;
       
-      if (mport_bundle_read_next_entry(inbundle, &entry) != MPORT_OK) {
-        mport_bundle_read_finish(NULL, inbundle);
-        sqlite3_finalize(stmt);
-        sqlite3_finalize(files);
-        RETURN_CURRENT_ERROR;
-      } 
+      DIAG("Adding %s", path)
       
-      if (strcmp(file, archive_entry_pathname(entry)) != 0) {
-        SET_ERRORX(MPORT_ERR_FATAL, "Plist to archive mismatch in package %s: found '%s', expected '%s'", pkgname, archive_entry_pathname(entry), file);
-        mport_bundle_read_finish(NULL, inbundle);
-        sqlite3_finalize(stmt);
-        sqlite3_finalize(files);
-        RETURN_CURRENT_ERROR;
+      if ((ret = mport_bundle_write_add_entry(bundle, inbundle, entry)) != MPORT_OK) {
+        DIAG("bundle add entry failed")
+        break;
       }
+    }
 
-      DIAG("Adding realfile: %s", archive_entry_pathname(entry));
-  
-      if (mport_bundle_write_add_entry(bundle, inbundle, entry) != MPORT_OK) {
-        mport_bundle_read_finish(NULL, inbundle);
-        sqlite3_finalize(stmt);
-        sqlite3_finalize(files);
-        RETURN_CURRENT_ERROR;
-      } 
+    if (ret != MPORT_OK) {
+      mport_bundle_read_finish(NULL, inbundle);
+      RETURN_CURRENT_ERROR;
     }
+    ret = mport_bundle_read_finish(NULL, inbundle);    
+  }
   
-    /* we're done with this package, onto the next one */
-    sqlite3_finalize(files);
-    mport_bundle_read_finish(NULL, inbundle);
-  } 
+  return ret;
+}
+
+
+/* each input's files, as the workers have them ready */
+static int archive_package_files(mportBundleWrite *bundle, struct merge *m)
+{
+  struct merge_input *in;
+  int ret;
   
-  sqlite3_finalize(stmt);
+  for (size_t i = 0; i < m->norder; i++) {
+    in = &m->inputs[m->order[i]];
+
+    if (merge_wait(m, in) != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+
+    if (!m->chunked) {
+      ret = merge_input_files(bundle, in);
+    } else if (in->chunked) {
+      ret = mport_bundle_write_add_bundle(bundle, in->file, &in->toc);
+    } else {
+      ret = mport_bundle_write_add_part(bundle, in->part);
+      mport_bundle_write_finish(in->part);
+      in->part = NULL;
+    }
+
+    if (ret != MPORT_OK)
+      RETURN_CURRENT_ERROR;
+  }
   
   return MPORT_OK;   
 }
@@ -474,6 +752,8 @@ static int extract_stub_db(const char *filename, const char *destfile)
     RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
   if (archive_read_support_filter_xz(a))
     RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
+  if (archive_read_support_filter_zstd(a) < ARCHIVE_WARN)
+    RETURN_ERROR(MPORT_ERR_FATAL, archive_error_string(a));
     
   if (archive_read_open_filename(a, filename, 10240) != ARCHIVE_OK) {
     SET_ERRORX(MPORT_ERR_FATAL, "Could not open %s: %s", filename, archive_error_string(a));
@@ -505,113 +785,3 @@ static int extract_stub_db(const char *filename, const char *destfile)
     
   return MPORT_OK;
 }
-
-
-/* insert into a name => file pair into the given hash table. */
-static int insert_into_table(struct table_entry **table, const char *name, const char *file)
-{
-  struct table_entry *node, *cur;
-  int hash = SuperFastHash(name) % TABLE_SIZE;
-  
-  if ((node = (struct table_entry *)calloc(1, sizeof(struct table_entry))) == NULL)
-    RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate table entry");
-
-  node->name     = strdup(name);
-  node->file     = strdup(file);
-  node->is_in_db = 0;
-  node->next     = NULL;
-   
-  if (table[hash] == NULL) {     
-    table[hash] = node;   
-  } else {
-    cur = table[hash];
-    while (cur->next != NULL) 
-      cur = cur->next;
-  
-    cur->next = node;
-  }
-  
-  return MPORT_OK;
-}
-
-
-static struct table_entry * find_in_table(struct table_entry **table, const char *name)
-{
-  int hash = SuperFastHash(name) % TABLE_SIZE;
-  struct table_entry *e = NULL;
-  
-  e = table[hash];  
-  while (e != NULL) {
-    if (strcmp(e->name, name) == 0)
-      return e;
-      
-    e = e->next;
-  }
-  
-  return e;
-}
-      
-      
-    
-      
-/* Paul Hsieh's fast hash function, from http://www.azillionmonkeys.com/qed/hash.html */
-/* This function has been modified to only work with C strings */
-#undef get16bits
-#if (defined(__GNUC__) && defined(__i386__)) || defined(__WATCOMC__) \
-  || defined(_MSC_VER) || defined (__BORLANDC__) || defined (__TURBOC__)
-#define get16bits(d) (*((const uint16_t *) (d)))
-#endif
-
-#if !defined (get16bits)
-#define get16bits(d) ((((uint32_t)(((const uint8_t *)(d))[1])) << 8)\
-                       +(uint32_t)(((const uint8_t *)(d))[0]) )
-#endif
-
-static uint32_t SuperFastHash(const char * data) 
-{
-    int len = strlen(data);
-    uint32_t hash = len, tmp;
-    int rem;
-
-    if (len <= 0 || data == NULL) return 0;
-
-    rem = len & 3;
-    len >>= 2;
-
-    /* Main loop */
-    for (;len > 0; len--) {
-        hash  += get16bits (data);
-        tmp    = (get16bits (data+2) << 11) ^ hash;
-        hash   = (hash << 16) ^ tmp;
-        data  += 2*sizeof (uint16_t);
-        hash  += hash >> 11;
-    }
-
-    /* Handle end cases */
-    switch (rem) {
-        case 3: hash += get16bits (data);
-                hash ^= hash << 16;
-                hash ^= data[sizeof (uint16_t)] << 18;
-                hash += hash >> 11;
-                break;
-        case 2: hash += get16bits (data);
-                hash ^= hash << 11;
-                hash += hash >> 17;
-                break;
-        case 1: hash += *data;
-                hash ^= hash << 10;
-                hash += hash >> 1;
-    }
-
-    /* Force "avalanching" of final 127 bits */
-    hash ^= hash << 3;
-    hash += hash >> 5;
-    hash ^= hash << 4;
-    hash += hash >> 17;
-    hash ^= hash << 25;
-    hash += hash >> 6;
-
-    return hash;
-}
-
-
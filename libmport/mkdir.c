@@ -35,6 +35,7 @@
 
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,18 +56,27 @@
  */
 int
 mport_mkdirp(char *path, mode_t omode)
+{
+
+	return (mport_mkdirp_at(AT_FDCWD, path, omode));
+}
+
+/*
+ * Same as mport_mkdirp(), with relative paths resolved against the
+ * directory open on dirfd rather than the process working directory.
+ */
+int
+mport_mkdirp_at(int dirfd, char *path, mode_t omode)
 {
 	struct stat sb;
-	mode_t numask, oumask;
-	int first, last, retval;
+	int last, retval;
 	char *p;
 
 	p = path;
-	oumask = 0;
 	retval = 1;
 	if (p[0] == '/')		/* Skip leading '/'. */
 		++p;
-	for (first = 1, last = 0; !last ; ++p) {
+	for (last = 0; !last ; ++p) {
 		if (p[0] == '\0')
 			last = 1;
 		else if (p[0] != '/')
@@ -74,29 +84,23 @@ mport_mkdirp(char *path, mode_t omode)
 		*p = '\0';
 		if (!last && p[1] == '\0')
 			last = 1;
-		if (first) {
-			/*
-			 * POSIX 1003.2:
-			 * For each dir operand that does not name an existing
-			 * directory, effects equivalent to those caused by the
-			 * following command shall occcur:
-			 *
-			 * mkdir -p -m $(umask -S),u+wx $(dirname dir) &&
-			 *    mkdir [-m mode] dir
-			 *
-			 * We change the user's umask and then restore it,
-			 * instead of doing chmod's.
-			 */
-			oumask = umask(0);
-			numask = oumask & ~(S_IWUSR | S_IXUSR);
-			(void)umask(numask);
-			first = 0;
-		}
-		if (last)
-			(void)umask(oumask);
-		if (mkdir(path, last ? omode : S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
+		/*
+		 * POSIX 1003.2:
+		 * For each dir operand that does not name an existing
+		 * directory, effects equivalent to those caused by the
+		 * following command shall occcur:
+		 *
+		 * mkdir -p -m $(umask -S),u+wx $(dirname dir) &&
+		 *    mkdir [-m mode] dir
+		 *
+		 * This used to clear u+wx from the umask while the parents
+		 * were made, but the umask belongs to the whole process and
+		 * other threads may be creating files.  A parent the umask
+		 * left without u+wx gets them with a chmod instead.
+		 */
+		if (mkdirat(dirfd, path, last ? omode : S_IRWXU | S_IRWXG | S_IRWXO) < 0) {
 			if (errno == EEXIST || errno == EISDIR) {
-				if (stat(path, &sb) < 0) {
+				if (fstatat(dirfd, path, &sb, 0) < 0) {
 					warn("%s", path);
 					retval = 0;
 					break;
@@ -116,11 +120,12 @@ mport_mkdirp(char *path, mode_t omode)
 				retval = 0;
 				break;
 			}
+		} else if (!last && fstatat(dirfd, path, &sb, 0) == 0 &&
+		    (sb.st_mode & (S_IWUSR | S_IXUSR)) != (S_IWUSR | S_IXUSR)) {
+			(void)fchmodat(dirfd, path, (sb.st_mode & ALLPERMS) | S_IWUSR | S_IXUSR, 0);
 		}
 		if (!last)
 		    *p = '/';
 	}
-	if (!first && !last)
-		(void)umask(oumask);
 	return (retval);
 }
@@ -38,6 +38,7 @@
 #include <sys/queue.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef void (*mport_msg_cb)(const char *);
 typedef void (*mport_progress_init_cb)(const char *);
@@ -45,10 +46,83 @@ typedef void (*mport_progress_step_cb)(int, int, const char *);
 typedef void (*mport_progress_free_cb)(void);
 typedef int (*mport_confirm_cb)(const char *, const char *, const char *, int);
 
+/* What fetching one file cost, across every mirror tried */
+typedef struct {
+  const char *file;
+  const char *mirror; /* the mirror that served it, NULL if none did */
+  bool ok;
+  off_t bytes; /* transferred from the mirror that served it */
+  long elapsed; /* ms, from the first attempt to the last */
+  long rate; /* bytes per second over the successful transfer */
+  int retries; /* attempts that failed before the last one */
+} mportFetchStats;
+
+typedef void (*mport_fetch_stats_cb)(const mportFetchStats *);
+
+/* Progress updates, at most a few a second, see progress.c */
+enum mport_progress_phase {
+  MPORT_PHASE_FETCH, MPORT_PHASE_INSTALL, MPORT_PHASE_DELETE
+};
+
+enum mport_progress_kind {
+  MPORT_PROGRESS_START, MPORT_PROGRESS_UPDATE, MPORT_PROGRESS_END
+};
+
+typedef struct {
+  enum mport_progress_kind kind;
+  enum mport_progress_phase phase;
+  const char *title;
+  const char *item; /* file or package just done, NULL if none */
+  int current;
+  int total; /* 0 if not known */
+  off_t bytes;
+  off_t bytes_total; /* 0 if not known */
+  long elapsed; /* ms since MPORT_PROGRESS_START */
+} mportProgressEvent;
+
+typedef void (*mport_progress_event_cb)(const mportProgressEvent *);
+
+/* Begin and end of each phase of an install, delete, upgrade or import, see trace.c */
+enum mport_trace_phase {
+  MPORT_TRACE_INSTALL, MPORT_TRACE_FETCH, MPORT_TRACE_VERIFY, MPORT_TRACE_STUB, MPORT_TRACE_PRECHECK,
+  MPORT_TRACE_PREINSTALL, MPORT_TRACE_EXTRACT, MPORT_TRACE_DB, MPORT_TRACE_SCRIPT, MPORT_TRACE_POSTINSTALL,
+  MPORT_TRACE_TRIGGER, MPORT_TRACE_DELETE, MPORT_TRACE_UPGRADE, MPORT_TRACE_PLAN, MPORT_TRACE_IMPORT
+};
+
+enum mport_trace_kind {
+  MPORT_TRACE_BEGIN, MPORT_TRACE_END
+};
+
+typedef struct {
+  enum mport_trace_kind kind;
+  enum mport_trace_phase phase;
+  const char *item; /* package or file, NULL if none */
+  int depth; /* phases open around this one */
+  int64_t time; /* us, CLOCK_MONOTONIC */
+  int64_t elapsed; /* us since the begin, for MPORT_TRACE_END */
+  long count; /* files, rows or packages done, for MPORT_TRACE_END */
+  off_t bytes;
+  int status; /* MPORT_OK, or the error the phase ended with */
+} mportTraceEvent;
+
+typedef void (*mport_trace_cb)(const mportTraceEvent *);
+
 /* Mport Instance (an installed copy of the mport system) */
 #define MPORT_INST_HAVE_INDEX 1
+#define MPORT_INST_INDEX_VERSION_KEY 2 /* idx.packages has version_key */
+#define MPORT_INST_READONLY 4 /* master.db opened read only, see mport_instance_init_flags() */
+#define MPORT_INST_DEEP 8 /* delete and verify hash every file, see mport_fingerprint_matches() */
+#define MPORT_INST_INDEX_DEFERRED 16 /* HAVE_INDEX, but idx is attached on first use, see mport_index_attach() */
 #define MPORT_LOCAL_PKG_PATH "/var/db/mport/downloads"
 
+struct mport_fetch_session;
+struct mport_stmt_cache;
+struct mport_index_cache;
+struct mport_trigger_queue;
+struct mport_progress;
+struct mport_precheck;
+struct mport_trace;
+
 typedef struct {
   int flags;
   sqlite3 *db;
@@ -59,18 +133,50 @@ typedef struct {
   mport_progress_init_cb progress_init_cb;
   mport_progress_step_cb progress_step_cb;
   mport_progress_free_cb progress_free_cb;
+  mport_progress_event_cb progress_event_cb; /* NULL unless wanted */
+  struct mport_progress *progress; /* see progress.c */
   mport_confirm_cb confirm_cb;
+  struct mport_fetch_session *fetch_session; /* mirror state, see fetch_session.c */
+  mport_fetch_stats_cb fetch_stats_cb; /* NULL unless wanted */
+  struct mport_stmt_cache *stmt_cache; /* see stmt_cache.c */
+  struct mport_index_cache *index_cache; /* see index_cache.c */
+  bool batch; /* inside mport_batch_begin() */
+  int batch_pending; /* packages installed since the batch last committed */
+  struct mport_trigger_queue *triggers; /* cache rebuilds held for the batch, see trigger.c */
+  struct mport_precheck *precheck; /* installed packages as the checks see them, see check_preconditions.c */
+  struct mport_trace *trace; /* NULL unless tracing, see trace.c */
+  char *repository; /* mirror for this instance only, see mport_set_repository() */
 } mportInstance;
 
+/* Result sets: vectors whose entries and strings are all freed at once */
+typedef struct mport_result_set mportResultSet;
+
+void mport_result_set_free(mportResultSet *);
+
 mportInstance * mport_instance_new(void);
 int mport_instance_init(mportInstance *, const char *, const char *, bool noIndex);
+
+/* mport_instance_init_flags() flags */
+#define MPORT_INIT_READONLY 0x01
+
+int mport_instance_init_flags(mportInstance *, const char *, const char *, bool noIndex, int);
+int mport_snapshot_begin(mportInstance *);
+int mport_snapshot_end(mportInstance *);
+int mport_batch_begin(mportInstance *);
+int mport_batch_end(mportInstance *);
 int mport_instance_free(mportInstance *);
 
 void mport_set_msg_cb(mportInstance *, mport_msg_cb);
 void mport_set_progress_init_cb(mportInstance *, mport_progress_init_cb);
 void mport_set_progress_step_cb(mportInstance *, mport_progress_step_cb);
 void mport_set_progress_free_cb(mportInstance *, mport_progress_free_cb);
+void mport_set_progress_event_cb(mportInstance *, mport_progress_event_cb);
 void mport_set_confirm_cb(mportInstance *, mport_confirm_cb);
+void mport_set_fetch_stats_cb(mportInstance *, mport_fetch_stats_cb);
+int mport_set_repository(mportInstance *, const char *);
+void mport_set_trace_cb(mportInstance *, mport_trace_cb);
+int mport_trace_file(mportInstance *, const char *);
+const char * mport_trace_phase_name(enum mport_trace_phase);
 
 void mport_default_msg_cb(const char *);
 int mport_default_confirm_cb(const char *, const char *, const char *, int);
@@ -162,12 +268,24 @@ typedef struct {
 
 int mport_asset_get_assetlist(mportInstance *, mportPackageMeta *, mportAssetList **);
 int mport_asset_get_package_from_file_path(mportInstance *, const char *, mportPackageMeta **);
+int mport_asset_get_owners(mportInstance *, const char **, size_t, char ***);
+void mport_asset_owners_free(char **, size_t);
 
 mportPackageMeta * mport_pkgmeta_new(void);
 void mport_pkgmeta_free(mportPackageMeta *);
 void mport_pkgmeta_vec_free(mportPackageMeta **);
 int mport_pkgmeta_search_master(mportInstance *, mportPackageMeta ***, const char *, ...);
+int mport_pkgmeta_get(mportInstance *, mportPackageMeta ***, const char *);
 int mport_pkgmeta_list(mportInstance *mport, mportPackageMeta ***ref);
+int mport_pkgmeta_search_master_set(mportInstance *, mportResultSet **, mportPackageMeta ***, const char *, ...);
+int mport_pkgmeta_list_set(mportInstance *, mportResultSet **, mportPackageMeta ***);
+
+typedef struct _PackageMetaIter mportPackageMetaIter;
+
+int mport_pkgmeta_iter_search(mportInstance *, mportPackageMetaIter **, const char *, ...);
+int mport_pkgmeta_iter_list(mportInstance *, mportPackageMetaIter **);
+int mport_pkgmeta_iter_next(mportPackageMetaIter *, mportPackageMeta **);
+void mport_pkgmeta_iter_free(mportPackageMetaIter *);
 int mport_pkgmeta_get_downdepends(mportInstance *, mportPackageMeta *, mportPackageMeta ***);
 int mport_pkgmeta_get_updepends(mportInstance *, mportPackageMeta *, mportPackageMeta ***);
 
@@ -186,13 +304,37 @@ typedef struct {
 int mport_index_load(mportInstance *);
 int mport_index_get(mportInstance *);
 int mport_index_check(mportInstance *, mportPackageMeta *);
+
+/* An installed package with an update in the index */
+typedef struct {
+  char *pkgname;
+  char *version; /* installed */
+  char *os_release; /* installed */
+  char *index_version; /* NULL if the index no longer has the package */
+  bool os_only; /* same version, rebuilt for a newer OS release */
+} mportOutdatedEntry;
+
+int mport_index_outdated(mportInstance *, mportOutdatedEntry ***);
+void mport_index_outdated_free_vec(mportOutdatedEntry **);
 int mport_index_list(mportInstance *, mportIndexEntry ***);
 int mport_index_lookup_pkgname(mportInstance *, const char *, mportIndexEntry ***);
 int mport_index_search(mportInstance *, mportIndexEntry ***, const char *, ...);
+int mport_index_list_set(mportInstance *, mportResultSet **, mportIndexEntry ***);
+int mport_index_search_set(mportInstance *, mportResultSet **, mportIndexEntry ***, const char *, ...);
 void mport_index_entry_free_vec(mportIndexEntry **);
 void mport_index_entry_free(mportIndexEntry *);
 
+/* Streaming cursors; the entry handed back is reused for every row */
+typedef struct _IndexIter mportIndexIter;
+
+int mport_index_iter_search(mportInstance *, mportIndexIter **, const char *, ...);
+int mport_index_iter_list(mportInstance *, mportIndexIter **);
+int mport_index_fulltext_search(mportInstance *, mportIndexIter **, const char *);
+int mport_index_iter_next(mportIndexIter *, mportIndexEntry **);
+void mport_index_iter_free(mportIndexIter *);
+
 int mport_index_print_mirror_list(mportInstance *);
+int mport_mirror_rank(mportInstance *);
 
 /* Index Depends */
 
@@ -204,6 +346,7 @@ typedef struct {
 } mportDependsEntry;
 
 int mport_index_depends_list(mportInstance *, const char *, const char *, mportDependsEntry ***);
+int mport_index_depends_closure(mportInstance *, const char *, const char *, mportIndexEntry ***);
 void mport_index_depends_free_vec(mportDependsEntry **);
 void mport_index_depends_free(mportDependsEntry *);
 
@@ -227,6 +370,17 @@ typedef struct package_message {
     struct package_message *next, *prev;
 } mportPackageMessage;
 
+/* how a bundle is compressed, see mport_bundle_write_init_compressed() */
+typedef enum {
+  MPORT_COMPRESS_DEFAULT = 0, /* the bundle_compression setting, or xz */
+  MPORT_COMPRESS_XZ,
+  MPORT_COMPRESS_ZSTD
+} mportCompression;
+
+#define MPORT_COMPRESS_THREADS_AUTO -1 /* one per CPU */
+
+int mport_compression_parse(const char *, mportCompression *);
+
 typedef struct {
   char *pkg_filename;
   char *sourcedir;
@@ -237,6 +391,11 @@ typedef struct {
   char *pkgdeinstall;
   char *pkgmessage;
   bool is_backup;
+  mportCompression compression;
+  int compression_level; /* 0 for the setting, or the codec's default */
+  int compression_threads; /* 0 for the setting, or 1; MPORT_COMPRESS_THREADS_AUTO */
+  bool dedup; /* store files repeating another's content as hard links; or the bundle_dedup setting */
+  bool chunks; /* write a version 6 bundle, in chunks with a +TOC; or the bundle_chunks setting */
 } mportCreateExtras;  
 
 mportCreateExtras * mport_createextras_new(void);
@@ -251,29 +410,75 @@ int mport_merge_primative(mportInstance *mport, const char **, const char *);
 int mport_install(mportInstance *, const char *, const char *, const char *, mportAutomatic);
 int mport_install_primative(mportInstance *, const char *, const char *, mportAutomatic);
 
+/* Install planning: dependencies ordered before their dependents */
+typedef enum {
+    MPORT_PLAN_INSTALL,
+    MPORT_PLAN_UPDATE
+} mportPlanAction;
+
+typedef struct {
+    mportPlanAction action;
+    mportAutomatic automatic;
+    mportIndexEntry *entry; /* what gets installed, owned by the plan */
+    const char *installed_version; /* what it replaces for MPORT_PLAN_UPDATE, otherwise NULL */
+    bool done; /* set by mport_plan_execute() once the step has succeeded */
+} mportPlanStep;
+
+struct mport_plan_graph;
+
+typedef struct {
+    mportPlanStep **steps; /* NULL terminated, in install order */
+    size_t nsteps;
+    bool keep_going; /* carry on past a failed step with whatever doesn't need it */
+    struct mport_plan_graph *graph;
+} mportPlan;
+
+int mport_plan_new(mportInstance *, mportPlan **);
+int mport_plan_add(mportInstance *, mportPlan *, const char *, const char *, mportAutomatic);
+int mport_plan_fetch(mportInstance *, mportPlan *);
+int mport_plan_execute(mportInstance *, mportPlan *);
+void mport_plan_free(mportPlan *);
+
 /* package updating */
 int mport_update(mportInstance *, const char *);
 int mport_update_primative(mportInstance *, const char *);
 
 /* package upgrade */
 int mport_upgrade(mportInstance *);
+int mport_upgrade_plan(mportInstance *, mportPlan **);
 
 /* Package deletion */
 int mport_delete_primative(mportInstance *, mportPackageMeta *, int);
+int mport_delete_packages(mportInstance *, mportPackageMeta **, int);
 
 int mport_autoremove(mportInstance *);
 
 /* package verify */
+typedef struct {
+  const char *name;
+  const char *version;
+  size_t files; /* regular files checked */
+  size_t hashed; /* of those, the ones read, the rest still had their install fingerprint */
+  size_t missing;
+  size_t modified;
+  size_t unreadable;
+} mportVerifyResult;
+
+typedef void (*mport_verify_cb)(const mportVerifyResult *, void *);
+
 int mport_verify_package(mportInstance *, mportPackageMeta *);
+int mport_verify_packages(mportInstance *, mport_verify_cb, void *);
 
 /* version comparing */
 int mport_version_cmp(const char *, const char *);
+size_t mport_version_key(const char *, char *, size_t);
 
 /* fetch XXX: This should become private */
 int mport_fetch_bundle(mportInstance *, const char *, const char *);
 int mport_download(mportInstance *, const char *, bool, char **);
+int mport_fetch_bundles(mportInstance *, const char *, mportIndexEntry **);
 
-/* Errors */
+/* Errors: the calling thread's last, see error.c */
 int mport_err_code(void);
 const char * mport_err_string(void);
 
@@ -293,6 +498,7 @@ int mport_setting_set(mportInstance *, const char *, const char *);
 /* Utils */
 void mport_parselist(char *, char ***);
 int mport_verify_hash(const char *, const char *);
+int mport_verify_bundle(mportInstance *, const char *, const char *);
 int mport_file_exists(const char *);
 char * mport_version(mportInstance *);
 char * mport_version_short(mportInstance *);
@@ -325,4 +531,9 @@ mportStats * mport_stats_new(void);
 int mport_import(mportInstance*,  char *);
 int mport_export(mportInstance*, char *);
 
+/* Resident daemon for read only queries, see daemon.c and mportd(8) */
+#define MPORT_DAEMON_SOCKET "/var/run/mportd.sock"
+
+int mport_daemon_request(const char *, int, char *const [], int *);
+
 #endif /* ! defined _MPORT_H */
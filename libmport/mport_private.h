@@ -41,19 +41,54 @@
 #if defined(__MidnightBSD__)
 #include <osreldate.h>
 #endif
+#include <sys/stat.h>
+#include <md5.h>
 #include <ohash.h>
+#include <sha256.h>
 #include <sqlite3.h>
+#include <time.h>
 #include "bzlib.h"
+#ifdef MPORT_BLAKE3
+#include <blake3.h>
+#endif
 
 #define MPORT_PUBLIC_API 
 
-#define MPORT_MASTER_VERSION 10
-#define MPORT_BUNDLE_VERSION 5
-#define MPORT_BUNDLE_VERSION_STR "5"
+#define MPORT_MASTER_VERSION 16
+/*
+ * The newest bundle format read.  Bundles are stamped 5, which readers
+ * from before 6 take, unless they need 6: chunks with a +TOC, or checksums
+ * prefixed with their algorithm.  See mport_stub_bundle_version().
+ */
+#define MPORT_BUNDLE_VERSION 6
+#define MPORT_BUNDLE_VERSION_STR "6"
+#define MPORT_BUNDLE_VERSION_PLAIN 5
+#define MPORT_BUNDLE_VERSION_PLAIN_STR "5"
 #define MPORT_VERSION "2.2.6"
 
+/* how long to wait on another process's lock (ms), then extra retries */
+#define MPORT_DB_BUSY_TIMEOUT 30000
+#define MPORT_DB_RETRIES 5
+
+/* packages between syncs inside mport_batch_begin() */
+#define MPORT_BATCH_COMMIT 16
+
 #define MPORT_SETTING_MIRROR_REGION "mirror_region"
 #define MPORT_SETTING_TARGET_OS "target_os"
+#define MPORT_SETTING_FETCH_JOBS "fetch_jobs"
+#define MPORT_SETTING_INSTALL_JOBS "install_jobs"
+#define MPORT_SETTING_DURABILITY "durability"
+#define MPORT_SETTING_UPDATE_BACKUP "update_backup"
+#define MPORT_SETTING_FETCH_MIRROR_JOBS "fetch_mirror_jobs"
+#define MPORT_SETTING_PACKAGE_CACHE "package_cache"
+#define MPORT_SETTING_FETCH_LOG "fetch_log"
+#define MPORT_SETTING_BUNDLE_COMPRESSION "bundle_compression"
+#define MPORT_SETTING_BUNDLE_COMPRESSION_LEVEL "bundle_compression_level"
+#define MPORT_SETTING_BUNDLE_COMPRESSION_THREADS "bundle_compression_threads"
+#define MPORT_SETTING_MERGE_JOBS "merge_jobs"
+#define MPORT_SETTING_BUNDLE_DEDUP "bundle_dedup"
+#define MPORT_SETTING_BUNDLE_CHUNKS "bundle_chunks"
+#define MPORT_SETTING_REPOSITORY "repository"
 
 /* callback syntactic sugar */
 void mport_call_msg_cb(mportInstance *, const char *, ...);
@@ -66,10 +101,14 @@ void mport_call_progress_init_cb(mportInstance *, const char *, ...);
 #define MPORT_PRECHECK_UPGRADEABLE 8
 #define MPORT_PRECHECK_OS          16
 int mport_check_preconditions(mportInstance *, mportPackageMeta *, long);
+int mport_check_preconditions_all(mportInstance *, mportPackageMeta **, long);
+void mport_precheck_forget(mportInstance *, const char *);
+void mport_precheck_reset(mportInstance *);
 
 /* schema */
 int mport_generate_master_schema(sqlite3 *);
 int mport_generate_stub_schema(mportInstance *, sqlite3 *);
+int mport_stub_bundle_version(sqlite3 *, bool);
 int mport_upgrade_master_schema(sqlite3 *, int);
 
 /* instance */
@@ -78,26 +117,160 @@ int mport_set_database_version(sqlite3 *);
 
 /* Various database convenience functions */
 int mport_attach_stub_db(sqlite3 *, const char *);
+int mport_attach_stub_db_mem(sqlite3 *, unsigned char *, size_t);
 int mport_detach_stub_db(sqlite3 *);
 int mport_db_do(sqlite3 *, const char *, ...);
 int mport_db_prepare(sqlite3 *, sqlite3_stmt **, const char *, ...);
 int mport_db_count(sqlite3 *, int *, const char *, ...);
+int mport_db_step(sqlite3_stmt *);
+int mport_batch_pause(mportInstance *);
+int mport_batch_resume(mportInstance *);
+
+/* ldconfig and friends, coalesced inside a batch, see trigger.c */
+int mport_trigger_run(mportInstance *, mportAssetListEntryType, const char *);
+int mport_trigger_flush(mportInstance *);
+void mport_trigger_reset(mportInstance *);
+
+/* throttled progress, see progress.c */
+void mport_progress_begin(mportInstance *, enum mport_progress_phase, int, const char *, ...);
+void mport_progress_step(mportInstance *, off_t, const char *);
+void mport_progress_set(mportInstance *, int, int, off_t, off_t, const char *);
+void mport_progress_end(mportInstance *);
+void mport_progress_reset(mportInstance *);
+
+/* phase timing, see trace.c */
+void mport_trace_begin(mportInstance *, enum mport_trace_phase, const char *);
+void mport_trace_end(mportInstance *, enum mport_trace_phase, long, off_t, int);
+void mport_trace_reset(mportInstance *);
+void mport_trace_totals_begin(mportInstance *);
+void mport_trace_totals_report(mportInstance *);
+
+/* the daemon's end of the mportd socket, see daemon.c */
+#define MPORT_DAEMON_REQUEST_MAX 16384
+#define MPORT_DAEMON_ARGS_MAX 256
+#define MPORT_DAEMON_DECLINED -1 /* reply status: the client runs the command itself */
+#define MPORT_DAEMON_ACCEPTED -2 /* sent before the command writes anything */
+
+typedef struct {
+  int sock;
+  int out; /* the client's stdout and stderr */
+  int err;
+  uid_t uid;
+  gid_t gid;
+  int argc;
+  char *argv[MPORT_DAEMON_ARGS_MAX + 1];
+  char buf[MPORT_DAEMON_REQUEST_MAX + 1];
+} mportDaemonRequest;
+
+int mport_daemon_listen(const char *, gid_t);
+int mport_daemon_accept(int, mportDaemonRequest *);
+int mport_daemon_receive(mportDaemonRequest *);
+int mport_daemon_reply(mportDaemonRequest *, int);
+void mport_daemon_done(mportDaemonRequest *);
+
+int mport_db_borrow(mportInstance *, sqlite3_stmt **, const char *);
+void mport_db_return(mportInstance *, sqlite3_stmt *);
+void mport_db_cache_reset(mportInstance *);
+
+/* index lookups, see index_cache.c */
+const char * mport_index_cache_alias(mportInstance *, const char *);
+void mport_index_cache_set_alias(mportInstance *, const char *, const char *);
+mportIndexEntry ** mport_index_cache_entries(mportInstance *, const char *);
+void mport_index_cache_set_entries(mportInstance *, const char *, mportIndexEntry **);
+void mport_index_cache_reset(mportInstance *);
+
+/* result sets */
+mportResultSet * mport_result_set_new(void);
+void * mport_result_set_alloc(mportResultSet *, size_t);
+char * mport_result_set_strdup(mportResultSet *, const char *);
+int mport_result_set_push(mportResultSet *, void *);
+void ** mport_result_set_vec(mportResultSet *);
 
 /* pkgmeta */
 int mport_pkgmeta_read_stub(mportInstance *, mportPackageMeta ***);
 int mport_pkgmeta_logevent(mportInstance *, mportPackageMeta *, const char *);
 
+/* settings */
+char *mport_setting_lookup(mportInstance *, const char *);
+int mport_setting_get_int(mportInstance *, const char *, int);
+
+/* how installed files are synced, see mport_durability() */
+enum mport_durability {
+  MPORT_DURABLE_NONE,
+  MPORT_DURABLE_PACKAGE,
+  MPORT_DURABLE_FILE
+};
+int mport_durability(mportInstance *);
+
+/* how an update can be undone if it fails, see mport_update_backup() */
+enum mport_update_backup {
+  MPORT_BACKUP_NONE,
+  MPORT_BACKUP_JOURNAL,
+  MPORT_BACKUP_BUNDLE
+};
+int mport_update_backup(mportInstance *);
+
+/* checksums, prefixed with their algorithm or bare legacy hex, see checksum.c */
+#define MPORT_CHECKSUM_MAX 80 /* "blake3:" and 64 hex digits, with room to spare */
+
+enum mport_checksum_alg {
+  MPORT_CHECKSUM_MD5,
+  MPORT_CHECKSUM_SHA256,
+  MPORT_CHECKSUM_BLAKE3
+};
+
+struct mport_hasher {
+  enum mport_checksum_alg alg;
+  bool prefixed;
+  union {
+    MD5_CTX md5;
+    SHA256_CTX sha256;
+#ifdef MPORT_BLAKE3
+    blake3_hasher blake3;
+#endif
+  } ctx;
+};
+
+bool mport_checksum_parse(const char *, enum mport_checksum_alg *, bool *);
+const char * mport_checksum_digest(const char *);
+bool mport_hasher_init(struct mport_hasher *, const char *);
+void mport_hasher_update(struct mport_hasher *, const void *, size_t);
+void mport_hasher_end(struct mport_hasher *, char *);
+bool mport_checksum_file(const char *, const char *, char *);
+bool mport_checksum_matches(const char *, const char *);
+
 /* Utils */
 bool mport_starts_with(const char *, const char *);
 char* mport_hash_file(const char *);
+char *mport_hash_cache_file(mportInstance *, const char *);
+void mport_hash_cache_put(mportInstance *, const char *, const char *);
+void mport_hash_cache_forget(mportInstance *, const char *);
+int64_t mport_stat_mtime(const struct stat *);
+int64_t mport_stat_ctime(const struct stat *);
+bool mport_fingerprint_matches(mportInstance *, const struct stat *, sqlite3_stmt *, int);
+
+/* shared, content addressed package cache */
+int mport_package_cache_fetch(mportInstance *, const char *, const char *);
+void mport_package_cache_store(mportInstance *, const char *, const char *);
 int mport_copy_file(const char *, const char *);
 uid_t mport_get_uid(const char *);
 gid_t mport_get_gid(const char *);
+
+/* owner, group and mode lookups for an install, see id_cache.c */
+struct mport_id_cache;
+
+struct mport_id_cache * mport_id_cache_new(void);
+uid_t mport_id_cache_uid(struct mport_id_cache *, const char *);
+gid_t mport_id_cache_gid(struct mport_id_cache *, const char *);
+const void * mport_id_cache_mode(struct mport_id_cache *, const char *);
+void mport_id_cache_free(struct mport_id_cache *);
 int mport_rmtree(const char *);
 int mport_mkdir(const char *);
 int mport_mkdirp(char *, mode_t);
+int mport_mkdirp_at(int, char *, mode_t);
 int mport_rmdir(const char *, int);
 int mport_chdir(mportInstance *, const char *);
+int mport_open_dir(mportInstance *, const char *);
 int mport_xsystem(mportInstance *, const char *, ...);
 int mport_run_asset_exec(mportInstance *, const char *, const char *, const char *);
 void mport_free_vec(void *);
@@ -105,29 +278,95 @@ int mport_decompress_bzip2(const char *, const char *);
 int mport_shell_register(const char *);
 int mport_shell_unregister(const char *);
 time_t mport_get_time(void);
+long mport_elapsed_ms(const struct timespec *);
+
+/*
+ * Version 6 bundles are still one tar, but compressed as a run of
+ * independent streams: the meta files (+CONTENTS.db and the rest), then
+ * the other files in chunks of about MPORT_BUNDLE_CHUNK.  A reader that
+ * knows nothing of this sees one stream.  +TOC, last of the meta files,
+ * says where each chunk is, see bundle_toc.c.
+ */
+#define MPORT_BUNDLE_TOC_FILE "+TOC"
+#define MPORT_BUNDLE_CHUNK (4 * 1024 * 1024)
+#define MPORT_BUNDLE_UNPACK_JOBS 4
+
+struct mport_bundle_chunk {
+  int64_t offset; /* from the first chunk, compressed */
+  int64_t size;
+  int64_t uoffset; /* from the first chunk, in the tar */
+  int64_t usize;
+};
+
+struct mport_bundle_toc {
+  int64_t data; /* bytes of chunks, which end the file */
+  struct mport_bundle_chunk *chunks;
+  size_t nchunks;
+  mportCompression codec; /* of the bundle read, by mport_bundle_toc_load() */
+};
+
+int mport_bundle_toc_parse(const char *, size_t, struct mport_bundle_toc *);
+int mport_bundle_toc_load(const char *, struct mport_bundle_toc *);
+int mport_bundle_toc_unpack(const char *, const struct mport_bundle_toc *, int);
+void mport_bundle_toc_free(struct mport_bundle_toc *);
 
 /* Mport Bundle (a file containing packages) */
 typedef struct {
-  struct archive *archive;
+  struct archive *archive; /* the tar, uncompressed; see bundle_write.c */
   char *filename;
   struct links_table *links;
+  mportCompression codec;
+  int level;
+  int threads;
+  int fd; /* the bundle */
+  int datafd; /* the chunks, until they follow the meta files into fd */
+  struct archive *chunk; /* compressing the chunk being written, the whole of a plain bundle, or NULL */
+  bool in_data; /* past the meta files */
+  bool failed;
+  bool chunked; /* a version 6 bundle, with chunks and a +TOC */
+  bool part; /* only chunks, for mport_bundle_write_add_part() */
+  bool discard; /* the end of a part's tar, which isn't wanted */
+  unsigned char *meta; /* the meta files' tar, compressed at the end */
+  size_t metalen;
+  size_t metasize;
+  int64_t datalen; /* compressed bytes in datafd */
+  int64_t udatalen; /* tar bytes sent to chunks */
+  struct mport_bundle_toc toc;
 } mportBundleWrite;
 
 
+/* a bundle metafile (+CONTENTS.db, +INFRASTRUCTURE/...) held in memory */
+struct mport_bundle_metafile {
+  char *name;
+  unsigned char *data;
+  size_t len;
+};
+
 typedef struct {
   struct archive *archive;
   char *filename;
   char *tmpdir;
   struct archive_entry *firstreal;
   short stub_attached;
+  int durability;
+  struct mport_bundle_metafile *meta;
+  size_t nmeta;
+  struct mport_unchanged *unchanged; /* files an update can leave alone, NULL otherwise */
 } mportBundleRead;
 
 
 mportBundleWrite* mport_bundle_write_new(void);
 int mport_bundle_write_init(mportBundleWrite *, const char *);
+int mport_bundle_write_init_compressed(mportBundleWrite *, const char *, mportCompression, int, int, bool);
 int mport_bundle_write_finish(mportBundleWrite *);
 int mport_bundle_write_add_file(mportBundleWrite *, const char *, const char *);
+int mport_bundle_write_add_file_hashed(mportBundleWrite *, const char *, const char *, char *);
+int mport_bundle_write_add_first(mportBundleWrite *, const char *, const char *);
+int mport_bundle_write_add_link(mportBundleWrite *, const char *, const char *, const char *);
 int mport_bundle_write_add_entry(mportBundleWrite *, mportBundleRead *, struct archive_entry *);
+int mport_bundle_write_init_part(mportBundleWrite *, const char *, mportCompression, int, int);
+int mport_bundle_write_add_part(mportBundleWrite *, mportBundleWrite *);
+int mport_bundle_write_add_bundle(mportBundleWrite *, const char *, const struct mport_bundle_toc *);
 
 
 mportBundleRead* mport_bundle_read_new(void);
@@ -135,17 +374,26 @@ int mport_bundle_read_init(mportBundleRead *, const char *);
 int mport_bundle_read_finish(mportInstance *, mportBundleRead *);
 int mport_bundle_read_prep_for_install(mportInstance *, mportBundleRead *);
 int mport_bundle_read_extract_metafiles(mportBundleRead *, char **);
+int mport_bundle_read_load_metafiles(mportBundleRead *);
+const unsigned char * mport_bundle_read_metafile(mportBundleRead *, const char *, size_t *);
+int mport_bundle_read_metafile_path(mportBundleRead *, const char *, mode_t, char *, size_t);
 int mport_bundle_read_skip_metafiles(mportBundleRead *);
 int mport_bundle_read_next_entry(mportBundleRead *, struct archive_entry **);
 int mport_bundle_read_extract_next_file(mportBundleRead *, struct archive_entry *);
+int mport_bundle_read_extract_next_file_at(mportBundleRead *, struct archive_entry *, int, const char *);
 int mport_bundle_read_install_pkg(mportInstance *, mportBundleRead *, mportPackageMeta *);
 int mport_bundle_read_update_pkg(mportInstance *, mportBundleRead *, mportPackageMeta *);
 
+/* files identical in the installed and new versions, see bundle_read_update_pkg.c */
+struct mport_unchanged;
+bool mport_unchanged_has(const struct mport_unchanged *, const char *);
+int mport_delete_primative_except(mportInstance *, mportPackageMeta *, int, const struct mport_unchanged *);
+
 int mport_install_depends(mportInstance *, const char *, const char *, mportAutomatic);
-int mport_update_down(mportInstance *, mportPackageMeta *, struct ohash_info *, struct ohash *);
 
 /* version compare functions */
 void mport_version_cmp_sqlite(sqlite3_context *, int, sqlite3_value **);
+void mport_version_key_sqlite(sqlite3_context *, int, sqlite3_value **);
 int mport_version_require_check(const char *, const char *);
 
 #define RETURN_CURRENT_ERROR return mport_err_code()
@@ -173,6 +421,8 @@ int mport_set_errx(int , const char *, ...);
 #define MPORT_INDEX_FILE	"/var/db/mport/index.db"
 #define MPORT_INDEX_FILE_BZ2	"/var/db/mport/index.db.bz2"
 #define MPORT_INDEX_FILE_HASH	"/var/db/mport/index.db.bz2.md5"
+#define MPORT_INDEX_DELTA_SOURCE	"index.delta.db.bz2"
+#define MPORT_INDEX_DELTA_FILE	"/var/db/mport/index.delta.db"
 #define MPORT_FETCH_STAGING_DIR "/var/db/mport/downloads"
 
 
@@ -207,13 +457,105 @@ int mport_set_errx(int , const char *, ...);
 int mport_fetch_index(mportInstance *);
 int mport_fetch_bootstrap_index(mportInstance *);
 
+/* A single transfer, safe to run off the main thread. */
+typedef struct mport_fetch_xfer {
+  const char *url;
+  const char *dest;
+  off_t size;  /* as reported by the remote, -1 if unknown */
+  off_t got;
+  void (*progress)(struct mport_fetch_xfer *);
+  void *cookie;
+  bool resume; /* continue from dest.part, and keep it on failure */
+  bool decompress; /* write dest decompressed (bzip2, xz, zstd, ...); implies !resume */
+  time_t ims; /* if set, only fetch if the remote is newer than this */
+  bool unchanged; /* it wasn't, and dest was left alone */
+  time_t mtime; /* the remote's modification time, 0 if unknown */
+  char hash[65]; /* SHA256 of dest, computed as it was written; "" if unknown */
+  int errcode; /* the FETCH_ code of a failure */
+  struct timespec started; /* CLOCK_MONOTONIC, when the transfer began */
+  long elapsed; /* ms spent on the transfer itself, kept current for progress */
+  off_t transferred; /* bytes moved this time, not counting a resumed .part */
+  char errmsg[256];
+} mportFetchXfer;
+
+int mport_fetch_xfer(mportFetchXfer *);
+void mport_fetch_stats_report(mportInstance *, mportFetchStats *, const struct timespec *, const mportFetchXfer *);
+
+/* Mirror state kept for the life of an instance */
+typedef struct mport_fetch_session {
+  char **mirrors;
+  int nmirrors;
+  bool *down;     /* couldn't connect this session */
+  int *score;     /* ms to connect and pull a probe sample, lower is better */
+  char *osrel;
+} mportFetchSession;
+
+mportFetchSession * mport_fetch_session(mportInstance *);
+void mport_fetch_session_reset(mportInstance *);
+void mport_fetch_session_free(mportFetchSession *);
+int mport_fetch_session_order(mportFetchSession *, int *);
+void mport_fetch_session_mark(mportFetchSession *, int, const mportFetchXfer *, int);
+void mport_fetch_timeout_hold(void);
+void mport_fetch_timeout_release(void);
+
+#define MPORT_SETTING_MIRROR_SCORE_PREFIX "mirror_score:"
+#define MPORT_SETTING_MIRROR_SCORE_TTL "mirror_score_ttl"
+#define MPORT_MIRROR_UNREACHABLE 600000 /* score for a mirror that failed its probe */
+
+#define MPORT_DEFAULT_FETCH_JOBS 4
+#define MPORT_DEFAULT_FETCH_MIRROR_JOBS 2
+#define MPORT_MAX_FETCH_JOBS 32
+
+/* downloads running ahead of the installer, see fetch_queue.c */
+#define MPORT_SETTING_FETCH_AHEAD "fetch_ahead"
+#define MPORT_SETTING_FETCH_BUDGET "fetch_budget"
+#define MPORT_DEFAULT_FETCH_AHEAD 8
+#define MPORT_DEFAULT_FETCH_BUDGET 1024 /* MB */
+
+struct mport_fetch_queue;
+typedef void (*mport_fetch_ready_cb)(void *, const char *);
+
+int mport_fetch_queue_new(mportInstance *, mport_fetch_ready_cb, void *, struct mport_fetch_queue **);
+int mport_fetch_queue_add(mportInstance *, struct mport_fetch_queue *, mportIndexEntry *, const char *);
+int mport_fetch_queue_start(mportInstance *, struct mport_fetch_queue *, int, off_t);
+int mport_fetch_queue_wait(mportInstance *, struct mport_fetch_queue *, mportIndexEntry *);
+void mport_fetch_queue_release(struct mport_fetch_queue *, mportIndexEntry *);
+int mport_fetch_queue_finish(mportInstance *, struct mport_fetch_queue *);
+void mport_fetch_queue_free(struct mport_fetch_queue *);
+
+/* bundles decompressed ahead of the installer, see unpack_queue.c */
+#define MPORT_MAX_INSTALL_JOBS 32
+#define MPORT_SETTING_UNPACK_SPACE "unpack_space"
+#define MPORT_DEFAULT_UNPACK_SPACE 2048 /* MB */
+
+struct mport_unpack_queue;
+
+int mport_unpack_queue_start(mportInstance *, mportPlan *, bool, struct mport_unpack_queue **);
+void mport_unpack_queue_ready(void *, const char *);
+const char * mport_unpack_queue_wait(struct mport_unpack_queue *, size_t);
+void mport_unpack_queue_release(struct mport_unpack_queue *, size_t);
+void mport_unpack_queue_free(struct mport_unpack_queue *);
+int mport_default_install_jobs(void);
+
+/* files hashed at once by mport_verify_packages(), see verify.c */
+#define MPORT_SETTING_VERIFY_JOBS "verify_jobs"
+#define MPORT_SETTING_VERIFY_REHASH_DAYS "verify_rehash_days"
+#define MPORT_MAX_VERIFY_JOBS 32
+
+int mport_install_entry(mportInstance *, mportIndexEntry *, const char *, mportAutomatic, const char *);
+
 /* a few index things */
 int mport_index_get_mirror_list(mportInstance *, char ***, int *);
+char * mport_repository(mportInstance *);
+int mport_index_delta_version(mportInstance *);
+int mport_index_apply_delta(mportInstance *, const char *);
+int mport_index_attach(mportInstance *);
 
-#define MPORT_CHECK_FOR_INDEX(mport, func) if (!(mport->flags & MPORT_INST_HAVE_INDEX)) RETURN_ERRORX(MPORT_ERR_FATAL, "Attempt to use %s before loading index.", func);
+#define MPORT_CHECK_FOR_INDEX(mport, func) if (!(mport->flags & MPORT_INST_HAVE_INDEX)) RETURN_ERRORX(MPORT_ERR_FATAL, "Attempt to use %s before loading index.", func); else if (mport_index_attach(mport) != MPORT_OK) RETURN_CURRENT_ERROR;
 #define MPORT_DAY 3600 * 24
 #define MPORT_MAX_INDEX_AGE MPORT_DAY * 7 /* one week */
 #define MPORT_SETTING_INDEX_LAST_CHECKED "index_last_check"
+#define MPORT_SETTING_INDEX_LAST_MODIFIED "index_last_modified"
 #define MPORT_SETTING_REPO_AUTOUPDATE "index_autoupdate"
 
 /* Binaries we use */
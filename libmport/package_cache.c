@@ -0,0 +1,179 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The package cache is a directory of bundles named by their hash,
+ * <cache>/ab/abcdef... for SHA256 and <cache>/ab/blake3-abcdef... for
+ * BLAKE3, set with the package_cache setting.  Since bundles
+ * are found by content rather than by name, one cache can serve any number
+ * of roots (a nullfs mount into each jail or chroot) or hosts (NFS), and a
+ * root that can only read it still benefits.  Everything here is best
+ * effort; a cache that is missing, read only or corrupt just means the
+ * bundle is downloaded as it would have been without one.
+ */
+
+static char *cache_path(mportInstance *, const char *);
+
+
+/* mport_package_cache_fetch(mport, hash, dest)
+ *
+ * Put the cached bundle with hash at dest, as a hard link or, across file
+ * systems, a symlink.  Returns MPORT_OK if dest now holds a verified copy,
+ * MPORT_ERR_WARN if the bundle isn't cached.  The error state is untouched.
+ */
+int
+mport_package_cache_fetch(mportInstance *mport, const char *hash, const char *dest)
+{
+	char *path;
+	int ret = MPORT_ERR_WARN;
+
+	if ((path = cache_path(mport, hash)) == NULL)
+		return MPORT_ERR_WARN;
+
+	if (access(path, R_OK) != 0 || (link(path, dest) != 0 && symlink(path, dest) != 0)) {
+		free(path);
+		return MPORT_ERR_WARN;
+	}
+
+	if (mport_verify_bundle(mport, dest, hash)) {
+		ret = MPORT_OK;
+	} else {
+		/* don't hand the bad copy to anyone else either */
+		(void)unlink(dest);
+		(void)unlink(path);
+	}
+
+	free(path);
+
+	return ret;
+}
+
+
+/* mport_package_cache_store(mport, hash, path)
+ *
+ * Add the verified bundle at path to the cache, if there is a writable one
+ * and it doesn't have the bundle already.
+ */
+void
+mport_package_cache_store(mportInstance *mport, const char *hash, const char *path)
+{
+	struct stat st;
+	char *dest;
+	char *tmp = NULL;
+	char *slash;
+
+	if ((dest = cache_path(mport, hash)) == NULL)
+		return;
+
+	/* already there, or path is itself a reference to it */
+	if (stat(dest, &st) == 0 || lstat(path, &st) != 0 || S_ISLNK(st.st_mode))
+		goto DONE;
+
+	slash = strrchr(dest, '/');
+	*slash = '\0';
+	if (mkdir(dest, 0755) != 0 && errno != EEXIST)
+		goto DONE;
+	*slash = '/';
+
+	if (asprintf(&tmp, "%s.%d", dest, getpid()) == -1) {
+		tmp = NULL;
+		goto DONE;
+	}
+
+	/* copy rather than link if the cache is elsewhere, so it never holds a partial bundle */
+	if (link(path, tmp) != 0 && (errno != EXDEV || mport_copy_file(path, tmp) != MPORT_OK)) {
+		(void)unlink(tmp);
+		goto DONE;
+	}
+
+	(void)chmod(tmp, 0644);
+	if (rename(tmp, dest) != 0)
+		(void)unlink(tmp);
+
+DONE:
+	free(tmp);
+	free(dest);
+}
+
+
+/* the cache path for hash, or NULL if there's no cache */
+static char *
+cache_path(mportInstance *mport, const char *hash)
+{
+	enum mport_checksum_alg alg;
+	bool prefixed;
+	const char *digest, *name;
+	char *dir;
+	char *path = NULL;
+
+	if (hash == NULL || !mport_checksum_parse(hash, &alg, &prefixed))
+		return NULL;
+
+	/* SHA256 keeps the bare names it always had; MD5 is too weak to name a bundle by */
+	switch (alg) {
+	case MPORT_CHECKSUM_SHA256:
+		name = "";
+		break;
+	case MPORT_CHECKSUM_BLAKE3:
+		name = "blake3-";
+		break;
+	default:
+		return NULL;
+	}
+
+	/* it ends up in a path; only trust what a 256 bit digest looks like */
+	digest = mport_checksum_digest(hash);
+	if (strlen(digest) != 64)
+		return NULL;
+	for (const char *c = digest; *c != '\0'; c++) {
+		if (!isxdigit((unsigned char)*c))
+			return NULL;
+	}
+
+	if ((dir = mport_setting_lookup(mport, MPORT_SETTING_PACKAGE_CACHE)) == NULL)
+		return NULL;
+
+	if (dir[0] != '\0' && asprintf(&path, "%s/%.2s/%s%s", dir, digest, name, digest) == -1)
+		path = NULL;
+
+	free(dir);
+
+	return path;
+}
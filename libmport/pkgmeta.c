@@ -36,8 +36,9 @@
 #include "mport.h"
 #include "mport_private.h"
 
-static int populate_meta_from_stmt(mportPackageMeta *, sqlite3 *, sqlite3_stmt *);
+static int populate_meta_from_stmt(mportPackageMeta *, mportResultSet *, sqlite3 *, sqlite3_stmt *);
 static int populate_vec_from_stmt(mportPackageMeta ***, int, sqlite3 *, sqlite3_stmt *);
+static void pkgmeta_clear(mportPackageMeta *);
 
 
 /* Package meta-data creation and destruction */
@@ -61,15 +62,12 @@ mport_pkgmeta_new(void)
 	return pack;
 }
 
-MPORT_PUBLIC_API void
-mport_pkgmeta_free(mportPackageMeta *pack)
+/* free the strings held by pack, leaving an empty struct behind */
+static void
+pkgmeta_clear(mportPackageMeta *pack)
 {
 	int i;
 
-	if (pack == NULL) {
-		return;
-	}
-
 	free(pack->name);
 	pack->name = NULL;
 
@@ -113,6 +111,17 @@ mport_pkgmeta_free(mportPackageMeta *pack)
 	}
 	free(pack->categories);
 	pack->categories = NULL;
+}
+
+MPORT_PUBLIC_API void
+mport_pkgmeta_free(mportPackageMeta *pack)
+{
+
+	if (pack == NULL) {
+		return;
+	}
+
+	pkgmeta_clear(pack);
 	free(pack);
 }
 
@@ -185,6 +194,248 @@ mport_pkgmeta_read_stub(mportInstance *mport, mportPackageMeta ***ref)
     return ret;
 }
 
+/*
+ * Streaming cursors over the installed packages.
+ *
+ * The iterator keeps a single mportPackageMeta and refills it for every
+ * row, so it must not be freed by the caller and is only valid until the
+ * next call to mport_pkgmeta_iter_next() or mport_pkgmeta_iter_free().
+ */
+struct _PackageMetaIter {
+    mportInstance *mport;
+    sqlite3_stmt *stmt;
+    bool borrowed;
+    mportPackageMeta *pack;
+};
+
+#define PKGMETA_COLUMNS "pkg, version, origin, lang, prefix, comment, os_release, cpe, locked, deprecated, expiration_date, no_provide_shlib, flavor, automatic, install_date, type"
+
+static int
+pkgmeta_iter_open(mportInstance *mport, mportPackageMetaIter **iter_p, sqlite3_stmt *stmt, bool borrowed)
+{
+    mportPackageMetaIter *iter;
+
+    if ((iter = calloc(1, sizeof(mportPackageMetaIter))) == NULL) {
+        if (borrowed)
+            mport_db_return(mport, stmt);
+        else
+            sqlite3_finalize(stmt);
+        RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+    }
+
+    iter->mport = mport;
+    iter->stmt = stmt;
+    iter->borrowed = borrowed;
+    *iter_p = iter;
+
+    return MPORT_OK;
+}
+
+static void
+pkgmeta_iter_release(mportPackageMetaIter *iter)
+{
+
+    if (iter->stmt == NULL)
+        return;
+
+    if (iter->borrowed)
+        mport_db_return(iter->mport, iter->stmt);
+    else
+        sqlite3_finalize(iter->stmt);
+    iter->stmt = NULL;
+}
+
+static int
+pkgmeta_iter_vsearch(mportInstance *mport, mportPackageMetaIter **iter_p, const char *fmt, va_list args)
+{
+    sqlite3_stmt *stmt = NULL;
+    char *where;
+
+    if (mport == NULL)
+        RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
+
+    if ((where = sqlite3_vmprintf(fmt, args)) == NULL)
+        RETURN_ERROR(MPORT_ERR_FATAL, "Could not build where clause");
+
+    if (mport_db_prepare(mport->db, &stmt, "SELECT " PKGMETA_COLUMNS " FROM packages WHERE %s", where) != MPORT_OK) {
+        sqlite3_free(where);
+        sqlite3_finalize(stmt);
+        RETURN_CURRENT_ERROR;
+    }
+    sqlite3_free(where);
+
+    return pkgmeta_iter_open(mport, iter_p, stmt, false);
+}
+
+/*
+ * Open an iterator over the installed packages matching a where clause, as
+ * with mport_pkgmeta_search_master().
+ */
+MPORT_PUBLIC_API int
+mport_pkgmeta_iter_search(mportInstance *mport, mportPackageMetaIter **iter_p, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = pkgmeta_iter_vsearch(mport, iter_p, fmt, args);
+    va_end(args);
+
+    return ret;
+}
+
+/* Open an iterator over all installed packages, ordered by name and version */
+MPORT_PUBLIC_API int
+mport_pkgmeta_iter_list(mportInstance *mport, mportPackageMetaIter **iter_p)
+{
+    sqlite3_stmt *stmt = NULL;
+
+    if (mport == NULL)
+    	RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
+
+    if (mport_db_prepare(mport->db, &stmt, "SELECT " PKGMETA_COLUMNS " FROM packages ORDER BY pkg, version_key") != MPORT_OK) {
+        sqlite3_finalize(stmt);
+        RETURN_CURRENT_ERROR;
+    }
+
+    return pkgmeta_iter_open(mport, iter_p, stmt, false);
+}
+
+/*
+ * Step to the next package.  *pack is set to the iterator's package, or to
+ * NULL once the rows are exhausted.
+ */
+MPORT_PUBLIC_API int
+mport_pkgmeta_iter_next(mportPackageMetaIter *iter, mportPackageMeta **pack)
+{
+
+    *pack = NULL;
+
+    if (iter == NULL || iter->stmt == NULL)
+        return MPORT_OK;
+
+    switch (sqlite3_step(iter->stmt)) {
+        case SQLITE_ROW:
+            if (iter->pack == NULL && (iter->pack = mport_pkgmeta_new()) == NULL)
+                RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate meta.");
+            if (populate_meta_from_stmt(iter->pack, NULL, iter->mport->db, iter->stmt) != MPORT_OK)
+                RETURN_CURRENT_ERROR;
+            *pack = iter->pack;
+            return MPORT_OK;
+        case SQLITE_DONE:
+            pkgmeta_iter_release(iter);
+            return MPORT_OK;
+        default:
+            RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(iter->mport->db));
+    }
+}
+
+MPORT_PUBLIC_API void
+mport_pkgmeta_iter_free(mportPackageMetaIter *iter)
+{
+
+    if (iter == NULL)
+        return;
+
+    pkgmeta_iter_release(iter);
+    mport_pkgmeta_free(iter->pack);
+    free(iter);
+}
+
+/*
+ * Drain an iterator into a NULL terminated vector.  Each row's meta is
+ * taken over from the iterator rather than copied.  *ref is left NULL when
+ * there were no rows.  The iterator is freed in every case.
+ */
+static int
+pkgmeta_iter_collect(mportPackageMetaIter *iter, mportPackageMeta ***ref)
+{
+    mportPackageMeta **vec = NULL, **grown, *pack;
+    size_t len = 0, cap = 0;
+
+    *ref = NULL;
+
+    while (1) {
+        if (mport_pkgmeta_iter_next(iter, &pack) != MPORT_OK) {
+            mport_pkgmeta_vec_free(vec);
+            mport_pkgmeta_iter_free(iter);
+            RETURN_CURRENT_ERROR;
+        }
+
+        if (pack == NULL)
+            break;
+
+        if (len == cap) {
+            cap = cap == 0 ? 16 : cap * 2;
+            if ((grown = realloc(vec, (cap + 1) * sizeof(mportPackageMeta *))) == NULL) {
+                mport_pkgmeta_vec_free(vec);
+                mport_pkgmeta_iter_free(iter);
+                RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate meta.");
+            }
+            vec = grown;
+        }
+
+        vec[len++] = pack;
+        vec[len] = NULL;
+        iter->pack = NULL;
+    }
+
+    mport_pkgmeta_iter_free(iter);
+    *ref = vec;
+
+    return MPORT_OK;
+}
+
+/*
+ * Drain an iterator's statement into a result set, building each meta
+ * straight from the row in the set's blocks.  *ref is left NULL when there
+ * were no rows.  The iterator is freed in every case, and *set_p is only
+ * set on success.
+ */
+static int
+pkgmeta_iter_collect_set(mportPackageMetaIter *iter, mportResultSet **set_p, mportPackageMeta ***ref)
+{
+    mportResultSet *set;
+    mportPackageMeta *pack;
+    int ret;
+
+    *set_p = NULL;
+    *ref = NULL;
+
+    if ((set = mport_result_set_new()) == NULL) {
+        mport_pkgmeta_iter_free(iter);
+        RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate meta.");
+    }
+
+    while ((ret = sqlite3_step(iter->stmt)) == SQLITE_ROW) {
+        if ((pack = mport_result_set_alloc(set, sizeof(mportPackageMeta))) == NULL) {
+            SET_ERROR(MPORT_ERR_FATAL, "Couldn't allocate meta.");
+            goto error;
+        }
+        pack->action = MPORT_ACTION_UNKNOWN;
+
+        if (populate_meta_from_stmt(pack, set, iter->mport->db, iter->stmt) != MPORT_OK ||
+            mport_result_set_push(set, pack) != MPORT_OK)
+            goto error;
+    }
+
+    if (ret != SQLITE_DONE) {
+        SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(iter->mport->db));
+        goto error;
+    }
+
+    mport_pkgmeta_iter_free(iter);
+    *ref = (mportPackageMeta **) mport_result_set_vec(set);
+    *set_p = set;
+
+    return MPORT_OK;
+
+error:
+    mport_result_set_free(set);
+    mport_pkgmeta_iter_free(iter);
+    RETURN_CURRENT_ERROR;
+}
+
 /* mport_pkgmeta_search_master(mportInstance *mport, mportPacakgeMeta ***pack, const char *where, ...)
  *
  * Allocate and populate the package meta for the given package from the
@@ -205,53 +456,50 @@ MPORT_PUBLIC_API int
 mport_pkgmeta_search_master(mportInstance *mport, mportPackageMeta ***ref, const char *fmt, ...)
 {
     va_list args;
-    sqlite3_stmt *stmt;
-    int ret, len;
-    char *where;
-    sqlite3 *db = mport->db;
+    mportPackageMetaIter *iter;
+    int ret;
 
     va_start(args, fmt);
-    where = sqlite3_vmprintf(fmt, args);
+    ret = pkgmeta_iter_vsearch(mport, &iter, fmt, args);
     va_end(args);
 
-    if (where == NULL)
-        RETURN_ERROR(MPORT_ERR_FATAL, "Could not build where clause");
+    if (ret != MPORT_OK)
+        RETURN_CURRENT_ERROR;
 
-    if (mport == NULL)
-    	RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
+    return pkgmeta_iter_collect(iter, ref);
+}
 
-    if (mport_db_prepare(db, &stmt, "SELECT count(*) FROM packages WHERE %s", where) != MPORT_OK) {
-        sqlite3_finalize(stmt);
-        RETURN_CURRENT_ERROR;
-    }
 
-    if (sqlite3_step(stmt) != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
-        RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-    }
+/* mport_pkgmeta_get(mportInstance *mport, mportPackageMeta ***ref, const char *name)
+ *
+ * The same as mport_pkgmeta_search_master(mport, ref, "pkg=%Q", name), but
+ * with cached statements, for callers that look packages up one at a time.
+ *
+ * pack is set to NULL and MPORT_OK is returned if no packages where found.
+ */
+MPORT_PUBLIC_API int
+mport_pkgmeta_get(mportInstance *mport, mportPackageMeta ***ref, const char *name)
+{
+    sqlite3_stmt *stmt;
+    mportPackageMetaIter *iter;
 
-    len = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+    if (mport == NULL)
+    	RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
 
-    if (len == 0) {
-        sqlite3_free(where);
-        *ref = NULL;
-        return MPORT_OK;
-    }
+    if (mport_db_borrow(mport, &stmt, "SELECT " PKGMETA_COLUMNS " FROM packages WHERE pkg=?") != MPORT_OK)
+        RETURN_CURRENT_ERROR;
 
-    if (mport_db_prepare(db, &stmt,
-                         "SELECT pkg, version, origin, lang, prefix, comment, os_release, cpe, locked, deprecated, expiration_date, no_provide_shlib, flavor, automatic, install_date, type FROM packages WHERE %s",
-                         where) != MPORT_OK) {
-        sqlite3_finalize(stmt);
+    /* name outlives the iterator, which is drained before we return */
+    if (sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC) != SQLITE_OK) {
+        SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+        mport_db_return(mport, stmt);
         RETURN_CURRENT_ERROR;
     }
 
-    ret = populate_vec_from_stmt(ref, len, db, stmt);
-
-    sqlite3_free(where);
-    sqlite3_finalize(stmt);
+    if (pkgmeta_iter_open(mport, &iter, stmt, true) != MPORT_OK)
+        RETURN_CURRENT_ERROR;
 
-    return ret;
+    return pkgmeta_iter_collect(iter, ref);
 }
 
 
@@ -264,44 +512,46 @@ mport_pkgmeta_search_master(mportInstance *mport, mportPackageMeta ***ref, const
 MPORT_PUBLIC_API int
 mport_pkgmeta_list(mportInstance *mport, mportPackageMeta ***ref)
 {
-    sqlite3_stmt *stmt;
-    int ret, len;
-
-    if (mport == NULL)
-    	RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
-
-    sqlite3 *db = mport->db;
+    mportPackageMetaIter *iter;
 
-    if (mport_db_prepare(db, &stmt, "SELECT count(*) FROM packages") != MPORT_OK) {
-        sqlite3_finalize(stmt);
+    if (mport_pkgmeta_iter_list(mport, &iter) != MPORT_OK)
         RETURN_CURRENT_ERROR;
-    }
 
-    if (sqlite3_step(stmt) != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
-        RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-    }
+    return pkgmeta_iter_collect(iter, ref);
+}
 
-    len = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
+/*
+ * mport_pkgmeta_search_master() and mport_pkgmeta_list() into a result
+ * set, for callers that walk many packages.  The metas belong to the set:
+ * release them with mport_result_set_free(), never mport_pkgmeta_free()
+ * or mport_pkgmeta_vec_free().
+ */
+MPORT_PUBLIC_API int
+mport_pkgmeta_search_master_set(mportInstance *mport, mportResultSet **set, mportPackageMeta ***ref, const char *fmt, ...)
+{
+    va_list args;
+    mportPackageMetaIter *iter;
+    int ret;
 
-    if (len == 0) {
-        *ref = NULL;
-        return MPORT_OK;
-    }
+    va_start(args, fmt);
+    ret = pkgmeta_iter_vsearch(mport, &iter, fmt, args);
+    va_end(args);
 
-    if (mport_db_prepare(db, &stmt,
-                         "SELECT pkg, version, origin, lang, prefix, comment, os_release, cpe, locked, deprecated, expiration_date, no_provide_shlib, flavor, automatic, install_date, type FROM packages ORDER BY pkg, version") !=
-        MPORT_OK) {
-        sqlite3_finalize(stmt);
+    if (ret != MPORT_OK)
         RETURN_CURRENT_ERROR;
-    }
 
-    ret = populate_vec_from_stmt(ref, len, db, stmt);
+    return pkgmeta_iter_collect_set(iter, set, ref);
+}
 
-    sqlite3_finalize(stmt);
+MPORT_PUBLIC_API int
+mport_pkgmeta_list_set(mportInstance *mport, mportResultSet **set, mportPackageMeta ***ref)
+{
+    mportPackageMetaIter *iter;
 
-    return ret;
+    if (mport_pkgmeta_iter_list(mport, &iter) != MPORT_OK)
+        RETURN_CURRENT_ERROR;
+
+    return pkgmeta_iter_collect_set(iter, set, ref);
 }
 
 /* mport_pkgmeta_get_downdepends(mportInstance *mport, mportPackageMeta *pkg, mportPackageMeta ***pkg_vec)
@@ -439,7 +689,7 @@ populate_vec_from_stmt(mportPackageMeta ***ref, int len, sqlite3 *db, sqlite3_st
 				if (*vec == NULL) {
                     RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't allocate meta.");
                 }
-				if (populate_meta_from_stmt(*vec, db, stmt) != MPORT_OK) {
+				if (populate_meta_from_stmt(*vec, NULL, db, stmt) != MPORT_OK) {
                     RETURN_CURRENT_ERROR;
                 }
 				vec++;
@@ -460,84 +710,54 @@ populate_vec_from_stmt(mportPackageMeta ***ref, int len, sqlite3 *db, sqlite3_st
 }
 
 
+/*
+ * Copy a text column to *out, into set if there is one.  dflt stands in
+ * for NULL; without one, NULL is an error.
+ */
 static int
-populate_meta_from_stmt(mportPackageMeta *pack, sqlite3 *db, sqlite3_stmt *stmt)
+pkgmeta_column(mportResultSet *set, sqlite3 *db, sqlite3_stmt *stmt, int col, const char *dflt, char **out)
 {
-	const char *tmp = 0;
-
-    /* Copy pkg to pack->name */
-	if ((tmp = sqlite3_column_text(stmt, 0)) == NULL)
-		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+	const char *tmp = (const char *) sqlite3_column_text(stmt, col);
 
-	if ((pack->name = strdup(tmp)) == NULL)
-		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-
-	/* Copy version to pack->version */
-	if ((tmp = sqlite3_column_text(stmt, 1)) == NULL)
-		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-
-	if ((pack->version = strdup(tmp)) == NULL)
-		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-
-	/* Copy origin to pack->origin */
-	if ((tmp = sqlite3_column_text(stmt, 2)) == NULL)
-		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-
-	if ((pack->origin = strdup(tmp)) == NULL)
-		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-
-	/* Copy lang to pack->lang */
-	if ((tmp = sqlite3_column_text(stmt, 3)) == NULL)
-		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+	if (tmp == NULL) {
+		if (dflt == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
+		tmp = dflt;
+	}
 
-	if ((pack->lang = strdup(tmp)) == NULL)
+	*out = set != NULL ? mport_result_set_strdup(set, tmp) : strdup(tmp);
+	if (*out == NULL)
 		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
 
-	/* Copy prefix to pack->prefix */
-	if ((tmp = sqlite3_column_text(stmt, 4)) == NULL)
-		RETURN_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(db));
-
-	if ((pack->prefix = strdup(tmp)) == NULL)
-		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	return MPORT_OK;
+}
 
-	/* Copy comment to pack->comment */
-	if ((tmp = sqlite3_column_text(stmt, 5)) == NULL) {
-		if ((pack->comment = strdup("")) == NULL)
-			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-	} else {
-		if ((pack->comment = strdup(tmp)) == NULL)
-			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-	}
+/*
+ * Fill pack from the current row.  With a result set the strings are
+ * allocated from it and pack must be fresh from the set; otherwise pack
+ * may be fresh from mport_pkgmeta_new() or hold a previous row.
+ */
+static int
+populate_meta_from_stmt(mportPackageMeta *pack, mportResultSet *set, sqlite3 *db, sqlite3_stmt *stmt)
+{
 
-	/* os_release */
-	if ((tmp = sqlite3_column_text(stmt, 6)) == NULL) {
-		if ((pack->os_release = strdup(MPORT_OSVERSION)) == NULL)
-			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-	} else {
-        if ((pack->os_release = strdup(tmp)) == NULL)
-            RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-	}
+	if (set == NULL)
+		pkgmeta_clear(pack);
+
+	if (pkgmeta_column(set, db, stmt, 0, NULL, &pack->name) != MPORT_OK ||
+	    pkgmeta_column(set, db, stmt, 1, NULL, &pack->version) != MPORT_OK ||
+	    pkgmeta_column(set, db, stmt, 2, NULL, &pack->origin) != MPORT_OK ||
+	    pkgmeta_column(set, db, stmt, 3, NULL, &pack->lang) != MPORT_OK ||
+	    pkgmeta_column(set, db, stmt, 4, NULL, &pack->prefix) != MPORT_OK ||
+	    pkgmeta_column(set, db, stmt, 5, "", &pack->comment) != MPORT_OK ||
+	    pkgmeta_column(set, db, stmt, 6, MPORT_OSVERSION, &pack->os_release) != MPORT_OK ||
+	    pkgmeta_column(set, db, stmt, 7, "", &pack->cpe) != MPORT_OK ||
+	    pkgmeta_column(set, db, stmt, 9, "", &pack->deprecated) != MPORT_OK ||
+	    pkgmeta_column(set, db, stmt, 12, "", &pack->flavor) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
 
 	pack->locked = sqlite3_column_int(stmt, 8);
 
-	/* CPE */
-	if ((tmp = sqlite3_column_text(stmt, 7)) == NULL) {
-		if ((pack->cpe = strdup("")) == NULL)
-            RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-	} else {
-		if ((pack->cpe = strdup(tmp)) == NULL)
-			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-	}
-
-	/* deprecated */
-	if ((tmp = sqlite3_column_text(stmt, 9)) == NULL) {
-		if ((pack->deprecated = strdup("")) == NULL)
-            RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-	} else {
-		if ((pack->deprecated = strdup(tmp)) == NULL)
-			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-	}
-
 	if (sqlite3_column_type(stmt, 10) == SQLITE_INTEGER) {
 		pack->expiration_date = sqlite3_column_int64(stmt, 10);
 	} else {
@@ -550,13 +770,6 @@ populate_meta_from_stmt(mportPackageMeta *pack, sqlite3 *db, sqlite3_stmt *stmt)
 		pack->no_provide_shlib = 0;
 	}
 
-	/* flavor */
-	if ((tmp = sqlite3_column_text(stmt, 12)) == NULL) {
-		pack->flavor = strdup("");
-	} else if ((pack->flavor = strdup(tmp)) == NULL) {
-        RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
-    }
-
     /* Automatic dependency install */
     if (sqlite3_column_type(stmt, 13) == SQLITE_INTEGER) {
         pack->automatic = sqlite3_column_int(stmt, 13);
@@ -0,0 +1,623 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ohash.h>
+
+/*
+ * Install planning.
+ *
+ * mport_plan_add() loads the dependency subgraph under a package from the
+ * index with one recursive query, together with what is installed, into
+ * an in-memory graph keyed by package name.  A depth first walk of that
+ * graph then appends the packages that need installing or updating to the
+ * plan, dependencies first, and reports dependency cycles instead of
+ * recursing forever.  Several roots can be added to one plan; packages
+ * they share are only planned once.
+ *
+ * As with the old recursive installer, an installed package that is up to
+ * date ends the walk: its own dependencies are not revisited.
+ */
+
+enum plan_state { PLAN_UNSEEN, PLAN_VISITING, PLAN_DONE };
+
+struct plan_node {
+	char *version;
+	char *installed_version; /* NULL unless installed */
+	bool known; /* its own row has been loaded */
+	bool installed;
+	bool outdated;
+	mportIndexEntry *entry; /* NULL if the index doesn't have it */
+	struct plan_node **deps;
+	size_t ndeps;
+	size_t capdeps;
+	unsigned int gen; /* the mport_plan_add() that created it */
+	enum plan_state state;
+	mportPlanStep *step;
+	char name[]; /* the ohash key */
+};
+
+struct mport_plan_graph {
+	struct ohash nodes;
+	unsigned int gen;
+	size_t capsteps;
+	struct plan_node **stepnodes; /* the node of each step */
+};
+
+static void *plan_calloc(size_t, void *);
+static void plan_free_cb(void *, size_t, void *);
+static void *plan_alloc(size_t, void *);
+static struct plan_node *plan_node_get(struct mport_plan_graph *, const char *);
+static int plan_node_add_dep(struct plan_node *, struct plan_node *);
+static int plan_load(mportInstance *, mportPlan *, const char *, const char *);
+static int plan_visit(mportInstance *, mportPlan *, struct plan_node *, mportAutomatic);
+static int plan_append(mportPlan *, struct plan_node *, mportAutomatic);
+
+static void *
+plan_calloc(size_t s, void *data)
+{
+
+	return calloc(1, s);
+}
+
+static void
+plan_free_cb(void *p, size_t s, void *data)
+{
+
+	free(p);
+}
+
+static void *
+plan_alloc(size_t s, void *data)
+{
+
+	return malloc(s);
+}
+
+static struct ohash_info plan_info = {
+	offsetof(struct plan_node, name), NULL, plan_calloc, plan_free_cb, plan_alloc
+};
+
+MPORT_PUBLIC_API int
+mport_plan_new(mportInstance *mport, mportPlan **plan_p)
+{
+	mportPlan *plan;
+
+	*plan_p = NULL;
+
+	if ((plan = calloc(1, sizeof(mportPlan))) == NULL ||
+	    (plan->graph = calloc(1, sizeof(struct mport_plan_graph))) == NULL ||
+	    (plan->steps = calloc(1, sizeof(mportPlanStep *))) == NULL) {
+		if (plan != NULL)
+			free(plan->graph);
+		free(plan);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+
+	ohash_init(&plan->graph->nodes, 6, &plan_info);
+	*plan_p = plan;
+
+	return MPORT_OK;
+}
+
+MPORT_PUBLIC_API void
+mport_plan_free(mportPlan *plan)
+{
+	struct plan_node *node;
+	unsigned int i;
+
+	if (plan == NULL)
+		return;
+
+	for (node = ohash_first(&plan->graph->nodes, &i); node != NULL; node = ohash_next(&plan->graph->nodes, &i)) {
+		mport_index_entry_free(node->entry);
+		free(node->version);
+		free(node->installed_version);
+		free(node->deps);
+		free(node);
+	}
+	ohash_delete(&plan->graph->nodes);
+	free(plan->graph->stepnodes);
+	free(plan->graph);
+
+	for (size_t s = 0; s < plan->nsteps; s++)
+		free(plan->steps[s]);
+	free(plan->steps);
+	free(plan);
+}
+
+/* find name in the graph, adding an unknown node for it if it isn't there */
+static struct plan_node *
+plan_node_get(struct mport_plan_graph *g, const char *name)
+{
+	struct plan_node *node;
+	unsigned int slot;
+	const char *end = NULL;
+
+	slot = ohash_qlookupi(&g->nodes, name, &end);
+	if ((node = ohash_find(&g->nodes, slot)) != NULL)
+		return node;
+
+	if ((node = ohash_create_entry(&plan_info, name, &end)) == NULL)
+		return NULL;
+
+	memset(node, 0, offsetof(struct plan_node, name));
+	node->gen = g->gen;
+	ohash_insert(&g->nodes, slot, node);
+
+	return node;
+}
+
+static int
+plan_node_add_dep(struct plan_node *node, struct plan_node *dep)
+{
+	struct plan_node **grown;
+
+	for (size_t i = 0; i < node->ndeps; i++) {
+		if (node->deps[i] == dep)
+			return MPORT_OK;
+	}
+
+	if (node->ndeps == node->capdeps) {
+		node->capdeps = node->capdeps == 0 ? 4 : node->capdeps * 2;
+		if ((grown = realloc(node->deps, node->capdeps * sizeof(struct plan_node *))) == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		node->deps = grown;
+	}
+	node->deps[node->ndeps++] = dep;
+
+	return MPORT_OK;
+}
+
+/*
+ * Load every package reachable from pkgname/version through idx.depends,
+ * with its edges, whether and how it is installed, and its index entry.
+ * A dependency is found by name: the index entry of the version it asks
+ * for, or else the newest the index has, as d_version is often only the
+ * version the package was built against.  Nodes already in the graph from
+ * an earlier root keep what they had.
+ */
+static int
+plan_load(mportInstance *mport, mportPlan *plan, const char *pkgname, const char *version)
+{
+	struct mport_plan_graph *g = plan->graph;
+	struct plan_node *node, *dep;
+	sqlite3_stmt *stmt;
+	mportIndexEntry *e;
+	char *os_release;
+	const char *col;
+	int step;
+	int ret = MPORT_OK;
+
+	if ((os_release = mport_get_osrelease(mport)) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Unable to determine OS release");
+
+	if (mport_db_prepare(mport->db, &stmt,
+	    "WITH RECURSIVE closure(pkg, version) AS (VALUES(%Q, %Q) "
+	    "UNION SELECT d.d_pkg, COALESCE(x.version, b.version, d.d_version) "
+	    "FROM idx.depends d JOIN closure c ON d.pkg=c.pkg AND d.version=c.version "
+	    "LEFT JOIN idx.packages x ON x.pkg=d.d_pkg AND x.version=d.d_version "
+	    "LEFT JOIN idx.packages b ON x.pkg IS NULL AND b.pkg=d.d_pkg AND NOT EXISTS "
+	    "(SELECT 1 FROM idx.packages n WHERE n.pkg=b.pkg AND mport_version_key(n.version) > mport_version_key(b.version))) "
+	    "SELECT c.pkg, c.version, d.d_pkg, p.pkg IS NOT NULL, "
+	    "p.pkg IS NOT NULL AND (p.version_key < mport_version_key(c.version) OR "
+	    "(p.version_key = mport_version_key(c.version) AND mport_version_cmp(p.os_release, %Q) < 0)), "
+	    "i.comment, i.bundlefile, i.license, i.hash, i.type, p.version "
+	    "FROM closure c "
+	    "LEFT JOIN idx.depends d ON d.pkg=c.pkg AND d.version=c.version "
+	    "LEFT JOIN packages p ON p.pkg=c.pkg "
+	    "LEFT JOIN idx.packages i ON i.pkg=c.pkg AND i.version=c.version",
+	    pkgname, version, os_release) != MPORT_OK) {
+		free(os_release);
+		sqlite3_finalize(stmt);
+		RETURN_CURRENT_ERROR;
+	}
+	free(os_release);
+
+	while ((step = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if ((node = plan_node_get(g, (const char *) sqlite3_column_text(stmt, 0))) == NULL) {
+			ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+			break;
+		}
+
+		/* only the query that found a node supplies its edges */
+		if (node->gen != g->gen)
+			continue;
+
+		if (!node->known) {
+			node->known = true;
+			node->installed = sqlite3_column_int(stmt, 3) != 0;
+			node->outdated = sqlite3_column_int(stmt, 4) != 0;
+
+			if ((node->version = strdup((const char *) sqlite3_column_text(stmt, 1))) == NULL) {
+				ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+				break;
+			}
+
+			if ((col = (const char *) sqlite3_column_text(stmt, 10)) != NULL &&
+			    (node->installed_version = strdup(col)) == NULL) {
+				ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+				break;
+			}
+
+			if (sqlite3_column_type(stmt, 6) != SQLITE_NULL) {
+				if ((e = calloc(1, sizeof(mportIndexEntry))) == NULL) {
+					ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+					break;
+				}
+				node->entry = e;
+				e->pkgname = strdup(node->name);
+				e->version = strdup(node->version);
+				col = (const char *) sqlite3_column_text(stmt, 5);
+				e->comment = strdup(col != NULL ? col : "");
+				e->bundlefile = strdup((const char *) sqlite3_column_text(stmt, 6));
+				col = (const char *) sqlite3_column_text(stmt, 7);
+				e->license = strdup(col != NULL ? col : "");
+				if ((col = (const char *) sqlite3_column_text(stmt, 8)) != NULL)
+					e->hash = strdup(col);
+				e->type = sqlite3_column_int(stmt, 9);
+
+				if (e->pkgname == NULL || e->version == NULL || e->comment == NULL ||
+				    e->bundlefile == NULL || e->license == NULL || (col != NULL && e->hash == NULL)) {
+					ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+					break;
+				}
+			}
+		}
+
+		if (sqlite3_column_type(stmt, 2) == SQLITE_NULL)
+			continue;
+
+		if ((dep = plan_node_get(g, (const char *) sqlite3_column_text(stmt, 2))) == NULL) {
+			ret = SET_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+			break;
+		}
+
+		if (plan_node_add_dep(node, dep) != MPORT_OK) {
+			ret = mport_err_code();
+			break;
+		}
+	}
+
+	if (ret == MPORT_OK && step != SQLITE_DONE)
+		ret = SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
+
+	sqlite3_finalize(stmt);
+
+	return ret;
+}
+
+static int
+plan_append(mportPlan *plan, struct plan_node *node, mportAutomatic automatic)
+{
+	struct mport_plan_graph *g = plan->graph;
+	mportPlanStep **grown;
+	mportPlanStep *step;
+	struct plan_node **nodes;
+
+	if (plan->nsteps + 1 >= g->capsteps) {
+		g->capsteps = g->capsteps == 0 ? 16 : g->capsteps * 2;
+		if ((grown = realloc(plan->steps, g->capsteps * sizeof(mportPlanStep *))) == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		plan->steps = grown;
+		if ((nodes = realloc(g->stepnodes, g->capsteps * sizeof(struct plan_node *))) == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		g->stepnodes = nodes;
+	}
+
+	if ((step = calloc(1, sizeof(mportPlanStep))) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+
+	step->action = node->installed ? MPORT_PLAN_UPDATE : MPORT_PLAN_INSTALL;
+	step->automatic = automatic;
+	step->entry = node->entry;
+	step->installed_version = node->installed_version;
+	node->step = step;
+
+	g->stepnodes[plan->nsteps] = node;
+	plan->steps[plan->nsteps++] = step;
+	plan->steps[plan->nsteps] = NULL;
+
+	return MPORT_OK;
+}
+
+/* depth first, appending each node after everything it depends on */
+static int
+plan_visit(mportInstance *mport, mportPlan *plan, struct plan_node *node, mportAutomatic automatic)
+{
+
+	if (node->state == PLAN_DONE) {
+		/* a dependency of an earlier root can later be asked for explicitly */
+		if (node->step != NULL && automatic == MPORT_EXPLICIT)
+			node->step->automatic = MPORT_EXPLICIT;
+		return MPORT_OK;
+	}
+
+	if (node->state == PLAN_VISITING)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Dependency cycle detected at %s", node->name);
+
+	if (!node->known)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Could not resolve dependency '%s'.", node->name);
+
+	if (node->installed && !node->outdated) {
+		node->state = PLAN_DONE;
+		return MPORT_OK;
+	}
+
+	if (node->entry == NULL) {
+		/* installed but not in the index at this version: nothing to update to */
+		if (node->installed) {
+			node->state = PLAN_DONE;
+			return MPORT_OK;
+		}
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Could not resolve '%s-%s'.", node->name, node->version);
+	}
+
+	node->state = PLAN_VISITING;
+
+	for (size_t i = 0; i < node->ndeps; i++) {
+		if (node->deps[i]->state == PLAN_VISITING)
+			RETURN_ERRORX(MPORT_ERR_FATAL, "Dependency cycle detected: %s depends on %s", node->name,
+			    node->deps[i]->name);
+
+		if (plan_visit(mport, plan, node->deps[i], MPORT_AUTOMATIC) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+	}
+
+	node->state = PLAN_DONE;
+
+	return plan_append(plan, node, automatic);
+}
+
+/* mport_plan_add(mport, plan, pkgname, version, automatic)
+ *
+ * Add pkgname/version from the index, and whatever it needs installed or
+ * updated, to plan.  The package itself is marked automatic as given; the
+ * dependencies it pulls in are always MPORT_AUTOMATIC.  On error the plan
+ * should only be freed.
+ */
+MPORT_PUBLIC_API int
+mport_plan_add(mportInstance *mport, mportPlan *plan, const char *pkgname, const char *version, mportAutomatic automatic)
+{
+	struct plan_node *root;
+	unsigned int slot;
+
+	MPORT_CHECK_FOR_INDEX(mport, "mport_plan_add()");
+
+	if (pkgname == NULL || version == NULL)
+		RETURN_ERROR(MPORT_ERR_WARN, "Dependency name or version is null");
+
+	slot = ohash_qlookup(&plan->graph->nodes, pkgname);
+	if ((root = ohash_find(&plan->graph->nodes, slot)) == NULL || !root->known) {
+		plan->graph->gen++;
+		if (plan_load(mport, plan, pkgname, version) != MPORT_OK)
+			RETURN_CURRENT_ERROR;
+		root = ohash_find(&plan->graph->nodes, ohash_qlookup(&plan->graph->nodes, pkgname));
+	}
+
+	if (root == NULL)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Could not resolve '%s-%s'.", pkgname, version);
+
+	return plan_visit(mport, plan, root, automatic);
+}
+
+/* mport_plan_fetch(mport, plan)
+ *
+ * Download every bundle the plan needs, concurrently, ahead of executing it.
+ */
+MPORT_PUBLIC_API int
+mport_plan_fetch(mportInstance *mport, mportPlan *plan)
+{
+	mportIndexEntry **installs, **updates;
+	size_t ni = 0, nu = 0;
+	int ret = MPORT_OK;
+
+	installs = calloc(plan->nsteps + 1, sizeof(mportIndexEntry *));
+	updates = calloc(plan->nsteps + 1, sizeof(mportIndexEntry *));
+	if (installs == NULL || updates == NULL) {
+		free(installs);
+		free(updates);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+
+	for (size_t s = 0; s < plan->nsteps; s++) {
+		if (plan->steps[s]->action == MPORT_PLAN_INSTALL)
+			installs[ni++] = plan->steps[s]->entry;
+		else
+			updates[nu++] = plan->steps[s]->entry;
+	}
+
+	/* installs stage their bundles separately from mport_download() */
+	if (mport_fetch_bundles(mport, MPORT_FETCH_STAGING_DIR, installs) != MPORT_OK ||
+	    mport_fetch_bundles(mport, mport->outputPath, updates) != MPORT_OK)
+		ret = mport_err_code();
+
+	free(installs);
+	free(updates);
+
+	return ret;
+}
+
+/*
+ * Queue the plan's downloads to run behind the installer.  *fetch is left
+ * NULL, and the steps fetch for themselves, if the queue can't be had.
+ */
+static void
+plan_fetch_start(mportInstance *mport, mportPlan *plan, struct mport_unpack_queue *unpack,
+    struct mport_fetch_queue **fetch)
+{
+	struct mport_fetch_queue *q;
+	int ahead;
+	off_t budget;
+
+	*fetch = NULL;
+
+	if (mport_fetch_queue_new(mport, mport_unpack_queue_ready, unpack, &q) != MPORT_OK)
+		return;
+
+	/* installs stage their bundles separately from mport_download() */
+	for (size_t s = 0; s < plan->nsteps; s++) {
+		if (mport_fetch_queue_add(mport, q, plan->steps[s]->entry,
+		    plan->steps[s]->action == MPORT_PLAN_INSTALL ? MPORT_FETCH_STAGING_DIR : mport->outputPath) != MPORT_OK) {
+			mport_fetch_queue_free(q);
+			return;
+		}
+	}
+
+	ahead = mport_setting_get_int(mport, MPORT_SETTING_FETCH_AHEAD, MPORT_DEFAULT_FETCH_AHEAD);
+	budget = (off_t)mport_setting_get_int(mport, MPORT_SETTING_FETCH_BUDGET, MPORT_DEFAULT_FETCH_BUDGET) * 1024 * 1024;
+
+	if (mport_fetch_queue_start(mport, q, ahead, budget) != MPORT_OK) {
+		mport_fetch_queue_free(q);
+		return;
+	}
+
+	*fetch = q;
+}
+
+/* mport_plan_execute(mport, plan)
+ *
+ * Install or update each step in order, stopping at the first one that
+ * fails.  Bundles for later steps download, verify and decompress in the
+ * background while earlier steps install.
+ *
+ * With plan->keep_going a failed step is reported and the rest carry on,
+ * except the steps that depend on it, which are skipped; each step that
+ * succeeded is marked done, and MPORT_ERR_WARN says how many weren't.
+ */
+MPORT_PUBLIC_API int
+mport_plan_execute(mportInstance *mport, mportPlan *plan)
+{
+	mportPlanStep *step;
+	struct plan_node *node, *blocker;
+	struct mport_unpack_queue *unpack = NULL;
+	struct mport_fetch_queue *fetch = NULL;
+	const char *unpacked;
+	char *path;
+	size_t errors = 0;
+	bool batch = false;
+	int ret;
+
+	if (plan->nsteps == 0)
+		return MPORT_OK;
+
+	/* decompression runs ahead on other cores; installing stays in plan order */
+	if (mport_unpack_queue_start(mport, plan, true, &unpack) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	/* each bundle is handed to the unpack queue as soon as it verifies */
+	plan_fetch_start(mport, plan, unpack, &fetch);
+
+	/* a caller's batch is left to the caller */
+	if (!mport->batch) {
+		if (mport_batch_begin(mport) != MPORT_OK) {
+			mport_fetch_queue_free(fetch);
+			mport_unpack_queue_free(unpack);
+			RETURN_CURRENT_ERROR;
+		}
+		batch = true;
+	}
+
+	for (size_t s = 0; s < plan->nsteps; s++) {
+		step = plan->steps[s];
+		node = plan->graph->stepnodes[s];
+
+		/* a bundle that didn't make it (already reported) is fetched again by its step */
+		(void) mport_fetch_queue_wait(mport, fetch, step->entry);
+		unpacked = mport_unpack_queue_wait(unpack, s);
+
+		/* dependencies come first, so one not done has failed or was skipped */
+		blocker = NULL;
+		for (size_t d = 0; d < node->ndeps && blocker == NULL; d++) {
+			if (node->deps[d]->step != NULL && !node->deps[d]->step->done)
+				blocker = node->deps[d];
+		}
+
+		if (blocker != NULL) {
+			mport_call_msg_cb(mport, "Skipping %s-%s: %s-%s was not installed", step->entry->pkgname,
+			    step->entry->version, blocker->name, blocker->version);
+			ret = MPORT_ERR_WARN;
+		} else if (step->action == MPORT_PLAN_INSTALL) {
+			ret = mport_install_entry(mport, step->entry, NULL, step->automatic, unpacked);
+		} else if ((ret = mport_download(mport, step->entry->pkgname, false, &path)) == MPORT_OK) {
+			ret = mport_update_primative(mport, path);
+			free(path);
+		}
+
+		mport_unpack_queue_release(unpack, s);
+		mport_fetch_queue_release(fetch, step->entry);
+
+		if (ret == MPORT_OK) {
+			step->done = true;
+			continue;
+		}
+
+		if (!plan->keep_going)
+			goto error;
+
+		if (blocker == NULL)
+			mport_call_msg_cb(mport, "Unable to %s %s-%s: %s",
+			    step->action == MPORT_PLAN_INSTALL ? "install" : "update", step->entry->pkgname,
+			    step->entry->version, mport_err_string());
+		errors++;
+	}
+
+	mport_fetch_queue_free(fetch);
+	mport_unpack_queue_free(unpack);
+
+	if (batch && mport_batch_end(mport) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (errors > 0)
+		RETURN_ERRORX(MPORT_ERR_WARN, "%zu of %zu packages could not be installed or updated", errors,
+		    plan->nsteps);
+
+	return MPORT_OK;
+
+error:
+	mport_fetch_queue_free(fetch);
+	mport_unpack_queue_free(unpack);
+
+	/* keep what was installed before the failure */
+	if (batch) {
+		int code = mport_err_code();
+		char *msg = strdup(mport_err_string());
+
+		(void) mport_batch_end(mport);
+		if (msg != NULL) {
+			SET_ERROR(code, msg);
+			free(msg);
+		}
+	}
+	RETURN_CURRENT_ERROR;
+}
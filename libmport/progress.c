@@ -0,0 +1,246 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Progress for installs, deletes and downloads.  The library used to call
+ * progress_step_cb for every file, and the default callback redraws the
+ * terminal each time, which shows up in profiles of packages with tens of
+ * thousands of files.  Steps are now counted here and only passed on when
+ * the percentage moves or MPORT_PROGRESS_INTERVAL_MS has gone by, and always
+ * for the last step.  Frontends that want more than a bar can set
+ * progress_event_cb and get the phase, counts and bytes of each update.
+ */
+
+#define MPORT_PROGRESS_INTERVAL_MS 100
+
+struct mport_progress {
+	mportProgressEvent ev;
+	char *title;
+	bool active;
+	int shown; /* percent last passed on, -1 for none */
+	struct timespec start;
+	struct timespec last;
+};
+
+static long
+ms_since(const struct timespec *then, const struct timespec *now)
+{
+
+	return (now->tv_sec - then->tv_sec) * 1000 + (now->tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/* whole percent done, by bytes when the total is known, otherwise by count */
+static int
+percent(const mportProgressEvent *ev)
+{
+
+	if (ev->bytes_total > 0)
+		return (int)(ev->bytes * 100 / ev->bytes_total);
+	if (ev->total > 0)
+		return (int)((int64_t)ev->current * 100 / ev->total);
+	return -1;
+}
+
+static void
+emit(mportInstance *mport, struct mport_progress *p, const struct timespec *now)
+{
+	mportProgressEvent *ev = &p->ev;
+
+	ev->elapsed = ms_since(&p->start, now);
+	p->last = *now;
+	p->shown = percent(ev);
+
+	if (mport->progress_event_cb != NULL)
+		(mport->progress_event_cb)(ev);
+
+	if (ev->kind != MPORT_PROGRESS_UPDATE || mport->progress_step_cb == NULL)
+		return;
+
+	if (ev->bytes_total > 0)
+		(mport->progress_step_cb)((int)(ev->bytes / 1024), (int)(ev->bytes_total / 1024),
+		    ev->item != NULL ? ev->item : "");
+	else
+		(mport->progress_step_cb)(ev->current, ev->total, ev->item != NULL ? ev->item : "");
+}
+
+/* pass the current state on if it has changed enough to be worth drawing */
+static void
+update(mportInstance *mport, struct mport_progress *p)
+{
+	struct timespec now;
+	int pct;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pct = percent(&p->ev);
+	if (pct != p->shown || ms_since(&p->last, &now) >= MPORT_PROGRESS_INTERVAL_MS ||
+	    (p->ev.total > 0 && p->ev.current >= p->ev.total))
+		emit(mport, p, &now);
+}
+
+
+/*
+ * mport_progress_begin(mport, phase, total, fmt, ...)
+ *
+ * Start a progress display titled fmt for total items (0 if not known),
+ * ending any display still open.
+ */
+void
+mport_progress_begin(mportInstance *mport, enum mport_progress_phase phase, int total, const char *fmt, ...)
+{
+	struct mport_progress *p = mport->progress;
+	struct timespec now;
+	va_list args;
+
+	if (p == NULL) {
+		if ((p = calloc(1, sizeof(struct mport_progress))) == NULL)
+			return;
+		mport->progress = p;
+	}
+
+	if (p->active)
+		mport_progress_end(mport);
+
+	free(p->title);
+	va_start(args, fmt);
+	if (vasprintf(&p->title, fmt, args) == -1)
+		p->title = NULL;
+	va_end(args);
+
+	(void)memset(&p->ev, 0, sizeof(p->ev));
+	p->ev.kind = MPORT_PROGRESS_START;
+	p->ev.phase = phase;
+	p->ev.title = p->title != NULL ? p->title : "";
+	p->ev.total = total;
+	p->active = true;
+
+	if (mport->progress_init_cb != NULL)
+		(mport->progress_init_cb)(p->ev.title);
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	p->start = now;
+	emit(mport, p, &now);
+	p->ev.kind = MPORT_PROGRESS_UPDATE;
+}
+
+
+/*
+ * mport_progress_step(mport, bytes, item)
+ *
+ * One more item done, bytes long.  item is what to show with it; it only
+ * needs to last until the call returns.
+ */
+void
+mport_progress_step(mportInstance *mport, off_t bytes, const char *item)
+{
+	struct mport_progress *p = mport->progress;
+
+	if (p == NULL || !p->active)
+		return;
+
+	p->ev.current++;
+	p->ev.bytes += bytes;
+	p->ev.item = item;
+	update(mport, p);
+	p->ev.item = NULL;
+}
+
+
+/*
+ * mport_progress_set(mport, current, total, bytes, bytes_total, item)
+ *
+ * Progress where the caller keeps the totals, as a download does.  A
+ * bytes_total of 0 means the bar is drawn by count.
+ */
+void
+mport_progress_set(mportInstance *mport, int current, int total, off_t bytes, off_t bytes_total,
+    const char *item)
+{
+	struct mport_progress *p = mport->progress;
+
+	if (p == NULL || !p->active)
+		return;
+
+	p->ev.current = current;
+	p->ev.total = total;
+	p->ev.bytes = bytes;
+	p->ev.bytes_total = bytes_total;
+	p->ev.item = item;
+	update(mport, p);
+	p->ev.item = NULL;
+}
+
+
+/*
+ * mport_progress_end(mport)
+ *
+ * Close the display, drawing the final state first if a throttled step
+ * left it behind.  Does nothing if no display is open.
+ */
+void
+mport_progress_end(mportInstance *mport)
+{
+	struct mport_progress *p = mport->progress;
+	struct timespec now;
+
+	if (p == NULL || !p->active)
+		return;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	if (percent(&p->ev) != p->shown)
+		emit(mport, p, &now);
+
+	p->ev.kind = MPORT_PROGRESS_END;
+	emit(mport, p, &now);
+	p->active = false;
+
+	if (mport->progress_free_cb != NULL)
+		(mport->progress_free_cb)();
+}
+
+
+void
+mport_progress_reset(mportInstance *mport)
+{
+	struct mport_progress *p = mport->progress;
+
+	if (p == NULL)
+		return;
+
+	free(p->title);
+	free(p);
+	mport->progress = NULL;
+}
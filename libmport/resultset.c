@@ -0,0 +1,168 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <sys/param.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Result sets.
+ *
+ * Listing every installed package or the whole index builds tens of
+ * thousands of small structs and strings.  A result set carves them out of
+ * a few large blocks instead, and keeps the NULL terminated vector that
+ * points at them, so the whole thing goes away with one
+ * mport_result_set_free().  Nothing it hands out may be passed to the
+ * individual free functions.
+ */
+
+#define RESULT_SET_ALIGN 16	/* mportPackageMeta is 16 byte aligned */
+#define RESULT_SET_BLOCK (64 * 1024)
+
+struct result_set_block {
+	struct result_set_block *next;
+	size_t size;
+	size_t used;
+};
+
+#define RESULT_SET_HEADER roundup(sizeof(struct result_set_block), RESULT_SET_ALIGN)
+
+struct mport_result_set {
+	struct result_set_block *blocks;
+	void **vec;
+	size_t len;
+	size_t cap;
+};
+
+mportResultSet *
+mport_result_set_new(void)
+{
+
+	return calloc(1, sizeof(mportResultSet));
+}
+
+/* Zeroed, suitably aligned memory that lives as long as the set */
+void *
+mport_result_set_alloc(mportResultSet *set, size_t len)
+{
+	struct result_set_block *b = set->blocks;
+	size_t size, offset;
+	char *p;
+
+	len = roundup(len, RESULT_SET_ALIGN);
+	/* strings may have left the block unaligned */
+	offset = b == NULL ? 0 : roundup(b->used, RESULT_SET_ALIGN);
+
+	if (b == NULL || offset > b->size || b->size - offset < len) {
+		/* oversized requests get a block of their own */
+		size = MAX(len, RESULT_SET_BLOCK - RESULT_SET_HEADER);
+		if ((b = calloc(1, RESULT_SET_HEADER + size)) == NULL)
+			return NULL;
+		b->size = size;
+		b->next = set->blocks;
+		set->blocks = b;
+		offset = 0;
+	}
+
+	p = (char *) b + RESULT_SET_HEADER + offset;
+	b->used = offset + len;
+
+	return p;
+}
+
+/* strdup() into the set, passing NULL through */
+char *
+mport_result_set_strdup(mportResultSet *set, const char *s)
+{
+	size_t len;
+	char *copy;
+
+	if (s == NULL)
+		return NULL;
+
+	len = strlen(s) + 1;
+
+	/* strings need no alignment, so pack them after the last allocation */
+	if (set->blocks != NULL && set->blocks->size - set->blocks->used >= len) {
+		copy = (char *) set->blocks + RESULT_SET_HEADER + set->blocks->used;
+		set->blocks->used += len;
+	} else if ((copy = mport_result_set_alloc(set, len)) == NULL) {
+		return NULL;
+	}
+
+	memcpy(copy, s, len);
+
+	return copy;
+}
+
+/* Append to the set's NULL terminated vector */
+int
+mport_result_set_push(mportResultSet *set, void *item)
+{
+	void **grown;
+
+	if (set->len == set->cap) {
+		set->cap = set->cap == 0 ? 64 : set->cap * 2;
+		if ((grown = realloc(set->vec, (set->cap + 1) * sizeof(void *))) == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		set->vec = grown;
+	}
+
+	set->vec[set->len++] = item;
+	set->vec[set->len] = NULL;
+
+	return MPORT_OK;
+}
+
+/* The vector built by mport_result_set_push(), or NULL if it is empty */
+void **
+mport_result_set_vec(mportResultSet *set)
+{
+
+	return set->vec;
+}
+
+MPORT_PUBLIC_API void
+mport_result_set_free(mportResultSet *set)
+{
+	struct result_set_block *b, *next;
+
+	if (set == NULL)
+		return;
+
+	for (b = set->blocks; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+
+	free(set->vec);
+	free(set);
+}
@@ -32,6 +32,7 @@
 #include "mport_private.h"
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 MPORT_PUBLIC_API char *
 mport_setting_get(mportInstance *mport, const char *name) {
@@ -77,6 +78,110 @@ mport_setting_set(mportInstance *mport, const char *name, const char *val) {
             RETURN_CURRENT_ERROR;
     }
 
+    /* the fetch session caches what these resolve to */
+    if (strcmp(name, MPORT_SETTING_MIRROR_REGION) == 0 || strcmp(name, MPORT_SETTING_TARGET_OS) == 0)
+        mport_fetch_session_reset(mport);
+
     return MPORT_OK;
 }
 
+
+/* mport_setting_lookup(mport, name)
+ *
+ * The value of setting name, or NULL if it is not set; must free result.
+ * Unlike mport_setting_get() a missing setting is not an error.
+ */
+char *
+mport_setting_lookup(mportInstance *mport, const char *name) {
+	sqlite3_stmt *stmt;
+	char *val = NULL;
+
+	if (mport_db_prepare(mport->db, &stmt, "SELECT val FROM settings WHERE name=%Q", name) != MPORT_OK) {
+		sqlite3_finalize(stmt);
+		return NULL;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+		val = strdup((const char *) sqlite3_column_text(stmt, 0));
+
+	sqlite3_finalize(stmt);
+
+	return val;
+}
+
+
+/* mport_setting_get_int(mport, name, def)
+ *
+ * Numeric settings.  Returns def when the setting is missing or isn't a
+ * number.  Unlike mport_setting_get() a missing setting is not an error.
+ */
+int
+mport_setting_get_int(mportInstance *mport, const char *name, int def) {
+	sqlite3_stmt *stmt;
+	int val = def;
+
+	if (mport_db_prepare(mport->db, &stmt, "SELECT val FROM settings WHERE name=%Q", name) != MPORT_OK) {
+		sqlite3_finalize(stmt);
+		return def;
+	}
+
+	if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+		const char *text = (const char *) sqlite3_column_text(stmt, 0);
+		char *end;
+		long l = strtol(text, &end, 10);
+
+		if (end != text && *end == '\0')
+			val = (int) l;
+	}
+
+	sqlite3_finalize(stmt);
+
+	return val;
+}
+
+/* mport_durability(mport)
+ *
+ * The durability setting: "file" syncs each installed file before it
+ * is renamed into place, "package" (the default) syncs a package's files
+ * together once it is extracted, and "none" leaves it all to the
+ * filesystem, for throwaway roots such as image builds.
+ */
+int
+mport_durability(mportInstance *mport) {
+	char *val = mport_setting_get(mport, MPORT_SETTING_DURABILITY);
+	int durability = MPORT_DURABLE_PACKAGE;
+
+	if (val != NULL) {
+		if (strcasecmp(val, "file") == 0)
+			durability = MPORT_DURABLE_FILE;
+		else if (strcasecmp(val, "none") == 0)
+			durability = MPORT_DURABLE_NONE;
+		free(val);
+	}
+
+	return durability;
+}
+
+/* mport_update_backup(mport)
+ *
+ * The update_backup setting: "journal" (the default) keeps hard links to
+ * the files an update replaces and puts them back if it fails, "bundle"
+ * builds a complete package of the installed version first, as mport
+ * always used to, and "none" keeps nothing.  The journal gives way to the
+ * bundle for packages whose delete runs scripts it couldn't undo.
+ */
+int
+mport_update_backup(mportInstance *mport) {
+	char *val = mport_setting_get(mport, MPORT_SETTING_UPDATE_BACKUP);
+	int backup = MPORT_BACKUP_JOURNAL;
+
+	if (val != NULL) {
+		if (strcasecmp(val, "bundle") == 0)
+			backup = MPORT_BACKUP_BUNDLE;
+		else if (strcasecmp(val, "none") == 0)
+			backup = MPORT_BACKUP_NONE;
+		free(val);
+	}
+
+	return backup;
+}
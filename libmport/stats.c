@@ -78,6 +78,9 @@ mport_stats(mportInstance *mport, mportStats **stats)
 	s->pkg_installed = (unsigned int) sqlite3_column_int(stmt, 0);
 	sqlite3_finalize(stmt);
 
+	if (mport_index_attach(mport) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
 	if (mport_db_prepare(db, &stmt, "SELECT COUNT(*) FROM idx.packages") != MPORT_OK) {
 		sqlite3_finalize(stmt);
 		RETURN_CURRENT_ERROR;
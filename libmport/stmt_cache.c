@@ -0,0 +1,167 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Prepared statements kept for the life of an instance, for queries run
+ * over and over (once per dependency, per asset, per package).  Callers
+ * borrow a statement by its SQL text, bind it, step it and give it back;
+ * that resets it for the next caller instead of finalizing it.
+ *
+ * The SQL must be constant, with ? parameters rather than %Q formatting, or
+ * every call would make a new entry.  A handful of statements are cached,
+ * so they are kept in a plain array.
+ */
+
+struct cached_stmt {
+	char *sql;
+	sqlite3_stmt *stmt;
+	bool busy;
+};
+
+struct mport_stmt_cache {
+	struct cached_stmt *stmts;
+	int count;
+	int size;
+};
+
+
+/* mport_db_borrow(mport, stmt, sql)
+ *
+ * Set stmt to a prepared statement for sql with no bindings, ready to step.
+ * Hand it back with mport_db_return(), never sqlite3_finalize().  Borrowing
+ * a statement that is already out (a recursive caller) prepares a private
+ * copy, which mport_db_return() finalizes.
+ */
+int
+mport_db_borrow(mportInstance *mport, sqlite3_stmt **stmt, const char *sql)
+{
+	struct mport_stmt_cache *cache = mport->stmt_cache;
+	struct cached_stmt *grown;
+
+	*stmt = NULL;
+
+	if (cache == NULL) {
+		if ((cache = calloc(1, sizeof(struct mport_stmt_cache))) == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		mport->stmt_cache = cache;
+	}
+
+	for (int i = 0; i < cache->count; i++) {
+		if (strcmp(cache->stmts[i].sql, sql) != 0)
+			continue;
+
+		if (cache->stmts[i].busy)
+			return mport_db_prepare(mport->db, stmt, "%s", sql);
+
+		cache->stmts[i].busy = true;
+		*stmt = cache->stmts[i].stmt;
+		return MPORT_OK;
+	}
+
+	if (mport_db_prepare(mport->db, stmt, "%s", sql) != MPORT_OK) {
+		sqlite3_finalize(*stmt);
+		*stmt = NULL;
+		RETURN_CURRENT_ERROR;
+	}
+
+	if (cache->count == cache->size) {
+		int size = cache->size == 0 ? 16 : cache->size * 2;
+
+		/* still usable, just not cached */
+		if ((grown = realloc(cache->stmts, size * sizeof(struct cached_stmt))) == NULL)
+			return MPORT_OK;
+		cache->stmts = grown;
+		cache->size = size;
+	}
+
+	if ((cache->stmts[cache->count].sql = strdup(sql)) == NULL)
+		return MPORT_OK;
+	cache->stmts[cache->count].stmt = *stmt;
+	cache->stmts[cache->count].busy = true;
+	cache->count++;
+
+	return MPORT_OK;
+}
+
+
+/* mport_db_return(mport, stmt)
+ *
+ * Give back a statement from mport_db_borrow().  NULL is ignored.
+ */
+void
+mport_db_return(mportInstance *mport, sqlite3_stmt *stmt)
+{
+	struct mport_stmt_cache *cache = mport->stmt_cache;
+
+	if (stmt == NULL)
+		return;
+
+	if (cache != NULL) {
+		for (int i = 0; i < cache->count; i++) {
+			if (cache->stmts[i].stmt == stmt) {
+				sqlite3_reset(stmt);
+				sqlite3_clear_bindings(stmt);
+				cache->stmts[i].busy = false;
+				return;
+			}
+		}
+	}
+
+	sqlite3_finalize(stmt);
+}
+
+
+/* mport_db_cache_reset(mport)
+ *
+ * Finalize every cached statement, before the database is closed or an
+ * attached database is swapped out from under them.  Nothing may be
+ * borrowed at the time.
+ */
+void
+mport_db_cache_reset(mportInstance *mport)
+{
+	struct mport_stmt_cache *cache = mport->stmt_cache;
+
+	if (cache == NULL)
+		return;
+
+	for (int i = 0; i < cache->count; i++) {
+		sqlite3_finalize(cache->stmts[i].stmt);
+		free(cache->stmts[i].sql);
+	}
+
+	free(cache->stmts);
+	free(cache);
+	mport->stmt_cache = NULL;
+}
@@ -0,0 +1,400 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Begin and end events for the phases of installs, deletes and upgrades,
+ * so a frontend can see where the time goes: fetching, verifying, the
+ * stub, the precondition checks, extraction, the database, package
+ * scripts and triggers.  Nothing is timed until mport_set_trace_cb() or
+ * mport_trace_file() is called; until then mport_trace_begin() and
+ * mport_trace_end() return straight away.
+ *
+ * Phases nest.  The ends are matched to the begins here, so callers only
+ * say which phase is ending, and an end for a phase left open by an
+ * early return closes whatever was opened inside it too.
+ *
+ * Between mport_trace_totals_begin() and mport_trace_totals_report() the
+ * phases are also timed for a summary, with or without anyone watching.
+ */
+
+#define MPORT_TRACE_DEPTH 16 /* phases open at once */
+#define MPORT_TRACE_ITEM 256
+#define MPORT_TRACE_PHASES (MPORT_TRACE_IMPORT + 1)
+
+struct mport_trace_frame {
+	enum mport_trace_phase phase;
+	int64_t start;
+	char item[MPORT_TRACE_ITEM];
+	bool has_item;
+};
+
+struct mport_trace_total {
+	long calls;
+	long count;
+	off_t bytes;
+	int64_t elapsed;
+};
+
+struct mport_trace {
+	mport_trace_cb cb;
+	int fd; /* timeline file, -1 for none */
+	int depth; /* may pass MPORT_TRACE_DEPTH, the extra phases aren't reported */
+	struct mport_trace_frame frames[MPORT_TRACE_DEPTH];
+	bool totalling;
+	struct mport_trace_total totals[MPORT_TRACE_PHASES];
+};
+
+static const char *phase_names[] = {
+	[MPORT_TRACE_INSTALL] = "install",
+	[MPORT_TRACE_FETCH] = "fetch",
+	[MPORT_TRACE_VERIFY] = "verify",
+	[MPORT_TRACE_STUB] = "stub",
+	[MPORT_TRACE_PRECHECK] = "precheck",
+	[MPORT_TRACE_PREINSTALL] = "preinstall",
+	[MPORT_TRACE_EXTRACT] = "extract",
+	[MPORT_TRACE_DB] = "db",
+	[MPORT_TRACE_SCRIPT] = "script",
+	[MPORT_TRACE_POSTINSTALL] = "postinstall",
+	[MPORT_TRACE_TRIGGER] = "trigger",
+	[MPORT_TRACE_DELETE] = "delete",
+	[MPORT_TRACE_UPGRADE] = "upgrade",
+	[MPORT_TRACE_PLAN] = "plan",
+	[MPORT_TRACE_IMPORT] = "import",
+};
+
+MPORT_PUBLIC_API const char *
+mport_trace_phase_name(enum mport_trace_phase phase)
+{
+
+	if ((size_t)phase >= sizeof(phase_names) / sizeof(phase_names[0]) || phase_names[phase] == NULL)
+		return "unknown";
+	return phase_names[phase];
+}
+
+static struct mport_trace *
+trace_state(mportInstance *mport)
+{
+	struct mport_trace *t;
+
+	if (mport->trace != NULL)
+		return mport->trace;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return NULL;
+	t->fd = -1;
+	mport->trace = t;
+
+	return t;
+}
+
+/*
+ * Call cb with every phase begun and ended from now on, NULL to stop.  A
+ * timeline file set with mport_trace_file() is still written.
+ */
+MPORT_PUBLIC_API void
+mport_set_trace_cb(mportInstance *mport, mport_trace_cb cb)
+{
+	struct mport_trace *t;
+
+	if ((t = trace_state(mport)) != NULL)
+		t->cb = cb;
+}
+
+/*
+ * mport_trace_file(mport, path)
+ *
+ * Append every phase begun and ended from now on to path, one JSON object
+ * a line.  The file is opened for appending, so the tools mport runs for
+ * some commands can be pointed at the same file; pid tells them apart.
+ */
+MPORT_PUBLIC_API int
+mport_trace_file(mportInstance *mport, const char *path)
+{
+	struct mport_trace *t;
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		RETURN_ERRORX(MPORT_ERR_FATAL, "Couldn't open %s: %s", path, strerror(errno));
+
+	if ((t = trace_state(mport)) == NULL) {
+		close(fd);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+
+	if (t->fd != -1)
+		close(t->fd);
+	t->fd = fd;
+
+	return (MPORT_OK);
+}
+
+void
+mport_trace_reset(mportInstance *mport)
+{
+	struct mport_trace *t = mport->trace;
+
+	if (t == NULL)
+		return;
+
+	if (t->fd != -1)
+		close(t->fd);
+	free(t);
+	mport->trace = NULL;
+}
+
+static void add_total(struct mport_trace *, const mportTraceEvent *);
+
+static int64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* item as a JSON string; package names and paths rarely need escaping */
+static void
+json_string(char *buf, size_t len, const char *s)
+{
+	size_t n = 0;
+
+	buf[n++] = '"';
+	for (; *s != '\0' && n + 8 < len; s++) {
+		unsigned char c = (unsigned char)*s;
+
+		if (c == '"' || c == '\\') {
+			buf[n++] = '\\';
+			buf[n++] = (char)c;
+		} else if (c < 0x20) {
+			n += snprintf(buf + n, len - n, "\\u%04x", c);
+		} else {
+			buf[n++] = (char)c;
+		}
+	}
+	buf[n++] = '"';
+	buf[n] = '\0';
+}
+
+static void
+write_event(struct mport_trace *t, const mportTraceEvent *ev)
+{
+	char item[MPORT_TRACE_ITEM * 2 + 8];
+	char line[MPORT_TRACE_ITEM * 2 + 256];
+	int len;
+
+	if (ev->item != NULL)
+		json_string(item, sizeof(item), ev->item);
+	else
+		(void)strlcpy(item, "null", sizeof(item));
+
+	if (ev->kind == MPORT_TRACE_BEGIN)
+		len = snprintf(line, sizeof(line),
+		    "{\"ts\":%jd,\"pid\":%ld,\"ev\":\"begin\",\"phase\":\"%s\",\"item\":%s,\"depth\":%d}\n",
+		    (intmax_t)ev->time, (long)getpid(), mport_trace_phase_name(ev->phase), item, ev->depth);
+	else
+		len = snprintf(line, sizeof(line),
+		    "{\"ts\":%jd,\"pid\":%ld,\"ev\":\"end\",\"phase\":\"%s\",\"item\":%s,\"depth\":%d,"
+		    "\"elapsed\":%jd,\"count\":%ld,\"bytes\":%jd,\"status\":%d}\n",
+		    (intmax_t)ev->time, (long)getpid(), mport_trace_phase_name(ev->phase), item, ev->depth,
+		    (intmax_t)ev->elapsed, ev->count, (intmax_t)ev->bytes, ev->status);
+
+	/* one write, so lines from other processes appending don't interleave */
+	if (len > 0 && (size_t)len < sizeof(line))
+		(void)write(t->fd, line, (size_t)len);
+}
+
+static void
+emit(struct mport_trace *t, const mportTraceEvent *ev)
+{
+
+	if (t->cb != NULL)
+		(t->cb)(ev);
+	if (t->fd != -1)
+		write_event(t, ev);
+}
+
+/*
+ * mport_trace_begin(mport, phase, item)
+ *
+ * Start timing phase for item, a package or file name, or NULL.
+ */
+void
+mport_trace_begin(mportInstance *mport, enum mport_trace_phase phase, const char *item)
+{
+	struct mport_trace *t = mport->trace;
+	struct mport_trace_frame *f;
+	mportTraceEvent ev;
+
+	if (t == NULL || (t->cb == NULL && t->fd == -1 && !t->totalling))
+		return;
+
+	if (t->depth++ >= MPORT_TRACE_DEPTH)
+		return;
+
+	f = &t->frames[t->depth - 1];
+	f->phase = phase;
+	f->start = now_us();
+	f->has_item = item != NULL;
+	if (item != NULL)
+		(void)strlcpy(f->item, item, sizeof(f->item));
+
+	memset(&ev, 0, sizeof(ev));
+	ev.kind = MPORT_TRACE_BEGIN;
+	ev.phase = phase;
+	ev.item = item;
+	ev.depth = t->depth - 1;
+	ev.time = f->start;
+	emit(t, &ev);
+}
+
+/*
+ * mport_trace_end(mport, phase, count, bytes, status)
+ *
+ * End the innermost open phase, with what it got through and its result,
+ * MPORT_OK or an error code.  Any phases still open inside it end with
+ * status too.  An end with no matching begin is ignored.
+ */
+void
+mport_trace_end(mportInstance *mport, enum mport_trace_phase phase, long count, off_t bytes, int status)
+{
+	struct mport_trace *t = mport->trace;
+	struct mport_trace_frame *f;
+	mportTraceEvent ev;
+	int match;
+
+	if (t == NULL || t->depth == 0)
+		return;
+
+	/* deeper than reported; the frame to end isn't kept */
+	if (t->depth > MPORT_TRACE_DEPTH) {
+		t->depth--;
+		return;
+	}
+
+	for (match = t->depth - 1; match >= 0 && t->frames[match].phase != phase; match--)
+		;
+	if (match < 0)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.kind = MPORT_TRACE_END;
+	ev.time = now_us();
+	ev.status = status;
+
+	while (t->depth > match) {
+		f = &t->frames[--t->depth];
+		ev.phase = f->phase;
+		ev.item = f->has_item ? f->item : NULL;
+		ev.depth = t->depth;
+		ev.elapsed = ev.time - f->start;
+		ev.count = t->depth == match ? count : 0;
+		ev.bytes = t->depth == match ? bytes : 0;
+		if (t->totalling)
+			add_total(t, &ev);
+		if (t->cb != NULL || t->fd != -1)
+			emit(t, &ev);
+	}
+}
+
+/* the ended phase's time, unless it was inside another of the same */
+static void
+add_total(struct mport_trace *t, const mportTraceEvent *ev)
+{
+	struct mport_trace_total *total;
+
+	if ((size_t)ev->phase >= MPORT_TRACE_PHASES)
+		return;
+
+	for (int i = 0; i < t->depth; i++) {
+		if (t->frames[i].phase == ev->phase)
+			return;
+	}
+
+	total = &t->totals[ev->phase];
+	total->calls++;
+	total->count += ev->count;
+	total->bytes += ev->bytes;
+	total->elapsed += ev->elapsed;
+}
+
+/*
+ * mport_trace_totals_begin(mport)
+ *
+ * Start adding up the time spent in each phase, for
+ * mport_trace_totals_report().
+ */
+void
+mport_trace_totals_begin(mportInstance *mport)
+{
+	struct mport_trace *t;
+
+	if ((t = trace_state(mport)) == NULL)
+		return;
+
+	memset(t->totals, 0, sizeof(t->totals));
+	t->totalling = true;
+}
+
+/*
+ * mport_trace_totals_report(mport)
+ *
+ * Show the time, and what was got through, in each phase since
+ * mport_trace_totals_begin(), and stop adding them up.  Phases nest, so
+ * the times of the inner ones are also in those around them.
+ */
+void
+mport_trace_totals_report(mportInstance *mport)
+{
+	struct mport_trace *t = mport->trace;
+	struct mport_trace_total *total;
+
+	if (t == NULL || !t->totalling)
+		return;
+	t->totalling = false;
+
+	mport_call_msg_cb(mport, "%-12s %6s %10s %10s %10s", "phase", "times", "seconds", "count", "MB");
+	for (size_t p = 0; p < MPORT_TRACE_PHASES; p++) {
+		total = &t->totals[p];
+		if (total->calls == 0)
+			continue;
+		mport_call_msg_cb(mport, "%-12s %6ld %10.3f %10ld %10.1f", mport_trace_phase_name((enum mport_trace_phase)p),
+		    total->calls, (double)total->elapsed / 1000000, total->count, (double)total->bytes / (1024 * 1024));
+	}
+}
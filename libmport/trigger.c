@@ -0,0 +1,189 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Cache rebuilds asked for by @ldconfig, @glib-schemas, @info and
+ * @desktop-file-utils.  Each package used to run its own, so upgrading a
+ * desktop ran ldconfig and update-desktop-database once per package.
+ * Inside mport_batch_begin() they are queued instead, one per command and
+ * target directory, and run once by mport_batch_end().
+ */
+
+struct mport_trigger {
+	mportAssetListEntryType type;
+	char *target;
+};
+
+struct mport_trigger_queue {
+	struct mport_trigger *items;
+	int count;
+};
+
+static int run_trigger(mportInstance *, mportAssetListEntryType, const char *);
+static int run_trigger_cmd(mportInstance *, mportAssetListEntryType, const char *);
+
+/*
+ * mport_trigger_run(mport, type, target)
+ *
+ * Run the trigger for an asset of type, now or at the end of the batch.
+ * target is the directory it applies to, the asset's data or the package
+ * prefix; it is ignored for @ldconfig and @desktop-file-utils, which
+ * rebuild system wide caches.
+ */
+int
+mport_trigger_run(mportInstance *mport, mportAssetListEntryType type, const char *target)
+{
+	struct mport_trigger_queue *q;
+	struct mport_trigger *t;
+
+	if (type == ASSET_LDCONFIG || type == ASSET_DESKTOP_FILE_UTILS || target == NULL)
+		target = "";
+
+	if (!mport->batch)
+		return run_trigger(mport, type, target);
+
+	if ((q = mport->triggers) == NULL) {
+		if ((q = calloc(1, sizeof(*q))) == NULL)
+			RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+		mport->triggers = q;
+	}
+
+	for (int i = 0; i < q->count; i++) {
+		if (q->items[i].type == type && strcmp(q->items[i].target, target) == 0)
+			return (MPORT_OK);
+	}
+
+	if ((t = reallocarray(q->items, q->count + 1, sizeof(*t))) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	q->items = t;
+
+	if ((q->items[q->count].target = strdup(target)) == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	q->items[q->count].type = type;
+	q->count++;
+
+	return (MPORT_OK);
+}
+
+/*
+ * mport_trigger_flush(mport)
+ *
+ * Run the queued triggers, ldconfig first since the other tools may need
+ * the libraries just installed.  A failing trigger doesn't stop the rest;
+ * the last error is returned.
+ */
+int
+mport_trigger_flush(mportInstance *mport)
+{
+	struct mport_trigger_queue *q = mport->triggers;
+	int ret = MPORT_OK;
+
+	if (q == NULL)
+		return (MPORT_OK);
+
+	for (int pass = 0; pass < 2; pass++) {
+		for (int i = 0; i < q->count; i++) {
+			struct mport_trigger *t = &q->items[i];
+			bool ldconfig = t->type == ASSET_LDCONFIG || t->type == ASSET_LDCONFIG_LINUX;
+
+			if (ldconfig != (pass == 0))
+				continue;
+
+			if (run_trigger(mport, t->type, t->target) != MPORT_OK) {
+				mport_call_msg_cb(mport, "%s", mport_err_string());
+				ret = mport_err_code();
+			}
+		}
+	}
+
+	mport_trigger_reset(mport);
+
+	return (ret);
+}
+
+/* drop anything still queued */
+void
+mport_trigger_reset(mportInstance *mport)
+{
+	struct mport_trigger_queue *q = mport->triggers;
+
+	if (q == NULL)
+		return;
+
+	for (int i = 0; i < q->count; i++)
+		free(q->items[i].target);
+	free(q->items);
+	free(q);
+	mport->triggers = NULL;
+}
+
+/* run_trigger_cmd(), as one traced phase */
+static int
+run_trigger(mportInstance *mport, mportAssetListEntryType type, const char *target)
+{
+	int ret;
+
+	mport_trace_begin(mport, MPORT_TRACE_TRIGGER, target[0] == '\0' ? NULL : target);
+	ret = run_trigger_cmd(mport, type, target);
+	mport_trace_end(mport, MPORT_TRACE_TRIGGER, 1, 0, ret);
+
+	return (ret);
+}
+
+static int
+run_trigger_cmd(mportInstance *mport, mportAssetListEntryType type, const char *target)
+{
+
+	switch (type) {
+		case ASSET_LDCONFIG:
+			return mport_xsystem(mport, "/usr/sbin/service ldconfig restart > /dev/null");
+		case ASSET_LDCONFIG_LINUX:
+			return mport_xsystem(mport, "%s/sbin/ldconfig", target[0] == '\0' ? "/compat/linux" : target);
+		case ASSET_GLIB_SCHEMAS:
+			if (!mport_file_exists("/usr/local/bin/glib-compile-schemas"))
+				return (MPORT_OK);
+			return mport_xsystem(mport,
+			    "/usr/local/bin/glib-compile-schemas %s/share/glib-2.0/schemas > /dev/null || true", target);
+		case ASSET_INFO:
+			if (!mport_file_exists("/usr/local/bin/indexinfo"))
+				return (MPORT_OK);
+			return mport_xsystem(mport, "/usr/local/bin/indexinfo %s", target);
+		case ASSET_DESKTOP_FILE_UTILS:
+			if (!mport_file_exists("/usr/local/bin/update-desktop-database"))
+				return (MPORT_OK);
+			return mport_xsystem(mport, "/usr/local/bin/update-desktop-database -q > /dev/null || true");
+		default:
+			RETURN_ERRORX(MPORT_ERR_FATAL, "No trigger for asset type %d", (int)type);
+	}
+}
@@ -0,0 +1,503 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "mport.h"
+#include "mport_private.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Parallel bundle unpacking for mport_plan_execute().
+ *
+ * A bundle is installed in one pass over its xz compressed tar, in which
+ * the main thread writes each file, records it as an asset and runs the
+ * package's exec lines as it comes to them.  Only the decompression is
+ * independent of everything else, and it is most of the CPU time, so a
+ * pool of workers decompresses the bundles of the plan's install steps to
+ * plain tar files ahead of the main thread.  The main thread still
+ * installs them one at a time in plan order: every database write, the
+ * error state and the scripts stay with it, and scripts run after those
+ * of the packages they depend on.
+ *
+ * Workers keep at most a window of steps ahead of the one being
+ * installed, and the tar files on disk at once within the unpack_space
+ * setting, so a large plan doesn't fill the disk.  A bundle that can't be
+ * unpacked, or doesn't fit in what is left of that space, is installed
+ * from the .mport as before.
+ * When the bundles are still downloading, steps wait for the fetch queue
+ * to hand each one over through mport_unpack_queue_ready().
+ */
+
+#define UNPACK_SUFFIX ".tar"
+#define UNPACK_BLOCK (64 * 1024)
+
+enum unpack_state {
+	UNPACK_NONE,	/* not an install step, or no bundle on disk */
+	UNPACK_WAITING,	/* bundle not downloaded yet */
+	UNPACK_PENDING, UNPACK_RUNNING, UNPACK_DONE, UNPACK_FAILED
+};
+
+struct unpack_job {
+	char *src;
+	char *dest;
+	enum unpack_state state;
+	int64_t size;		/* bytes of dest counted in used */
+};
+
+struct mport_unpack_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct unpack_job *jobs;
+	size_t njobs;
+	size_t current;		/* the step the main thread is on */
+	size_t window;
+	int64_t limit;		/* bytes of tar the jobs may have on disk at once */
+	int64_t used;
+	bool stop;
+	pthread_t threads[MPORT_MAX_INSTALL_JOBS];
+	int nthreads;
+};
+
+static void *unpack_worker(void *);
+static bool unpack_bundle(struct mport_unpack_queue *, struct unpack_job *);
+static bool unpack_reserve(struct mport_unpack_queue *, struct unpack_job *, int64_t);
+static void unpack_unreserve(struct mport_unpack_queue *, struct unpack_job *);
+
+
+/* mport_unpack_queue_start(mport, plan, fetching, queue)
+ *
+ * Start unpacking the plan's bundles, with as many workers as the
+ * install_jobs setting allows, into as much space as unpack_space allows.  If fetching, no bundle is touched until
+ * mport_unpack_queue_ready() says it is downloaded and verified.  *queue
+ * is left NULL when unpacking is turned off or there is nothing to
+ * unpack; the other functions accept that.
+ */
+int
+mport_unpack_queue_start(mportInstance *mport, mportPlan *plan, bool fetching, struct mport_unpack_queue **queue)
+{
+	struct mport_unpack_queue *q;
+	struct unpack_job *job;
+	int nthreads, space, pending = 0;
+
+	*queue = NULL;
+
+	nthreads = mport_setting_get_int(mport, MPORT_SETTING_INSTALL_JOBS, mport_default_install_jobs());
+	space = mport_setting_get_int(mport, MPORT_SETTING_UNPACK_SPACE, MPORT_DEFAULT_UNPACK_SPACE);
+	if (nthreads < 1 || space < 1 || plan->nsteps < 1)
+		return MPORT_OK;
+	if (nthreads > MPORT_MAX_INSTALL_JOBS)
+		nthreads = MPORT_MAX_INSTALL_JOBS;
+
+	if ((q = calloc(1, sizeof(struct mport_unpack_queue))) == NULL ||
+	    (q->jobs = calloc(plan->nsteps, sizeof(struct unpack_job))) == NULL) {
+		free(q);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+	q->njobs = plan->nsteps;
+	q->limit = (int64_t)space * 1024 * 1024;
+
+	for (size_t s = 0; s < plan->nsteps; s++) {
+		job = &q->jobs[s];
+
+		/* updates go through mport_download(), which may pick another copy */
+		if (plan->steps[s]->action != MPORT_PLAN_INSTALL)
+			continue;
+
+		if (asprintf(&job->src, "%s/%s", MPORT_FETCH_STAGING_DIR, plan->steps[s]->entry->bundlefile) == -1) {
+			job->src = NULL;
+			continue;
+		}
+
+		if ((!fetching && !mport_file_exists(job->src)) ||
+		    asprintf(&job->dest, "%s%s", job->src, UNPACK_SUFFIX) == -1) {
+			free(job->src);
+			job->src = NULL;
+			job->dest = NULL;
+			continue;
+		}
+
+		job->state = fetching ? UNPACK_WAITING : UNPACK_PENDING;
+		pending++;
+	}
+
+	if (pending == 0) {
+		mport_unpack_queue_free(q);
+		return MPORT_OK;
+	}
+
+	if (nthreads > pending)
+		nthreads = pending;
+	q->window = (size_t)nthreads * 2;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&q->threads[q->nthreads], NULL, unpack_worker, q) != 0)
+			break;
+		q->nthreads++;
+	}
+
+	if (q->nthreads == 0) {
+		/* no threads, no point: install straight from the bundles */
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->lock);
+		for (size_t s = 0; s < q->njobs; s++)
+			q->jobs[s].state = UNPACK_NONE;
+		mport_unpack_queue_free(q);
+		return MPORT_OK;
+	}
+
+	*queue = q;
+
+	return MPORT_OK;
+}
+
+
+/* mport_unpack_queue_wait(queue, step)
+ *
+ * Wait for the given step's bundle and return the unpacked tar to install
+ * from, or NULL to use the bundle itself.  Steps must be waited for in
+ * order.
+ */
+const char *
+mport_unpack_queue_wait(struct mport_unpack_queue *q, size_t step)
+{
+	struct unpack_job *job;
+	const char *dest = NULL;
+
+	if (q == NULL || step >= q->njobs)
+		return NULL;
+
+	job = &q->jobs[step];
+
+	pthread_mutex_lock(&q->lock);
+	q->current = step;
+	pthread_cond_broadcast(&q->cond);
+
+	/* never downloaded, the step will fetch it itself */
+	if (job->state == UNPACK_WAITING)
+		job->state = UNPACK_NONE;
+
+	while (job->state == UNPACK_PENDING || job->state == UNPACK_RUNNING)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	if (job->state == UNPACK_DONE)
+		dest = job->dest;
+	pthread_mutex_unlock(&q->lock);
+
+	return dest;
+}
+
+
+/* mport_unpack_queue_ready(queue, path)
+ *
+ * The bundle at path is downloaded and verified, so its step can be
+ * unpacked.  A mport_fetch_ready_cb, called from the fetch workers.
+ */
+void
+mport_unpack_queue_ready(void *cookie, const char *path)
+{
+	struct mport_unpack_queue *q = cookie;
+
+	if (q == NULL)
+		return;
+
+	pthread_mutex_lock(&q->lock);
+	for (size_t s = 0; s < q->njobs; s++) {
+		if (q->jobs[s].state == UNPACK_WAITING && strcmp(q->jobs[s].src, path) == 0)
+			q->jobs[s].state = UNPACK_PENDING;
+	}
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+/* mport_unpack_queue_release(queue, step)
+ *
+ * Remove the step's tar once it has been installed.
+ */
+void
+mport_unpack_queue_release(struct mport_unpack_queue *q, size_t step)
+{
+	struct unpack_job *job;
+
+	if (q == NULL || step >= q->njobs)
+		return;
+
+	job = &q->jobs[step];
+
+	pthread_mutex_lock(&q->lock);
+	if (job->state == UNPACK_DONE)
+		(void)unlink(job->dest);
+	job->state = UNPACK_NONE;
+	/* the space is free for the steps after it */
+	q->used -= job->size;
+	job->size = 0;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+/* mport_unpack_queue_free(queue)
+ *
+ * Stop the workers and remove any tar files that weren't installed.
+ */
+void
+mport_unpack_queue_free(struct mport_unpack_queue *q)
+{
+
+	if (q == NULL)
+		return;
+
+	if (q->nthreads > 0) {
+		pthread_mutex_lock(&q->lock);
+		q->stop = true;
+		pthread_cond_broadcast(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+
+		for (int i = 0; i < q->nthreads; i++)
+			pthread_join(q->threads[i], NULL);
+
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->lock);
+	}
+
+	for (size_t s = 0; s < q->njobs; s++) {
+		if (q->jobs[s].state == UNPACK_DONE)
+			(void)unlink(q->jobs[s].dest);
+		free(q->jobs[s].src);
+		free(q->jobs[s].dest);
+	}
+
+	free(q->jobs);
+	free(q);
+}
+
+
+/* the number of processors online, which install_jobs defaults to */
+int
+mport_default_install_jobs(void)
+{
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (ncpu < 1)
+		return 1;
+	if (ncpu > MPORT_MAX_INSTALL_JOBS)
+		return MPORT_MAX_INSTALL_JOBS;
+
+	return (int)ncpu;
+}
+
+
+static void *
+unpack_worker(void *arg)
+{
+	struct mport_unpack_queue *q = arg;
+	struct unpack_job *job;
+	size_t s;
+	bool ok;
+
+	pthread_mutex_lock(&q->lock);
+
+	while (!q->stop) {
+		job = NULL;
+
+		for (s = q->current; s < q->njobs && s < q->current + q->window; s++) {
+			if (q->jobs[s].state == UNPACK_PENDING) {
+				job = &q->jobs[s];
+				break;
+			}
+		}
+
+		if (job == NULL) {
+			/* done, unless the window has yet to reach the rest or they're downloading */
+			for (s = q->current; s < q->njobs && q->jobs[s].state != UNPACK_PENDING &&
+			    q->jobs[s].state != UNPACK_WAITING; s++)
+				;
+			if (s >= q->njobs)
+				break;
+			pthread_cond_wait(&q->cond, &q->lock);
+			continue;
+		}
+
+		/* out of space until an installed step is released; the one being installed can't wait */
+		if (q->used >= q->limit) {
+			if (s == q->current) {
+				job->state = UNPACK_FAILED;
+				pthread_cond_broadcast(&q->cond);
+			} else {
+				pthread_cond_wait(&q->cond, &q->lock);
+			}
+			continue;
+		}
+
+		job->state = UNPACK_RUNNING;
+		pthread_mutex_unlock(&q->lock);
+
+		ok = unpack_bundle(q, job);
+		if (!ok)
+			unpack_unreserve(q, job);
+
+		pthread_mutex_lock(&q->lock);
+		job->state = ok ? UNPACK_DONE : UNPACK_FAILED;
+		pthread_cond_broadcast(&q->cond);
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+
+/*
+ * Decompress the job's src to dest, by way of a temporary file so the main
+ * thread never sees half a tar, counting what is written against the
+ * queue's space.  Only libarchive and the file system are used; failures,
+ * running out of space among them, just mean the bundle gets installed
+ * directly.  A version 6 bundle's chunks are decompressed in parallel, see
+ * bundle_toc.c.
+ */
+static bool
+unpack_bundle(struct mport_unpack_queue *q, struct unpack_job *job)
+{
+	const char *src = job->src, *dest = job->dest;
+	struct archive *a;
+	struct archive_entry *entry;
+	char tmp[FILENAME_MAX];
+	struct mport_bundle_toc toc;
+	char *buf;
+	ssize_t len;
+	ssize_t w;
+	int fd = -1;
+	bool ok = false;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.part", dest) >= sizeof(tmp))
+		return false;
+
+	if ((buf = malloc(UNPACK_BLOCK)) == NULL)
+		return false;
+
+	if ((a = archive_read_new()) == NULL) {
+		free(buf);
+		return false;
+	}
+
+	if (archive_read_support_filter_xz(a) != ARCHIVE_OK ||
+	    archive_read_support_filter_zstd(a) < ARCHIVE_WARN ||
+	    archive_read_support_format_raw(a) != ARCHIVE_OK ||
+	    archive_read_open_filename(a, src, 10240) != ARCHIVE_OK ||
+	    archive_read_next_header(a, &entry) != ARCHIVE_OK)
+		goto done;
+
+	/* a bundle that isn't compressed has nothing to gain */
+	if (archive_filter_code(a, 0) == ARCHIVE_FILTER_NONE)
+		goto done;
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) == -1)
+		goto done;
+
+	/* a bundle with chunks can have them decompressed side by side, its size known up front */
+	if (mport_bundle_toc_load(src, &toc) == MPORT_OK) {
+		if (toc.nchunks > 1) {
+			len = unpack_reserve(q, job, toc.chunks[toc.nchunks - 1].uoffset + toc.chunks[toc.nchunks - 1].usize) &&
+			    mport_bundle_toc_unpack(src, &toc, fd) == MPORT_OK ? 0 : -1;
+			mport_bundle_toc_free(&toc);
+			goto written;
+		}
+		mport_bundle_toc_free(&toc);
+	}
+
+	while ((len = archive_read_data(a, buf, UNPACK_BLOCK)) > 0) {
+		if (!unpack_reserve(q, job, len))
+			goto done;
+		for (ssize_t off = 0; off < len; off += w) {
+			if ((w = write(fd, buf + off, (size_t)(len - off))) < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				goto done;
+			}
+		}
+	}
+
+written:
+	if (len == 0 && close(fd) == 0) {
+		fd = -1;
+		ok = rename(tmp, dest) == 0;
+	}
+
+done:
+	if (fd != -1)
+		(void)close(fd);
+	if (!ok)
+		(void)unlink(tmp);
+	archive_read_free(a);
+	free(buf);
+
+	return ok;
+}
+
+
+/* count n more bytes of the job's tar, if there is room for them */
+static bool
+unpack_reserve(struct mport_unpack_queue *q, struct unpack_job *job, int64_t n)
+{
+	bool ok;
+
+	pthread_mutex_lock(&q->lock);
+	if ((ok = q->used + n <= q->limit)) {
+		q->used += n;
+		job->size += n;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return ok;
+}
+
+
+/* give back the space of a tar that wasn't kept */
+static void
+unpack_unreserve(struct mport_unpack_queue *q, struct unpack_job *job)
+{
+
+	pthread_mutex_lock(&q->lock);
+	q->used -= job->size;
+	job->size = 0;
+	pthread_mutex_unlock(&q->lock);
+}
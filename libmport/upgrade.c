@@ -29,145 +29,105 @@
 #include "mport.h"
 #include "mport_private.h"
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <time.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <errno.h>
-#include <stddef.h>
-#include <err.h>
-#include <ohash.h>
-
-static void * ecalloc(size_t, void *);
-static void efree(void *, size_t, void *);
-
-static void *
-ecalloc(size_t s1, void *data) {
-	void *p;
-
-	if (!(p = malloc(s1)))
-		err(1, "malloc");
-	memset(p, 0, s1);
-	return p;
-}
 
-static void
-efree(void *p, size_t s1, void *data){
-	free(p);
+/*
+ * Upgrading is planned before anything is touched.  Every outdated package
+ * found by mport_index_outdated() is added to one plan, which loads the
+ * dependency graph under it once and orders the updates so a package's
+ * dependencies are updated (or newly installed) before it.  The plan then
+ * runs through mport_plan_execute(), or is just shown for a dry run.  A
+ * package that fails to update only holds back the ones that depend on it.
+ */
+
+/* mport_upgrade_plan(mport, plan)
+ *
+ * Plan updating every installed package the index has a newer build of.
+ * The caller frees the plan with mport_plan_free().
+ */
+MPORT_PUBLIC_API int
+mport_upgrade_plan(mportInstance *mport, mportPlan **plan_p) {
+	mportOutdatedEntry **outdated;
+	mportPlan *plan;
+
+	*plan_p = NULL;
+
+	/* one query for the whole set, rather than an index lookup per package */
+	if (mport_index_outdated(mport, &outdated) != MPORT_OK)
+		RETURN_CURRENT_ERROR;
+
+	if (mport_plan_new(mport, &plan) != MPORT_OK) {
+		mport_index_outdated_free_vec(outdated);
+		RETURN_CURRENT_ERROR;
+	}
+
+	for (mportOutdatedEntry **o = outdated; *o != NULL; o++) {
+		if ((*o)->index_version == NULL)
+			continue;
+
+		/* the flag only matters for new dependencies, which are always automatic */
+		if (mport_plan_add(mport, plan, (*o)->pkgname, (*o)->index_version, MPORT_AUTOMATIC) != MPORT_OK) {
+			mport_plan_free(plan);
+			mport_index_outdated_free_vec(outdated);
+			RETURN_CURRENT_ERROR;
+		}
+	}
+
+	mport_index_outdated_free_vec(outdated);
+	*plan_p = plan;
+
+	return (MPORT_OK);
 }
 
 MPORT_PUBLIC_API int
 mport_upgrade(mportInstance *mport) {
-	mportPackageMeta **packs, **packs_orig;
+	mportPlan *plan;
 	int total = 0;
 	int updated = 0;
-	struct ohash_info info = { 0, NULL, ecalloc, efree, NULL };
-	struct ohash h;
-	unsigned int slot;
-	char *key;
+	int ret;
 
 	if (mport == NULL) {
 		RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized\n");
 	}
 
-	if (mport_pkgmeta_list(mport, &packs_orig) != MPORT_OK) {
+	if (mport_db_count(mport->db, &total, "SELECT COUNT(*) FROM packages") != MPORT_OK) {
 		RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't load package list\n");
 	}
 
-	if (packs_orig == NULL) {
+	if (total == 0) {
 		SET_ERROR(MPORT_ERR_FATAL, "No packages installed");
 		mport_call_msg_cb(mport, "No packages installed\n");
 		return (MPORT_ERR_FATAL);
 	}
 
-	ohash_init(&h, 6, &info);
+	mport_trace_begin(mport, MPORT_TRACE_UPGRADE, NULL);
+	mport_trace_begin(mport, MPORT_TRACE_PLAN, NULL);
+	if (mport_upgrade_plan(mport, &plan) != MPORT_OK) {
+		mport_trace_end(mport, MPORT_TRACE_PLAN, 0, 0, mport_err_code());
+		mport_trace_end(mport, MPORT_TRACE_UPGRADE, 0, 0, mport_err_code());
+		RETURN_CURRENT_ERROR;
+	}
+	mport_trace_end(mport, MPORT_TRACE_PLAN, (long)plan->nsteps, 0, MPORT_OK);
 
-	packs = packs_orig;
-	while (*packs != NULL) {
+	/* one package that won't update doesn't hold back the ones that don't need it */
+	plan->keep_going = true;
+	ret = mport_plan_execute(mport, plan);
 
-		slot = ohash_qlookup(&h, (*packs)->name);
-		key = ohash_find(&h, slot);
-		if (key == NULL) {
-			if (mport_index_check(mport, *packs)) {
-				updated += mport_update_down(mport, *packs, &info, &h);
-			}
-		}
-		packs++;
-		total++;
+	for (size_t s = 0; s < plan->nsteps; s++) {
+		if (plan->steps[s]->action == MPORT_PLAN_UPDATE && plan->steps[s]->done)
+			updated++;
 	}
-	mport_pkgmeta_vec_free(packs_orig);
-	packs_orig = NULL;
-	packs = NULL;
-	ohash_delete(&h);
+	mport_plan_free(plan);
+	mport_trace_end(mport, MPORT_TRACE_UPGRADE, updated, 0, ret);
 
-	mport_call_msg_cb(mport, "Packages updated: %d\nTotal: %d\n", updated, total);
-	return (MPORT_OK);
-}
-
-int
-mport_update_down(mportInstance *mport, mportPackageMeta *pack, struct ohash_info *info, struct ohash *h) {
-	mportPackageMeta **depends, **depends_orig;
-	int ret = 0;
-	unsigned int slot;
-	char *key;
-
-	if (mport_pkgmeta_get_downdepends(mport, pack, &depends_orig) == MPORT_OK) {
-		if (depends_orig == NULL) {
-			
-			slot = ohash_qlookup(h, pack->name);
-			key = ohash_find(h, slot);
-			if (key == NULL) {
-				if (mport_index_check(mport, pack)) {
-					mport_call_msg_cb(mport, "Updating %s\n", pack->name);
-					if (mport_update(mport, pack->name) !=0) {
-						mport_call_msg_cb(mport, "Error updating %s\n", pack->name);
-						ret = 0;
-					} else {
-						ret = 1;
-						ohash_insert(h, slot, pack->name);
-					}
-				} else
-					ret = 0;
-			} else {
-				ret = 0;
-			}
-		} else {
-			depends = depends_orig;
-			while (*depends != NULL) {
-				slot = ohash_qlookup(h, (*depends)->name);
-				key = ohash_find(h, slot);
-				if (key == NULL) {
-					ret += mport_update_down(mport, (*depends), info, h);
-					if (mport_index_check(mport, *depends)) {
-						mport_call_msg_cb(mport, "Updating depends %s\n", (*depends)->name);
-						if (mport_update(mport, (*depends)->name) != 0) {
-							mport_call_msg_cb(mport, "Error updating %s\n", (*depends)->name);
-						} else {
-							ret++;
-							ohash_insert(h, slot, (*depends)->name);
-						}
-					}
-				}
-				depends++;
-			}
-			if (mport_index_check(mport, pack)) {
-				if (mport_update(mport, pack->name) != 0) {
-					mport_call_msg_cb(mport, "Error updating %s\n", pack->name);
-				} else {
-					ret++;
-					slot = ohash_qlookup(h, pack->name);
-					key = ohash_find(h, slot);
-					if (key == NULL)
-						ohash_insert(h, slot, pack->name);
-				}
-			}
-		}
-		mport_pkgmeta_vec_free(depends_orig);
-		depends_orig = NULL;
-		depends = NULL;
+	if (ret != MPORT_OK) {
+		mport_call_msg_cb(mport, "Error upgrading packages: %s\n", mport_err_string());
+		if (ret != MPORT_ERR_WARN)
+			RETURN_CURRENT_ERROR;
 	}
 
+	mport_call_msg_cb(mport, "Packages updated: %d\nTotal: %d\n", updated, total);
 	return (ret);
 }
@@ -105,23 +105,16 @@ mport_createextras_free(mportCreateExtras *extra)
     free(extra);
 }
 
+/* mport_verify_hash(filename, hash)
+ *
+ * Returns 1 if filename hashes to hash, in the algorithm hash names (see
+ * checksum.c), 0 otherwise.
+ */
 MPORT_PUBLIC_API int
 mport_verify_hash(const char *filename, const char *hash)
 {
-  char *filehash;
 
-  filehash = mport_hash_file(filename);
-#ifdef DEBUG
-  printf("gen: '%s'\nsql: '%s'\n", filehash, hash);
-#endif
-  if (strncmp(filehash, hash, 65) == 0)
-  {
-    free(filehash);
-    return 1;
-  }
-
-  free(filehash);
-  return 0;
+  return mport_checksum_matches(filename, hash) ? 1 : 0;
 }
 
 bool
@@ -143,31 +136,56 @@ mport_hash_file(const char *filename)
 uid_t
 mport_get_uid(const char *username)
 {
-    struct passwd *pw;
+    struct passwd pwd, *pw = NULL;
+    char *buf = NULL, *nbuf;
+    size_t len = 1024;
+    uid_t uid = 0; /* if we can't figure it out be safe */
+    int error;
 
     if (username == NULL || *username == '\0')
         return 0; /* root */
 
-    pw = getpwnam(username);
-    if (pw == NULL)
-        return 0; /* if we can't figure it out be safe */
+    /* the _r version, as other threads may be looking names up too */
+    do {
+        if ((nbuf = realloc(buf, len)) == NULL)
+            break;
+        buf = nbuf;
+        error = getpwnam_r(username, &pwd, buf, len, &pw);
+        len *= 2;
+    } while (error == ERANGE && len <= 1024 * 1024);
 
-    return pw->pw_uid;
+    if (pw != NULL)
+        uid = pw->pw_uid;
+    free(buf);
+
+    return uid;
 }
 
 gid_t
 mport_get_gid(const char *group)
 {
-    struct group *gr;
+    struct group grp, *gr = NULL;
+    char *buf = NULL, *nbuf;
+    size_t len = 4096; /* the member list comes too */
+    gid_t gid = 0; /* wheel, could not look up */
+    int error;
 
     if (group == NULL || *group == '\0')
         return 0; /* wheel */
 
-    gr = getgrnam(group);
-    if (gr == NULL)
-        return 0; /* wheel, could not look up */
+    do {
+        if ((nbuf = realloc(buf, len)) == NULL)
+            break;
+        buf = nbuf;
+        error = getgrnam_r(group, &grp, buf, len, &gr);
+        len *= 2;
+    } while (error == ERANGE && len <= 1024 * 1024);
+
+    if (gr != NULL)
+        gid = gr->gr_gid;
+    free(buf);
 
-    return gr->gr_gid;
+    return gid;
 }
 
 /* a wrapper around chdir, to work with our error system */
@@ -193,7 +211,31 @@ int mport_chdir(mportInstance *mport, const char *dir)
     }
 
     return (MPORT_OK);
-}    
+}
+
+/*
+ * Open dir (under the instance root) as a directory descriptor, for use
+ * with the *at() calls in place of mport_chdir().  Returns the descriptor,
+ * or -1 with the error set.
+ */
+int
+mport_open_dir(mportInstance *mport, const char *dir)
+{
+    char finaldir[FILENAME_MAX];
+    int fd;
+
+    if (snprintf(finaldir, sizeof(finaldir), "%s%s", mport->root, dir) >= (int)sizeof(finaldir)) {
+        SET_ERRORX(MPORT_ERR_FATAL, "Path too long: %s%s", mport->root, dir);
+        return (-1);
+    }
+
+    if ((fd = open(finaldir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        SET_ERRORX(MPORT_ERR_FATAL, "Couldn't open directory %s: %s", finaldir, strerror(errno));
+        return (-1);
+    }
+
+    return (fd);
+}
 
 
 /* deletes the entire directory tree at filename.
@@ -439,13 +481,12 @@ mport_run_asset_exec(mportInstance *mport, const char *fmt, const char *cwd, con
     char *name;
     char *lfcpy;
     int ret;
-    static int max = 0;
+    int max;
     size_t maxlen = sizeof(max);
 
-    if (max == 0) {
-        if (sysctlbyname("kern.argmax", &max, &maxlen, NULL, 0) < 0)
-            RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't determine maximum argument length");
-    }
+    /* looked up each time; a cached copy was counted down as the command was built */
+    if (sysctlbyname("kern.argmax", &max, &maxlen, NULL, 0) < 0)
+        RETURN_ERROR(MPORT_ERR_FATAL, "Couldn't determine maximum argument length");
 
     if ((cmnd = malloc(max * sizeof(char))) == NULL)
         RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory");
@@ -469,7 +510,10 @@ mport_run_asset_exec(mportInstance *mport, const char *fmt, const char *cwd, con
                     max -= l;
                     break;
                 case 'B':
-                    lfcpy = malloc(strlen(last_file) * sizeof(char));
+                    if ((lfcpy = strdup(last_file)) == NULL) {
+                        free(cmnd);
+                        RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory");
+                    }
                     name = dirname(lfcpy); /* dirname(3) in MidnightBSD 3.0 and higher modifies the source. */
                     (void) strlcpy(pos, name, max);
                     l = strlen(name);
@@ -742,3 +786,14 @@ mport_get_time(void)
 
 	return now.tv_sec;
 }
+
+/* milliseconds on the monotonic clock since start */
+long
+mport_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000L + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
@@ -32,49 +32,191 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <string.h>
 #include <sqlite3.h>
-#include <md5.h>
-#include <sha256.h>
 #include <stdlib.h>
 #include "mport.h"
 #include "mport_private.h"
 
+/*
+ * Verifying installed files.
+ *
+ * One scan of assets, in package order, feeds a bounded queue of files to a
+ * pool of workers, which stat and hash them with mport_checksum_file(), in
+ * whichever algorithm each checksum names.  Each package's result is handed
+ * to the caller, in scan order, once the last of its files is done;
+ * messages, callbacks and database writes only ever come from the calling
+ * thread.
+ *
+ * Every file that is hashed and matches goes into verify_ledger with its
+ * stat fingerprint, so the next run only reads what changed since.  With
+ * verify_rehash_days set to N, a different Nth of the files is hashed
+ * regardless each day, so the whole system is re-read every N days without
+ * any one run doing all of it.
+ */
+
+#define VERIFY_QUEUE 256
+
+enum verify_outcome {
+	VERIFY_OK, VERIFY_HASHED, VERIFY_SKIPPED, VERIFY_MISSING, VERIFY_MODIFIED, VERIFY_UNREADABLE
+};
+
+struct verify_fingerprint {
+	sqlite3_int64 size, mtime, ino, ctime;
+};
+
+struct verify_job {
+	size_t pkg;		/* index into state->pkgs */
+	char *file;
+	char *data;		/* the asset, for the ledger; NULL if there is none */
+	char checksum[MPORT_CHECKSUM_MAX];
+	bool due;		/* hash it whatever the fingerprints say */
+	bool installed;		/* the install fingerprint is set */
+	struct verify_fingerprint install;
+	bool ledger;		/* the ledger fingerprint and hash are set */
+	struct verify_fingerprint last;
+	char last_hash[MPORT_CHECKSUM_MAX];
+};
+
+struct verify_problem {
+	struct verify_problem *next;
+	char msg[];
+};
+
+/* a ledger row to write */
+struct verify_mark {
+	struct verify_mark *next;
+	struct verify_fingerprint fp;
+	char hash[MPORT_CHECKSUM_MAX];
+	char data[];
+};
+
+struct verify_pkg {
+	mportVerifyResult result;
+	size_t pending;		/* queued or being worked on */
+	bool scanned;		/* all of its files have been queued */
+	struct verify_problem *problems, **tail;
+	struct verify_mark *marks;
+};
+
+struct verify_state {
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* the queue has a job, or stop */
+	pthread_cond_t done;	/* a job finished */
+	struct verify_job queue[VERIFY_QUEUE];
+	size_t head, count;
+	struct verify_pkg *pkgs;
+	size_t npkgs, reported;
+	bool deep, stop;
+	pthread_t threads[MPORT_MAX_VERIFY_JOBS];
+	int nthreads;
+};
+
+static void *verify_worker(void *);
+static void verify_finish(struct verify_state *, struct verify_job *);
+static enum verify_outcome verify_file(const struct verify_job *, bool, char **, char *, struct stat *);
+static bool verify_fingerprint_read(sqlite3_stmt *, int, struct verify_fingerprint *);
+static bool verify_fingerprint_is(const struct verify_fingerprint *, const struct stat *);
+static void verify_ledger_write(mportInstance *, const char *, struct verify_mark *);
+static int verify_add_pkg(struct verify_state *, const char *, const char *);
+static void verify_report(mportInstance *, struct verify_state *, mport_verify_cb, void *);
+static int verify_run(mportInstance *, const char *, mport_verify_cb, void *);
+
+
+/*
+ * mport_verify_package(mport, pack)
+ *
+ * Report every file of pack that no longer matches its checksum.  Files
+ * whose size, mtime and inode are as installed are taken to match, unless
+ * MPORT_INST_DEEP is set in mport->flags.
+ */
 MPORT_PUBLIC_API int
 mport_verify_package(mportInstance *mport, mportPackageMeta *pack)
 {
-	sqlite3_stmt *stmt;
-	mportAssetListEntryType type;
-	int ret;
-	const char *data, *checksum;
-	struct stat st;
-	char hash[65];
-	
+
 	mport_call_msg_cb(mport, "Verifying %s-%s", pack->name, pack->version);
-	if (mport_db_prepare(mport->db, &stmt, "SELECT type,data,checksum FROM assets WHERE pkg=%Q", pack->name) != MPORT_OK) {
+
+	return verify_run(mport, pack->name, NULL, NULL);
+}
+
+/*
+ * mport_verify_packages(mport, cb, arg)
+ *
+ * mport_verify_package() for every installed package at once, hashing
+ * files on as many threads as the verify_jobs setting allows.  cb, if not
+ * NULL, is called with each package's counts, in package name order, after
+ * the messages about its files.
+ */
+MPORT_PUBLIC_API int
+mport_verify_packages(mportInstance *mport, mport_verify_cb cb, void *arg)
+{
+
+	return verify_run(mport, NULL, cb, arg);
+}
+
+static int
+verify_run(mportInstance *mport, const char *pkg, mport_verify_cb cb, void *arg)
+{
+	struct verify_state *state;
+	struct verify_job *job;
+	sqlite3_stmt *stmt;
+	const char *name, *version, *prefix, *data, *checksum;
+	const char *last_hash;
+	char file[FILENAME_MAX];
+	int nthreads, ret, rehash, today;
+
+	if (mport == NULL)
+		RETURN_ERROR(MPORT_ERR_FATAL, "mport not initialized");
+
+	/* the day's share of a full re-hash, by asset rowid */
+	rehash = mport_setting_get_int(mport, MPORT_SETTING_VERIFY_REHASH_DAYS, 0);
+	today = rehash > 0 ? (int) ((time(NULL) / 86400) % rehash) : 0;
+
+	if (mport_db_prepare(mport->db, &stmt,
+	    "SELECT a.pkg, p.version, p.prefix, a.data, a.checksum, a.size, a.mtime, a.ino, a.ctime, a.rowid, "
+	    "l.size, l.mtime, l.ino, l.ctime, l.hash "
+	    "FROM assets a JOIN packages p ON p.pkg=a.pkg "
+	    "LEFT JOIN verify_ledger l ON l.pkg=a.pkg AND l.data=a.data "
+	    "WHERE a.type IN (%i, %i, %i, %i) "
+	    "AND (%Q IS NULL OR a.pkg=%Q) ORDER BY a.pkg, a.rowid",
+	    ASSET_FILE, ASSET_FILE_OWNER_MODE, ASSET_SAMPLE, ASSET_SAMPLE_OWNER_MODE, pkg, pkg) != MPORT_OK) {
 		sqlite3_finalize(stmt);
 		RETURN_CURRENT_ERROR;
 	}
 
-	while (1) {
-		ret = sqlite3_step(stmt);
+	if ((state = calloc(1, sizeof(struct verify_state))) == NULL) {
+		sqlite3_finalize(stmt);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+	pthread_mutex_init(&state->lock, NULL);
+	pthread_cond_init(&state->work, NULL);
+	pthread_cond_init(&state->done, NULL);
+	state->deep = (mport->flags & MPORT_INST_DEEP) != 0;
 
-		if (ret == SQLITE_DONE)
+	/* one package has nothing to share out */
+	nthreads = pkg != NULL ? 1 : mport_setting_get_int(mport, MPORT_SETTING_VERIFY_JOBS, mport_default_install_jobs());
+	if (nthreads > MPORT_MAX_VERIFY_JOBS)
+		nthreads = MPORT_MAX_VERIFY_JOBS;
+	for (int i = 0; i < nthreads; i++) {
+		if (pthread_create(&state->threads[i], NULL, verify_worker, state) != 0)
 			break;
+		state->nthreads++;
+	}
 
-		if (ret != SQLITE_ROW) {
-			/* some error occured */
-			SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
-			sqlite3_finalize(stmt);
-			RETURN_CURRENT_ERROR;
-		}
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		name = (const char *) sqlite3_column_text(stmt, 0);
+		version = (const char *) sqlite3_column_text(stmt, 1);
+		prefix = (const char *) sqlite3_column_text(stmt, 2);
+		data = (const char *) sqlite3_column_text(stmt, 3);
+		checksum = (const char *) sqlite3_column_text(stmt, 4);
 
-		type = (mportAssetListEntryType) sqlite3_column_int(stmt, 0);
-		data = sqlite3_column_text(stmt, 1);
-		checksum = sqlite3_column_text(stmt, 2);
+		if (state->npkgs == 0 || strcmp(state->pkgs[state->npkgs - 1].result.name, name) != 0) {
+			if (verify_add_pkg(state, name, version) != MPORT_OK)
+				break;
+		}
 
-		char file[FILENAME_MAX];
-		/* XXX TMP */
 		if (data == NULL) {
 			/* XXX data is null when ASSET_CHMOD (mode) or similar commands are in plist */
 			snprintf(file, sizeof(file), "%s", mport->root);
@@ -82,58 +224,358 @@ mport_verify_package(mportInstance *mport, mportPackageMeta *pack)
 			/* we don't use mport->root because it's an absolute path like /var */
 			snprintf(file, sizeof(file), "%s", data);
 		} else {
-			snprintf(file, sizeof(file), "%s%s/%s", mport->root, pack->prefix, data);
+			snprintf(file, sizeof(file), "%s%s/%s", mport->root, prefix, data);
 		}
 
-		switch (type) {
-			case ASSET_FILE_OWNER_MODE:
-				/* FALLS THROUGH */
-			case ASSET_FILE:
-				/* FALLS THROUGH */
-			case ASSET_SAMPLE:
-				/* FALLS THROUGH */
-			case ASSET_SAMPLE_OWNER_MODE:
-				if (lstat(file, &st) != 0) {
-					mport_call_msg_cb(mport, "Can't stat %s: %s", file, strerror(errno));
-					break; /* next asset */
-				}
-
-				if (S_ISREG(st.st_mode)) {
-					if (checksum == NULL) {
-						mport_call_msg_cb(mport, "Source checksum missing %s", file);
-					} else if (strlen(checksum) < 34) {
-						if (MD5File(file, hash) == NULL)
-							mport_call_msg_cb(mport, "Can't MD5 %s: %s", file, strerror(errno));
-
-						if (hash == NULL)
-							mport_call_msg_cb(mport,
-							                  "Destination checksum could not be computed %s",
-							                  file);
-						else if (strcmp(hash, checksum) != 0)
-							mport_call_msg_cb(mport, "Checksum mismatch: %s %s %s", file, hash,
-							                  checksum);
-					} else {
-						if (SHA256_File(file, hash) == NULL)
-							mport_call_msg_cb(mport, "Can't SHA256 %s: %s", file, strerror(errno));
-
-						if (hash == NULL)
-							mport_call_msg_cb(mport,
-							                  "Destination checksum could not be computed %s",
-							                  file);
-						else if (strcmp(hash, checksum) != 0)
-							mport_call_msg_cb(mport, "Checksum mismatch: %s %s %s", file, hash,
-							                  checksum);
-					}
-				}
+		pthread_mutex_lock(&state->lock);
+		while (state->count == VERIFY_QUEUE) {
+			pthread_mutex_unlock(&state->lock);
+			verify_report(mport, state, cb, arg);
+			pthread_mutex_lock(&state->lock);
+			if (state->count == VERIFY_QUEUE)
+				pthread_cond_wait(&state->done, &state->lock);
+		}
+		job = &state->queue[(state->head + state->count) % VERIFY_QUEUE];
+		job->pkg = state->npkgs - 1;
+		job->file = strdup(file);
+		job->data = data == NULL ? NULL : strdup(data);
+		job->checksum[0] = '\0';
+		if (checksum != NULL)
+			(void) strlcpy(job->checksum, checksum, sizeof(job->checksum));
+		job->due = rehash > 0 && sqlite3_column_int64(stmt, 9) % rehash == today;
+		job->installed = verify_fingerprint_read(stmt, 5, &job->install);
+		last_hash = (const char *) sqlite3_column_text(stmt, 14);
+		/* rows from before master schema 16 have no ctime, and never match */
+		job->ledger = last_hash != NULL && verify_fingerprint_read(stmt, 10, &job->last);
+		(void) strlcpy(job->last_hash, last_hash == NULL ? "" : last_hash, sizeof(job->last_hash));
+		state->pkgs[job->pkg].pending++;
 
-				break;
-			default:
-				/* do nothing */
-				break;
+		if (state->nthreads == 0) {
+			/* no workers could be started, do it here */
+			struct verify_job local = *job;
+			pthread_mutex_unlock(&state->lock);
+			verify_finish(state, &local);
+		} else {
+			state->count++;
+			pthread_cond_signal(&state->work);
+			pthread_mutex_unlock(&state->lock);
 		}
 	}
 
+	if (ret != SQLITE_DONE && ret != SQLITE_ROW)
+		SET_ERROR(MPORT_ERR_FATAL, sqlite3_errmsg(mport->db));
 	sqlite3_finalize(stmt);
-	
+
+	/* let the queue drain, reporting packages as they complete */
+	pthread_mutex_lock(&state->lock);
+	if (state->npkgs > 0)
+		state->pkgs[state->npkgs - 1].scanned = true;
+	while (state->reported < state->npkgs) {
+		pthread_mutex_unlock(&state->lock);
+		verify_report(mport, state, cb, arg);
+		pthread_mutex_lock(&state->lock);
+		if (state->reported < state->npkgs && state->pkgs[state->reported].pending > 0)
+			pthread_cond_wait(&state->done, &state->lock);
+	}
+	state->stop = true;
+	pthread_cond_broadcast(&state->work);
+	pthread_mutex_unlock(&state->lock);
+
+	for (int i = 0; i < state->nthreads; i++)
+		pthread_join(state->threads[i], NULL);
+
+	for (size_t i = 0; i < state->npkgs; i++) {
+		free((char *) state->pkgs[i].result.name);
+		free((char *) state->pkgs[i].result.version);
+	}
+	free(state->pkgs);
+	pthread_cond_destroy(&state->done);
+	pthread_cond_destroy(&state->work);
+	pthread_mutex_destroy(&state->lock);
+	free(state);
+
+	if (ret != SQLITE_DONE)
+		RETURN_CURRENT_ERROR;
+
+	return MPORT_OK;
+}
+
+/* start a package's result; the last one's files have all been queued */
+static int
+verify_add_pkg(struct verify_state *state, const char *name, const char *version)
+{
+	struct verify_pkg *grown, *p;
+
+	pthread_mutex_lock(&state->lock);
+	if (state->npkgs > 0)
+		state->pkgs[state->npkgs - 1].scanned = true;
+	if ((grown = realloc(state->pkgs, (state->npkgs + 1) * sizeof(struct verify_pkg))) == NULL) {
+		pthread_mutex_unlock(&state->lock);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+	state->pkgs = grown;
+	p = &state->pkgs[state->npkgs++];
+	memset(p, 0, sizeof(struct verify_pkg));
+	p->result.name = strdup(name);
+	p->result.version = strdup(version);
+	p->tail = &p->problems;
+	if (p->result.name == NULL || p->result.version == NULL) {
+		free((char *) p->result.name);
+		free((char *) p->result.version);
+		state->npkgs--;
+		pthread_mutex_unlock(&state->lock);
+		RETURN_ERROR(MPORT_ERR_FATAL, "Out of memory.");
+	}
+	pthread_mutex_unlock(&state->lock);
+
 	return MPORT_OK;
 }
+
+/*
+ * Record the files of pkg that were hashed and matched, and free the list.
+ * The ledger only saves work later, so failing to write it is not an error.
+ */
+static void
+verify_ledger_write(mportInstance *mport, const char *pkg, struct verify_mark *marks)
+{
+	struct verify_mark *next;
+	sqlite3_stmt *stmt = NULL;
+	time_t now = time(NULL);
+
+	if (marks != NULL && (mport->flags & MPORT_INST_READONLY) == 0 &&
+	    sqlite3_exec(mport->db, "SAVEPOINT verify_ledger", NULL, NULL, NULL) == SQLITE_OK) {
+		if (mport_db_borrow(mport, &stmt,
+		    "INSERT OR REPLACE INTO verify_ledger (pkg, data, size, mtime, ino, ctime, hash, verified) "
+		    "VALUES (?, ?, ?, ?, ?, ?, ?, ?)") != MPORT_OK)
+			stmt = NULL;
+		for (struct verify_mark *m = marks; stmt != NULL && m != NULL; m = m->next) {
+			sqlite3_bind_text(stmt, 1, pkg, -1, SQLITE_STATIC);
+			sqlite3_bind_text(stmt, 2, m->data, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt, 3, m->fp.size);
+			sqlite3_bind_int64(stmt, 4, m->fp.mtime);
+			sqlite3_bind_int64(stmt, 5, m->fp.ino);
+			sqlite3_bind_int64(stmt, 6, m->fp.ctime);
+			sqlite3_bind_text(stmt, 7, m->hash, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt, 8, (sqlite3_int64) now);
+			(void) sqlite3_step(stmt);
+			(void) sqlite3_reset(stmt);
+		}
+		if (stmt != NULL)
+			(void) sqlite3_clear_bindings(stmt);
+		mport_db_return(mport, stmt);
+		(void) sqlite3_exec(mport->db, "RELEASE verify_ledger", NULL, NULL, NULL);
+	}
+
+	for (; marks != NULL; marks = next) {
+		next = marks->next;
+		free(marks);
+	}
+}
+
+/* hand over every finished package at the front, in order */
+static void
+verify_report(mportInstance *mport, struct verify_state *state, mport_verify_cb cb, void *arg)
+{
+	struct verify_pkg *p;
+	struct verify_problem *problem, *next;
+	struct verify_mark *marks;
+	mportVerifyResult result;
+
+	pthread_mutex_lock(&state->lock);
+	while (state->reported < state->npkgs) {
+		p = &state->pkgs[state->reported];
+		if (!p->scanned || p->pending > 0)
+			break;
+		result = p->result;
+		problem = p->problems;
+		p->problems = NULL;
+		marks = p->marks;
+		p->marks = NULL;
+		state->reported++;
+		pthread_mutex_unlock(&state->lock);
+
+		verify_ledger_write(mport, result.name, marks);
+
+		for (; problem != NULL; problem = next) {
+			next = problem->next;
+			mport_call_msg_cb(mport, "%s", problem->msg);
+			free(problem);
+		}
+		if (cb != NULL)
+			cb(&result, arg);
+
+		pthread_mutex_lock(&state->lock);
+	}
+	pthread_mutex_unlock(&state->lock);
+}
+
+static void *
+verify_worker(void *arg)
+{
+	struct verify_state *state = arg;
+	struct verify_job job;
+
+	pthread_mutex_lock(&state->lock);
+	for (;;) {
+		while (state->count == 0 && !state->stop)
+			pthread_cond_wait(&state->work, &state->lock);
+		if (state->count == 0)
+			break;
+
+		job = state->queue[state->head];
+		state->head = (state->head + 1) % VERIFY_QUEUE;
+		state->count--;
+		pthread_mutex_unlock(&state->lock);
+
+		verify_finish(state, &job);
+
+		pthread_mutex_lock(&state->lock);
+	}
+	pthread_mutex_unlock(&state->lock);
+
+	return NULL;
+}
+
+/* check one file and count it against its package */
+static void
+verify_finish(struct verify_state *state, struct verify_job *job)
+{
+	struct verify_pkg *p;
+	struct verify_problem *problem = NULL;
+	struct verify_mark *mark = NULL;
+	enum verify_outcome outcome;
+	struct stat st;
+	char *msg = NULL, hash[MPORT_CHECKSUM_MAX];
+
+	outcome = job->file == NULL ? VERIFY_UNREADABLE : verify_file(job, state->deep, &msg, hash, &st);
+	if (job->file == NULL)
+		msg = strdup("Out of memory.");
+
+	if (msg != NULL && (problem = malloc(sizeof(struct verify_problem) + strlen(msg) + 1)) != NULL) {
+		problem->next = NULL;
+		(void) strcpy(problem->msg, msg);
+	}
+	if (outcome == VERIFY_HASHED && job->data != NULL &&
+	    (mark = malloc(sizeof(struct verify_mark) + strlen(job->data) + 1)) != NULL) {
+		mark->fp.size = (sqlite3_int64) st.st_size;
+		mark->fp.mtime = mport_stat_mtime(&st);
+		mark->fp.ino = (sqlite3_int64) st.st_ino;
+		mark->fp.ctime = mport_stat_ctime(&st);
+		(void) strlcpy(mark->hash, hash, sizeof(mark->hash));
+		(void) strcpy(mark->data, job->data);
+	}
+	free(msg);
+	free(job->file);
+	free(job->data);
+
+	pthread_mutex_lock(&state->lock);
+	p = &state->pkgs[job->pkg];
+	switch (outcome) {
+		case VERIFY_SKIPPED:
+			break;
+		case VERIFY_HASHED:
+			p->result.hashed++;
+			/* FALLS THROUGH */
+		case VERIFY_OK:
+			p->result.files++;
+			break;
+		case VERIFY_MISSING:
+			p->result.files++;
+			p->result.missing++;
+			break;
+		case VERIFY_MODIFIED:
+			p->result.files++;
+			p->result.hashed++;
+			p->result.modified++;
+			break;
+		case VERIFY_UNREADABLE:
+			p->result.files++;
+			p->result.unreadable++;
+			break;
+	}
+	if (problem != NULL) {
+		*p->tail = problem;
+		p->tail = &problem->next;
+	}
+	if (mark != NULL) {
+		mark->next = p->marks;
+		p->marks = mark;
+	}
+	p->pending--;
+	pthread_cond_signal(&state->done);
+	pthread_mutex_unlock(&state->lock);
+}
+
+/*
+ * Stat and, unless a fingerprint says it is untouched, hash one file into
+ * hash.  *msg is set to a message for the user when there is something to
+ * say; *st is the file's, for the ledger, when VERIFY_HASHED is returned.
+ */
+static enum verify_outcome
+verify_file(const struct verify_job *job, bool deep, char **msg, char *hash, struct stat *stp)
+{
+	struct stat st;
+
+	if (lstat(job->file, &st) != 0) {
+		(void) asprintf(msg, "Can't stat %s: %s", job->file, strerror(errno));
+		return VERIFY_MISSING;
+	}
+
+	/* symlinks and the like have no checksum of their own */
+	if (!S_ISREG(st.st_mode))
+		return VERIFY_SKIPPED;
+
+	if (job->checksum[0] == '\0') {
+		(void) asprintf(msg, "Source checksum missing %s", job->file);
+		return VERIFY_OK;
+	}
+
+	/* as last verified, or as installed; see mport_fingerprint_matches() */
+	if (!deep && !job->due) {
+		if (job->ledger && verify_fingerprint_is(&job->last, &st) &&
+		    strcmp(job->last_hash, job->checksum) == 0)
+			return VERIFY_OK;
+		if (job->installed && verify_fingerprint_is(&job->install, &st))
+			return VERIFY_OK;
+	}
+
+	if (!mport_checksum_file(job->file, job->checksum, hash)) {
+		(void) asprintf(msg, "Destination checksum could not be computed %s: %s", job->file, strerror(errno));
+		return VERIFY_UNREADABLE;
+	}
+
+	if (strcmp(hash, job->checksum) != 0) {
+		(void) asprintf(msg, "Checksum mismatch: %s %s %s", job->file, hash, job->checksum);
+		return VERIFY_MODIFIED;
+	}
+
+	*stp = st;
+
+	return VERIFY_HASHED;
+}
+
+/* columns col to col + 3 of stmt into fp; false if any is NULL */
+static bool
+verify_fingerprint_read(sqlite3_stmt *stmt, int col, struct verify_fingerprint *fp)
+{
+
+	fp->size = sqlite3_column_int64(stmt, col);
+	fp->mtime = sqlite3_column_int64(stmt, col + 1);
+	fp->ino = sqlite3_column_int64(stmt, col + 2);
+	fp->ctime = sqlite3_column_int64(stmt, col + 3);
+
+	for (int i = col; i < col + 4; i++) {
+		if (sqlite3_column_type(stmt, i) == SQLITE_NULL)
+			return false;
+	}
+
+	return true;
+}
+
+static bool
+verify_fingerprint_is(const struct verify_fingerprint *fp, const struct stat *st)
+{
+
+	return fp->size == (sqlite3_int64) st->st_size && fp->mtime == mport_stat_mtime(st) &&
+	    fp->ino == (sqlite3_int64) st->st_ino && fp->ctime == mport_stat_ctime(st);
+}
@@ -37,19 +37,35 @@
 #include "mport_private.h"
 
 struct version {
-	char *version;
+	const char *version; /* the dotted part, up to end */
+	const char *end;
 	int revision;
 	int epoch;
 };
 
+/*
+ * One component of the dotted part: a run of digits, without leading
+ * zeros, or a single other character standing for its character code.
+ * A missing component is a zero length run, i.e. 0.
+ */
+struct vtoken {
+	const char *digits;
+	size_t len;
+	char buf[4];
+};
+
 static void parse_version(const char *, struct version *);
-static int cmp_versions(char *, char *);
+static void next_token(const char **, const char *, struct vtoken *);
+static int cmp_tokens(const struct vtoken *, const struct vtoken *);
+static int cmp_versions(const struct version *, const struct version *);
 static int cmp_ints(int, int);
 
 /* mport_version_cmp(version1, version2)
  *
  * Compare two given version strings.  Returns 0 if the versions
  * are the same, -1 if version1 is less than version2, 1 otherwise.
+ *
+ * This doesn't allocate; it is called per row from sqlite.
  */
 MPORT_PUBLIC_API int
 mport_version_cmp(const char *astr, const char *bstr)
@@ -61,44 +77,120 @@ mport_version_cmp(const char *astr, const char *bstr)
 	parse_version(astr, &a);
 	parse_version(bstr, &b);
 
-	/* remember that a.version/b.version are useless after calling
-	   cmp_versions (but astr and bstr are unchanged.) */
 	if ((result = cmp_ints(a.epoch, b.epoch)) == 0) {
-		if ((result = cmp_versions(a.version, b.version)) == 0) {
+		if ((result = cmp_versions(&a, &b)) == 0) {
 			result = cmp_ints(a.revision, b.revision);
 		}
 	}
 
 #ifdef DEBUG
-	printf("Version a %s, Version b %s, result %d\n", a.version, b.version, result);
+	printf("Version a %s, Version b %s, result %d\n", astr, bstr, result);
 #endif
 
-	free(a.version);
-	free(b.version);
-  
 	return (result);
 }
 
+/* mport_version_key(version, key, keylen)
+ *
+ * Encode version as a string whose byte order is the order of
+ * mport_version_cmp(): strcmp(key(a), key(b)) has the sign of
+ * mport_version_cmp(a, b), and equal versions ("1.0" and "1") get equal
+ * keys.  This is what the version_key columns hold.
+ *
+ * Writes at most keylen bytes including the terminating NUL and returns the
+ * length of the whole key, as strlcpy(3) does.
+ */
+MPORT_PUBLIC_API size_t
+mport_version_key(const char *version, char *key, size_t keylen)
+{
+	struct version v;
+	struct vtoken t;
+	const char *p;
+	size_t len = 0, zeros = 0;
+	int n;
+
+#define KEY_PUT(...) do { \
+		n = snprintf(key + (len < keylen ? len : 0), len < keylen ? keylen - len : 0, __VA_ARGS__); \
+		len += (size_t) n; \
+	} while (0)
+
+	parse_version(version, &v);
+
+	/* epoch and revision are biased so that negative values sort first */
+	KEY_PUT("%08x", (unsigned int) v.epoch ^ 0x80000000u);
+
+	/* trailing zero components are dropped, so a shorter key is always the lesser */
+	p = v.version;
+	while (p < v.end) {
+		next_token(&p, v.end, &t);
+		if (t.len == 0) {
+			zeros++;
+			continue;
+		}
+		for (; zeros > 0; zeros--)
+			KEY_PUT(".00");
+		if (t.len > 0xff)
+			t.len = 0xff;
+		KEY_PUT(".%02zx%.*s", t.len, (int) t.len, t.digits);
+	}
+
+	/* '-' sorts before '.', ending the dotted part before any longer one */
+	KEY_PUT("-%08x", (unsigned int) v.revision ^ 0x80000000u);
+
+#undef KEY_PUT
+
+	return (len);
+}
+
 
 /* version of mport_version_cmp() that is bound to the sqlite3 database. */
 void
 mport_version_cmp_sqlite(sqlite3_context *context, int argc, sqlite3_value **argv)
 {
-    char *a, *b;
+	const char *a, *b;
+
+	assert(argc == 2);
+
+	a = (const char *) sqlite3_value_text(argv[0]);
+	b = (const char *) sqlite3_value_text(argv[1]);
+
+	if (a == NULL || b == NULL) {
+		sqlite3_result_null(context);
+		return;
+	}
+
+	sqlite3_result_int(context, mport_version_cmp(a, b));
+}
+
+/* mport_version_key() bound to the sqlite3 database, for filling version_key columns */
+void
+mport_version_key_sqlite(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+	const char *v;
+	char buf[128];
+	char *key;
+	size_t len;
 
-    assert(argc == 2);
+	assert(argc == 1);
 
-    a = strdup(sqlite3_value_text(argv[0]));
-    b = strdup(sqlite3_value_text(argv[1]));
+	if ((v = (const char *) sqlite3_value_text(argv[0])) == NULL) {
+		sqlite3_result_null(context);
+		return;
+	}
 
-    assert(a != NULL);
-    assert(b != NULL);
+	if ((len = mport_version_key(v, buf, sizeof(buf))) < sizeof(buf)) {
+		sqlite3_result_text(context, buf, (int) len, SQLITE_TRANSIENT);
+		return;
+	}
 
-    sqlite3_result_int(context, mport_version_cmp(a, b));
+	if ((key = sqlite3_malloc((int) len + 1)) == NULL) {
+		sqlite3_result_error_nomem(context);
+		return;
+	}
 
-    free(a);
-    free(b);
-}  
+	(void) mport_version_key(v, key, len + 1);
+	sqlite3_result_text(context, key, (int) len, sqlite3_free);
+}
 
 
 /* Returns 0 if baseline meets the given requirement, -1 if the requirement
@@ -272,45 +364,78 @@ mport_version_require_check(const char *baseline, const char *require)
     return (ret);
 }
 
+/*
+ * Split a version into its parts without copying it: the dotted part runs
+ * up to the first of the last '_' (revision), ',' (epoch), '<' or '>'.
+ * The latter two keep a multiversion string such as 2.0<1.5 from being
+ * parsed as one version; ideally these are caught upstream.
+ */
 static void
 parse_version(const char *in, struct version *v) 
 {
-    char *s = strdup(in);
-    char *underscore;
-    char *comma;
-    // greater than and less than prevent multiversion strings from getting parsed incorrectly
-    // so 2.0<1.5 would just be 2.0. Ideally we need to catch this upstream and do the right check.
-    char *lessthan;
-    char *greaterthan;
-
-    underscore = rindex(s, '_');
-    comma = rindex(s, ',');
-	lessthan = rindex(s, '<');
-	greaterthan = rindex(s, '>');
-
-	if (lessthan != NULL) {
-		*lessthan = '\0';
+	const char *cut[4];
+	const char *underscore, *comma;
+	int i;
+
+	underscore = strrchr(in, '_');
+	comma = strrchr(in, ',');
+
+	cut[0] = underscore;
+	cut[1] = comma;
+	cut[2] = strrchr(in, '<');
+	cut[3] = strrchr(in, '>');
+
+	v->version = in;
+	v->end = in + strlen(in);
+	for (i = 0; i < 4; i++) {
+		if (cut[i] != NULL && cut[i] < v->end)
+			v->end = cut[i];
 	}
 
-	if (greaterthan != NULL) {
-		*greaterthan = '\0';
+	/* the cut characters are never digits, so strtol stops at them */
+	v->epoch = comma == NULL ? 0 : (int) strtol(comma + 1, NULL, 10);
+	v->revision = underscore == NULL ? 0 : (int) strtol(underscore + 1, NULL, 10);
+}
+
+static void
+next_token(const char **pp, const char *end, struct vtoken *t)
+{
+	const char *p = *pp;
+
+	while (p < end && (*p == '.' || *p == '+'))
+		p++;
+
+	if (p >= end) {
+		t->digits = p;
+		t->len = 0;
+	} else if (isdigit((unsigned char) *p)) {
+		while (p < end && *p == '0')
+			p++;
+		t->digits = p;
+		while (p < end && isdigit((unsigned char) *p))
+			p++;
+		t->len = (size_t) (p - t->digits);
+	} else {
+		t->len = (size_t) snprintf(t->buf, sizeof(t->buf), "%u", (unsigned char) *p);
+		t->digits = t->buf;
+		p++;
 	}
 
-    if (comma == NULL) {
-        v->epoch = 0;
-    } else {
-        *comma = '\0';
-        v->epoch = (int) strtol(comma + 1, NULL, 10);
-    }
+	*pp = p;
+}
 
-    if (underscore == NULL) {
-        v->revision = 0;
-    } else {
-        *underscore = '\0';
-        v->revision = (int) strtol(underscore + 1, NULL, 10);
-    }
+static int
+cmp_tokens(const struct vtoken *a, const struct vtoken *b)
+{
+	int result;
 
-    v->version = s;
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+
+	if ((result = memcmp(a->digits, b->digits, a->len)) == 0)
+		return 0;
+
+	return result < 0 ? -1 : 1;
 }
 
 static int
@@ -326,44 +451,19 @@ cmp_ints(int a, int b)
 }
 
 static int
-cmp_versions(char *a, char *b)
+cmp_versions(const struct version *va, const struct version *vb)
 {
-    int a_sub, b_sub, result = 0;
-
-    while (*a || *b) {
-        if (*a) {
-            while (*a == '.' || *a == '+')
-                a++;
-
-            if (isdigit(*a)) {
-                a_sub = (int) strtol(a, &a, 10);
-            } else {
-                a_sub = (int) *a;
-                a++;
-            }
-        } else {
-            a_sub = 0;
-        }
-
-        if (*b) {
-            while (*b == '.' || *b == '+')
-                b++;
-
-            if (isdigit(*b)) {
-                b_sub = (int) strtol(b, &b, 10);
-            } else {
-                b_sub = (int) *b;
-                b++;
-            }
-        } else {
-            b_sub = 0;
-        }
-
-        result = cmp_ints(a_sub, b_sub);
-
-        if (result != 0)
+    const char *a = va->version, *b = vb->version;
+    struct vtoken at, bt;
+    int result = 0;
+
+    while (a < va->end || b < vb->end) {
+        next_token(&a, va->end, &at);
+        next_token(&b, vb->end, &bt);
+
+        if ((result = cmp_tokens(&at, &bt)) != 0)
             break;
     }
 
     return (result);
-}    
+}
@@ -40,6 +40,8 @@
 #include <mport.h>
 #include <mport_private.h>
 
+#include "query.h"
+
 #define MPORT_TOOLS_PATH "/usr/libexec/"
 
 static void usage(void);
@@ -58,29 +60,28 @@ static int configGet(mportInstance *, const char *);
 
 static int configSet(mportInstance *, const char *, const char *);
 
-static int delete(const char *);
+static int delete(const char *, bool, const char *);
+static int deepOption(mportInstance *, int, char *[]);
 
 static int deleteAll(mportInstance *);
 
-static int info(mportInstance *, const char *);
-
-static int search(mportInstance *, char **);
-
-static int stats(mportInstance *mport);
-
 static int clean(mportInstance *);
 
-static int verify(mportInstance *);
+static int verify(mportInstance *, bool);
+
+static int upgradeDryRun(mportInstance *);
 
 static int lock(mportInstance *, const char *);
 
 static int unlock(mportInstance *, const char *);
 
-static int which(mportInstance *, const char *, bool, bool);
+static bool daemonServes(const char *);
+
+static bool readOnlyCommand(int, char *[]);
+
 
 int
 main(int argc, char *argv[]) {
-	char *flag = NULL, *buf = NULL;
 	mportInstance *mport;
 	int resultCode = MPORT_ERR_FATAL;
 	int tempResultCode;
@@ -89,13 +90,18 @@ main(int argc, char *argv[]) {
 	signed char ch;
 	const char *chroot_path = NULL;
 	const char *outputPath = NULL;
+	const char *tracePath = NULL;
+	const char *repository = NULL;
 	int version = 0;
 	int noIndex = 0;
+	int initFlags = 0;
 
 	struct option longopts[] = {
 		    {"no-index", no_argument, NULL, 'U'},
 			{"chroot",  required_argument, NULL, 'c'},
 			{"output",  required_argument, NULL, 'o'},
+			{"repository", required_argument, NULL, 'r'},
+			{"trace",   required_argument, NULL, 'T'},
 			{"version", no_argument,       NULL, 'v'},
 			{NULL,      0,                 NULL, 0},
 	};
@@ -109,7 +115,7 @@ main(int argc, char *argv[]) {
 
 	setlocale(LC_ALL, "");
 
-	while ((ch = getopt_long(argc, argv, "+c:o:Uv", longopts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "+c:o:r:T:Uv", longopts, NULL)) != -1) {
 		switch (ch) {
 			case 'U':
 				noIndex++;
@@ -120,6 +126,12 @@ main(int argc, char *argv[]) {
 			case 'o':
 				outputPath = optarg;
                 break;
+			case 'r':
+				repository = optarg;
+				break;
+			case 'T':
+				tracePath = optarg;
+				break;
 			case 'v':
 				version++;
 				break;
@@ -131,15 +143,46 @@ main(int argc, char *argv[]) {
 	argc -= optind;
 	argv += optind;
 
+	/* a running mportd answers queries without opening the databases again */
+	if (argc > 0 && chroot_path == NULL && outputPath == NULL && tracePath == NULL &&
+	    noIndex == 0 && version == 0 && daemonServes(argv[0])) {
+		tempResultCode = mport_daemon_request(MPORT_DAEMON_SOCKET, argc, argv, &resultCode);
+		if (tempResultCode == MPORT_OK)
+			exit(resultCode);
+		/* past MPORT_ERR_WARN it may have printed some of the answer already */
+		if (tempResultCode != MPORT_ERR_WARN)
+			errx(1, "%s", mport_err_string());
+	}
+
 	if (chroot_path != NULL) {
 		if (chroot(chroot_path) == -1) {
 			err(EXIT_FAILURE, "chroot failed");
 		}
 	}
 
+	/* commands that only look at the database start with just the open */
+	if (argc > 0 && readOnlyCommand(argc, argv))
+		initFlags |= MPORT_INIT_READONLY;
+
 	mport = mport_instance_new();
 
-	if (mport_instance_init(mport, NULL, outputPath, noIndex != 0) != MPORT_OK) {
+	if (mport_instance_init_flags(mport, NULL, outputPath, noIndex != 0, initFlags) != MPORT_OK) {
+		if (!(initFlags & MPORT_INIT_READONLY))
+			errx(1, "%s", mport_err_string());
+
+		/* a master.db that needs creating or upgrading gets a full start */
+		mport_instance_free(mport);
+		mport = mport_instance_new();
+		initFlags &= ~MPORT_INIT_READONLY;
+		if (mport_instance_init_flags(mport, NULL, outputPath, noIndex != 0, initFlags) != MPORT_OK)
+			errx(1, "%s", mport_err_string());
+	}
+
+	if (tracePath != NULL && mport_trace_file(mport, tracePath) != MPORT_OK) {
+		errx(1, "%s", mport_err_string());
+	}
+
+	if (repository != NULL && mport_set_repository(mport, repository) != MPORT_OK) {
 		errx(1, "%s", mport_err_string());
 	}
 
@@ -163,12 +206,14 @@ main(int argc, char *argv[]) {
 				resultCode = tempResultCode;
 		}
 	} else if (!strcmp(cmd, "delete")) {
-		if (argc == 1) {
+		int first = deepOption(mport, argc, argv);
+
+		if (first == argc) {
 			mport_instance_free(mport);
 			usage();
 		}
-		for (i = 1; i < argc; i++) {
-			tempResultCode = delete(argv[i]);
+		for (i = first; i < argc; i++) {
+			tempResultCode = delete(argv[i], (mport->flags & MPORT_INST_DEEP) != 0, tracePath);
 			if (tempResultCode != 0)
 				resultCode = tempResultCode;
 		}
@@ -213,19 +258,35 @@ main(int argc, char *argv[]) {
 			}
 		}
 	} else if (!strcmp(cmd, "upgrade")) {
+		int ch2, nflag = 0;
+
+		optreset = 1;
+		optind = 1;
+		while ((ch2 = getopt(argc, argv, "n")) != -1) {
+			switch (ch2) {
+				case 'n':
+					nflag = 1;
+					break;
+				default:
+					mport_instance_free(mport);
+					usage();
+			}
+		}
+
 		loadIndex(mport);
-		resultCode = mport_upgrade(mport);
+		if (nflag)
+			resultCode = upgradeDryRun(mport);
+		else
+			resultCode = mport_upgrade(mport);
 	} else if (!strcmp(cmd, "locks")) {
-		asprintf(&buf, "%s%s", MPORT_TOOLS_PATH, "mport.list");
-		flag = strdup("-l");
-		resultCode = execl(buf, "mport.list", flag, (char *) 0);
-		free(flag);
-		free(buf);
+		resultCode = list_packages(mport, LIST_LOCKS);
 	} else if (!strcmp(cmd, "import")) {
 		loadIndex(mport);
-		resultCode = mport_import(mport, argv[2]);
+		resultCode = mport_import(mport, argc > 1 ? argv[1] : NULL);
+		if (resultCode != MPORT_OK)
+			warnx("%s", mport_err_string());
 	} else if (!strcmp(cmd, "export")) {
-		resultCode = mport_export(mport, argv[2]);
+		resultCode = mport_export(mport, argc > 1 ? argv[1] : NULL);
 	} else if (!strcmp(cmd, "lock")) {
 		if (argc > 1) {
 			lock(mport, argv[1]);
@@ -239,23 +300,19 @@ main(int argc, char *argv[]) {
 			usage();
 		}
 	} else if (!strcmp(cmd, "list")) {
-		asprintf(&buf, "%s%s", MPORT_TOOLS_PATH, "mport.list");
 		if (argc > 1) {
 			if (!strcmp(argv[1], "updates") ||
 			    !strcmp(argv[1], "up")) {
-				flag = strdup("-u");
+				resultCode = list_packages(mport, LIST_UPDATES);
 			} else if (!strcmp(argv[1], "prime")) {
-				flag = strdup("-p");
+				resultCode = list_packages(mport, LIST_PRIME);
 			} else {
 				mport_instance_free(mport);
 				usage();
 			}
 		} else {
-			flag = strdup("-v");
+			resultCode = list_packages(mport, LIST_VERBOSE);
 		}
-		resultCode = execl(buf, "mport.list", flag, (char *) 0);
-		free(flag);
-		free(buf);
 	} else if (!strcmp(cmd, "info")) {
 		loadIndex(mport);
 		resultCode = info(mport, argv[1]);
@@ -293,12 +350,15 @@ main(int argc, char *argv[]) {
 			resultCode = configSet(mport, argv[2], argv[3]);
 		}
 	} else if (!strcmp(cmd, "mirror")) {
-		if (argc > 2) {
+		if (argc > 1) {
 			if (!strcmp(argv[1], "list")) {
 				loadIndex(mport);
 				printf("To set a mirror, use the following command:\n");
 				printf("mport set config mirror_region <country>\n\n");
 				resultCode = mport_index_print_mirror_list(mport);
+			} else if (!strcmp(argv[1], "rank")) {
+				loadIndex(mport);
+				resultCode = mport_mirror_rank(mport);
 			}
 		}
 	} else if (!strcmp(cmd, "cpe")) {
@@ -308,7 +368,29 @@ main(int argc, char *argv[]) {
 	} else if (!strcmp(cmd, "autoremove")) {
 		resultCode = mport_autoremove(mport);
 	} else if (!strcmp(cmd, "verify")) {
-		resultCode = verify(mport);
+		struct option verifyopts[] = {
+				{"deep",    no_argument, NULL, 'd'},
+				{"machine", no_argument, NULL, 'm'},
+				{NULL,      0,           NULL, 0},
+		};
+		int ch2, mflag = 0;
+
+		optreset = 1;
+		optind = 1;
+		while ((ch2 = getopt_long(argc, argv, "dm", verifyopts, NULL)) != -1) {
+			switch (ch2) {
+				case 'd':
+					mport->flags |= MPORT_INST_DEEP;
+					break;
+				case 'm':
+					mflag = 1;
+					break;
+				default:
+					mport_instance_free(mport);
+					usage();
+			}
+		}
+		resultCode = verify(mport, mflag != 0);
 	} else if (!strcmp(cmd, "version")) {
 		int local_argc = argc;
 		char *const *local_argv = argv;
@@ -356,7 +438,7 @@ main(int argc, char *argv[]) {
 			}
 			local_argc -= optind;
 			local_argv += optind;
-			which(mport, *local_argv, qflag, oflag);
+			which(mport, local_argv, local_argc, qflag, oflag);
 		} else {
 			usage();
 		}
@@ -374,13 +456,13 @@ usage(void) {
 	show_version(NULL, 2);
 
 	fprintf(stderr,
-	        "usage: mport [-c chroot dir] [-U] [-o output] <command> args:\n"
+	        "usage: mport [-c chroot dir] [-U] [-o output] [-r repository] [-T timeline] <command> args:\n"
 	        "       mport autoremove\n"
 	        "       mport clean\n"
 	        "       mport config get [setting name]\n"
 	        "       mport config set [setting name] [setting val]\n"
 	        "       mport cpe\n"
-	        "       mport delete [package name]\n"
+	        "       mport delete [-d] [package name]\n"
 	        "       mport deleteall\n"
 	        "       mport download [-d] [package name]\n"
 	        "       mport export [filename]\n"
@@ -392,14 +474,15 @@ usage(void) {
 	        "       mport lock [package name]\n"
 	        "       mport locks\n"
 		"       mport mirror list\n"
+		"       mport mirror rank\n"
 	        "       mport search [query ...]\n"
 	        "       mport stats\n"
 	        "       mport unlock [package name]\n"
 	        "       mport update [package name]\n"
-	        "       mport upgrade\n"
-	        "       mport verify\n"
+	        "       mport upgrade [-n]\n"
+	        "       mport verify [-dm]\n"
 		"       mport version -t [v1] [v2]\n"
-	        "       mport which [file path]\n"
+	        "       mport which [file path ...]\n"
 	);
 	exit(EXIT_FAILURE);
 }
@@ -417,6 +500,40 @@ show_version(mportInstance *mport, int count) {
 	free(version);
 }
 
+/* the commands mportd can run, which it may still hand back */
+static bool
+daemonServes(const char *cmd) {
+	static const char *served[] = { "info", "list", "locks", "search", "stats", "which" };
+
+	for (size_t i = 0; i < sizeof(served) / sizeof(served[0]); i++) {
+		if (!strcmp(cmd, served[i]))
+			return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * The commands that never write, which open master.db read only.  Those
+ * that need the index only do when it is there already, as they can't
+ * fetch one, and they use it however old it is.
+ */
+static bool
+readOnlyCommand(int argc, char *argv[]) {
+	const char *cmd = argv[0];
+
+	if (!strcmp(cmd, "which") || !strcmp(cmd, "export") || !strcmp(cmd, "locks"))
+		return (true);
+
+	if (!strcmp(cmd, "list"))
+		return (argc < 2 || (strcmp(argv[1], "updates") != 0 && strcmp(argv[1], "up") != 0));
+
+	if (!strcmp(cmd, "info") || !strcmp(cmd, "search") || !strcmp(cmd, "stats"))
+		return (mport_file_exists(MPORT_INDEX_FILE));
+
+	return (false);
+}
+
 void
 loadIndex(mportInstance *mport) {
 	int result = mport_index_load(mport);
@@ -439,36 +556,6 @@ lookupIndex(mportInstance *mport, const char *packageName) {
 	return (indexEntries);
 }
 
-int
-search(mportInstance *mport, char **query) {
-	mportIndexEntry **indexEntry;
-
-	if (query == NULL || *query == NULL) {
-		fprintf(stderr, "Search terms required\n");
-		return (1);
-	}
-
-	while (query != NULL && *query != NULL) {
-		mport_index_search(mport, &indexEntry, "pkg glob %Q or comment glob %Q", *query, *query);
-		if (indexEntry == NULL || *indexEntry == NULL) {
-			query++;
-			continue;
-		}
-
-		while (indexEntry != NULL && *indexEntry != NULL) {
-			fprintf(stdout, "%s\t%s\t%s\n", (*indexEntry)->pkgname,
-			        (*indexEntry)->version,
-			        (*indexEntry)->comment);
-			indexEntry++;
-		}
-
-		mport_index_entry_free_vec(indexEntry);
-		query++;
-	}
-
-	return (0);
-}
-
 int
 lock(mportInstance *mport, const char *packageName) {
 	mportPackageMeta **packs;
@@ -478,7 +565,7 @@ lock(mportInstance *mport, const char *packageName) {
 		return (1);
 	}
 
-	if (mport_pkgmeta_search_master(mport, &packs, "pkg=%Q", packageName) != MPORT_OK) {
+	if (mport_pkgmeta_get(mport, &packs, packageName) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		return (1);
 	}
@@ -502,7 +589,7 @@ unlock(mportInstance *mport, const char *packageName) {
 		return (1);
 	}
 
-	if (mport_pkgmeta_search_master(mport, &packs, "pkg=%Q", packageName) != MPORT_OK) {
+	if (mport_pkgmeta_get(mport, &packs, packageName) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		return (1);
 	}
@@ -517,70 +604,6 @@ unlock(mportInstance *mport, const char *packageName) {
 	return (0);
 }
 
-static int
-stats(mportInstance *mport) {
-	mportStats *s;
-	if (mport_stats(mport, &s) != MPORT_OK) {
-		warnx("%s", mport_err_string());
-		return (1);
-	}
-
-	printf("Local package database:\n");
-	printf("\tInstalled packages: %d\n", s->pkg_installed);
-	printf("\nRemote package database:\n");
-	printf("\tPackages available: %d\n", s->pkg_available);
-
-	return (0);
-}
-
-int
-info(mportInstance *mport, const char *packageName) {
-	if (packageName == NULL) {
-		warnx("%s", "Specify package name");
-		return (1);
-	}
-
-	char *out = mport_info(mport, packageName);
-	if (out == NULL) {
-		warnx("%s", mport_err_string());
-		return (1);
-	}
-
-	printf("%s", out);
-	free(out);
-
-	return (0);
-}
-
-int
-which(mportInstance *mport, const char *filePath, bool quiet, bool origin) {
-	mportPackageMeta *pack = NULL;
-
-	if (filePath == NULL) {
-		warnx("%s", "Specify file path");
-		return (1);
-	}
-
-	if (mport_asset_get_package_from_file_path(mport, filePath, &pack) != MPORT_OK) {
-		warnx("%s", mport_err_string());
-		return (1);
-	}
-
-	if (pack != NULL && pack->origin != NULL) {
-		if (quiet && origin) {
-			printf("%s\n", pack->origin);
-		} else if (quiet) {
-			printf("%s-%s\n", pack->name, pack->version);
-		} else if (origin) {
-			printf("%s was installed by package %s\n", filePath, pack->origin);
-		} else {
-			printf("%s was installed by package %s-%s\n", filePath, pack->name, pack->version);
-		}
-	}
-
-	return (0);
-}
-
 int
 install(mportInstance *mport, const char *packageName) {
 	mportIndexEntry **indexEntry;
@@ -644,11 +667,14 @@ install(mportInstance *mport, const char *packageName) {
 }
 
 int
-delete(const char *packageName) {
+delete(const char *packageName, bool deep, const char *tracePath) {
 	char *buf;
 	int resultCode;
 
-	asprintf(&buf, "%s%s %s %s", MPORT_TOOLS_PATH, "mport.delete", "-n", packageName);
+	/* mport.delete appends to the same timeline */
+	asprintf(&buf, "%s%s %s%s%s%s-n %s", MPORT_TOOLS_PATH, "mport.delete", deep ? "-d " : "",
+	    tracePath != NULL ? "-T " : "", tracePath != NULL ? tracePath : "", tracePath != NULL ? " " : "",
+	    packageName);
 	if (buf == NULL) {
 		warnx("Out of memory.");
 		return (1);
@@ -659,6 +685,69 @@ delete(const char *packageName) {
 	return (resultCode);
 }
 
+/*
+ * Parse -d (--deep) after a command, which has delete and verify hash every
+ * file rather than trusting the size, mtime and inode recorded at install.
+ * Returns the index of the command's first argument.
+ */
+static int
+deepOption(mportInstance *mport, int argc, char *argv[]) {
+	struct option deepopts[] = {
+			{"deep", no_argument, NULL, 'd'},
+			{NULL,   0,           NULL, 0},
+	};
+	int ch2;
+
+	optreset = 1;
+	optind = 1;
+	while ((ch2 = getopt_long(argc, argv, "d", deepopts, NULL)) != -1) {
+		switch (ch2) {
+			case 'd':
+				mport->flags |= MPORT_INST_DEEP;
+				break;
+			default:
+				mport_instance_free(mport);
+				usage();
+		}
+	}
+
+	return optind;
+}
+
+/* print what mport upgrade would do, in the order it would do it */
+static int
+upgradeDryRun(mportInstance *mport) {
+	mportPlan *plan;
+	mportPlanStep *step;
+	size_t updates = 0, installs = 0;
+
+	if (mport_upgrade_plan(mport, &plan) != MPORT_OK) {
+		warnx("%s", mport_err_string());
+		return (1);
+	}
+
+	for (size_t s = 0; s < plan->nsteps; s++) {
+		step = plan->steps[s];
+		if (step->action == MPORT_PLAN_UPDATE) {
+			printf("Update %s: %s -> %s\n", step->entry->pkgname,
+			    step->installed_version != NULL ? step->installed_version : "?", step->entry->version);
+			updates++;
+		} else {
+			printf("Install %s-%s (new dependency)\n", step->entry->pkgname, step->entry->version);
+			installs++;
+		}
+	}
+
+	if (plan->nsteps == 0)
+		printf("All packages are up to date.\n");
+	else
+		printf("%zu to update, %zu to install.\n", updates, installs);
+
+	mport_plan_free(plan);
+
+	return (0);
+}
+
 int configGet(mportInstance *mport, const char *settingName) {
 	char *val;
 
@@ -687,14 +776,16 @@ int configSet(mportInstance *mport, const char *settingName, const char *val) {
 int
 cpeList(mportInstance *mport) {
 	mportPackageMeta **packs;
+	mportResultSet *set;
 	int cpe_total = 0;
 
-	if (mport_pkgmeta_list(mport, &packs) != MPORT_OK) {
+	if (mport_pkgmeta_list_set(mport, &set, &packs) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		return mport_err_code();
 	}
 
 	if (packs == NULL) {
+		mport_result_set_free(set);
 		warnx("No packages installed.");
 		return (1);
 	}
@@ -706,7 +797,7 @@ cpeList(mportInstance *mport) {
 		}
 		packs++;
 	}
-	mport_pkgmeta_vec_free(packs);
+	mport_result_set_free(set);
 
 	if (cpe_total == 0) {
 		errx(EX_SOFTWARE, "No packages contained CPE information.");
@@ -715,41 +806,66 @@ cpeList(mportInstance *mport) {
 	return (0);
 }
 
+struct verifyTally {
+	bool machine;
+	int total;
+	int changed;
+};
+
+/* file problems go to stderr with -m, so stdout is only the package lines */
+static void
+verifyMsgToStderr(const char *msg) {
+
+	fprintf(stderr, "%s\n", msg);
+}
+
+static void
+verifyResult(const mportVerifyResult *result, void *arg) {
+	struct verifyTally *tally = arg;
+	bool ok = result->missing == 0 && result->modified == 0 && result->unreadable == 0;
+
+	tally->total++;
+	if (!ok)
+		tally->changed++;
+
+	if (tally->machine)
+		printf("%s\t%s\t%s\t%zu\t%zu\t%zu\t%zu\t%zu\n", result->name, result->version,
+		    ok ? "ok" : "changed", result->files, result->hashed, result->missing,
+		    result->modified, result->unreadable);
+}
+
 int
-verify(mportInstance *mport) {
-	mportPackageMeta **packs, **ref;
-	int total = 0;
+verify(mportInstance *mport, bool machine) {
+	struct verifyTally tally = { machine, 0, 0 };
 
-	if (mport_pkgmeta_list(mport, &packs) != MPORT_OK) {
+	if (machine)
+		mport_set_msg_cb(mport, &verifyMsgToStderr);
+
+	if (mport_verify_packages(mport, verifyResult, &tally) != MPORT_OK) {
 		warnx("%s", mport_err_string());
 		return mport_err_code();
 	}
 
-	if (packs == NULL) {
+	if (tally.total == 0) {
 		warnx("No packages installed.");
 		return (1);
 	}
-	ref = packs;
 
-	while (*packs != NULL) {
-		mport_verify_package(mport, *packs);
-		packs++;
-		total++;
+	if (!machine) {
+		printf("Packages verified: %d\n", tally.total);
+		if (tally.changed > 0)
+			printf("Packages with changed files: %d\n", tally.changed);
 	}
 
-	mport_pkgmeta_vec_free(ref);
-	printf("Packages verified: %d\n", total);
-
 	return (0);
 }
 
 int
 deleteAll(mportInstance *mport) {
 	mportPackageMeta **packs;
-	mportPackageMeta **depends;
 	int total = 0;
 	int errors = 0;
-	int skip;
+	int ret;
 
 	if (mport_pkgmeta_list(mport, &packs) != MPORT_OK) {
 		warnx("%s", mport_err_string());
@@ -761,33 +877,22 @@ deleteAll(mportInstance *mport) {
 		return (1);
 	}
 
-	while (1) {
-		skip = 0;
-		while (*packs != NULL) {
-			if (mport_pkgmeta_get_updepends(mport, *packs, &depends) == MPORT_OK) {
-				if (depends == NULL) {
-					if (delete((*packs)->name) != 0) {
-						fprintf(stderr, "Error deleting %s\n", (*packs)->name);
-						errors++;
-					}
-					total++;
-				} else {
-					skip++;
-					mport_pkgmeta_vec_free(depends);
-				}
-			}
-			packs++;
-		}
-		if (skip == 0)
-			break;
-		mport_pkgmeta_vec_free(packs);
-		if (mport_pkgmeta_list(mport, &packs) != MPORT_OK) {
-			warnx("%s", mport_err_string());
+	while (packs[total] != NULL)
+		total++;
+
+	/* everything goes, so dependents are ordered before their dependencies in one pass */
+	ret = mport_delete_packages(mport, packs, 1);
+	mport_pkgmeta_vec_free(packs);
+
+	if (ret != MPORT_OK) {
+		warnx("%s", mport_err_string());
+		if (ret != MPORT_ERR_WARN)
 			return (1);
-		}
 	}
 
-	mport_pkgmeta_vec_free(packs);
+	/* whatever is left couldn't be deleted */
+	if (mport_db_count(mport->db, &errors, "SELECT COUNT(*) FROM packages") != MPORT_OK)
+		errors = 0;
 
 	printf("Packages deleted: %d\nErrors: %d\nTotal: %d\n", total - errors, errors, total);
 	return (0);
@@ -0,0 +1,281 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The read only commands: what mport prints for info, which, search, stats
+ * and list.  They are shared by mport, mport.list and mportd, which runs
+ * them with the client's stdout and stderr, so the output is the same
+ * whichever one answers.  None of them exit; errors are warned about and
+ * returned as the exit status.
+ */
+
+#include <sys/cdefs.h>
+
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mport.h>
+
+#include "query.h"
+
+static char * str_remove(const char *, const char);
+
+int
+search(mportInstance *mport, char **query) {
+	mportIndexIter *iter;
+	mportIndexEntry *indexEntry;
+	int ret;
+
+	if (query == NULL || *query == NULL) {
+		fprintf(stderr, "Search terms required\n");
+		return (1);
+	}
+
+	while (query != NULL && *query != NULL) {
+		/* glob patterns keep the old behaviour, plain words use the full text index */
+		if (strpbrk(*query, "*?[") != NULL)
+			ret = mport_index_iter_search(mport, &iter, "pkg glob %Q or comment glob %Q", *query, *query);
+		else
+			ret = mport_index_fulltext_search(mport, &iter, *query);
+
+		if (ret != MPORT_OK) {
+			warnx("%s", mport_err_string());
+			return (1);
+		}
+
+		while (mport_index_iter_next(iter, &indexEntry) == MPORT_OK && indexEntry != NULL) {
+			fprintf(stdout, "%s\t%s\t%s\n", indexEntry->pkgname,
+			        indexEntry->version,
+			        indexEntry->comment);
+		}
+
+		mport_index_iter_free(iter);
+		query++;
+	}
+
+	return (0);
+}
+
+int
+stats(mportInstance *mport) {
+	mportStats *s;
+	if (mport_stats(mport, &s) != MPORT_OK) {
+		warnx("%s", mport_err_string());
+		return (1);
+	}
+
+	printf("Local package database:\n");
+	printf("\tInstalled packages: %d\n", s->pkg_installed);
+	printf("\nRemote package database:\n");
+	printf("\tPackages available: %d\n", s->pkg_available);
+
+	return (0);
+}
+
+int
+info(mportInstance *mport, const char *packageName) {
+	if (packageName == NULL) {
+		warnx("%s", "Specify package name");
+		return (1);
+	}
+
+	char *out = mport_info(mport, packageName);
+	if (out == NULL) {
+		warnx("%s", mport_err_string());
+		return (1);
+	}
+
+	printf("%s", out);
+	free(out);
+
+	return (0);
+}
+
+int
+which(mportInstance *mport, char *const *filePaths, int count, bool quiet, bool origin) {
+	mportPackageMeta **packs;
+	mportPackageMeta *pack;
+	char **owners;
+
+	if (filePaths == NULL || count < 1 || *filePaths == NULL) {
+		warnx("%s", "Specify file path");
+		return (1);
+	}
+
+	/* every path is looked up in one batch */
+	if (mport_asset_get_owners(mport, (const char **) filePaths, (size_t) count, &owners) != MPORT_OK) {
+		warnx("%s", mport_err_string());
+		return (1);
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (owners[i] == NULL)
+			continue;
+
+		if (mport_pkgmeta_get(mport, &packs, owners[i]) != MPORT_OK || packs == NULL) {
+			warnx("%s", "Package does not exist despite having assets");
+			continue;
+		}
+		pack = packs[0];
+
+		if (pack->origin != NULL) {
+			if (quiet && origin) {
+				printf("%s\n", pack->origin);
+			} else if (quiet) {
+				printf("%s-%s\n", pack->name, pack->version);
+			} else if (origin) {
+				printf("%s was installed by package %s\n", filePaths[i], pack->origin);
+			} else {
+				printf("%s was installed by package %s-%s\n", filePaths[i], pack->name, pack->version);
+			}
+		}
+
+		mport_pkgmeta_vec_free(packs);
+	}
+
+	mport_asset_owners_free(owners, (size_t) count);
+
+	return (0);
+}
+
+/*
+ * list_packages(mport, flags)
+ *
+ * The installed packages as mport.list prints them, LIST_* in flags.  With
+ * LIST_UPDATES, the ones the index has another version of; the index is
+ * loaded if it isn't already.  Returns 3 if nothing is installed, 8 if the
+ * index couldn't be loaded.
+ */
+int
+list_packages(mportInstance *mport, int flags)
+{
+	mportPackageMeta **packs;
+	mportResultSet *set;
+	mportOutdatedEntry **outdated;
+	char *comment;
+	char name_version[30];
+	bool quiet = (flags & LIST_QUIET) != 0;
+	bool origin = (flags & LIST_ORIGIN) != 0;
+
+	if ((flags & LIST_UPDATES) && !(mport->flags & MPORT_INST_HAVE_INDEX) && mport_index_load(mport) != MPORT_OK) {
+		warnx("Unable to load updates index, %s", mport_err_string());
+		return (8);
+	}
+
+	if (mport_pkgmeta_list_set(mport, &set, &packs) != MPORT_OK) {
+		warnx("%s", mport_err_string());
+		return (EXIT_FAILURE);
+	}
+
+	if (packs == NULL) {
+		if (!quiet)
+			warnx("No packages installed matching.");
+		mport_result_set_free(set);
+		return (3);
+	}
+
+	if (flags & LIST_UPDATES) {
+		if (mport_index_outdated(mport, &outdated) != MPORT_OK) {
+			(void) fprintf(stderr, "Error looking up updates: %d %s\n", mport_err_code(), mport_err_string());
+			mport_result_set_free(set);
+			return (mport_err_code());
+		}
+
+		for (mportOutdatedEntry **o = outdated; *o != NULL; o++) {
+			if ((*o)->index_version == NULL)
+				(void) printf("%-15s %8s is no longer available.\n", (*o)->pkgname, (*o)->version);
+			else if (flags & LIST_VERBOSE)
+				(void) printf("%-15s %8s (%s)  <  %-s\n", (*o)->pkgname, (*o)->version,
+				              (*o)->os_release, (*o)->index_version);
+			else
+				(void) printf("%-15s %8s  <  %-8s\n", (*o)->pkgname, (*o)->version, (*o)->index_version);
+		}
+
+		mport_index_outdated_free_vec(outdated);
+		mport_result_set_free(set);
+
+		return (0);
+	}
+
+	for (; *packs != NULL; packs++) {
+		if (flags & LIST_VERBOSE) {
+			comment = str_remove((*packs)->comment, '\\');
+			snprintf(name_version, 30, "%s-%s", (*packs)->name, (*packs)->version);
+
+			(void) printf("%-30s\t%6s\t%s\n", name_version, (*packs)->os_release, comment);
+			free(comment);
+		}
+		else if ((flags & LIST_PRIME) && (*packs)->automatic == 0)
+			(void) printf("%s\n", (*packs)->name);
+		else if (quiet && !origin)
+			(void) printf("%s\n", (*packs)->name);
+		else if (quiet && origin)
+			(void) printf("%s\n", (*packs)->origin);
+		else if (origin)
+			(void) printf("Information for %s-%s:\n\nOrigin:\n%s\n\n",
+						  (*packs)->name, (*packs)->version, (*packs)->origin);
+		else if (flags & LIST_LOCKS) {
+			if ((*packs)->locked == 1)
+				(void) printf("%s-%s\n", (*packs)->name, (*packs)->version);
+
+		} else
+			(void) printf("%s-%s\n", (*packs)->name, (*packs)->version);
+	}
+
+	mport_result_set_free(set);
+
+	return (0);
+}
+
+static char *
+str_remove(const char *str, const char ch)
+{
+	size_t i;
+	size_t x;
+	size_t len;
+	char *output;
+	
+	if (str == NULL)
+		return NULL;
+	
+	len = strlen(str);
+	
+	output = calloc(len + 1, sizeof(char));
+	
+	for (i = 0, x = 0; i <= len; i++) {
+		if (str[i] != ch) {
+			output[x] = str[i];
+			x++;
+		}
+    }
+    output[len] = '\0';
+	
+    return (output);
+}
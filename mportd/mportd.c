@@ -0,0 +1,333 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause-FreeBSD
+ *
+ * Copyright (c) 2026 Lucas Holt
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mportd answers mport's query commands over MPORT_DAEMON_SOCKET.  mport
+ * hands it the command with its stdout and stderr, so a client can't tell
+ * it from running the command itself, without paying to start mport and
+ * load the index every time.
+ *
+ * The daemon only accepts and forks.  Each child reads its request and
+ * opens a read only instance of its own, as a SQLite connection must not
+ * be carried across fork(), so a client that is slow to send, or stops
+ * reading its output, holds up only its own child, never the daemon.
+ */
+
+#include <sys/cdefs.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <grp.h>
+#include <libutil.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <mport.h>
+#include <mport_private.h>
+
+#include "query.h"
+
+#define MPORTD_PIDFILE "/var/run/mportd.pid"
+#define MPORTD_CHILDREN_MAX 16 /* commands running at once; more are declined */
+
+static volatile sig_atomic_t stop;
+
+static void usage(void);
+static void on_signal(int);
+static mportInstance * open_instance(void);
+static bool accepted(mportDaemonRequest *);
+static int run(mportInstance *, mportDaemonRequest *);
+static void serve(mportDaemonRequest *);
+
+int
+main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	struct pidfh *pfh;
+	struct group *gr;
+	mportDaemonRequest req;
+	const char *socketPath = MPORT_DAEMON_SOCKET;
+	bool foreground = false;
+	gid_t gid = (gid_t)-1;
+	pid_t otherpid, pid;
+	int ch, lfd, children = 0;
+
+	while ((ch = getopt(argc, argv, "dg:s:")) != -1) {
+		switch (ch) {
+			case 'd':
+				foreground = true;
+				break;
+			case 'g':
+				if ((gr = getgrnam(optarg)) == NULL)
+					errx(EXIT_FAILURE, "Unknown group %s", optarg);
+				gid = gr->gr_gid;
+				break;
+			case 's':
+				socketPath = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	if (argc != 0)
+		usage();
+
+	/* mport's options parse the same way here as there */
+	if (setenv("POSIXLY_CORRECT", "1", 1) == -1)
+		err(EXIT_FAILURE, "setenv() failed");
+
+	pfh = pidfile_open(MPORTD_PIDFILE, 0600, &otherpid);
+	if (pfh == NULL) {
+		if (errno == EEXIST)
+			errx(EXIT_FAILURE, "already running, pid %d", (int) otherpid);
+		warn("Cannot open or create pidfile");
+	}
+
+	if ((lfd = mport_daemon_listen(socketPath, gid)) == -1) {
+		pidfile_remove(pfh);
+		errx(EXIT_FAILURE, "%s", mport_err_string());
+	}
+
+	if (!foreground && daemon(0, 0) == -1) {
+		pidfile_remove(pfh);
+		err(EXIT_FAILURE, "daemon");
+	}
+	pidfile_write(pfh);
+
+	openlog("mportd", LOG_PID | (foreground ? LOG_PERROR : 0), LOG_DAEMON);
+	/* warnings go to the client as mport's own */
+	setprogname("mport");
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+	/* no SA_RESTART, so accept() returns to check stop */
+	sa.sa_handler = on_signal;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	while (!stop) {
+		if (mport_daemon_accept(lfd, &req) != MPORT_OK) {
+			if (mport_err_code() == MPORT_ERR_FATAL) {
+				syslog(LOG_ERR, "%s", mport_err_string());
+				sleep(1);
+			}
+			continue;
+		}
+
+		while (children > 0 && waitpid(-1, NULL, WNOHANG) > 0)
+			children--;
+
+		pid = -1;
+		if (children < MPORTD_CHILDREN_MAX && (pid = fork()) == 0) {
+			close(lfd);
+			serve(&req);
+		}
+
+		/* declined unread; the client runs it itself */
+		if (pid == -1) {
+			if (children < MPORTD_CHILDREN_MAX)
+				syslog(LOG_ERR, "fork: %m");
+			if (mport_daemon_reply(&req, MPORT_DAEMON_DECLINED) != MPORT_OK)
+				syslog(LOG_DEBUG, "%s", mport_err_string());
+		} else {
+			children++;
+		}
+		mport_daemon_done(&req);
+	}
+
+	syslog(LOG_INFO, "exiting");
+	close(lfd);
+	(void) unlink(socketPath);
+	pidfile_remove(pfh);
+
+	return (EXIT_SUCCESS);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: mportd [-d] [-g group] [-s socket]\n");
+	exit(EXIT_FAILURE);
+}
+
+static void
+on_signal(int sig __unused)
+{
+
+	stop = 1;
+}
+
+static mportInstance *
+open_instance(void)
+{
+	mportInstance *mport;
+
+	mport = mport_instance_new();
+	if (mport_instance_init_flags(mport, NULL, NULL, true, MPORT_INIT_READONLY) != MPORT_OK) {
+		syslog(LOG_WARNING, "%s", mport_err_string());
+		mport_instance_free(mport);
+		return (NULL);
+	}
+
+	/* without an index the commands that need one are left to mport */
+	if (mport_file_exists(MPORT_INDEX_FILE) &&
+	    (mport_index_load(mport) != MPORT_OK || mport_index_attach(mport) != MPORT_OK))
+		syslog(LOG_WARNING, "Unable to load index %s", mport_err_string());
+
+	return (mport);
+}
+
+/*
+ * Read one request, and run it with the client's stdout and stderr on an
+ * instance of its own, in the child.  The instance is opened for every
+ * command, so each sees the package database and the index as they are.
+ */
+static void
+serve(mportDaemonRequest *req)
+{
+	struct sigaction sa;
+	mportInstance *mport;
+	int status;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	if (mport_daemon_receive(req) != MPORT_OK) {
+		syslog(LOG_DEBUG, "%s", mport_err_string());
+		_exit(EXIT_FAILURE);
+	}
+
+	if ((mport = open_instance()) == NULL) {
+		(void) mport_daemon_reply(req, MPORT_DAEMON_DECLINED);
+		_exit(EXIT_FAILURE);
+	}
+
+	if (dup2(req->out, STDOUT_FILENO) == -1 || dup2(req->err, STDERR_FILENO) == -1) {
+		syslog(LOG_ERR, "dup2: %m");
+		(void) mport_daemon_reply(req, MPORT_DAEMON_DECLINED);
+		_exit(EXIT_FAILURE);
+	}
+
+	status = run(mport, req);
+	mport_instance_free(mport);
+
+	fflush(stdout);
+	fflush(stderr);
+	if (mport_daemon_reply(req, status) != MPORT_OK)
+		syslog(LOG_DEBUG, "%s", mport_err_string());
+
+	_exit(EXIT_SUCCESS);
+}
+
+/* tell the client the command is ours, before it writes anything */
+static bool
+accepted(mportDaemonRequest *req)
+{
+
+	if (mport_daemon_reply(req, MPORT_DAEMON_ACCEPTED) != MPORT_OK) {
+		syslog(LOG_DEBUG, "%s", mport_err_string());
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * run(mport, req)
+ *
+ * The command as mport would run it, argv[0] being the command.  Anything
+ * this doesn't handle the same way, from writes to usage errors, is
+ * declined and mport runs it itself; that is decided before accepting it.
+ */
+static int
+run(mportInstance *mport, mportDaemonRequest *req)
+{
+	int argc = req->argc;
+	char **argv = req->argv;
+	const char *cmd = argv[0];
+	bool haveIndex = (mport->flags & MPORT_INST_HAVE_INDEX) != 0;
+	bool qflag = false, oflag = false;
+	int mode;
+	int ch;
+
+	if (!strcmp(cmd, "which")) {
+		if (argc < 2 || !accepted(req))
+			return (MPORT_DAEMON_DECLINED);
+		optreset = 1;
+		optind = 1;
+		while ((ch = getopt(argc, argv, "qo")) != -1) {
+			switch (ch) {
+				case 'q':
+					qflag = true;
+					break;
+				case 'o':
+					oflag = true;
+					break;
+			}
+		}
+		/* mport doesn't exit with which's status either */
+		(void) which(mport, argv + optind, argc - optind, qflag, oflag);
+		return (0);
+	} else if (!strcmp(cmd, "list")) {
+		if (argc == 1)
+			mode = LIST_VERBOSE;
+		else if (haveIndex && (!strcmp(argv[1], "updates") || !strcmp(argv[1], "up")))
+			mode = LIST_UPDATES;
+		else if (!strcmp(argv[1], "prime"))
+			mode = LIST_PRIME;
+		else
+			return (MPORT_DAEMON_DECLINED);
+		return (accepted(req) ? list_packages(mport, mode) : MPORT_DAEMON_DECLINED);
+	} else if (!strcmp(cmd, "locks")) {
+		return (accepted(req) ? list_packages(mport, LIST_LOCKS) : MPORT_DAEMON_DECLINED);
+	} else if (!haveIndex) {
+		return (MPORT_DAEMON_DECLINED);
+	} else if (!strcmp(cmd, "info")) {
+		return (accepted(req) ? info(mport, argv[1]) : MPORT_DAEMON_DECLINED);
+	} else if (!strcmp(cmd, "search")) {
+		return (accepted(req) ? search(mport, argv + 1) : MPORT_DAEMON_DECLINED);
+	} else if (!strcmp(cmd, "stats")) {
+		return (accepted(req) ? stats(mport) : MPORT_DAEMON_DECLINED);
+	}
+
+	return (MPORT_DAEMON_DECLINED);
+}